@@ -119,6 +119,23 @@ function executeReadOnly(command, originalKey, objectType, cacheKey, func, ...)
     writeStringAsValue(command, originalKey, "ERROR_CACHE_MISS")
 end
 
+-- helper function for reading a single field of a lua table stored in the cache
+-- only the requested field is decoded. func is called with the value of the 
+-- field (nil if missing) and the field name
+function executeReadField(command, originalKey, objectType, cacheKey, field, func) 
+    local hashMap   = getHashMap()
+    local cacheItem = hashMap:get(objectType.."$"..cacheKey)
+    if (cacheItem ~= nil) then 
+        local sobject = cacheItem:getData()
+        cacheItem:delete()
+        
+        local result  = func(table.getfield(sobject, field), field)
+        writeStringAsValue(command, originalKey, result)
+        return 
+    end 
+    writeStringAsValue(command, originalKey, "ERROR_CACHE_MISS")
+end
+
 -- helper function for read/write operations on lua tables stored in the cache 
 -- orginal object is deleted and a new object is created with the same key with 
 -- latest data values 
@@ -137,6 +154,7 @@ function executeReadWrite(command, originalKey, objectType, cacheKey, func, ...)
         command:setData(sobject)
         cacheItem = command:newCacheItem()
         hashMap:put(cacheItem)
+        appendLog(objectType.."$"..cacheKey)
         writeStringAsValue(command, originalKey, result)
         return 
     end 
@@ -160,8 +178,11 @@ function executeNew(command, originalKey, objectType, cacheKey, func, ...)
         command:setData(sobject)
         cacheItem = command:newCacheItem()
         hashMap:put(cacheItem)
+        appendLog(objectType.."$"..cacheKey)
         writeStringAsValue(command, originalKey, "CREATED")
     else 
+        -- the old object is gone
+        appendLog(objectType.."$"..cacheKey)
         writeStringAsValue(command, originalKey, "NOT_CREATED")
     end 
 end    
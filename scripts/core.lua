@@ -1,23 +1,8 @@
 
 local function handleGET(command) 
-     local hashMap   = getHashMap()   
-     local keyCount = command:hasMultipleKeys();		
-     if ( keyCount > 0) then 
-	local keys = command:getMultipleKeys()
-	for k,v in pairs(keys) do
-	    local cacheItem = hashMap:get(v)
-	    if (cacheItem ~= nil) then
-		command:writeCacheItem(cacheItem); 
-		cacheItem:delete()
-	    end 
-	end 
-     else 
-        local cacheItem = hashMap:get(command:getKey())
-	if (cacheItem ~= nil) then
-            command:writeCacheItem(cacheItem); 
-            cacheItem:delete()
-        end 
-     end 
+     -- looks up all the keys of the command in one call and writes 
+     -- the hits directly to the connection
+     getHashMap():getMulti(command)
      command:writeString("END\r\n")	
      return 0
 end
@@ -62,6 +47,7 @@ local function handleDELETE(command)
   if (cacheItem ~= nil) then 
       getHashMap():delete(command:getKey())
       cacheItem:delete()
+      appendLog(command:getKey())
       command:writeString("DELETED\r\n")
   else 
       command:writeString("NOT_FOUND\r\n")
@@ -69,9 +55,52 @@ local function handleDELETE(command)
   return 0
 end
 
+-- incr/decr keep the flags and the expiry time of the item
+local function handleINCRDECR(command, sign)
+  local hashMap   = getHashMap()
+  local cacheItem = hashMap:get(command:getKey())
+  if (cacheItem == nil) then
+      command:writeString("NOT_FOUND\r\n")
+      return 0
+  end
+  local value = tonumber(cacheItem:getData())
+  if (value == nil) then
+      cacheItem:delete()
+      command:writeString("CLIENT_ERROR cannot increment or decrement non-numeric value\r\n")
+      return 0
+  end
+  value = value + (sign * command:getDelta())
+  if (value < 0) then
+      value = 0
+  end
+  command:setExpiryTime(cacheItem:getTTL())
+  command:setFlags(cacheItem:getFlags())
+  cacheItem:delete()
+  hashMap:delete(command:getKey())
+  local newValue = string.format("%d", value)
+  command:setData(newValue)
+  cacheItem = command:newCacheItem()
+  if (cacheItem ~= nil) then
+      hashMap:put(cacheItem)
+      command:writeString(newValue.."\r\n")
+  else
+      command:writeString("SERVER_ERROR Not Enough Memory\r\n")
+  end
+  return 0
+end
+
+local function handleINCR(command)
+  return handleINCRDECR(command, 1)
+end
+
+local function handleDECR(command)
+  return handleINCRDECR(command, -1)
+end
+
 local function handleFLUSH_ALL(command) 
      -- passing 64GB - max possible size of cache 
      getHashMap():deleteLRU(64 * 1024 * 1024 * 1024)
+     appendLogFlush()
      command:writeString("OK\r\n")
      return 0
 end
@@ -88,6 +117,206 @@ local function handleVERBOSITY(command)
      return 0
 end
 
+local function writeStat(command, name, value)
+     command:writeString(string.format("STAT %s %d\r\n", name, value))
+end
+
+local function handleSTATS(command)
+     local group = command:getKey()
+     for i, stat in ipairs(getServerStats(group)) do
+         writeStat(command, stat.name, stat.value)
+     end
+     if (group == nil or group == "scripts") then
+         for name, stats in pairs(getScriptStats()) do
+             writeStat(command, "script:"..name..":calls",        stats.calls)
+             writeStat(command, "script:"..name..":instructions", stats.instructions)
+             writeStat(command, "script:"..name..":usec",         stats.usec)
+             writeStat(command, "script:"..name..":aborts",       stats.aborts)
+             writeStat(command, "script:"..name..":oom",          stats.oom)
+         end
+     end
+     local nearCache = getNearCacheStats()
+     if (nearCache ~= nil and (group == nil or group == "nearcache")) then
+         writeStat(command, "near_cache_hits",          nearCache.hits)
+         writeStat(command, "near_cache_misses",        nearCache.misses)
+         writeStat(command, "near_cache_pushed",        nearCache.pushed)
+         writeStat(command, "near_cache_evictions",     nearCache.evictions)
+         writeStat(command, "near_cache_entries",       nearCache.entries)
+         writeStat(command, "near_cache_bytes",         nearCache.bytes)
+         writeStat(command, "near_cache_ttl_ms",        nearCache.ttl)
+         if (nearCache.hot ~= nil) then
+             writeStat(command, "near_cache_hot_keys",      nearCache.hot)
+             writeStat(command, "near_cache_peers",         nearCache.peers)
+             writeStat(command, "near_cache_pushes",        nearCache.pushes)
+             writeStat(command, "near_cache_invalidations", nearCache.invalidations)
+             writeStat(command, "near_cache_push_failures", nearCache.failures)
+             writeStat(command, "near_cache_peer_hits",     nearCache.peerhits)
+         end
+     end
+     local health = getHealthStats()
+     if (health ~= nil and (group == nil or group == "health")) then
+         writeStat(command, "health_probes",         health.probes)
+         writeStat(command, "health_probe_failures", health.failures)
+         writeStat(command, "health_fast_fails",     health.fastfails)
+         writeStat(command, "health_servers",        health.servers)
+         writeStat(command, "health_servers_down",   health.down)
+         writeStat(command, "health_interval_ms",    health.interval)
+         writeStat(command, "health_timeout_ms",     health.timeout)
+     end
+     local cluster = getClusterStats()
+     if (group == nil or group == "cluster") then
+         writeStat(command, "cluster_suspended",      cluster.suspended)
+         writeStat(command, "cluster_in_flight",      cluster.inflight)
+         writeStat(command, "cluster_max_in_flight",  cluster.maxinflight)
+         writeStat(command, "cluster_deadline_ms",    cluster.deadline)
+         writeStat(command, "cluster_timeouts",       cluster.timeouts)
+         writeStat(command, "cluster_rejected",       cluster.rejected)
+         writeStat(command, "cluster_resumed",        cluster.resumed)
+         writeStat(command, "cluster_wait_us_avg",    cluster.avg)
+         writeStat(command, "cluster_wait_us_p50",    cluster.p50)
+         writeStat(command, "cluster_wait_us_p90",    cluster.p90)
+         writeStat(command, "cluster_wait_us_p99",    cluster.p99)
+         writeStat(command, "cluster_wait_us_max",    cluster.max)
+         for i, bucket in ipairs(cluster.buckets) do
+             writeStat(command, "cluster_wait_us_le_" .. string.format("%.0f", bucket.le), bucket.count)
+         end
+     end
+     local migration = getMigrationStats()
+     if (migration ~= nil and (group == nil or group == "migration")) then
+         writeStat(command, "migration_active",     migration.active)
+         writeStat(command, "migration_pending",    migration.pending)
+         writeStat(command, "migration_started",    migration.migrations)
+         writeStat(command, "migration_scanned",    migration.scanned)
+         writeStat(command, "migration_sent",       migration.sent)
+         writeStat(command, "migration_moved",      migration.moved)
+         writeStat(command, "migration_failed",     migration.failed)
+         writeStat(command, "migration_dual_reads", migration.dualreads)
+     end
+     local replication = getReplicationStats()
+     if (replication ~= nil and (group == nil or group == "replication")) then
+         writeStat(command, "repl_connected",      replication.connected)
+         writeStat(command, "repl_resyncing",      replication.resyncing)
+         writeStat(command, "repl_resyncs",        replication.resyncs)
+         writeStat(command, "repl_commands_sent",  replication.sent)
+         writeStat(command, "repl_commands_acked", replication.acked)
+         writeStat(command, "repl_bytes_sent",     replication.bytes)
+         writeStat(command, "repl_backlog_bytes",  replication.backlog)
+         writeStat(command, "repl_lag_usec",       replication.lag)
+         writeStat(command, "repl_max_lag_usec",   replication.maxlag)
+     end
+     local snapshot = getSnapshotStats()
+     if (snapshot ~= nil and (group == nil or group == "snapshot")) then
+         writeStat(command, "snapshot_in_progress", snapshot.inprogress)
+         writeStat(command, "snapshot_completed",   snapshot.snapshots)
+         writeStat(command, "snapshot_failed",      snapshot.failed)
+         writeStat(command, "snapshot_last_items",  snapshot.items)
+         writeStat(command, "snapshot_last_bytes",  snapshot.bytes)
+         writeStat(command, "snapshot_last_ms",     snapshot.millis)
+         writeStat(command, "snapshot_last_time",   snapshot.time)
+         writeStat(command, "snapshot_loaded_items", snapshot.loaded)
+         writeStat(command, "snapshot_load_ms",     snapshot.loadmillis)
+     end
+     local appendlog = getAppendLogStats()
+     if (appendlog ~= nil and (group == nil or group == "appendlog")) then
+         writeStat(command, "appendlog_records",       appendlog.records)
+         writeStat(command, "appendlog_bytes",         appendlog.bytes)
+         writeStat(command, "appendlog_pending_bytes", appendlog.pending)
+         writeStat(command, "appendlog_writes",        appendlog.writes)
+         writeStat(command, "appendlog_syncs",         appendlog.syncs)
+         writeStat(command, "appendlog_sync_ms",       appendlog.syncmillis)
+         writeStat(command, "appendlog_failed",        appendlog.failed)
+         writeStat(command, "appendlog_keys",          appendlog.keys)
+         writeStat(command, "appendlog_compacting",    appendlog.compacting)
+         writeStat(command, "appendlog_compactions",   appendlog.compactions)
+         writeStat(command, "appendlog_compact_ms",    appendlog.compactmillis)
+         writeStat(command, "appendlog_replayed",      appendlog.replayed)
+         writeStat(command, "appendlog_replay_ms",     appendlog.replaymillis)
+     end
+     command:writeString("END\r\n")
+     return 0
+end
+
+local function handleRELOAD(command)
+     -- builds a new lua state from the scripts directory, this 
+     -- request still completes on the current one
+     if (reloadScripts() == 0) then
+         command:writeString("OK\r\n")
+     else
+         command:writeString("SERVER_ERROR reload failed\r\n")
+     end
+     return 0
+end
+
+local function handleRING(command)
+     -- new ring for the proxy, the keys are moved in the background
+     local servers = command:getKey()
+     if (servers ~= nil and changeRing(servers) == 0) then
+         command:writeString("OK\r\n")
+     else
+         command:writeString("SERVER_ERROR ring change failed\r\n")
+     end
+     return 0
+end
+
+local function handleGOSSIP(command)
+     -- member list of another server, answered with ours
+     local members = gossip(command:getKey())
+     if (members ~= nil) then
+         command:writeString("GOSSIP "..members.."\r\n")
+     else
+         command:writeString("SERVER_ERROR gossip not enabled\r\n")
+     end
+     return 0
+end
+
+local function handleNEARSET(command)
+     -- value of a hot key pushed by its owner, answered with the hits
+     -- of the copy it replaced
+     local hits = command:pushToNearCache()
+     if (hits ~= nil) then
+         command:writeString(string.format("NEARSET %d\r\n", hits))
+     else
+         command:writeString("SERVER_ERROR near cache not enabled\r\n")
+     end
+     return 0
+end
+
+local function handleNEARDELETE(command)
+     command:dropFromNearCache()
+     command:writeString("DELETED\r\n")
+     return 0
+end
+
+local function handleSNAPSHOT(command)
+     -- the items are written by a forked child, see "stats snapshot"
+     if (snapshot() == 0) then
+         command:writeString("OK\r\n")
+     else
+         command:writeString("SERVER_ERROR snapshot not started\r\n")
+     end
+     return 0
+end
+
+local function handleSLOWLOG(command)
+     -- slowlog [count], newest first, or slowlog reset
+     local arg = command:getKey()
+     if (arg == "reset") then
+         resetSlowlog()
+         command:writeString("RESET\r\n")
+         return 0
+     end
+     local entries = getSlowlog(tonumber(arg))
+     if (entries == nil) then
+         command:writeString("SERVER_ERROR slowlog not enabled\r\n")
+         return 0
+     end
+     for i, entry in ipairs(entries) do
+         command:writeString("SLOWLOG "..entry.."\r\n")
+     end
+     command:writeString("END\r\n")
+     return 0
+end
+
 local function handleQUIT(command) 
     return -1
 end
@@ -157,8 +386,18 @@ core = {
     set       = handleSET, 
     add       = handleADD,
     delete    = handleDELETE,
+    incr      = handleINCR,
+    decr      = handleDECR,
     flush_all = handleFLUSH_ALL,
     version   = handleVERSION,	
+    stats     = handleSTATS,
+    reload    = handleRELOAD,
+    ring      = handleRING,
+    gossip    = handleGOSSIP,
+    nearset   = handleNEARSET,
+    neardelete = handleNEARDELETE,
+    snapshot  = handleSNAPSHOT,
+    slowlog   = handleSLOWLOG,
     quit      = handleQUIT,
     prepend   = handlePREPEND,
     append    = handleAPPEND,
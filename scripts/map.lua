@@ -55,16 +55,14 @@ local function handleNEW(command, originalKey, cacheKey)
 end
 
 local function handleGET(command, originalKey, cacheKey, objectKey)
-       executeReadOnly(command, originalKey, "map", cacheKey, 
-           function(o, k)
-              local value = get(o, k)
+       executeReadField(command, originalKey, "map", cacheKey, objectKey,
+           function(value, k)
               if ( value ~= nil) then 
                   return k .. " : " .. value
               else
                   return "NOT_FOUND" 
               end
-           end,
-       objectKey)
+           end)
 end
 
 local function handlePUT(command, originalKey, cacheKey, objectKey, objectValue)
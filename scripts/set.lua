@@ -75,15 +75,14 @@ local function handleNEW(command, originalKey, cacheKey)
 end
 
 local function handleEXISTS(command, originalKey, cacheKey, objectKey)
-       executeReadOnly(command, originalKey, "set", cacheKey, 
-           function(o, k)
-              if (exists(o, k) == 1) then 
+       executeReadField(command, originalKey, "set", cacheKey, objectKey,
+           function(value, k)
+              if (value == 1) then 
                   return "EXISTS"
               else
                   return "NOT_FOUND" 
               end
-           end,
-       objectKey)
+           end)
 end
 
 local function handlePUT(command, originalKey, cacheKey, objectKey)
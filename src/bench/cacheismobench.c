@@ -0,0 +1,642 @@
+#include <time.h>
+#include <math.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "../common/common.h"
+#include "../common/hdrhistogram.h"
+
+/* Load generator for a cacheismo on this machine.
+ *
+ * usage: cacheismo-bench [options], see usage() for the options.
+ *
+ * Every connection keeps up to depth requests in flight over the ascii
+ * protocol, a request goes out as soon as an answer comes in. The latency
+ * of a request is from when it is queued to when its answer is parsed,
+ * so with a pipeline it includes the wait behind the requests before it.
+ *
+ * The workloads are
+ *   kv     get and set of key:<n>, gets of multi-get width keys at once
+ *   set    set:exist and set:put on the set objects bench<n>, the puts
+ *          are counted as sets
+ *   quota  quota:addandcheck on the quota objects q<n>
+ * set and quota need a server with virtual keys (-e). With -l the keys
+ * or objects are created before the run and the run is timed alone.
+ *
+ * One line is printed at the end as name=value pairs, latencies in micro
+ * seconds. Only 127.0.0.1 is ever connected to.
+ */
+
+#define BENCH_MAX_CONNECTIONS  1024
+#define BENCH_MAX_DEPTH        1024
+#define BENCH_MAX_MULTI_GET    100
+#define BENCH_MAX_VALUE        (1024 * 1024)
+#define BENCH_SET_MEMBERS      1000
+#define BENCH_QUOTA_LIMIT      2000000000
+#define BENCH_BUFFER           (64 * 1024)
+
+enum benchWorkload_t {
+	WORKLOAD_KV = 1,
+	WORKLOAD_SET,
+	WORKLOAD_QUOTA
+};
+
+enum benchRequest_t {
+	REQUEST_GET = 1,       //answered by VALUE blocks and END
+	REQUEST_SET,           //answered by one line
+	REQUEST_PUT            //a get which changes an object, counted as a set
+};
+
+typedef struct {
+	u_int64_t  start;      //nano seconds
+	int        type;
+	u_int32_t  keys;
+} pending_t;
+
+typedef struct {
+	int        fd;
+	char*      out;
+	u_int32_t  outUsed;
+	u_int32_t  outSent;
+	u_int32_t  outSize;
+	char*      in;
+	u_int32_t  inUsed;
+	u_int32_t  inSize;
+	pending_t  pending[BENCH_MAX_DEPTH];
+	u_int32_t  head;
+	u_int32_t  count;
+	int        closed;
+} benchConnection_t;
+
+typedef struct {
+	u_int16_t  port;
+	int        connections;
+	int        depth;
+	u_int64_t  requests;       //0 for a timed run
+	double     seconds;
+	u_int32_t  keys;
+	double     zipf;           //0 for uniform
+	u_int32_t  valueMin;
+	u_int32_t  valueMax;
+	int        getPercent;
+	int        multiGet;
+	int        workload;
+	int        preload;
+	u_int64_t  seed;
+} benchOptions_t;
+
+typedef struct {
+	hdrHistogram_t latency;
+	u_int64_t      gets;
+	u_int64_t      sets;
+	u_int64_t      keys;       //asked for by the gets
+	u_int64_t      hits;
+	u_int64_t      errors;
+} benchResults_t;
+
+static benchOptions_t     options;
+static benchResults_t     results;
+static benchConnection_t* connections;
+static double*            zipfCdf;
+static char*              value;
+static u_int64_t          randomState;
+static int                measuring;
+static u_int64_t          issued;
+static u_int64_t          deadline;
+
+static u_int64_t nowNanos(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((u_int64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/* xorshift64*, the same sequence for the same seed */
+static u_int64_t nextRandom(void) {
+	randomState ^= randomState >> 12;
+	randomState ^= randomState << 25;
+	randomState ^= randomState >> 27;
+	return randomState * 2685821657736338717ULL;
+}
+
+static double nextUniform(void) {
+	return (nextRandom() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int createZipf(void) {
+	double sum = 0;
+
+	zipfCdf = ALLOCATE_N(options.keys, double);
+	if (!zipfCdf) {
+		return -1;
+	}
+	for (u_int32_t i = 0; i < options.keys; i++) {
+		sum += 1.0 / pow(i + 1, options.zipf);
+		zipfCdf[i] = sum;
+	}
+	for (u_int32_t i = 0; i < options.keys; i++) {
+		zipfCdf[i] /= sum;
+	}
+	return 0;
+}
+
+/* key 0 is the most popular one with zipf */
+static u_int32_t nextKey(void) {
+	double    u    = 0;
+	u_int32_t low  = 0;
+	u_int32_t high = 0;
+
+	if (!zipfCdf) {
+		return nextRandom() % options.keys;
+	}
+	u    = nextUniform();
+	high = options.keys - 1;
+	while (low < high) {
+		u_int32_t middle = low + (high - low) / 2;
+		if (zipfCdf[middle] < u) {
+			low = middle + 1;
+		}else {
+			high = middle;
+		}
+	}
+	return low;
+}
+
+static u_int32_t nextValueSize(void) {
+	return options.valueMin + (nextRandom() % (options.valueMax - options.valueMin + 1));
+}
+
+static int reserve(char** pBuffer, u_int32_t* pSize, u_int32_t needed) {
+	if (needed > *pSize) {
+		u_int32_t size   = *pSize ? *pSize : BENCH_BUFFER;
+		char*     buffer = 0;
+		while (size < needed) {
+			size *= 2;
+		}
+		buffer = realloc(*pBuffer, size);
+		if (!buffer) {
+			return -1;
+		}
+		*pBuffer = buffer;
+		*pSize   = size;
+	}
+	return 0;
+}
+
+static int appendOut(benchConnection_t* pConn, const char* data, u_int32_t length) {
+	if (0 != reserve(&pConn->out, &pConn->outSize, pConn->outUsed + length)) {
+		return -1;
+	}
+	memcpy(pConn->out + pConn->outUsed, data, length);
+	pConn->outUsed += length;
+	return 0;
+}
+
+/* the request to create key or object n, before the run */
+static int formatPreload(char* line, int size, u_int32_t n, int* pType, u_int32_t* pDataLength) {
+	switch (options.workload) {
+	case WORKLOAD_SET:
+		*pType = REQUEST_GET;
+		return snprintf(line, size, "get set:new:bench%u\r\n", n);
+	case WORKLOAD_QUOTA:
+		*pType = REQUEST_GET;
+		return snprintf(line, size, "get quota:new:q%u:%u:day\r\n", n, BENCH_QUOTA_LIMIT);
+	default:
+		*pType       = REQUEST_SET;
+		*pDataLength = nextValueSize();
+		return snprintf(line, size, "set key:%u 0 0 %u\r\n", n, *pDataLength);
+	}
+}
+
+static int formatRequest(char* line, int size, int* pType, u_int32_t* pKeys, u_int32_t* pDataLength) {
+	int isGet  = (int)(nextRandom() % 100) < options.getPercent;
+	int length = 0;
+
+	*pType = REQUEST_GET;
+	*pKeys = 1;
+	switch (options.workload) {
+	case WORKLOAD_SET:
+		*pType = isGet ? REQUEST_GET : REQUEST_PUT;
+		return snprintf(line, size, "get set:%s:bench%u:m%u\r\n", isGet ? "exist" : "put",
+				nextKey(), (u_int32_t)(nextRandom() % BENCH_SET_MEMBERS));
+	case WORKLOAD_QUOTA:
+		return snprintf(line, size, "get quota:addandcheck:q%u:1\r\n", nextKey());
+	default:
+		if (!isGet) {
+			*pType       = REQUEST_SET;
+			*pDataLength = nextValueSize();
+			return snprintf(line, size, "set key:%u 0 0 %u\r\n", nextKey(), *pDataLength);
+		}
+		length = snprintf(line, size, "get");
+		for (int i = 0; i < options.multiGet; i++) {
+			length += snprintf(line + length, size - length, " key:%u", nextKey());
+		}
+		*pKeys = options.multiGet;
+		return length + snprintf(line + length, size - length, "\r\n");
+	}
+}
+
+static int moreRequests(void) {
+	if (!measuring) {
+		return issued < options.keys;
+	}
+	if (options.requests) {
+		return issued < options.requests;
+	}
+	return nowNanos() < deadline;
+}
+
+static int queueRequest(benchConnection_t* pConn) {
+	char       line[BENCH_MAX_MULTI_GET * 24];
+	int        type       = 0;
+	u_int32_t  keys       = 0;
+	u_int32_t  dataLength = 0;
+	int        length     = 0;
+	pending_t* pPending   = 0;
+
+	if (measuring) {
+		length = formatRequest(line, sizeof(line), &type, &keys, &dataLength);
+	}else {
+		length = formatPreload(line, sizeof(line), issued, &type, &dataLength);
+	}
+	if (0 != appendOut(pConn, line, length)) {
+		return -1;
+	}
+	if ((type == REQUEST_SET) &&
+			((0 != appendOut(pConn, value, dataLength)) || (0 != appendOut(pConn, "\r\n", 2)))) {
+		return -1;
+	}
+	pPending = &pConn->pending[(pConn->head + pConn->count) % BENCH_MAX_DEPTH];
+	pPending->start = nowNanos();
+	pPending->type  = type;
+	pPending->keys  = keys;
+	pConn->count++;
+	issued++;
+	return 0;
+}
+
+/* Length of the answer at the start of the buffer, 0 till it is all
+ * in. Anything but VALUE blocks and END for a get, or STORED for a set,
+ * is an error.
+ */
+static u_int32_t answerLength(char* buffer, u_int32_t used, int type, u_int32_t* pHits, int* pError) {
+	u_int32_t offset = 0;
+
+	*pHits  = 0;
+	*pError = 0;
+	while (offset < used) {
+		char*     line = buffer + offset;
+		char*     end  = memchr(line, '\n', used - offset);
+		u_int32_t size = 0;
+
+		if (!end) {
+			return 0;
+		}
+		offset = (end - buffer) + 1;
+		if (type == REQUEST_SET) {
+			*pError = (0 != strncmp(line, "STORED\r\n", 8));
+			return offset;
+		}
+		if (0 == strncmp(line, "END\r\n", 5)) {
+			return offset;
+		}
+		if ((0 != strncmp(line, "VALUE ", 6)) || (1 != sscanf(line, "VALUE %*s %*u %u", &size))) {
+			*pError = 1;
+			return offset;
+		}
+		if (offset + size + 2 > used) {
+			return 0;
+		}
+		offset += size + 2;
+		(*pHits)++;
+	}
+	return 0;
+}
+
+static void answerDone(pending_t* pPending, u_int32_t hits, int error, u_int64_t now) {
+	if (!measuring) {
+		results.errors += error;
+		return;
+	}
+	hdrHistogramAdd(&results.latency, now - pPending->start);
+	results.errors += error;
+	if (pPending->type != REQUEST_GET) {
+		results.sets++;
+	}else {
+		results.gets++;
+		results.keys += pPending->keys;
+		results.hits += hits;
+	}
+}
+
+static int readAnswers(benchConnection_t* pConn) {
+	u_int32_t consumed = 0;
+	u_int64_t now      = 0;
+	ssize_t   got      = 0;
+
+	if (0 != reserve(&pConn->in, &pConn->inSize, pConn->inUsed + BENCH_BUFFER)) {
+		return -1;
+	}
+	got = recv(pConn->fd, pConn->in + pConn->inUsed, pConn->inSize - pConn->inUsed, 0);
+	if (got == 0) {
+		return -1;
+	}
+	if (got < 0) {
+		return ((errno == EAGAIN) || (errno == EINTR)) ? 0 : -1;
+	}
+	pConn->inUsed += got;
+	now = nowNanos();
+	while (pConn->count > 0) {
+		pending_t* pPending = &pConn->pending[pConn->head];
+		u_int32_t  hits     = 0;
+		int        error    = 0;
+		u_int32_t  length   = answerLength(pConn->in + consumed, pConn->inUsed - consumed,
+				pPending->type, &hits, &error);
+		if (length == 0) {
+			break;
+		}
+		answerDone(pPending, hits, error, now);
+		consumed   += length;
+		pConn->head = (pConn->head + 1) % BENCH_MAX_DEPTH;
+		pConn->count--;
+	}
+	if (consumed > 0) {
+		memmove(pConn->in, pConn->in + consumed, pConn->inUsed - consumed);
+		pConn->inUsed -= consumed;
+	}
+	return 0;
+}
+
+static int writeRequests(benchConnection_t* pConn) {
+	while (pConn->outSent < pConn->outUsed) {
+		ssize_t sent = send(pConn->fd, pConn->out + pConn->outSent, pConn->outUsed - pConn->outSent,
+				MSG_NOSIGNAL);
+		if (sent < 0) {
+			return ((errno == EAGAIN) || (errno == EINTR)) ? 0 : -1;
+		}
+		pConn->outSent += sent;
+	}
+	pConn->outUsed = 0;
+	pConn->outSent = 0;
+	return 0;
+}
+
+static int connectLocal(void) {
+	struct sockaddr_in address;
+	int                fd  = socket(AF_INET, SOCK_STREAM, 0);
+	int                one = 1;
+
+	if (fd < 0) {
+		return -1;
+	}
+	memset(&address, 0, sizeof(address));
+	address.sin_family      = AF_INET;
+	address.sin_port        = htons(options.port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((0 != connect(fd, (struct sockaddr*)&address, sizeof(address))) ||
+			(0 != setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one))) ||
+			(0 != fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Runs till no connection has a request to send or an answer to wait
+ * for. A connection closed by the server fails the run.
+ */
+static int runPhase(void) {
+	struct pollfd fds[BENCH_MAX_CONNECTIONS];
+	int           active = options.connections;
+
+	while (active > 0) {
+		active = 0;
+		for (int i = 0; i < options.connections; i++) {
+			benchConnection_t* pConn = &connections[i];
+			while ((pConn->count < options.depth) && moreRequests()) {
+				if (0 != queueRequest(pConn)) {
+					fprintf(stderr, "out of memory\n");
+					return -1;
+				}
+			}
+			if (0 != writeRequests(pConn)) {
+				fprintf(stderr, "error writing to 127.0.0.1:%u\n", options.port);
+				return -1;
+			}
+			fds[i].fd      = pConn->fd;
+			fds[i].events  = POLLIN | ((pConn->outUsed > pConn->outSent) ? POLLOUT : 0);
+			fds[i].revents = 0;
+			active += (pConn->count > 0);
+		}
+		if (active == 0) {
+			break;
+		}
+		if (poll(fds, options.connections, 1000) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		for (int i = 0; i < options.connections; i++) {
+			if ((fds[i].revents & (POLLIN | POLLERR | POLLHUP)) &&
+					(0 != readAnswers(&connections[i]))) {
+				fprintf(stderr, "connection to 127.0.0.1:%u closed\n", options.port);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static const char* workloadName(int workload) {
+	switch (workload) {
+	case WORKLOAD_SET:   return "set";
+	case WORKLOAD_QUOTA: return "quota";
+	}
+	return "kv";
+}
+
+static void report(double seconds) {
+	u_int64_t requests = results.gets + results.sets;
+	char      distribution[32];
+
+	if (options.zipf > 0) {
+		snprintf(distribution, sizeof(distribution), "zipf:%.2f", options.zipf);
+	}else {
+		snprintf(distribution, sizeof(distribution), "uniform");
+	}
+	printf("bench=cacheismo workload=%s distribution=%s keys=%u value_bytes=%u-%u get_percent=%d "
+			"multi_get=%d connections=%d depth=%d seconds=%.2f requests=%llu ops_per_sec=%.0f "
+			"gets=%llu sets=%llu hits=%llu misses=%llu errors=%llu "
+			"p50_us=%.1f p90_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f\n",
+			workloadName(options.workload), distribution, options.keys, options.valueMin,
+			options.valueMax, options.getPercent, options.multiGet, options.connections,
+			options.depth, seconds, (unsigned long long)requests, requests / seconds,
+			(unsigned long long)results.gets, (unsigned long long)results.sets,
+			(unsigned long long)results.hits, (unsigned long long)(results.keys - results.hits),
+			(unsigned long long)results.errors,
+			hdrHistogramPercentile(&results.latency, 50) / 1000.0,
+			hdrHistogramPercentile(&results.latency, 90) / 1000.0,
+			hdrHistogramPercentile(&results.latency, 99) / 1000.0,
+			hdrHistogramPercentile(&results.latency, 99.9) / 1000.0,
+			results.latency.max / 1000.0);
+}
+
+static void usage(const char* name) {
+	fprintf(stderr, "usage: %s [options]\n\n", name);
+	fprintf(stderr, "-p    <port of the cacheismo on 127.0.0.1>    default <11211>  \n");
+	fprintf(stderr, "-c    <connections>                           default <4>      \n");
+	fprintf(stderr, "-d    <requests in flight per connection>     default <1>      \n");
+	fprintf(stderr, "-t    <seconds to run>                        default <10>     \n");
+	fprintf(stderr, "-n    <requests to send, instead of -t>       default <None>   \n");
+	fprintf(stderr, "-k    <keys or objects>                       default <100000> \n");
+	fprintf(stderr, "-z    <zipf exponent, 0 for uniform keys>     default <0>      \n");
+	fprintf(stderr, "-v    <value bytes, min[-max]>                default <100>    \n");
+	fprintf(stderr, "-g    <percent of gets, the rest are sets>    default <90>     \n");
+	fprintf(stderr, "-m    <keys per get>                          default <1>      \n");
+	fprintf(stderr, "-w    <workload kv, set or quota>             default <kv>     \n");
+	fprintf(stderr, "-l    <create the keys or objects first>      default <Disabled> \n");
+	fprintf(stderr, "-s    <random seed>                           default <1>      \n");
+	exit(1);
+}
+
+static int parseArgs(int argc, char** argv) {
+	int c = 0;
+
+	options.port        = 11211;
+	options.connections = 4;
+	options.depth       = 1;
+	options.requests    = 0;
+	options.seconds     = 10;
+	options.keys        = 100000;
+	options.zipf        = 0;
+	options.valueMin    = 100;
+	options.valueMax    = 100;
+	options.getPercent  = 90;
+	options.multiGet    = 1;
+	options.workload    = WORKLOAD_KV;
+	options.preload     = 0;
+	options.seed        = 1;
+
+	while (-1 != (c = getopt(argc, argv, "p:c:d:t:n:k:z:v:g:m:w:ls:h"))) {
+		switch (c) {
+		case 'p':
+			options.port = atoi(optarg);
+			break;
+		case 'c':
+			options.connections = atoi(optarg);
+			break;
+		case 'd':
+			options.depth = atoi(optarg);
+			break;
+		case 't':
+			options.seconds = atof(optarg);
+			break;
+		case 'n':
+			options.requests = strtoull(optarg, 0, 10);
+			break;
+		case 'k':
+			options.keys = strtoul(optarg, 0, 10);
+			break;
+		case 'z':
+			options.zipf = atof(optarg);
+			break;
+		case 'v':
+			if (2 != sscanf(optarg, "%u-%u", &options.valueMin, &options.valueMax)) {
+				options.valueMin = options.valueMax = strtoul(optarg, 0, 10);
+			}
+			break;
+		case 'g':
+			options.getPercent = atoi(optarg);
+			break;
+		case 'm':
+			options.multiGet = atoi(optarg);
+			break;
+		case 'w':
+			if (0 == strcmp(optarg, "set")) {
+				options.workload = WORKLOAD_SET;
+			}else if (0 == strcmp(optarg, "quota")) {
+				options.workload = WORKLOAD_QUOTA;
+			}else if (0 == strcmp(optarg, "kv")) {
+				options.workload = WORKLOAD_KV;
+			}else {
+				return -1;
+			}
+			break;
+		case 'l':
+			options.preload = 1;
+			break;
+		case 's':
+			options.seed = strtoull(optarg, 0, 10);
+			break;
+		default:
+			return -1;
+		}
+	}
+	if ((options.connections < 1) || (options.connections > BENCH_MAX_CONNECTIONS) ||
+			(options.depth < 1) || (options.depth > BENCH_MAX_DEPTH) ||
+			(options.multiGet < 1) || (options.multiGet > BENCH_MAX_MULTI_GET) ||
+			(options.getPercent < 0) || (options.getPercent > 100) ||
+			(options.keys < 1) || (options.zipf < 0) || (options.seconds <= 0) ||
+			(options.valueMin > options.valueMax) || (options.valueMax > BENCH_MAX_VALUE)) {
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	u_int64_t start = 0;
+
+	if (0 != parseArgs(argc, argv)) {
+		usage(argv[0]);
+	}
+	randomState = options.seed ? options.seed : 1;
+	value       = malloc(options.valueMax + 1);
+	connections = ALLOCATE_N(options.connections, benchConnection_t);
+	if (!value || !connections || ((options.zipf > 0) && (0 != createZipf()))) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	memset(value, 'x', options.valueMax);
+	for (int i = 0; i < options.connections; i++) {
+		connections[i].fd = connectLocal();
+		if (connections[i].fd < 0) {
+			fprintf(stderr, "error connecting to 127.0.0.1:%u\n", options.port);
+			return 1;
+		}
+	}
+
+	if (options.preload) {
+		if (0 != runPhase()) {
+			return 1;
+		}
+		if (results.errors > 0) {
+			fprintf(stderr, "%llu errors creating the keys, is -e missing on the server?\n",
+					(unsigned long long)results.errors);
+		}
+		results.errors = 0;
+	}
+
+	measuring = 1;
+	issued    = 0;
+	start     = nowNanos();
+	deadline  = start + (u_int64_t)(options.seconds * 1e9);
+	if (0 != runPhase()) {
+		return 1;
+	}
+	report((nowNanos() - start) / 1e9);
+
+	for (int i = 0; i < options.connections; i++) {
+		close(connections[i].fd);
+		free(connections[i].out);
+		free(connections[i].in);
+	}
+	FREE(connections);
+	free(value);
+	free(zipfCdf);
+	return 0;
+}
@@ -0,0 +1,620 @@
+#include <time.h>
+#include <unistd.h>
+#include "../common/common.h"
+#include "../chunkpool/chunkpool.h"
+#include "../fallocator/fallocator.h"
+#include "../datastream/datastream.h"
+#include "../cacheitem/cacheitem.h"
+#include "../hashmap/hashmap.h"
+#include "../parser/parser.h"
+
+/* Cost of the components on the request path, without the network.
+ *
+ * usage: componentbench [-n ops] [-k keys] [-f file] [-b name]
+ *
+ *   chunkpool   chunkpoolMalloc and chunkpoolFree of sizes from 16 bytes
+ *               to a page, alone and churning, then chunkpoolGC over a
+ *               pool fragmented in small free chunks
+ *   hashmap     hashMapPutElement and hashMapGetElement, hits and misses,
+ *               every time the map grew by half up to keys items, the
+ *               puts splitting a bucket each and the load factor staying
+ *               at 1, then with the buckets made for keys, 2 * keys and
+ *               4 * keys items by hashMapReserve, so at load factors of
+ *               1, 1/2 and 1/4 without splits
+ *   datastream  dataStreamClone and dataStreamIteratorCreate of values
+ *               up to 1MB made of 1KB read buffers,
+ *               dataStreamTruncateFromStart of a read stream consumed a
+ *               command at a time
+ *   parser      requestParserParse of get, multi-get, set and mixed
+ *               command streams fed in 1KB reads, and of file, a request
+ *               stream recorded from a client, when given
+ *
+ * -b runs only the named one. One line per run is printed as name=value
+ * pairs, ns_per_op is per call or per command. Default is 1000000 ops and
+ * 1048576 keys.
+ */
+
+#define TABLE_SIZE        (64 * 1024)              //random sizes and indexes
+#define TABLE_MASK        (TABLE_SIZE - 1)
+#define POOL_PAGES        (16 * 1024)              //64MB
+#define GC_CALL_PAGES     ((8 * 1024 * 1024) / 4096) //pages chunkpoolGC merges a call
+#define GC_CHUNK_SIZE     48
+#define HASHMAP_VALUE     32
+#define HASHMAP_ITEM_COST 256                      //pool bytes per item, generous
+#define HASHMAP_MAX_SPARE 4                        //buckets per key of the last run
+#define KEY_SIZE          16
+#define READ_SIZE         1024                     //as connectionRead
+#define STREAM_COMMANDS   (16 * 1024)
+#define SET_VALUE         100
+#define MULTI_GET_KEYS    10
+#define CLONE_BYTES       (1024 * 1024 * 1024)     //copied by a clone run at most
+
+int logLevel = ERR;
+
+static u_int32_t  sizes[TABLE_SIZE];
+static u_int32_t  indexes[TABLE_SIZE];
+
+static double nowSeconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void printRun(const char* bench, const char* op, const char* extra, u_int64_t ops,
+		double elapsed) {
+	printf("bench=%s op=%s %sn=%llu ns_per_op=%.1f ops_per_sec=%.0f\n", bench, op, extra,
+			(unsigned long long)ops, ops ? (elapsed * 1e9) / ops : 0,
+			(elapsed > 0) ? ops / elapsed : 0);
+}
+
+/* 16 bytes to a page, every power of two as likely */
+static void createTables(void) {
+	for (int i = 0; i < TABLE_SIZE; i++) {
+		u_int32_t base = 16 << (random() % 8);
+		sizes[i]   = base + (random() % base);
+		indexes[i] = random();
+	}
+}
+
+static void chunkpoolBench(u_int64_t ops) {
+	chunkpool_t      chunkpool = chunkpoolCreate(POOL_PAGES);
+	void**           chunks    = ALLOCATE_N(TABLE_SIZE, void*);
+	void**           small     = 0;
+	u_int32_t        smallCount = 0, smallMax = (POOL_PAGES * 4096) / GC_CHUNK_SIZE;
+	u_int64_t        failed    = 0;
+	u_int32_t        calls     = 0;
+	chunkpoolStats_t before, after;
+	double           start     = 0;
+	char             extra[256];
+
+	if (!chunkpool || !chunks) {
+		fprintf(stderr, "error creating chunkpool\n");
+		goto OnError;
+	}
+	for (int i = 0; i < TABLE_SIZE; i++) {
+		if (sizes[i] > chunkpoolMaxMallocSize(chunkpool)) {
+			sizes[i] = chunkpoolMaxMallocSize(chunkpool);
+		}
+	}
+
+	start = nowSeconds();
+	for (int i = 0; i < TABLE_SIZE; i++) {
+		chunks[i] = chunkpoolMalloc(chunkpool, sizes[i]);
+		failed   += (chunks[i] == 0);
+	}
+	snprintf(extra, sizeof(extra), "live=%d failed=%llu ", TABLE_SIZE, (unsigned long long)failed);
+	printRun("chunkpool", "malloc", extra, TABLE_SIZE, nowSeconds() - start);
+
+	// a free and a malloc of another size in a random slot
+	failed = 0;
+	start  = nowSeconds();
+	for (u_int64_t i = 0; i < ops; i++) {
+		u_int32_t slot = indexes[i & TABLE_MASK] & TABLE_MASK;
+		if (chunks[slot]) {
+			chunkpoolFree(chunkpool, chunks[slot]);
+		}
+		chunks[slot] = chunkpoolMalloc(chunkpool, sizes[(i * 7) & TABLE_MASK]);
+		failed      += (chunks[slot] == 0);
+	}
+	start = nowSeconds() - start;
+	chunkpoolGetStats(chunkpool, &after);
+	snprintf(extra, sizeof(extra), "live=%d failed=%llu free_chunks=%llu ", TABLE_SIZE,
+			(unsigned long long)failed, (unsigned long long)after.freeChunks);
+	printRun("chunkpool", "churn", extra, ops, start);
+
+	start = nowSeconds();
+	for (int i = 0; i < TABLE_SIZE; i++) {
+		if (chunks[i]) {
+			chunkpoolFree(chunkpool, chunks[i]);
+		}
+	}
+	printRun("chunkpool", "free", "", TABLE_SIZE, nowSeconds() - start);
+
+	/* GC merges free neighbours only when at least 1/8 of the pool is free
+	 * in chunks of less than 256 bytes on average. The pool is filled
+	 * with small chunks and 3 out of 4 are freed.
+	 */
+	small = ALLOCATE_N(smallMax, void*);
+	if (!small) {
+		fprintf(stderr, "out of memory\n");
+		goto OnError;
+	}
+	while ((smallCount < smallMax) &&
+			(small[smallCount] = chunkpoolMalloc(chunkpool, GC_CHUNK_SIZE))) {
+		smallCount++;
+	}
+	for (u_int32_t i = 0; i < smallCount; i++) {
+		if (i & 3) {
+			chunkpoolFree(chunkpool, small[i]);
+		}
+	}
+	chunkpoolGetStats(chunkpool, &before);
+	start = nowSeconds();
+	for (calls = 0; calls < (POOL_PAGES / GC_CALL_PAGES) + 1; calls++) {
+		chunkpoolGC(chunkpool);
+	}
+	start = nowSeconds() - start;
+	chunkpoolGetStats(chunkpool, &after);
+	snprintf(extra, sizeof(extra), "pool_mb=%d free_mb=%llu free_chunks_before=%llu free_chunks_after=%llu ",
+			(POOL_PAGES * 4096) >> 20, (unsigned long long)(before.freeBytes >> 20),
+			(unsigned long long)before.freeChunks, (unsigned long long)after.freeChunks);
+	printRun("chunkpool", "gc", extra, calls, start);
+
+OnError:
+	if (small) {
+		FREE(small);
+	}
+	if (chunks) {
+		FREE(chunks);
+	}
+	if (chunkpool) {
+		chunkpoolDelete(chunkpool);
+	}
+}
+
+/* a value made of 1KB read buffers, like the data of a set */
+static dataStream_t createValue(fallocator_t fallocator, u_int32_t size) {
+	dataStream_t dataStream = dataStreamCreate();
+
+	while (dataStream && (dataStreamGetSize(dataStream) < size)) {
+		u_int32_t length = size - dataStreamGetSize(dataStream);
+		void*     buffer = dataStreamBufferAllocate(0, fallocator, READ_SIZE);
+
+		if (!buffer) {
+			dataStreamDelete(dataStream);
+			return 0;
+		}
+		length = (length > READ_SIZE) ? READ_SIZE : length;
+		memset(buffer, 'v', length);
+		dataStreamAppendData(dataStream, buffer, 0, length);
+		dataStreamBufferFree(buffer);
+	}
+	return dataStream;
+}
+
+static cacheItem_t createItem(chunkpool_t chunkpool, char* key, dataStream_t value) {
+	command_t command;
+
+	memset(&command, 0, sizeof(command));
+	command.key        = key;
+	command.keySize    = strlen(key);
+	command.dataLength = dataStreamGetSize(value);
+	command.dataStream = value;
+	return cacheItemCreate(chunkpool, &command);
+}
+
+static double getElements(hashMap_t hashMap, chunkpool_t chunkpool, char (*keys)[KEY_SIZE],
+		u_int32_t count, u_int64_t lookups, u_int64_t* pFound) {
+	double start = nowSeconds();
+
+	for (u_int64_t i = 0; i < lookups; i++) {
+		char*       key  = keys[indexes[i & TABLE_MASK] % count];
+		cacheItem_t item = hashMapGetElement(hashMap, key, strlen(key));
+		if (item) {
+			(*pFound)++;
+			cacheItemDelete(chunkpool, item);
+		}
+	}
+	return nowSeconds() - start;
+}
+
+/* With reserve 0 the map grows from empty, otherwise it has the buckets
+ * for reserve items and the keys are put at once.
+ */
+static void hashMapBench(u_int64_t ops, u_int32_t keyCount, u_int32_t reserve) {
+	u_int32_t      pages     = ((u_int64_t)keyCount * HASHMAP_ITEM_COST) / 4096 + 1024;
+	chunkpool_t    chunkpool = chunkpoolCreate(pages);
+	fallocator_t   fallocator = fallocatorCreate();
+	hashMap_t      hashMap   = 0;
+	dataStream_t   value     = 0;
+	cacheItem_t*   items     = ALLOCATE_N(keyCount, cacheItem_t);
+	char           (*keys)[KEY_SIZE] = ALLOCATE_N(keyCount, char[KEY_SIZE]);
+	char           (*missing)[KEY_SIZE] = ALLOCATE_N(TABLE_SIZE, char[KEY_SIZE]);
+	u_int32_t      count     = 0, next = 1024;
+	hashMapStats_t stats;
+	char           extra[256];
+
+	if (!chunkpool || !fallocator || !items || !keys || !missing) {
+		fprintf(stderr, "out of memory\n");
+		goto OnError;
+	}
+	hashMap = hashMapCreate(cacheItemGetHashEntryAPI(chunkpool));
+	value   = createValue(fallocator, HASHMAP_VALUE);
+	if (!hashMap || !value || (reserve && (0 != hashMapReserve(hashMap, reserve)))) {
+		fprintf(stderr, "error creating hashmap\n");
+		goto OnError;
+	}
+	if (reserve) {
+		next = keyCount;
+	}
+	for (u_int32_t i = 0; i < keyCount; i++) {
+		snprintf(keys[i], KEY_SIZE, "key:%08u", i);
+	}
+	for (u_int32_t i = 0; i < TABLE_SIZE; i++) {
+		snprintf(missing[i], KEY_SIZE, "miss:%08u", i);
+	}
+
+	// the items are created before each step, the puts are timed alone
+	while (count < keyCount) {
+		u_int64_t found  = 0;
+		u_int32_t first  = count;
+		double    putTime = 0, hitTime = 0, missTime = 0;
+
+		next = (next > keyCount) ? keyCount : next;
+		for (u_int32_t i = first; i < next; i++) {
+			items[i] = createItem(chunkpool, keys[i], value);
+			if (!items[i]) {
+				fprintf(stderr, "error creating item %u, chunkpool full\n", i);
+				goto OnError;
+			}
+		}
+		putTime = nowSeconds();
+		for (; count < next; count++) {
+			hashMapPutElement(hashMap, items[count]);
+		}
+		putTime  = nowSeconds() - putTime;
+		hitTime  = getElements(hashMap, chunkpool, keys, count, ops, &found);
+		missTime = getElements(hashMap, chunkpool, missing, TABLE_SIZE, ops, &found);
+
+		hashMapGetStats(hashMap, &stats);
+		snprintf(extra, sizeof(extra), "keys=%u reserved=%u buckets=%u active_buckets=%u "
+				"split_at=%u load_factor=%.2f ", stats.count, reserve, stats.buckets,
+				stats.activeBuckets, stats.splitAt, (double)stats.count / stats.activeBuckets);
+		printRun("hashmap", "put", extra, count - first, putTime);
+		printRun("hashmap", "get_hit", extra, ops, hitTime);
+		printRun("hashmap", "get_miss", extra, ops, missTime);
+		if (found != ops) {
+			fprintf(stderr, "hashmap found %llu of %llu keys\n", (unsigned long long)found,
+					(unsigned long long)ops);
+		}
+		// half way to the next power of two, then to it
+		next = (next & (next - 1)) ? (next & (next - 1)) << 1 : next + (next >> 1);
+	}
+
+OnError:
+	if (hashMap) {
+		hashMapDelete(hashMap);
+	}
+	if (value) {
+		dataStreamDelete(value);
+	}
+	if (missing) {
+		FREE(missing);
+	}
+	if (keys) {
+		FREE(keys);
+	}
+	if (items) {
+		FREE(items);
+	}
+	if (fallocator) {
+		fallocatorDelete(fallocator);
+	}
+	if (chunkpool) {
+		chunkpoolDelete(chunkpool);
+	}
+}
+
+static void dataStreamBench(u_int64_t ops) {
+	static const u_int32_t valueSizes[] = {100, 4096, 64 * 1024, 1024 * 1024};
+	chunkpool_t    chunkpool  = chunkpoolCreate(POOL_PAGES);
+	fallocator_t   fallocator = fallocatorCreate();
+	dataStream_t   readStream = 0;
+	u_int64_t      failed     = 0;
+	double         start      = 0;
+	char           extra[256];
+
+	if (!chunkpool || !fallocator) {
+		fprintf(stderr, "out of memory\n");
+		goto OnError;
+	}
+	for (int v = 0; v < sizeof(valueSizes) / sizeof(valueSizes[0]); v++) {
+		u_int32_t    size   = valueSizes[v];
+		u_int64_t    clones = (ops < CLONE_BYTES / size) ? ops : CLONE_BYTES / size;
+		dataStream_t value  = createValue(fallocator, size);
+
+		if (!value) {
+			fprintf(stderr, "out of memory\n");
+			goto OnError;
+		}
+		failed = 0;
+		start  = nowSeconds();
+		for (u_int64_t i = 0; i < clones; i++) {
+			dataStream_t clone = dataStreamClone(chunkpool, value);
+			if (clone) {
+				dataStreamDelete(clone);
+			}else {
+				failed++;
+			}
+		}
+		start = nowSeconds() - start;
+		snprintf(extra, sizeof(extra), "size=%u failed=%llu mb_per_sec=%.0f ", size,
+				(unsigned long long)failed, (start > 0) ? (clones * (double)size) / (start * 1e6) : 0);
+		printRun("datastream", "clone", extra, clones, start);
+
+		// the middle half of the value
+		failed = 0;
+		start  = nowSeconds();
+		for (u_int64_t i = 0; i < ops; i++) {
+			dataStreamIterator_t iterator = dataStreamIteratorCreate(fallocator, value,
+					size / 4, size / 2);
+			if (iterator) {
+				dataStreamIteratorDelete(fallocator, iterator);
+			}else {
+				failed++;
+			}
+		}
+		start = nowSeconds() - start;
+		snprintf(extra, sizeof(extra), "size=%u failed=%llu ", size, (unsigned long long)failed);
+		printRun("datastream", "iterator", extra, ops, start);
+		dataStreamDelete(value);
+	}
+
+	/* a read stream of 16 to 32 reads, a 40 byte command consumed at a
+	 * time and a read appended when it falls below 16
+	 */
+	readStream = createValue(fallocator, 32 * READ_SIZE);
+	if (!readStream) {
+		fprintf(stderr, "out of memory\n");
+		goto OnError;
+	}
+	start = nowSeconds();
+	for (u_int64_t i = 0; i < ops; i++) {
+		u_int32_t size = dataStreamGetSize(readStream);
+		if (size < 16 * READ_SIZE) {
+			void* buffer = dataStreamBufferAllocate(0, fallocator, READ_SIZE);
+			if (!buffer) {
+				fprintf(stderr, "out of memory\n");
+				goto OnError;
+			}
+			dataStreamAppendData(readStream, buffer, 0, READ_SIZE);
+			dataStreamBufferFree(buffer);
+			size += READ_SIZE;
+		}
+		dataStreamTruncateFromStart(readStream, size - 40);
+	}
+	printRun("datastream", "truncate_from_start", "size=40 ", ops, nowSeconds() - start);
+
+OnError:
+	if (readStream) {
+		dataStreamDelete(readStream);
+	}
+	if (fallocator) {
+		fallocatorDelete(fallocator);
+	}
+	if (chunkpool) {
+		chunkpoolDelete(chunkpool);
+	}
+}
+
+enum streamKind_t {
+	STREAM_GET = 0,
+	STREAM_MULTI_GET,
+	STREAM_SET,
+	STREAM_MIXED
+};
+
+static char* createCommandStream(int kind, u_int32_t* pLength) {
+	char*     stream = malloc(STREAM_COMMANDS * (SET_VALUE + (MULTI_GET_KEYS * KEY_SIZE) + 64));
+	u_int32_t length = 0;
+	char      value[SET_VALUE + 1];
+
+	memset(value, 'v', SET_VALUE);
+	value[SET_VALUE] = 0;
+	for (int i = 0; stream && (i < STREAM_COMMANDS); i++) {
+		int command = kind;
+		if (kind == STREAM_MIXED) {
+			// 80% get, 10% multi-get, 10% set
+			u_int32_t r = random() % 10;
+			command = (r < 8) ? STREAM_GET : ((r == 8) ? STREAM_MULTI_GET : STREAM_SET);
+		}
+		switch (command) {
+		case STREAM_GET:
+			length += sprintf(stream + length, "get key:%08ld\r\n", random() % 1000000);
+			break;
+		case STREAM_MULTI_GET:
+			length += sprintf(stream + length, "get");
+			for (int k = 0; k < MULTI_GET_KEYS; k++) {
+				length += sprintf(stream + length, " key:%08ld", random() % 1000000);
+			}
+			length += sprintf(stream + length, "\r\n");
+			break;
+		default:
+			length += sprintf(stream + length, "set key:%08ld 0 0 %d\r\n%s\r\n",
+					random() % 1000000, SET_VALUE, value);
+			break;
+		}
+	}
+	*pLength = length;
+	return stream;
+}
+
+static char* readCommandFile(char* path, u_int32_t* pLength) {
+	FILE* file   = fopen(path, "r");
+	char* stream = 0;
+	long  length = 0;
+
+	if (file && (0 == fseek(file, 0, SEEK_END)) && ((length = ftell(file)) > 0)) {
+		rewind(file);
+		stream = malloc(length);
+		if (stream && (length != fread(stream, 1, length, file))) {
+			free(stream);
+			stream = 0;
+		}
+	}
+	if (file) {
+		fclose(file);
+	}
+	*pLength = length;
+	return stream;
+}
+
+/* the stream is fed in reads of READ_SIZE, copies included, until ops
+ * commands are parsed. -1 on a parse error.
+ */
+static int parseStream(const char* name, char* stream, u_int32_t length, u_int64_t ops) {
+	fallocator_t    fallocator = fallocatorCreate();
+	requestParser_t parser     = 0;
+	dataStream_t    readStream = dataStreamCreate();
+	u_int64_t       commands   = 0, bytes = 0;
+	int             returnValue = -1;
+	double          start      = 0;
+	char            extra[256];
+
+	parser = fallocator ? requestParserCreate(fallocator) : 0;
+	if (!parser || !readStream) {
+		fprintf(stderr, "out of memory\n");
+		goto OnError;
+	}
+	start = nowSeconds();
+	while (commands < ops) {
+		for (u_int32_t offset = 0; offset < length; offset += READ_SIZE) {
+			u_int32_t size   = ((length - offset) > READ_SIZE) ? READ_SIZE : (length - offset);
+			void*     buffer = dataStreamBufferAllocate(0, fallocator, READ_SIZE);
+			int       parsed = 0;
+
+			if (!buffer) {
+				fprintf(stderr, "out of memory\n");
+				goto OnError;
+			}
+			memcpy(buffer, stream + offset, size);
+			dataStreamAppendData(readStream, buffer, 0, size);
+			dataStreamBufferFree(buffer);
+			while (0 == (parsed = requestParserParse(parser, readStream))) {
+				commandDelete(fallocator, requestParserGetCommandAndReset(parser, readStream));
+				commands++;
+			}
+			if (parsed < 0) {
+				fprintf(stderr, "parse error in %s stream at byte %u\n", name, offset);
+				goto OnError;
+			}
+		}
+		bytes += length;
+		if (commands == 0) {
+			fprintf(stderr, "no command in %s stream\n", name);
+			goto OnError;
+		}
+	}
+	start = nowSeconds() - start;
+	snprintf(extra, sizeof(extra), "stream=%s bytes=%llu mb_per_sec=%.0f ", name,
+			(unsigned long long)bytes, (start > 0) ? bytes / (start * 1e6) : 0);
+	printRun("parser", "parse", extra, commands, start);
+	returnValue = 0;
+
+OnError:
+	if (readStream) {
+		dataStreamDelete(readStream);
+	}
+	if (parser) {
+		requestParserDelete(parser);
+	}
+	if (fallocator) {
+		fallocatorDelete(fallocator);
+	}
+	return returnValue;
+}
+
+static int parserBench(u_int64_t ops, char* path) {
+	static const char* names[] = {"get", "multi_get", "set", "mixed"};
+	char*              stream  = 0;
+	u_int32_t          length  = 0;
+	int                returnValue = 0;
+
+	for (int kind = STREAM_GET; kind <= STREAM_MIXED; kind++) {
+		stream = createCommandStream(kind, &length);
+		if (!stream) {
+			fprintf(stderr, "out of memory\n");
+			return -1;
+		}
+		returnValue |= parseStream(names[kind], stream, length, ops);
+		free(stream);
+	}
+	if (path) {
+		stream = readCommandFile(path, &length);
+		if (!stream) {
+			fprintf(stderr, "error reading %s\n", path);
+			return -1;
+		}
+		returnValue |= parseStream("file", stream, length, ops);
+		free(stream);
+	}
+	return returnValue;
+}
+
+static void usage(char* name) {
+	fprintf(stderr, "usage: %s [-n ops] [-k keys] [-f file] [-b chunkpool|hashmap|datastream|parser]\n",
+			name);
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	u_int64_t ops      = 1000000;
+	u_int32_t keys     = 1024 * 1024;
+	char*     path     = 0;
+	char*     only     = 0;
+	int       c        = 0;
+
+	while (-1 != (c = getopt(argc, argv, "n:k:f:b:h"))) {
+		switch (c) {
+		case 'n':
+			ops = strtoull(optarg, 0, 10);
+			break;
+		case 'k':
+			keys = strtoul(optarg, 0, 10);
+			break;
+		case 'f':
+			path = optarg;
+			break;
+		case 'b':
+			only = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if ((ops < 1) || (keys < 1024)) {
+		usage(argv[0]);
+	}
+	fallocatorInit(16 * (1024 / 4));
+	srandom(1);
+	createTables();
+
+	if (!only || (0 == strcmp(only, "chunkpool"))) {
+		chunkpoolBench(ops);
+	}
+	if (!only || (0 == strcmp(only, "hashmap"))) {
+		hashMapBench(ops, keys, 0);
+		for (u_int32_t spare = 1; spare <= HASHMAP_MAX_SPARE; spare *= 2) {
+			hashMapBench(ops, keys, keys * spare);
+		}
+	}
+	if (!only || (0 == strcmp(only, "datastream"))) {
+		dataStreamBench(ops);
+	}
+	if (!only || (0 == strcmp(only, "parser"))) {
+		if (0 != parserBench(ops, path)) {
+			return 1;
+		}
+	}
+	return 0;
+}
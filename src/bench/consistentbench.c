@@ -0,0 +1,98 @@
+#include <time.h>
+#include "../common/common.h"
+#include "../cluster/consistent.h"
+
+/* Lookup cost of consistentFindServer for every mode.
+ *
+ * usage: consistentbench [servers] [lookups]
+ * default is 1000 servers (160 points each on the ketama ring) and
+ * 1000000 lookups. One line per run is printed as name=value pairs.
+ */
+
+#define KEY_COUNT   (64 * 1024)
+#define KEY_SIZE    32
+
+static double nowSeconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static char* createServerNames(int count) {
+	char* names  = malloc(count * 24);
+	int   length = 0;
+
+	if (names) {
+		names[0] = 0;
+		for (int i = 0; i < count; i++) {
+			length += sprintf(names + length, "%s10.0.%d.%d:11211", (i ? "," : ""),
+					(i / 250), (i % 250) + 1);
+		}
+	}
+	return names;
+}
+
+static void run(char* serverNames, int servers, const char* modeName, int unavailable,
+		char keys[][KEY_SIZE], int lookups) {
+	consistent_t consistent = 0;
+	const char*  server     = 0;
+	u_int64_t    found      = 0;
+	double       start      = 0, elapsed = 0;
+	char         name[KEY_SIZE];
+
+	consistent = consistentCreateWithMode(serverNames, consistentModeFromName(modeName));
+	if (!consistent) {
+		fprintf(stderr, "error creating %s ring\n", modeName);
+		return;
+	}
+	// every 10th server down
+	for (int i = 0; i < servers && unavailable; i += 10) {
+		sprintf(name, "10.0.%d.%d:11211", (i / 250), (i % 250) + 1);
+		consistentSetServerAvailable(consistent, name, 0);
+	}
+
+	start = nowSeconds();
+	for (int i = 0; i < lookups; i++) {
+		server = consistentFindServer(consistent, keys[i & (KEY_COUNT - 1)]);
+		found += (server != 0);
+	}
+	elapsed = nowSeconds() - start;
+
+	printf("bench=consistent mode=%s servers=%d unavailable=%d lookups=%d found=%llu "
+			"ns_per_op=%.1f ops_per_sec=%.0f\n", modeName, servers, unavailable ? (servers + 9) / 10 : 0,
+			lookups, (unsigned long long)found, (elapsed * 1e9) / lookups, lookups / elapsed);
+	consistentDelete(consistent);
+}
+
+int main(int argc, char** argv) {
+	int   servers     = (argc > 1) ? atoi(argv[1]) : 1000;
+	int   lookups     = (argc > 2) ? atoi(argv[2]) : 1000000;
+	char* serverNames = 0;
+	char  (*keys)[KEY_SIZE] = 0;
+
+	if (servers <= 0 || servers > 62500 || lookups <= 0) {
+		fprintf(stderr, "usage: %s [servers] [lookups]\n", argv[0]);
+		return 1;
+	}
+	serverNames = createServerNames(servers);
+	keys        = malloc(KEY_COUNT * KEY_SIZE);
+	if (!serverNames || !keys) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	srandom(1);
+	for (int i = 0; i < KEY_COUNT; i++) {
+		snprintf(keys[i], KEY_SIZE, "user:%ld:%d", random(), i);
+	}
+
+	run(serverNames, servers, "ketama",     0, keys, lookups);
+	run(serverNames, servers, "ketama",     1, keys, lookups);
+	run(serverNames, servers, "jump",       0, keys, lookups);
+	run(serverNames, servers, "jump",       1, keys, lookups);
+	run(serverNames, servers, "rendezvous", 0, keys, lookups / 10);
+	run(serverNames, servers, "rendezvous", 1, keys, lookups / 10);
+
+	free(keys);
+	free(serverNames);
+	return 0;
+}
@@ -1,7 +1,10 @@
 #include "cacheismo.h"
 #include "parser/parser.h"
 #include "lua/binding.h"
+#include "cluster/proxy.h"
+#include "stats/admin.h"
 #include <unistd.h>
+#include <signal.h>
 
 int logLevel = 3;
 
@@ -19,6 +22,39 @@ typedef struct global_t {
 	hashMap_t          hashMap;
 	luaRunnable_t      runnable;
 	struct event*      timer;
+	struct event*      reloadSignal;
+	u_int64_t          luaMaxInstructions;
+	u_int32_t          luaMaxMillis;
+	u_int32_t          luaMaxMemory;
+	char*              proxyServers;
+	char*              proxySelf;
+	proxy_t            proxy;
+	char*              follower;
+	replication_t      replication;
+	u_int32_t          nearCacheMillis;
+	u_int32_t          healthMillis;
+	u_int32_t          healthTimeoutMillis;
+	u_int32_t          deadlineMillis;
+	u_int32_t          maxInFlight;
+	char*              seeds;
+	u_int32_t          gossipMillis;
+	membership_t       membership;
+	hotPush_t          hotPush;
+	char*              arenaFile;
+	char*              snapshotFile;
+	int                loadSnapshot;
+	snapshot_t         snapshot;
+	char*              appendLogFile;
+	u_int32_t          appendLogSyncMillis;
+	appendLog_t        appendLog;
+	u_int32_t          adminPort;
+	admin_t            admin;
+	char*              accountingSeparators;
+	accounting_t       accounting;
+	keySampler_t       keySampler;
+	int32_t            slowlogMicros;
+	slowlog_t          slowlog;
+	struct event*      stopSignals[2];
 }global_t;
 
 
@@ -30,6 +66,10 @@ typedef struct connectionContext_t {
 	requestParser_t  parser;
 	fallocator_t     fallocator;
 	command_t*       pCommand;
+	u_int32_t        writeMark;
+	u_int32_t        proxyPending;
+	u_int64_t        commandStart;
+	slowlogRequest_t slowlog;
 } connectionContext_t;
 
 global_t ENV;
@@ -42,6 +82,8 @@ void  setGlobalLogLevel(int level) {
 
 static void connectionContextDelete(connectionContext_t* pContext) {
 	if (pContext) {
+		serverStats.currentConnections--;
+		slowlogSuspend(ENV.slowlog, &pContext->slowlog);
 		if (pContext->readStream) {
 			dataStreamDelete(pContext->readStream);
 			pContext->readStream = 0;
@@ -66,6 +108,8 @@ static connectionContext_t* connectionContextCreate(connection_t conn) {
 
 	IfTrue(conn, ERR, "Null Connection");
 	IfTrue(pContext, ERR, "Error allocating memory");
+	serverStats.connections++;
+	serverStats.currentConnections++;
 
 	pContext->readStream = dataStreamCreate();
 	IfTrue(pContext->readStream, WARN, "Error creating read stream");
@@ -98,6 +142,64 @@ struct event_base* getGlobalEventBase(void) {
 	return ENV.base;
 }
 
+replication_t getGlobalReplication(void) {
+	return ENV.replication;
+}
+
+proxy_t getGlobalProxy(void) {
+	return ENV.proxy;
+}
+
+snapshot_t getGlobalSnapshot(void) {
+	return ENV.snapshot;
+}
+
+appendLog_t getGlobalAppendLog(void) {
+	return ENV.appendLog;
+}
+
+membership_t getGlobalMembership(void) {
+	return ENV.membership;
+}
+
+hotPush_t getGlobalHotPush(void) {
+	return ENV.hotPush;
+}
+
+luaAllocator_t getGlobalLuaAllocator(void) {
+	return ENV.runnable ? (LUA_RUNNABLE(ENV.runnable))->allocator : 0;
+}
+
+accounting_t getGlobalAccounting(void) {
+	return ENV.accounting;
+}
+
+keySampler_t getGlobalKeySampler(void) {
+	return ENV.keySampler;
+}
+
+slowlog_t getGlobalSlowlog(void) {
+	return ENV.slowlog;
+}
+
+clusterMap_t getGlobalClusterMap(void) {
+	if (ENV.proxy) {
+		return proxyGetClusterMap(ENV.proxy);
+	}
+	return ENV.runnable ? (LUA_RUNNABLE(ENV.runnable))->clusterMap : 0;
+}
+
+/* the proxy ring and the hot key pushes follow the members, scripts
+ * ask with getMembers() */
+static void membersChanged(void* context, char* members) {
+	if (ENV.proxy && (0 != proxyChangeRing(ENV.proxy, members))) {
+		LOG(ERR, "Error changing ring to [%s]", members);
+	}
+	if (ENV.hotPush && (0 != hotPushSetPeers(ENV.hotPush, members))) {
+		LOG(ERR, "Error setting near cache peers to [%s]", members);
+	}
+}
+
 static void newConnectionImpl(connection_t connection) {
 	LOG(DEBUG, "got a new connection %p", connection);
 	if (connection) {
@@ -113,7 +215,8 @@ static void newConnectionImpl(connection_t connection) {
 }
 
 cacheItem_t  createCacheItemFromCommand(command_t* pCommand) {
-	cacheItem_t item = cacheItemCreate(ENV.chunkpool, pCommand);
+	int         phase = slowlogEnter(ENV.slowlog, SLOWLOG_ALLOC);
+	cacheItem_t item  = cacheItemCreate(ENV.chunkpool, pCommand);
 	if (!item) {
 		int freeSize = 2 * cacheItemEstimateSize(pCommand);
 		while (!item && (freeSize < 2 * 1024 * 1024)) {
@@ -124,6 +227,7 @@ cacheItem_t  createCacheItemFromCommand(command_t* pCommand) {
 			}
 		}
 	}
+	slowlogLeave(ENV.slowlog, phase);
 	return item;
 }
 
@@ -186,10 +290,111 @@ int writeRawStringToStream(connection_t connection, char* value, int length) {
 }
 
 
+#define SCRIPT_ABORTED_RESPONSE   "SERVER_ERROR script exceeded execution budget\r\n"
+#define SCRIPT_NO_MEMORY_RESPONSE "SERVER_ERROR script out of memory\r\n"
+
+/* Whatever the script wrote before it was aborted is discarded,
+ * the client only gets the error.
+ */
+static void writeScriptAborted(connectionContext_t* pContext, int result) {
+	char* response = SCRIPT_ABORTED_RESPONSE;
+
+	if (result == LUA_RUNNABLE_NO_MEMORY) {
+		response = SCRIPT_NO_MEMORY_RESPONSE;
+	}
+	dataStreamTruncateFromEnd(pContext->writeStream, pContext->writeMark);
+	writeRawStringToStream(pContext->connection, response, strlen(response));
+}
+
 static int handleCommandLUA(connectionContext_t* pContext, command_t* pCommand) {
-	return luaRunnableRun(ENV.runnable, pContext->connection,
+	int phase  = slowlogEnter(ENV.slowlog, SLOWLOG_LUA);
+	int result = 0;
+
+	pContext->writeMark = dataStreamGetSize(pContext->writeStream);
+	result = luaRunnableRun(ENV.runnable, pContext->connection,
 			pContext->fallocator, pCommand,
 			ENV.enableVirtualKeys, ENV.enableClusterMode);
+	slowlogLeave(ENV.slowlog, phase);
+	return result;
+}
+
+#define PROXY_ERROR_RESPONSE "SERVER_ERROR proxy error\r\n"
+#define END_RESPONSE         "END\r\n"
+
+/* Once all forwarded requests of the command are answered, the keys
+ * left in a multi-get are looked up by the scripts, which also write
+ * the END. Otherwise we continue as if lua had just finished.
+ */
+static void proxyRequestDone(connectionContext_t* pContext) {
+	command_t* pCommand = pContext->pCommand;
+	int        result   = LUA_RUNNABLE_DONE;
+
+	if (--pContext->proxyPending > 0) {
+		return;
+	}
+	if (proxyIsMultiLine(pCommand)) {
+		if (pCommand->key || (pCommand->multiGetKeysCount > 0)) {
+			result = handleCommandLUA(pContext, pCommand);
+			if (result == LUA_RUNNABLE_SUSPENDED) {
+				return;
+			}
+		}else {
+			writeRawStringToStream(pContext->connection, END_RESPONSE, strlen(END_RESPONSE));
+		}
+	}
+	onLuaResponseAvailable(pContext->connection, result);
+}
+
+/* Responses are copied, they live in the buffers of the connection
+ * to the other server. The client connection doesn't wait for any
+ * event till the last response is in.
+ */
+static void proxyResponseHandler(void* context, int status, dataStream_t response) {
+	connectionContext_t* pContext = context;
+	command_t*           pCommand = pContext->pCommand;
+
+	if (!pCommand->noreply) {
+		if (status == 0) {
+			IfTrue(0 == dataStreamAppendCopy(pContext->writeStream, pContext->fallocator, response),
+					WARN, "Error copying forwarded response");
+		}else if (!proxyIsMultiLine(pCommand)) {
+			//for gets a failed server is just a miss
+			writeRawStringToStream(pContext->connection, PROXY_ERROR_RESPONSE,
+					strlen(PROXY_ERROR_RESPONSE));
+		}
+	}
+OnError:
+	proxyRequestDone(pContext);
+}
+
+/* Returns 1 if the command is forwarded, the connection then waits
+ * for proxyRequestDone. proxyPending is held at one till all requests
+ * are sent, responses may come back before proxyForward returns.
+ */
+static int handleCommandProxy(connectionContext_t* pContext, command_t* pCommand) {
+	int forwarded = 0;
+
+	pContext->pCommand     = pCommand;
+	pContext->proxyPending = 1;
+	forwarded = proxyForward(ENV.proxy, pContext->fallocator, pCommand, pContext,
+			proxyResponseHandler, &pContext->proxyPending);
+	if ((forwarded == 0) && (pCommand->key || (pCommand->multiGetKeysCount > 0) ||
+			!proxyIsMultiLine(pCommand))) {
+		pContext->pCommand     = 0;
+		pContext->proxyPending = 0;
+		return 0;
+	}
+	if (forwarded < 0) {
+		pContext->proxyPending = 0;
+		if (!pCommand->noreply) {
+			writeRawStringToStream(pContext->connection, PROXY_ERROR_RESPONSE,
+					strlen(PROXY_ERROR_RESPONSE));
+		}
+		onLuaResponseAvailable(pContext->connection, LUA_RUNNABLE_DONE);
+		return 1;
+	}
+	proxyRequestDone(pContext);
+	return 1;
 }
 
 
@@ -198,10 +403,13 @@ static int completeWrite(connectionContext_t* pContext) {
 	u_int32_t written = 0;
 	int       err     = 0;
 	if (size > 0) {
+		int phase = slowlogEnter(ENV.slowlog, SLOWLOG_WRITE);
 		err =  connectionWrite(pContext->connection, pContext->fallocator, pContext->writeStream,size, &written);
+		slowlogLeave(ENV.slowlog, phase);
 		if (err < 0) {
 			return err;
 		}
+		serverStats.bytesWritten += written;
 		if (written > 0) {
 			dataStreamTruncateFromStart(pContext->writeStream, (size - written));
 		}
@@ -210,6 +418,29 @@ static int completeWrite(connectionContext_t* pContext) {
 	return 0;
 }
 
+/* stats of a command answered by this server */
+static void commandDone(connectionContext_t* pContext, command_t* pCommand) {
+	statsCommandDone(pCommand->command, pContext->commandStart);
+	if (ENV.slowlog) {
+		//a multi-get is logged by its first key
+		char*     key       = pCommand->key;
+		u_int32_t keyLength = pCommand->keySize;
+		if (!key && (pCommand->multiGetKeysCount > 0)) {
+			key       = pCommand->multiGetKeys[0];
+			keyLength = strlen(key);
+		}
+		slowlogSetCommand(ENV.slowlog, &pContext->slowlog, statsCommandName(pCommand->command),
+				key, keyLength);
+	}
+	if (ENV.accounting) {
+		accountingCommand(ENV.accounting, pCommand->key, pCommand->keySize);
+		for (int i = 0; i < pCommand->multiGetKeysCount; i++) {
+			accountingCommand(ENV.accounting, pCommand->multiGetKeys[i],
+					strlen(pCommand->multiGetKeys[i]));
+		}
+	}
+}
+
 // forward declaration...is called form write available
 static void readAvailableImpl(connection_t connection);
 
@@ -236,33 +467,38 @@ static void writeAvailableImpl(connection_t connection) {
 }
 
 
+/* The slowlog request of the command ends with the first write of its
+ * answer, what is left is written when the socket takes it.
+ */
 void onLuaResponseAvailable(connection_t connection, int result) {
 	connectionContext_t* pContext  = connectionGetContext(connection);
+	int                  err       = 0;
+
+	slowlogResume(ENV.slowlog, &pContext->slowlog);
 	if (pContext->pCommand) {
+		commandDone(pContext, pContext->pCommand);
 		commandDelete(pContext->fallocator, pContext->pCommand);
 		pContext->pCommand = 0;
 	}
+	if ((result == LUA_RUNNABLE_ABORTED) || (result == LUA_RUNNABLE_NO_MEMORY)) {
+		writeScriptAborted(pContext, result);
+	}
 
 	if (dataStreamGetSize(pContext->writeStream) > 0) {
 		pContext->isWriting = true;
-		int err = completeWrite(pContext);
-		IfTrue(err >= 0, INFO, "Error writing response");
-		if (err == 0) {
-			pContext->isWriting = false;
-			if (dataStreamGetSize(pContext->readStream) > 0) {
-				readAvailableImpl(pContext->connection);
-			}else {
-				connectionWaitForRead(pContext->connection, ENV.base);
-			}
-		}else {
-			connectionWaitForWrite(pContext->connection, ENV.base);
-		}
-	}else {
+		err = completeWrite(pContext);
+	}
+	slowlogEnd(ENV.slowlog, &pContext->slowlog);
+	IfTrue(err >= 0, INFO, "Error writing response");
+	if (err == 0) {
+		pContext->isWriting = false;
 		if (dataStreamGetSize(pContext->readStream) > 0) {
 			readAvailableImpl(pContext->connection);
 		}else {
 			connectionWaitForRead(pContext->connection, ENV.base);
 		}
+	}else {
+		connectionWaitForWrite(pContext->connection, ENV.base);
 	}
 	goto OnSuccess;
 OnError:
@@ -280,12 +516,19 @@ OnSuccess:
 static void readAvailableImpl(connection_t connection){
 	connectionContext_t* pContext    = connectionGetContext(connection);
 	u_int32_t            bytesRead   = 0;
+	u_int32_t            bytesCounted = 0;
 	int                  returnValue = 0;
+	int                  err         = 0;
+	u_int64_t            parseStart  = 0;
 
 doParsing:
 	returnValue = connectionRead(pContext->connection, pContext->fallocator, pContext->readStream, 8 * 1024 , &bytesRead);
 	IfTrue(returnValue >= 0, INFO, "Socket closed");
+	/* bytesRead adds up over the commands of this call */
+	serverStats.bytesRead += bytesRead - bytesCounted;
+	bytesCounted = bytesRead;
 
+	parseStart  = slowlogClock();
 	returnValue = requestParserParse(pContext->parser, pContext->readStream);
 	IfTrue(returnValue >= 0, INFO, "Parsing Error %d", returnValue);
 
@@ -296,18 +539,29 @@ doParsing:
 
 	command_t* pCommand = requestParserGetCommandAndReset(pContext->parser, pContext->readStream);
 	IfTrue(pCommand, INFO, "Error getting command from parser");
+	pContext->commandStart = statsNow();
+	slowlogBegin(ENV.slowlog, &pContext->slowlog, parseStart);
+	if (ENV.proxy && handleCommandProxy(pContext, pCommand)) {
+		slowlogSuspend(ENV.slowlog, &pContext->slowlog);
+		goto OnSuccess;
+	}
 	returnValue = handleCommandLUA(pContext, pCommand);
 	/* In case of cluster support this command may not execute
 	 * completely in the current context. We need to save everything
 	 * and restart this, once the lua script exits.
 	 */
-	if (returnValue == 1) {
+	if (returnValue == LUA_RUNNABLE_SUSPENDED) {
 		//save the context....we will come back when
 		//lua gives us a callback..dont wait for io
 		pContext->pCommand = pCommand;
+		slowlogSuspend(ENV.slowlog, &pContext->slowlog);
 		goto OnSuccess;
 	}
+	if ((returnValue == LUA_RUNNABLE_ABORTED) || (returnValue == LUA_RUNNABLE_NO_MEMORY)) {
+		writeScriptAborted(pContext, returnValue);
+	}
 	if (pCommand) {
+		commandDone(pContext, pCommand);
 		commandDelete(pContext->fallocator, pCommand);
 		pCommand = 0;
 	}
@@ -317,24 +571,19 @@ doParsing:
 	}
 	if (dataStreamGetSize(pContext->writeStream) > 0) {
 		pContext->isWriting = true;
-		int err = completeWrite(pContext);
-		IfTrue(err >= 0, INFO, "Error writing response");
-		if (err == 0) {
-			pContext->isWriting = false;
-			if (dataStreamGetSize(pContext->readStream) > 0) {
-				goto doParsing;
-			}else {
-				connectionWaitForRead(pContext->connection, ENV.base);
-			}
-		}else {
-			connectionWaitForWrite(pContext->connection, ENV.base);
-		}
-	}else {
+		err = completeWrite(pContext);
+	}
+	slowlogEnd(ENV.slowlog, &pContext->slowlog);
+	IfTrue(err >= 0, INFO, "Error writing response");
+	if (err == 0) {
+		pContext->isWriting = false;
 		if (dataStreamGetSize(pContext->readStream) > 0) {
 			goto doParsing;
 		}else {
 			connectionWaitForRead(pContext->connection, ENV.base);
 		}
+	}else {
+		connectionWaitForWrite(pContext->connection, ENV.base);
 	}
 	goto OnSuccess;
 OnError:
@@ -364,12 +613,31 @@ static connectionHandler_t* createConnectionHandler() {
 
 
 
+/* The work of the timer holds up the requests waiting for the event
+ * loop, it is timed like a request for the slowlog.
+ */
 static void timerCallback(evutil_socket_t ignore, short events, void *ptr)
 {
+    slowlogRequest_t request;
+    int              phase = 0;
 
+    slowlogBegin(ENV.slowlog, &request, slowlogClock());
+    phase = slowlogEnter(ENV.slowlog, SLOWLOG_HASHMAP);
     hashMapDeleteExpired(ENV.hashMap);
+    slowlogLeave(ENV.slowlog, phase);
+    phase = slowlogEnter(ENV.slowlog, SLOWLOG_ALLOC);
     chunkpoolGC(ENV.chunkpool);
+    slowlogLeave(ENV.slowlog, phase);
+    phase = slowlogEnter(ENV.slowlog, SLOWLOG_LUA);
     luaRunnableGC(ENV.runnable);
+    slowlogLeave(ENV.slowlog, phase);
+    accountingTick(ENV.accounting);
+    phase = slowlogEnter(ENV.slowlog, SLOWLOG_HASHMAP);
+    keySamplerTick(ENV.keySampler);
+    slowlogLeave(ENV.slowlog, phase);
+    slowlogSetCommand(ENV.slowlog, &request, "timer", 0, 0);
+    slowlogEnd(ENV.slowlog, &request);
+    slowlogTick(ENV.slowlog);
 /*
     u_int32_t count   = hashMapSize(ENV.hashMap);
     if (count == 0) {
@@ -385,6 +653,64 @@ static void timerCallback(evutil_socket_t ignore, short events, void *ptr)
 
 
 
+/* The hashMap is not touched by a reload, only the lua state is
+ * replaced. If any script fails to load we continue with the
+ * scripts we have.
+ */
+int reloadScripts(void) {
+	luaRunnable_t runnable = luaRunnableCreate(ENV.scriptsDirectory, ENV.enableVirtualKeys);
+
+	IfTrue(runnable, ERR, "Error reloading scripts from [%s], keeping old scripts", ENV.scriptsDirectory);
+	luaRunnableSetBudget(runnable, ENV.luaMaxInstructions, ENV.luaMaxMillis);
+	luaRunnableSetMemoryLimit(runnable, (u_int64_t)ENV.luaMaxMemory * 1024 * 1024);
+	luaRunnableSetNearCache(runnable, ENV.nearCacheMillis);
+	luaRunnableRetire(ENV.runnable);
+	ENV.runnable = runnable;
+	LOG(INFO, "Reloaded scripts from [%s]", ENV.scriptsDirectory);
+	return 0;
+OnError:
+	return -1;
+}
+
+static void reloadSignalCallback(evutil_socket_t signal, short events, void *ptr) {
+	reloadScripts();
+}
+
+/* With -M the arena has to be closed for the next process to use it */
+static void stopSignalCallback(evutil_socket_t signal, short events, void *ptr) {
+	LOG(INFO, "Stopping on signal %d", (int)signal);
+	event_base_loopexit(ENV.base, NULL);
+}
+
+/* Only the items in the hashMap are tagged as roots, items deleted but
+ * still being written to a client don't come back after a restart.
+ */
+static void arenaListener(void* context, int event, void* value) {
+	chunkpoolSetRoot(ENV.chunkpool, value, event == HASHMAP_EVENT_PUT);
+}
+
+static void restoreItem(void* context, void* chunk) {
+	u_int32_t* pCount = context;
+	/* nothing is freed here, that would change the pages being scanned */
+	if (0 == cacheItemRestore(ENV.chunkpool, chunk)) {
+		if (0 == hashMapPutElement(ENV.hashMap, chunk)) {
+			(*pCount)++;
+		}
+	}else {
+		chunkpoolSetRoot(ENV.chunkpool, chunk, 0);
+	}
+}
+
+/* Puts the items of a restored arena back in the hashMap, then frees
+ * the chunks nobody uses any more.
+ */
+static void restoreItems(void) {
+	u_int32_t count = 0;
+	u_int32_t roots = chunkpoolScanRoots(ENV.chunkpool, restoreItem, &count);
+	u_int32_t freed = chunkpoolSweep(ENV.chunkpool);
+	LOG(INFO, "Restored %u items of %u from %s, freed %u chunks", count, roots, ENV.arenaFile, freed);
+}
+
 static void usage() {
 	printf("valid options are \n\n");
 	printf("-h    <prints help information>                    \n");
@@ -396,6 +722,26 @@ static void usage() {
 	printf("-c    <enable cluster mode>    default <Disabled>  \n");
 	printf("-i    <IO Memory Cache in MB>  default <16MB>      \n");
 	printf("-v    <Log Level debug(0), info(1), warn(2), err(3)>   default <err(3)> \n");
+	printf("-b    <lua instructions per request in thousands>   default <unlimited> \n");
+	printf("-t    <lua time per request in ms> default <unlimited> \n");
+	printf("-L    <lua memory in MB, 0 for unlimited>   default <unlimited> \n");
+	printf("-P    <proxy ring, comma separated ip:port> default <Disabled> \n");
+	printf("-x    <ip:port of this server in the ring>  default <None> \n");
+	printf("-f    <ip:port of the follower to replicate to> default <None> \n");
+	printf("-n    <near cache ttl in ms for getFromServer values, with -x hot keys are pushed> default <Disabled> \n");
+	printf("-H    <health check interval in ms for other servers> default <Disabled> \n");
+	printf("-T    <health check timeout in ms>  default <interval> \n");
+	printf("-D    <deadline in ms for requests to other servers> default <Disabled> \n");
+	printf("-I    <max requests in flight to other servers> default <unlimited> \n");
+	printf("-g    <gossip seeds, comma separated ip:port, needs -x> default <Disabled> \n");
+	printf("-G    <gossip interval in ms>  default <1000> \n");
+	printf("-M    <file to keep the memory in, kept across restarts> default <None> \n");
+	printf("-r    <snapshot file, loaded at start> default <cacheismo.snapshot, not loaded> \n");
+	printf("-A    <append log of scripted objects, replayed at start> default <Disabled> \n");
+	printf("-S    <append log sync interval in ms, 0 for every write> default <1000> \n");
+	printf("-a    <admin port serving GET /metrics>  default <Disabled> \n");
+	printf("-k    <key prefix separators for usage accounting, like :$> default <Disabled> \n");
+	printf("-s    <slowlog threshold in micro seconds> default <Disabled> \n");
 	exit(1);
 }
 
@@ -409,6 +755,27 @@ static int parseArgs(int argc, char** argv) {
 	ENV.enableVirtualKeys = 0;
 	ENV.enableClusterMode = 0;
 	ENV.ioBufferCount     = 16 * (1024/4);
+	ENV.luaMaxInstructions = 0;
+	ENV.luaMaxMillis       = 0;
+	ENV.luaMaxMemory       = 0;
+	ENV.proxyServers       = 0;
+	ENV.proxySelf          = 0;
+	ENV.follower           = 0;
+	ENV.nearCacheMillis    = 0;
+	ENV.healthMillis       = 0;
+	ENV.healthTimeoutMillis = 0;
+	ENV.deadlineMillis     = 0;
+	ENV.maxInFlight        = 0;
+	ENV.seeds              = 0;
+	ENV.gossipMillis       = 1000;
+	ENV.arenaFile          = 0;
+	ENV.snapshotFile       = "cacheismo.snapshot";
+	ENV.loadSnapshot       = 0;
+	ENV.appendLogFile      = 0;
+	ENV.appendLogSyncMillis = 1000;
+	ENV.adminPort          = 0;
+	ENV.accountingSeparators = 0;
+	ENV.slowlogMicros      = -1;
 
 	while (-1 != (c = getopt(argc, argv,
           "p:"  /* TCP port number to listen on */
@@ -419,6 +786,26 @@ static int parseArgs(int argc, char** argv) {
 		  "c"   /* enable cluster mode...runs each command on new lua thread*/
     	  "i:"	/* IO memory cache size */
     	  "v:"	/* logging level */
+    	  "b:"	/* lua instruction budget per request */
+    	  "t:"	/* lua time budget per request */
+    	  "L:"	/* lua memory limit in megabytes */
+    	  "P:"	/* servers in the proxy ring */
+    	  "x:"	/* name of this server in the proxy ring */
+    	  "f:"	/* follower to replicate writes to */
+    	  "n:"	/* near cache ttl in milli seconds */
+    	  "H:"	/* health check interval in milli seconds */
+    	  "T:"	/* health check timeout in milli seconds */
+    	  "D:"	/* deadline of requests to other servers in milli seconds */
+    	  "I:"	/* max requests in flight to other servers */
+    	  "g:"	/* gossip seeds */
+    	  "G:"	/* gossip interval in milli seconds */
+    	  "M:"	/* file backing the chunkpool */
+    	  "r:"	/* snapshot to load and write */
+    	  "A:"	/* append log of scripted objects */
+    	  "S:"	/* append log sync interval in milli seconds */
+    	  "a:"	/* admin port for the metrics */
+    	  "k:"	/* key prefix separators for accounting */
+    	  "s:"	/* slowlog threshold in micro seconds */
     	  "h"	/* help information */
         ))) {
         switch (c) {
@@ -452,6 +839,67 @@ static int parseArgs(int argc, char** argv) {
         	setGlobalLogLevel(level);
         	break;
         }
+        case 'b':
+        	ENV.luaMaxInstructions = strtoull(optarg, 0, 10) * 1000;
+        	break;
+        case 't':
+        	ENV.luaMaxMillis = atoi(optarg);
+        	break;
+        case 'L':
+        	ENV.luaMaxMemory = atoi(optarg);
+        	break;
+        case 'P':
+        	ENV.proxyServers = strdup(optarg);
+        	break;
+        case 'x':
+        	ENV.proxySelf = strdup(optarg);
+        	break;
+        case 'f':
+        	ENV.follower = strdup(optarg);
+        	break;
+        case 'n':
+        	ENV.nearCacheMillis = atoi(optarg);
+        	break;
+        case 'H':
+        	ENV.healthMillis = atoi(optarg);
+        	break;
+        case 'T':
+        	ENV.healthTimeoutMillis = atoi(optarg);
+        	break;
+        case 'D':
+        	ENV.deadlineMillis = atoi(optarg);
+        	break;
+        case 'I':
+        	ENV.maxInFlight = atoi(optarg);
+        	break;
+        case 'g':
+        	ENV.seeds = strdup(optarg);
+        	break;
+        case 'G':
+        	ENV.gossipMillis = atoi(optarg);
+        	break;
+        case 'M':
+        	ENV.arenaFile = strdup(optarg);
+        	break;
+        case 'r':
+        	ENV.snapshotFile = strdup(optarg);
+        	ENV.loadSnapshot = 1;
+        	break;
+        case 'A':
+        	ENV.appendLogFile = strdup(optarg);
+        	break;
+        case 'S':
+        	ENV.appendLogSyncMillis = atoi(optarg);
+        	break;
+        case 'a':
+        	ENV.adminPort = atoi(optarg);
+        	break;
+        case 'k':
+        	ENV.accountingSeparators = strdup(optarg);
+        	break;
+        case 's':
+        	ENV.slowlogMicros = atoi(optarg);
+        	break;
          default:
             fprintf(stderr, "Illegal argument \"%c\"\n", c);
             return -1;
@@ -464,10 +912,15 @@ int main(int argc, char** argv) {
 	struct timeval  one_sec = { 1 , 0 };
 
 	IfTrue( 0 == parseArgs(argc, argv), ERR, "Error parsing options");
+	statsInit();
 	event_init();
 	fallocatorInit(ENV.ioBufferCount);
 
-	ENV.chunkpool   = chunkpoolCreate(ENV.pageCount);
+	if (ENV.arenaFile) {
+		ENV.chunkpool = chunkpoolCreateMapped(ENV.pageCount, ENV.arenaFile);
+	}else {
+		ENV.chunkpool = chunkpoolCreate(ENV.pageCount);
+	}
 	IfTrue(ENV.chunkpool, ERR, "Error creating chunkpool for size %d", (ENV.pageCount * 4096));
 
 	ENV.base        = event_base_new();
@@ -477,21 +930,120 @@ int main(int argc, char** argv) {
 	ENV.hashMap     = hashMapCreate(cacheItemGetHashEntryAPI(ENV.chunkpool));
 	IfTrue(ENV.server, ERR, "Error creating hashMap");
 
+	ENV.keySampler  = keySamplerCreate(ENV.hashMap);
+	IfTrue(ENV.keySampler, ERR, "Error setting up the key sampler");
+
+	if (ENV.accountingSeparators) {
+		ENV.accounting = accountingCreate(ENV.hashMap, ENV.accountingSeparators);
+		IfTrue(ENV.accounting, ERR, "Error setting up accounting by [%s]", ENV.accountingSeparators);
+	}
+
+	if (ENV.slowlogMicros >= 0) {
+		ENV.slowlog = slowlogCreate(ENV.slowlogMicros);
+		IfTrue(ENV.slowlog, ERR, "Error setting up the slowlog");
+	}
+
+	if (ENV.arenaFile) {
+		IfTrue(0 == hashMapAddListener(ENV.hashMap, arenaListener, NULL), ERR,
+				"Error adding hashMap listener");
+		if (chunkpoolIsRestored(ENV.chunkpool)) {
+			restoreItems();
+		}
+	}
+
+	ENV.snapshot    = snapshotCreate(ENV.hashMap, ENV.chunkpool, ENV.snapshotFile);
+	IfTrue(ENV.snapshot, ERR, "Error setting up snapshots to %s", ENV.snapshotFile);
+	if (ENV.loadSnapshot) {
+		IfTrue(0 == snapshotLoad(ENV.snapshot), ERR, "Error loading snapshot %s", ENV.snapshotFile);
+	}
+
+	if (ENV.appendLogFile) {
+		ENV.appendLog = appendLogCreate(ENV.hashMap, ENV.chunkpool, ENV.appendLogFile,
+				ENV.appendLogSyncMillis);
+		IfTrue(ENV.appendLog, ERR, "Error opening append log %s", ENV.appendLogFile);
+		IfTrue(0 == appendLogReplay(ENV.appendLog), ERR, "Error replaying append log %s",
+				ENV.appendLogFile);
+	}
+
 	ENV.runnable    = luaRunnableCreate(ENV.scriptsDirectory, ENV.enableVirtualKeys);
 	IfTrue(ENV.runnable, ERR, "Error setting up lua environment [%s]", ENV.scriptsDirectory);
+	luaRunnableSetBudget(ENV.runnable, ENV.luaMaxInstructions, ENV.luaMaxMillis);
+	luaRunnableSetMemoryLimit(ENV.runnable, (u_int64_t)ENV.luaMaxMemory * 1024 * 1024);
+	IfTrue(0 == luaRunnableSetNearCache(ENV.runnable, ENV.nearCacheMillis), ERR,
+			"Error creating near cache");
+	IfTrue(0 == luaRunnableSetHealthCheck(ENV.runnable, ENV.healthMillis, ENV.healthTimeoutMillis),
+			ERR, "Error setting up health checks");
+	IfTrue(0 == luaRunnableSetLimits(ENV.runnable, ENV.deadlineMillis, ENV.maxInFlight),
+			ERR, "Error setting up request deadlines");
+
+	if (ENV.proxyServers) {
+		ENV.proxy = proxyCreate(ENV.proxyServers, ENV.proxySelf, ENV.enableVirtualKeys);
+		IfTrue(ENV.proxy, ERR, "Error creating proxy for [%s]", ENV.proxyServers);
+		IfTrue(0 == clusterMapSetHealthCheck(proxyGetClusterMap(ENV.proxy), ENV.healthMillis,
+				ENV.healthTimeoutMillis), ERR, "Error setting up health checks");
+		IfTrue(0 == clusterMapSetLimits(proxyGetClusterMap(ENV.proxy), ENV.deadlineMillis,
+				ENV.maxInFlight), ERR, "Error setting up request deadlines");
+	}
+
+	if (ENV.seeds) {
+		IfTrue(ENV.proxySelf, ERR, "Gossip needs the name of this server (-x)");
+		ENV.membership = membershipCreate(ENV.proxySelf, ENV.seeds, ENV.gossipMillis,
+				membersChanged, NULL);
+		IfTrue(ENV.membership, ERR, "Error setting up gossip with [%s]", ENV.seeds);
+	}
+
+	if (ENV.nearCacheMillis && ENV.proxySelf) {
+		ENV.hotPush = hotPushCreate(ENV.hashMap, ENV.proxySelf, ENV.nearCacheMillis);
+		IfTrue(ENV.hotPush, ERR, "Error setting up near cache pushes");
+		if (ENV.proxyServers) {
+			IfTrue(0 == hotPushSetPeers(ENV.hotPush, ENV.proxyServers), ERR,
+					"Error setting near cache peers to [%s]", ENV.proxyServers);
+		}
+	}
+
+	if (ENV.follower) {
+		ENV.replication = replicationCreate(ENV.follower, ENV.hashMap);
+		IfTrue(ENV.replication, ERR, "Error setting up replication to [%s]", ENV.follower);
+	}
 
 	connectionWaitForRead(ENV.server, ENV.base);
 
+	if (ENV.adminPort) {
+		ENV.admin = adminCreate(ENV.interface, ENV.adminPort);
+		IfTrue(ENV.admin, ERR, "Error opening admin port %d", ENV.adminPort);
+	}
+
 	ENV.timer        = evtimer_new(ENV.base, timerCallback, NULL);
+	ENV.reloadSignal = evsignal_new(ENV.base, SIGHUP, reloadSignalCallback, NULL);
+	event_add(ENV.reloadSignal, NULL);
+	if (ENV.arenaFile || ENV.appendLogFile) {
+		ENV.stopSignals[0] = evsignal_new(ENV.base, SIGTERM, stopSignalCallback, NULL);
+		ENV.stopSignals[1] = evsignal_new(ENV.base, SIGINT, stopSignalCallback, NULL);
+		event_add(ENV.stopSignals[0], NULL);
+		event_add(ENV.stopSignals[1], NULL);
+	}
 
 	event_add(ENV.timer, &one_sec);
 	event_base_dispatch(ENV.base);
 	goto OnSuccess;
 OnError:
+	if (ENV.arenaFile && ENV.chunkpool) {
+		/* still good for the next try */
+		chunkpoolDelete(ENV.chunkpool);
+	}
 	usage();
 OnSuccess:
 	if (ENV.server) {
 		connectionClose(ENV.server);
 	}
+	if (ENV.admin) {
+		adminDelete(ENV.admin);
+	}
+	if (ENV.appendLog) {
+		appendLogDelete(ENV.appendLog);
+	}
+	if (ENV.arenaFile && ENV.chunkpool) {
+		chunkpoolDelete(ENV.chunkpool);
+	}
 	return 0;
 }
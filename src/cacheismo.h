@@ -6,14 +6,45 @@
 #include "chunkpool/chunkpool.h"
 #include "cacheitem/cacheitem.h"
 #include "io/connection.h"
+#include "cluster/replication.h"
+#include "cluster/proxy.h"
+#include "cluster/membership.h"
+#include "cluster/hotpush.h"
+#include "lua/luaalloc.h"
+#include "persistence/snapshot.h"
+#include "persistence/appendlog.h"
+#include "stats/stats.h"
+#include "stats/accounting.h"
+#include "stats/keysampler.h"
+#include "stats/slowlog.h"
 
 hashMap_t           getGlobalHashMap(void);
 chunkpool_t         getGlobalChunkpool(void);
 struct event_base*  getGlobalEventBase(void);
+/* 0 if this server has no follower */
+replication_t       getGlobalReplication(void);
+/* 0 if this server is not in proxy mode */
+proxy_t             getGlobalProxy(void);
+/* 0 if gossip is not enabled */
+membership_t        getGlobalMembership(void);
+/* 0 if hot keys are not pushed to the other servers, needs -n and -x */
+hotPush_t           getGlobalHotPush(void);
+snapshot_t          getGlobalSnapshot(void);
+appendLog_t         getGlobalAppendLog(void);
+/* the allocator of the current scripts */
+luaAllocator_t      getGlobalLuaAllocator(void);
+/* the clusterMap of the proxy in proxy mode, the one of the scripts otherwise */
+clusterMap_t        getGlobalClusterMap(void);
+/* 0 if accounting is not enabled */
+accounting_t        getGlobalAccounting(void);
+keySampler_t        getGlobalKeySampler(void);
+/* 0 if the slowlog is not enabled */
+slowlog_t           getGlobalSlowlog(void);
 int                 writeCacheItemToStream(connection_t conn, cacheItem_t item);
 int                 writeRawStringToStream(connection_t conn, char* value, int length);
 cacheItem_t         createCacheItemFromCommand(command_t* pCommand);
 void                setGlobalLogLevel(int level);
 void                onLuaResponseAvailable(connection_t connection, int result);
+int                 reloadScripts(void);
 
 #endif /* CACHEISMO_H_ */
@@ -179,6 +179,16 @@ u_int32_t  cacheItemGetExpiry(cacheItem_t cacheItem) {
 	return 0;
 }
 
+/* seconds left before the item expires, 0 if it never does */
+u_int32_t  cacheItemGetTTL(cacheItem_t cacheItem) {
+	cacheItemImpl_t* pItem = CACHE_ITEM(cacheItem);
+	u_int32_t        now   = currentTimeInSeconds();
+	if (!pItem || (pItem->expiryTime == UINT32_MAX)) {
+		return 0;
+	}
+	return (pItem->expiryTime > now) ? (pItem->expiryTime - now) : 1;
+}
+
 
 hashEntryAPI_t* cacheItemGetHashEntryAPI(chunkpool_t chunkpool) {
 	hashEntryAPI_t* API = ALLOCATE_1(hashEntryAPI_t);
@@ -193,3 +203,26 @@ hashEntryAPI_t* cacheItemGetHashEntryAPI(chunkpool_t chunkpool) {
 	}
 	return API;
 }
+
+int cacheItemRestore(chunkpool_t chunkpool, cacheItem_t cacheItem) {
+	cacheItemImpl_t* pItem  = CACHE_ITEM(cacheItem);
+	int64_t          expiry = 0;
+
+	IfTrue(calculateRequiredMemory(pItem->keyLength) <= chunkpoolMaxMallocSize(chunkpool),
+			WARN, "Bad key length %u", pItem->keyLength);
+	IfTrue(pItem->key[pItem->keyLength] == '\0', WARN, "Bad key");
+	IfTrue(0 == dataStreamRestore(chunkpool, pItem->dataStream), WARN, "Bad data for key %s", pItem->key);
+	IfTrue(dataStreamGetSize(pItem->dataStream) == pItem->dataLength, WARN, "Bad data length for key %s",
+			pItem->key);
+
+	if (pItem->expiryTime != UINT32_MAX) {
+		expiry = (int64_t)pItem->expiryTime + chunkpoolGetClockShift(chunkpool);
+		/* already expired ones are left to hashMapDeleteExpired */
+		pItem->expiryTime = (expiry > 0) ? ((expiry < UINT32_MAX) ? expiry : UINT32_MAX - 1) : 1;
+	}
+	pItem->refcount = 1;
+	chunkpoolMark(chunkpool, pItem);
+	return 0;
+OnError:
+	return -1;
+}
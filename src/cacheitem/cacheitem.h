@@ -21,6 +21,12 @@ u_int32_t       cacheItemGetDataLength(cacheItem_t cacheItem);
 void            cacheItemAddReference(cacheItem_t cacheItem);
 u_int32_t       cacheItemGetTotalSize(cacheItem_t cacheItem);
 u_int32_t       cacheItemGetExpiry(cacheItem_t cacheItem);
+u_int32_t       cacheItemGetTTL(cacheItem_t cacheItem);
 hashEntryAPI_t* cacheItemGetHashEntryAPI(chunkpool_t chunkpool);
+/* For an item found in a restored chunkpool: marks its chunks, sets the
+ * refcount back to 1 and moves the expiry to the new clock. -1 if the
+ * chunk doesn't hold an item.
+ */
+int             cacheItemRestore(chunkpool_t chunkpool, cacheItem_t cacheItem);
 
 #endif /* CACHEITEM_CACHEITEM_H_ */
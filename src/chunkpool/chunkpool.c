@@ -1,6 +1,11 @@
 #include "chunkpool.h"
 #include "../common/skiplist.h"
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /*
  * A simple malloc implementation.
@@ -23,6 +28,15 @@
  * called to merge smaller buffers to create larger buffers. This is
  * also done at free time, but as discussed above doesn't work in
  * all the cases.
+ *
+ * The pool can also live in a shared mapping of a file. The pool
+ * itself is then kept in the first page, after a small header, and
+ * the file is mapped at the same address every time, so every pointer
+ * stored in the chunks is still good after a restart. Only the
+ * skiplist is rebuilt. The inUse field of allocated chunks carries two
+ * more bits, CHUNK_ROOT for the chunks the user wants to find again
+ * after a restart and CHUNK_MARK to tell the chunks still needed from
+ * the ones left over by the previous process.
  */
 
 typedef struct slabEntry_t {
@@ -53,9 +67,23 @@ typedef struct chunkpoolImpl_t {
     u_int64_t          freeMemory;
     u_int64_t          freeChunks;
     skipList_t         slabList;
+    int                fd;               /* -1 unless mapped */
+    u_int32_t          isRestored;
+    int64_t            clockShift;
     slab_t             slabs[0];
 }chunkpoolImpl_t;
 
+/* first bytes of the first page of a mapped pool */
+typedef struct chunkpoolFileHeader_t {
+    u_int32_t          magic;
+    u_int32_t          version;
+    u_int32_t          maxSizeInPages;
+    u_int32_t          isClean;          /* closed by chunkpoolDelete */
+    void*              startAddress;
+    int64_t            closedWallClock;
+    int64_t            closedMonotonic;
+}chunkpoolFileHeader_t;
+
 #define AS_CHUNKPOOL(x) ((chunkpoolImpl_t*)(x))
 
 #define PAGE_SIZE       (4*1024)           /*  4 KB */
@@ -67,6 +95,20 @@ typedef struct chunkpoolImpl_t {
 #define SLAB_GC_INLINE  (16)
 #define GC_PAGE_COUNT   ((8 * 1024 * 1024)/PAGE_SIZE)          //GC 8MB worth of memory at a time
 
+#define CHUNK_IN_USE    1
+#define CHUNK_ROOT      2
+#define CHUNK_MARK      4
+
+#define FILE_MAGIC      0x43484b50                             //CHKP
+#define FILE_VERSION    1
+#define FILE_POOL       64                                     //offset of the pool in the first page
+/* far from the heap, the stack and the shared libraries */
+#define FILE_ADDRESS    ((void*)0x200000000000UL)
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0
+#endif
+
 static slabFreeEntry_t* OFFSET2POINTER(chunkpoolImpl_t* pPool, u_int32_t offset) {
 	u_int64_t newOffset = offset;
 	u_int64_t value = (u_int64_t)pPool->startAddress;
@@ -82,28 +124,21 @@ static u_int32_t POINTER2OFFSET(chunkpoolImpl_t* pPool, slabFreeEntry_t* pointer
 	return (u_int32_t)(offset);
 }
 
-chunkpool_t chunkpoolCreate(u_int32_t maxSizeInPages) {
-    chunkpoolImpl_t* pPool    = 0;
-    int              err      = 0;
+/* Gives all the memory at startAddress to the last slab */
+static void chunkpoolFormat(chunkpoolImpl_t* pPool, u_int32_t maxSizeInPages) {
     int              index    = 0;
     int              slabSize = 0;
-    pPool = (chunkpoolImpl_t*)malloc(sizeof(chunkpoolImpl_t)+(SLAB_MAX+1)*sizeof(slab_t));
-    IfTrue(pPool, ERR, "Error allocating memory");
-    memset(pPool, 0, sizeof(chunkpoolImpl_t)+SLAB_MAX*sizeof(slab_t));
+
     pPool->pageCount  = maxSizeInPages -1;
     pPool->slabsCount = SLAB_MAX;
     pPool->gcIndex    = 1;
     pPool->freeMemory = PAGE_SIZE * pPool->pageCount;
     pPool->freeChunks = pPool->pageCount;
-    pPool->slabList   = skipListCreate();
-    IfTrue(pPool->slabList, ERR, "Error creating skip list");
-
-    err = posix_memalign(&(pPool->startAddress), PAGE_SIZE, PAGE_SIZE * maxSizeInPages);
-    IfTrue(err == 0, ERR, "posix_memalign failed err %d for memory size %d", err, PAGE_SIZE * maxSizeInPages);
-    /* Cool - we got all the memory we asked for*/
     for (index = 0; index <= SLAB_MAX; index++) {
         slabSize+= 16;
         pPool->slabs[index].slabSize  = slabSize - sizeof(slabEntry_t);
+        pPool->slabs[index].freeCount = 0;
+        pPool->slabs[index].nextFreeOffset = 0;
     }
     /* we will now assign all the allocated memory to the last slab
      * We can postponse this step to add buffers to slab if we want
@@ -123,6 +158,22 @@ chunkpool_t chunkpoolCreate(u_int32_t maxSizeInPages) {
     OFFSET2POINTER(pPool, PAGE_SIZE)->prevOffset = 0;
     pPool->slabs[SLAB_MAX].nextFreeOffset = PAGE_SIZE >> 4;
     skipListInsertSlab(pPool->slabList, SLAB_MAX);
+}
+
+chunkpool_t chunkpoolCreate(u_int32_t maxSizeInPages) {
+    chunkpoolImpl_t* pPool    = 0;
+    int              err      = 0;
+    pPool = (chunkpoolImpl_t*)malloc(sizeof(chunkpoolImpl_t)+(SLAB_MAX+1)*sizeof(slab_t));
+    IfTrue(pPool, ERR, "Error allocating memory");
+    memset(pPool, 0, sizeof(chunkpoolImpl_t)+SLAB_MAX*sizeof(slab_t));
+    pPool->fd         = -1;
+    pPool->slabList   = skipListCreate();
+    IfTrue(pPool->slabList, ERR, "Error creating skip list");
+
+    err = posix_memalign(&(pPool->startAddress), PAGE_SIZE, PAGE_SIZE * maxSizeInPages);
+    IfTrue(err == 0, ERR, "posix_memalign failed err %d for memory size %d", err, PAGE_SIZE * maxSizeInPages);
+    /* Cool - we got all the memory we asked for*/
+    chunkpoolFormat(pPool, maxSizeInPages);
     goto OnSuccess;
 OnError:
     if (pPool) {
@@ -133,6 +184,136 @@ OnSuccess:
     return pPool;
 }
 
+static int64_t clockSeconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec;
+}
+
+/* maps the file at address, 0 if something else is there */
+static void* mapAt(int fd, void* address, u_int64_t size) {
+    void* pointer = mmap(address, size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    if (pointer == MAP_FAILED) {
+        return 0;
+    }
+    if (pointer != address) {
+        /* old kernels take the address as a hint */
+        munmap(pointer, size);
+        return 0;
+    }
+    return pointer;
+}
+
+chunkpool_t chunkpoolCreateMapped(u_int32_t maxSizeInPages, char* path) {
+    chunkpoolImpl_t*       pPool   = 0;
+    chunkpoolFileHeader_t  header;
+    chunkpoolFileHeader_t* pHeader = 0;
+    u_int64_t              size    = (u_int64_t)PAGE_SIZE * maxSizeInPages;
+    void*                  address = 0;
+    struct stat            fileStat;
+    int                    fd      = -1;
+    int                    restore = 0;
+    int                    index   = 0;
+
+    IfTrue(FILE_POOL + sizeof(chunkpoolImpl_t) + (SLAB_MAX+1)*sizeof(slab_t) <= PAGE_SIZE,
+    		ERR, "Pool doesn't fit in the first page");
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    IfTrue(fd >= 0, ERR, "Error opening %s", path);
+    IfTrue(0 == flock(fd, LOCK_EX | LOCK_NB), ERR, "%s is used by another process", path);
+    IfTrue(0 == fstat(fd, &fileStat), ERR, "Error reading size of %s", path);
+
+    memset(&header, 0, sizeof(header));
+    if (fileStat.st_size == size) {
+        if (sizeof(header) == pread(fd, &header, sizeof(header), 0)) {
+            restore = (header.magic == FILE_MAGIC) && (header.version == FILE_VERSION) &&
+                      (header.maxSizeInPages == maxSizeInPages) && header.isClean;
+        }
+        if (!restore) {
+            LOG(WARN, "%s was not closed cleanly, starting empty", path);
+        }
+    }else if (fileStat.st_size) {
+        LOG(WARN, "%s was made for another memory size, starting empty", path);
+    }
+    if (restore) {
+        address = mapAt(fd, header.startAddress, size);
+        if (!address) {
+            LOG(WARN, "Address %p of %s is taken, starting empty", header.startAddress, path);
+            restore = 0;
+        }
+    }
+    if (!restore) {
+        /* drop whatever was in the file */
+        IfTrue(0 == ftruncate(fd, 0), ERR, "Error truncating %s", path);
+        IfTrue(0 == ftruncate(fd, size), ERR, "Error sizing %s to %lu", path, size);
+        address = mapAt(fd, FILE_ADDRESS, size);
+        if (!address) {
+            address = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            IfTrue(address != MAP_FAILED, ERR, "Error mapping %s", path);
+        }
+    }
+
+    pHeader = (chunkpoolFileHeader_t*)address;
+    pPool   = (chunkpoolImpl_t*)((char*)address + FILE_POOL);
+    pPool->fd           = fd;
+    pPool->startAddress = address;
+    pPool->slabList     = skipListCreate();
+    IfTrue(pPool->slabList, ERR, "Error creating skip list");
+
+    if (restore) {
+        for (index = 0; index <= SLAB_MAX; index++) {
+            if (pPool->slabs[index].freeCount) {
+                skipListInsertSlab(pPool->slabList, index);
+            }
+        }
+        pPool->isRestored = 1;
+        pPool->clockShift = (clockSeconds(CLOCK_MONOTONIC) - pHeader->closedMonotonic) -
+                            (clockSeconds(CLOCK_REALTIME)  - pHeader->closedWallClock);
+        LOG(INFO, "Restored %lu bytes in use from %s", pPool->pageCount * (u_int64_t)PAGE_SIZE -
+            pPool->freeMemory, path);
+    }else {
+        pPool->isRestored = 0;
+        pPool->clockShift = 0;
+        chunkpoolFormat(pPool, maxSizeInPages);
+        pHeader->magic          = FILE_MAGIC;
+        pHeader->version        = FILE_VERSION;
+        pHeader->maxSizeInPages = maxSizeInPages;
+        pHeader->startAddress   = address;
+    }
+    /* a crash from now on leaves the file unusable */
+    pHeader->isClean = 0;
+    msync(pHeader, PAGE_SIZE, MS_SYNC);
+    goto OnSuccess;
+OnError:
+    if (pPool && pPool->slabList) {
+        skipListDelete(pPool->slabList);
+    }
+    if (address && address != MAP_FAILED) {
+        munmap(address, size);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    pPool = 0;
+OnSuccess:
+    return pPool;
+}
+
+int chunkpoolIsRestored(chunkpool_t chunkpool) {
+    chunkpoolImpl_t* pPool = AS_CHUNKPOOL(chunkpool);
+    return pPool ? pPool->isRestored : 0;
+}
+
+int chunkpoolIsMapped(chunkpool_t chunkpool) {
+    chunkpoolImpl_t* pPool = AS_CHUNKPOOL(chunkpool);
+    return pPool ? (pPool->fd >= 0) : 0;
+}
+
+int64_t chunkpoolGetClockShift(chunkpool_t chunkpool) {
+    chunkpoolImpl_t* pPool = AS_CHUNKPOOL(chunkpool);
+    return pPool ? pPool->clockShift : 0;
+}
+
 static void crashNow() {
     char* a = 0;
     *a      = 1;
@@ -155,6 +336,22 @@ static void validateChunk(chunkpoolImpl_t* pPool, void* chunk) {
 
 void chunkpoolDelete(chunkpool_t chunkpool) {
     chunkpoolImpl_t* pPool = AS_CHUNKPOOL(chunkpool);
+    if (pPool && (pPool->fd >= 0)) {
+        chunkpoolFileHeader_t* pHeader = (chunkpoolFileHeader_t*)pPool->startAddress;
+        u_int64_t              size    = (u_int64_t)PAGE_SIZE * (pPool->pageCount + 1);
+        int                    fd      = pPool->fd;
+        skipListDelete(pPool->slabList);
+        pPool->slabList          = 0;
+        pHeader->closedWallClock = clockSeconds(CLOCK_REALTIME);
+        pHeader->closedMonotonic = clockSeconds(CLOCK_MONOTONIC);
+        /* everything else is on disk before the header says so */
+        msync(pHeader, size, MS_SYNC);
+        pHeader->isClean         = 1;
+        msync(pHeader, PAGE_SIZE, MS_SYNC);
+        munmap(pHeader, size);
+        close(fd);
+        return;
+    }
     if (pPool) {
         //chunkpoolPrint(pPool);
         if (pPool->startAddress) {
@@ -474,6 +671,29 @@ void chunkpoolPrint(chunkpool_t chunkpool) {
     }
 }
 
+void chunkpoolGetStats(chunkpool_t chunkpool, chunkpoolStats_t* pStats) {
+    chunkpoolImpl_t* pPool = AS_CHUNKPOOL(chunkpool);
+
+    memset(pStats, 0, sizeof(chunkpoolStats_t));
+    if (pPool) {
+    	pStats->totalBytes    = (u_int64_t)pPool->pageCount * PAGE_SIZE;
+    	pStats->freeBytes     = pPool->freeMemory;
+    	pStats->freeChunks    = pPool->freeChunks;
+    	pStats->freePageBytes = (u_int64_t)pPool->slabs[SLAB_MAX].freeCount *
+    			(pPool->slabs[SLAB_MAX].slabSize + sizeof(slabEntry_t));
+    }
+}
+
+void chunkpoolVisitSlabs(chunkpool_t chunkpool, chunkpoolSlabVisitor_t visitor, void* context) {
+    chunkpoolImpl_t* pPool = AS_CHUNKPOOL(chunkpool);
+
+    for (int i = 0; pPool && (i <= pPool->slabsCount); i++) {
+    	if (pPool->slabs[i].freeCount) {
+    		visitor(context, pPool->slabs[i].slabSize, pPool->slabs[i].freeCount);
+    	}
+    }
+}
+
 /* Not used */
 void* chunkpoolRelaxedMalloc(chunkpool_t chunkpool, u_int32_t prefferedSize, u_int32_t *pActualSize) {
     chunkpoolImpl_t* pPool     = AS_CHUNKPOOL(chunkpool);
@@ -533,7 +753,88 @@ void* chunkpoolRealloc(chunkpool_t chunkpool, void* pointer, u_int32_t newSize)
 	return newPointer;
 }
 
+static slabEntry_t* chunkHeader(void* chunk) {
+	return (slabEntry_t*)((char*)chunk - sizeof(slabEntry_t));
+}
+
+void chunkpoolSetRoot(chunkpool_t chunkpool, void* chunk, int isRoot) {
+	chunkpoolImpl_t* pPool  = AS_CHUNKPOOL(chunkpool);
+	if (pPool && chunk) {
+		validateChunk(pPool, chunk);
+		if (isRoot) {
+			chunkHeader(chunk)->inUse |= CHUNK_ROOT;
+		}else {
+			chunkHeader(chunk)->inUse &= ~CHUNK_ROOT;
+		}
+	}
+}
+
+/* Calls visitor for every allocated chunk, page by page */
+static u_int32_t visitChunks(chunkpoolImpl_t* pPool, u_int16_t flag, chunkpoolVisitor_t visitor,
+		void* context) {
+	u_int32_t count  = 0;
+	for (u_int32_t page = 1; page < pPool->pageCount; page++) {
+		char*     pStart = (char*)(pPool->startAddress)+(page*PAGE_SIZE);
+		u_int32_t offset = 0;
+		while (offset < PAGE_SIZE) {
+			slabEntry_t* pCurrent = (slabEntry_t*)(pStart+offset);
+			if (pCurrent->slabID > SLAB_MAX) {
+				LOG(ERR, "Bad chunk in page %u", page);
+				break;
+			}
+			/* the size is read before the visitor may free the chunk */
+			offset += pPool->slabs[pCurrent->slabID].slabSize+sizeof(slabEntry_t);
+			if (pCurrent->inUse & flag) {
+				visitor(context, pCurrent->data);
+				count++;
+			}
+		}
+	}
+	return count;
+}
+
+u_int32_t chunkpoolScanRoots(chunkpool_t chunkpool, chunkpoolVisitor_t visitor, void* context) {
+	chunkpoolImpl_t* pPool  = AS_CHUNKPOOL(chunkpool);
+	return pPool ? visitChunks(pPool, CHUNK_ROOT, visitor, context) : 0;
+}
 
+int chunkpoolIsAllocated(chunkpool_t chunkpool, void* chunk) {
+	chunkpoolImpl_t* pPool = AS_CHUNKPOOL(chunkpool);
+	unsigned long    start = (unsigned long)pPool->startAddress + PAGE_SIZE;
+	unsigned long    last  = start + (pPool->pageCount - 1) * PAGE_SIZE;
+	unsigned long    value = (unsigned long)chunk;
+	if ((value < start + sizeof(slabEntry_t)) || (value >= last) || (value % 16 != sizeof(slabEntry_t))) {
+		return 0;
+	}
+	return chunkHeader(chunk)->inUse ? 1 : 0;
+}
 
+void chunkpoolMark(chunkpool_t chunkpool, void* chunk) {
+	chunkpoolImpl_t* pPool = AS_CHUNKPOOL(chunkpool);
+	if (pPool && chunk) {
+		validateChunk(pPool, chunk);
+		chunkHeader(chunk)->inUse |= CHUNK_MARK;
+	}
+}
 
+static void sweepChunk(void* context, void* chunk) {
+	chunkpoolImpl_t* pPool   = AS_CHUNKPOOL(context);
+	slabEntry_t*     pHeader = chunkHeader(chunk);
+	if (pHeader->inUse & CHUNK_MARK) {
+		pHeader->inUse &= ~CHUNK_MARK;
+	}else {
+		/* no slabGC here, merging would move the chunks being walked */
+		putInFreeList(pPool, chunk);
+	}
+}
 
+u_int32_t chunkpoolSweep(chunkpool_t chunkpool) {
+	chunkpoolImpl_t* pPool = AS_CHUNKPOOL(chunkpool);
+	u_int64_t        chunks = 0;
+	if (!pPool) {
+		return 0;
+	}
+	chunks = pPool->freeChunks;
+	visitChunks(pPool, CHUNK_IN_USE | CHUNK_ROOT | CHUNK_MARK, sweepChunk, pPool);
+	return (u_int32_t)(pPool->freeChunks - chunks);
+}
@@ -5,6 +5,16 @@
 #include "../common/common.h"
 
 typedef void* chunkpool_t;
+typedef void (*chunkpoolVisitor_t)(void* context, void* chunk);
+/* free chunks of one slab size, see chunkpoolVisitSlabs */
+typedef void (*chunkpoolSlabVisitor_t)(void* context, u_int32_t slabSize, u_int32_t freeCount);
+
+typedef struct {
+	u_int64_t totalBytes;
+	u_int64_t freeBytes;
+	u_int64_t freeChunks;
+	u_int64_t freePageBytes;   //free in chunks of the largest size
+} chunkpoolStats_t;
 
 chunkpool_t  chunkpoolCreate(u_int32_t maxSizeInPages);
 void         chunkpoolDelete(chunkpool_t chunkpool);
@@ -16,5 +26,34 @@ void         chunkpoolGC(chunkpool_t  chunkpool);
 void         chunkpoolPrint(chunkpool_t  chunkpool);
 u_int32_t    chunkpoolMaxMallocSize(chunkpool_t chunkpool);
 u_int32_t    chunkpoolMemoryUsed(chunkpool_t chunkpool);
+void         chunkpoolGetStats(chunkpool_t chunkpool, chunkpoolStats_t* pStats);
+/* calls visitor for every slab size with free chunks, smallest first */
+void         chunkpoolVisitSlabs(chunkpool_t chunkpool, chunkpoolSlabVisitor_t visitor, void* context);
+
+/* Warm restart
+ *
+ * chunkpoolCreateMapped keeps the memory in a shared mapping of path,
+ * a file in /dev/shm outlives the process, a file on disk a reboot
+ * too. If the file was closed by chunkpoolDelete and has the same size,
+ * it is mapped at the same address again and the chunks allocated then
+ * are still allocated, chunkpoolIsRestored is 1. Otherwise, after a
+ * crash for instance, the pool starts empty.
+ *
+ * The user finds its objects again through the chunks tagged with
+ * chunkpoolSetRoot. It marks every chunk it keeps with chunkpoolMark,
+ * then chunkpoolSweep frees the chunks not marked, the ones held by
+ * requests of the previous process for instance.
+ */
+chunkpool_t  chunkpoolCreateMapped(u_int32_t maxSizeInPages, char* path);
+int          chunkpoolIsRestored(chunkpool_t chunkpool);
+int          chunkpoolIsMapped(chunkpool_t chunkpool);
+/* seconds to add to CLOCK_MONOTONIC times saved before the restart */
+int64_t      chunkpoolGetClockShift(chunkpool_t chunkpool);
+void         chunkpoolSetRoot(chunkpool_t chunkpool, void* chunk, int isRoot);
+u_int32_t    chunkpoolScanRoots(chunkpool_t chunkpool, chunkpoolVisitor_t visitor, void* context);
+int          chunkpoolIsAllocated(chunkpool_t chunkpool, void* chunk);
+void         chunkpoolMark(chunkpool_t chunkpool, void* chunk);
+/* returns the number of chunks freed */
+u_int32_t    chunkpoolSweep(chunkpool_t chunkpool);
 
 #endif //CHUNKPOOL_CHUNKPOOL_H
@@ -1,4 +1,7 @@
+#include <time.h>
 #include "clustermap.h"
+#include "nearcache.h"
+#include "consistent.h"
 #include "../io/connection.h"
 #include "../parser/parser.h"
 #include "../common/list.h"
@@ -11,21 +14,38 @@ typedef struct request_t {
 	char*             key;
 	void*             keyContext;
     void*             luaContext;
+    //last key of the multi-get it was sent in
+    int               lastInBatch;
+    //only for forwarded requests
+    dataStream_t               request;
+    dataStream_t               response;
+    int                        multiLine;
+    clusterMapForwardHandler_t forwardHandler;
+    //pending list of the clusterMap, oldest first
+    struct request_t*          pDeadlineNext;
+    struct request_t*          pDeadlinePrev;
+    u_int64_t                  deadline;
+    int                        tracked;
+    //written to a connection, the answer is on its way
+    int                        sent;
+    struct externalServer_t*   pServer;
 } request_t;
 
 
 enum connection_status_t {
 	status_connecting  = 1,
 	status_active,
-	status_pooled,
-    status_waiting_read,
-    status_waiting_write
+	status_pooled
 };
 
 /* This object handles the actual request by sending data to the server
- * parsing the response and reporting results.It takes a set of request
- * objects at a time. If a single object is given it uses get otherwise
- * it will use multi-get.
+ * parsing the response and reporting results. Requests are pipelined,
+ * upto MAX_PIPELINED_BATCHES batches can be waiting for the response
+ * on one connection. A batch is either a multi-get of upto
+ * MAX_MULTI_GET_REQUESTS lua gets, a forwarded get or upto
+ * MAX_PIPELINED_WRITES forwarded single line requests. The
+ * server answers them in order, currentRequests has the requests of
+ * all the batches in the order in which they were written.
  *
  * TODO: Since we use fallocator, it might be a good idea to close the
  * connection periodically, say after handling million requests.
@@ -42,37 +62,139 @@ typedef struct connectionContext_t {
 	list_t                      currentRequests; //list of request_t
 	fallocator_t                fallocator;
 	void*                       pExternalServer;
+	u_int32_t                   pendingBatches;
+	//all keys of the first multi-get got a value, only END is left
+	int                         awaitingEnd;
 } connectionContext_t;
 
 
+/* New requests are queued in unassignedRequests and handed to the
+ * connections once per event loop iteration, so that the gets made
+ * by all the scripts which ran in this iteration go out together.
+ *
+ * With health checks enabled a server which is not available has its
+ * circuit open, its requests are failed without being sent. Only the
+ * probe goes out, its answer closes the circuit again.
+ */
 typedef struct externalServer_t {
+	struct externalServer_t* pNext;
+	struct externalServer_t* pPrev;
 	char*      serverName;           //ip:port
 	char*      serverIP;
 	int        serverPort;
 	list_t     unassignedRequests;   //list of request_t
     list_t     freeConnections;      //list of connectionContext_t
     list_t     activeConnections;    //list of connectionContext_t
+    int        connectingCount;
+    int        flushScheduled;
     void*      pClusterMap;
+    int        available;
+    u_int32_t  failures;             //connection errors in a row
+    request_t* probe;                //0 if no probe is in flight
+    int        probeTimedOut;
+    u_int64_t  probeSentAt;
 } externalServer_t;
 
+/* Gets answered from the nearCache wait in nearCacheHits for the next
+ * event loop iteration.
+ *
+ * Gets and forwarded requests are in the pending list till they are
+ * answered. Requests only get a deadline when they are made, all with
+ * the same timeout, so the list is ordered by deadline and the timer
+ * only looks at its head.
+ */
 typedef struct clusterMapImpl_t {
 	clusterMapResultHandler_t resultHandler;
     map_t                     serverMap;
+    list_t                    servers;         //list of externalServer_t
+    nearCache_t               nearCache;
+    list_t                    nearCacheHits;   //list of request_t
+    int                       hitsScheduled;
+    struct event*             healthTimer;
+    dataStream_t              probeRequest;
+    fallocator_t              fallocator;      //for probeRequest
+    clusterMapHealthStats_t   health;
+    list_t                    pending;         //list of request_t
+    struct event*             deadlineTimer;
+    clusterMapRequestStats_t  requests;
 } clusterMapImpl_t;
 
 
 #define CLUSTER_MAP(x) (clusterMapImpl_t*)(x)
 
+#define MAX_MULTI_GET_REQUESTS         16
+#define MAX_PIPELINED_BATCHES          16
+#define MAX_PIPELINED_WRITES           16
+#define MAX_CONCURRENT_CONNECTIONS     64
+//connection errors in a row which open the circuit
+#define MAX_CONNECTION_FAILURES        3
+
+#define VERSION_COMMAND    "version\r\n"
+
+static u_int64_t currentTimeInMillis(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((u_int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
 static void deleteRequest(request_t* pRequest) {
 	if (pRequest) {
+		if (pRequest->tracked) {
+			clusterMapImpl_t* pCM = pRequest->pServer->pClusterMap;
+			listRemove(pCM->pending, pRequest);
+		}
 		if (pRequest->key) {
 			FREE(pRequest->key);
 			pRequest->key = 0;
 		}
+		if (pRequest->request) {
+			dataStreamDelete(pRequest->request);
+			pRequest->request = 0;
+		}
+		if (pRequest->response) {
+			dataStreamDelete(pRequest->response);
+			pRequest->response = 0;
+		}
 		FREE(pRequest);
 	}
 }
 
+/* Reports failure to whoever made the request and deletes it */
+static void failRequest(clusterMapImpl_t* pCM, request_t* pRequest) {
+	if (pRequest->forwardHandler) {
+		pRequest->forwardHandler(pRequest->luaContext, -1, NULL);
+	}else if (pRequest->luaContext) {
+		pCM->resultHandler(pRequest->luaContext, pRequest->keyContext, -1, NULL);
+	}
+	deleteRequest(pRequest);
+}
+
+/* The request stream is shared, it is released when the
+ * request is deleted.
+ */
+static request_t* createForwardRequest(dataStream_t request, int multiLine, void* context,
+		clusterMapForwardHandler_t handler) {
+	request_t* pRequest = ALLOCATE_1(request_t);
+
+	IfTrue(pRequest, ERR, "Error allocating memory");
+	pRequest->request = dataStreamCreate();
+	IfTrue(pRequest->request, ERR, "Error allocating memory");
+	IfTrue(0 == dataStreamAppendDataStream(pRequest->request, request), ERR, "Error copying request");
+	pRequest->response = dataStreamCreate();
+	IfTrue(pRequest->response, ERR, "Error allocating memory");
+	pRequest->multiLine      = multiLine;
+	pRequest->luaContext     = context;
+	pRequest->forwardHandler = handler;
+	goto OnSuccess;
+OnError:
+	if (pRequest) {
+		deleteRequest(pRequest);
+		pRequest = 0;
+	}
+OnSuccess:
+	return pRequest;
+}
+
 /**
  * creates a request object which encapsulates all the information
  * necessary for making a request
@@ -96,22 +218,49 @@ OnSuccess:
 }
 
 
+static void externalServerScheduleFlush(externalServer_t* pServer);
+
+/* Lua gets still waiting for the response are moved to another
+ * connection when move is set. Forwarded requests are always failed,
+ * they need not be idempotent. Gets nobody waits for any more, the
+ * expired ones, are dropped.
+ */
 static void connectionContextDelete(connectionContext_t* pContext, int move) {
 	if (pContext) {
 		externalServer_t* pServer  = pContext->pExternalServer;
 		clusterMapImpl_t* pCMap    = pServer->pClusterMap;
 		request_t*        pRequest = 0;
+		int               moved    = 0;
 
 		LOG(DEBUG, "deleting connection context");
 
-		while ((pRequest = listRemoveLast(pContext->currentRequests)) != 0) {
-			if (move) {
+		//the connection may be closed from outside its own callback
+		switch (pContext->status) {
+		case status_active:
+			listRemove(pServer->activeConnections, pContext);
+			connectionWaitCancel(pContext->connection, getGlobalEventBase());
+			break;
+		case status_pooled:
+			listRemove(pServer->freeConnections, pContext);
+			connectionWaitCancel(pContext->connection, getGlobalEventBase());
+			break;
+		case status_connecting:
+			pServer->connectingCount--;
+			break;
+		}
+		pContext->status = 0;
+
+		while (pContext->currentRequests &&
+				(pRequest = listRemoveLast(pContext->currentRequests)) != 0) {
+			if (move && !pRequest->forwardHandler && pRequest->luaContext) {
 				//move the existing requests to another socket
+				pRequest->lastInBatch = 0;
+				pRequest->sent        = 0;
 				listAddFirst(pServer->unassignedRequests, pRequest);
+				moved = 1;
 			}else {
 				//report error
-				pCMap->resultHandler(pRequest->luaContext, pRequest->keyContext,  -1,  NULL);
-				deleteRequest(pRequest);
+				failRequest(pCMap, pRequest);
 			}
 		}
 		if (pContext->connection) {
@@ -137,26 +286,30 @@ static void connectionContextDelete(connectionContext_t* pContext, int move) {
 			fallocatorDelete(pContext->fallocator);
 		}
 		FREE(pContext);
+		if (moved) {
+			externalServerScheduleFlush(pServer);
+		}
 	}
 }
 
-/*  create get request from request objects in the current request list
- *  and write it to the writeStream.
+/*  moves upto MAX_MULTI_GET_REQUESTS lua gets from the head of the
+ *  unassigned requests to the current requests and writes a single
+ *  get for them to the writeStream.
  */
 
-static int connectionMakeGetRequest(connectionContext_t* pCContext){
-	int count = listGetSize(pCContext->currentRequests);
+static int connectionMakeGetRequest(externalServer_t* pServer, connectionContext_t* pCContext){
+	request_t* pCurrent            = listGetFirst(pServer->unassignedRequests);
+	int        estimatedBufferSize = 4 + 2; // strlen("get ") + strlen("\r\n")
+	int        count               = 0;
+
+	while (pCurrent && !pCurrent->forwardHandler && (count < MAX_MULTI_GET_REQUESTS)) {
+		estimatedBufferSize += strlen(pCurrent->key) + 1;
+		count++;
+		pCurrent = listGetNext(pServer->unassignedRequests, pCurrent);
+	}
 	if (count < 1) {
 		return 0;
 	}
-	request_t* pCurrent = listGetFirst(pCContext->currentRequests);
-	int estimatedBufferSize   = 0;
-	while (pCurrent) {
-		estimatedBufferSize = strlen(pCurrent->key) + 1;
-		pCurrent = listGetNext(pCContext->currentRequests, pCurrent);
-	}
-	estimatedBufferSize -= 1;     //don't need space after last key
-	estimatedBufferSize += 4 + 2; // strlen("get ") + strlen("\r\n")
 
 	u_int32_t offset     = 0;
 	char*     buffer     = 0;
@@ -164,29 +317,54 @@ static int connectionMakeGetRequest(connectionContext_t* pCContext){
 	buffer = connectionGetBuffer(pCContext->connection, pCContext->fallocator,
 			        estimatedBufferSize, &offset);
     if (buffer) {
-    	request_t* pCurrent = listGetFirst(pCContext->currentRequests);
-    	strncpy(buffer+offset, "get ", 4);
-    	written += 4;
-		while (pCurrent) {
-			request_t* pNext = listGetNext(pCContext->currentRequests, pCurrent);
+    	memcpy(buffer+offset, "get", 3);
+    	written += 3;
+		while (count-- > 0) {
+			pCurrent = listRemoveFirst(pServer->unassignedRequests);
 			int keyLength = strlen(pCurrent->key);
-			strncpy(buffer+offset+written, pCurrent->key, keyLength);
-			written+= keyLength;
-			if (pNext) {
-				strncpy(buffer+offset+written, " ", 1);
-				written+= 1;
-			}
-			pCurrent = pNext;
+			buffer[offset+written] = ' ';
+			memcpy(buffer+offset+written+1, pCurrent->key, keyLength);
+			written += keyLength + 1;
+			pCurrent->lastInBatch = (count == 0);
+			pCurrent->sent        = 1;
+			listAddLast(pCContext->currentRequests, pCurrent);
 		}
-		strncpy(buffer+offset+written, "\r\n", 2);
+		memcpy(buffer+offset+written, "\r\n", 2);
 		written += 2;
 		LOG(DEBUG, "created request %.*s", written, buffer+offset);
-		dataStreamAppendData(pCContext->writeStream, buffer, offset, written);
-		//TODO : check return value
+		if (0 != dataStreamAppendData(pCContext->writeStream, buffer, offset, written)) {
+			return -1;
+		}
     }
 	return written;
 }
 
+/*  moves a forwarded request from the head of the unassigned requests
+ *  to the current requests and appends it to the writeStream. Single
+ *  line requests (set, delete, incr..) which follow it are added to the
+ *  same batch, upto MAX_PIPELINED_WRITES of them.
+ */
+
+static int connectionMakeForwardRequest(externalServer_t* pServer, connectionContext_t* pCContext) {
+	request_t* pCurrent = 0;
+	request_t* pNext    = 0;
+	int        count    = 0;
+
+	do {
+		pCurrent = listRemoveFirst(pServer->unassignedRequests);
+		pCurrent->sent = 1;
+		listAddLast(pCContext->currentRequests, pCurrent);
+		if (0 != dataStreamAppendDataStream(pCContext->writeStream, pCurrent->request)) {
+			return -1;
+		}
+		count++;
+		pNext = listGetFirst(pServer->unassignedRequests);
+	} while (!pCurrent->multiLine && pNext && pNext->forwardHandler && !pNext->multiLine &&
+			(count < MAX_PIPELINED_WRITES));
+
+	pCurrent->lastInBatch = 1;
+	return count;
+}
 
 static connectionContext_t* connectionContextCreate(connection_t conn, void* pServer) {
 	connectionContext_t* pContext = ALLOCATE_1(connectionContext_t);
@@ -194,6 +372,7 @@ static connectionContext_t* connectionContextCreate(connection_t conn, void* pSe
 	IfTrue(conn, ERR, "Null Connection");
 	IfTrue(pContext, ERR, "Error allocating memory");
 
+	pContext->pExternalServer = pServer;
 	pContext->readStream = dataStreamCreate();
 	IfTrue(pContext->readStream, WARN, "Error creating read stream");
 	pContext->writeStream = dataStreamCreate();
@@ -206,7 +385,6 @@ static connectionContext_t* connectionContextCreate(connection_t conn, void* pSe
 			                               OFFSET(request_t, pPrev));
 	IfTrue(pContext->currentRequests, WARN, "Error creating request list");
 	pContext->connection      = conn;
-	pContext->pExternalServer = pServer;
 	goto OnSuccess;
 OnError:
 	if (pContext) {
@@ -239,57 +417,255 @@ static int completeWrite(connectionContext_t* pContext) {
 	return 0;
 }
 
-static int connectionSubmitRequests(externalServer_t* pServer, connectionContext_t* pCContext);
+/* While a write is pending the responses are still read, the server
+ * might be blocked writing to us. A connection with nothing pending
+ * goes back to the pool and waits for read in case the server closes it.
+ */
+static void connectionContextWait(connectionContext_t* pCContext) {
+	externalServer_t* pServer = pCContext->pExternalServer;
+
+	connectionWaitCancel(pCContext->connection, getGlobalEventBase());
+	if (dataStreamGetSize(pCContext->writeStream) > 0) {
+		connectionWaitForReadWrite(pCContext->connection, getGlobalEventBase());
+		return;
+	}
+	if ((pCContext->status == status_active) && (pCContext->pendingBatches == 0)) {
+		listRemove(pServer->activeConnections, pCContext);
+		pCContext->status = status_pooled;
+		listAddLast(pServer->freeConnections, pCContext);
+	}
+	connectionWaitForRead(pCContext->connection, getGlobalEventBase());
+}
+
+/* Fills the pipeline of an active connection from the unassigned
+ * requests and writes what it can. Consecutive lua gets are sent as
+ * one multi-get, forwarded requests are written as they are.
+ */
+static int connectionSubmitRequests(externalServer_t* pServer, connectionContext_t* pCContext) {
+	request_t* pRequest = 0;
+	int        err      = 0;
+
+	while ((pCContext->pendingBatches < MAX_PIPELINED_BATCHES) &&
+			((pRequest = listGetFirst(pServer->unassignedRequests)) != 0)) {
+		if (pRequest->forwardHandler) {
+			IfTrue(connectionMakeForwardRequest(pServer, pCContext) > 0, WARN,
+					"Error appending forwarded request");
+		}else {
+			IfTrue(connectionMakeGetRequest(pServer, pCContext) > 0, WARN, "Error creating get request");
+		}
+		pCContext->pendingBatches++;
+	}
+	err = completeWrite(pCContext);
+	// error writing to server/ connection closed ?
+	IfTrue(err >= 0, INFO, "Error writing to server %s", pServer->serverName);
+	connectionContextWait(pCContext);
+	return 0;
+OnError:
+	connectionContextDelete(pCContext, 1);
+	return -1;
+}
+
+/* When we can't connect to the server and no connection to it is
+ * active, nothing would pick up the queued requests. Fail them. Only
+ * the requests queued now are failed, the handlers can queue more.
+ */
+static void externalServerFailUnassigned(externalServer_t* pServer) {
+	clusterMapImpl_t* pCM      = pServer->pClusterMap;
+	request_t*        pRequest = 0;
+	int               count    = listGetSize(pServer->unassignedRequests);
+
+	if ((listGetSize(pServer->activeConnections) > 0) || (pServer->connectingCount > 0)) {
+		return;
+	}
+	while ((count-- > 0) && (pRequest = listRemoveFirst(pServer->unassignedRequests)) != 0) {
+		failRequest(pCM, pRequest);
+	}
+}
+
+/* Opening the circuit closes the connections, the requests waiting on
+ * them are failed or, for lua gets, failed by the next flush.
+ */
+static void externalServerSetAvailable(externalServer_t* pServer, int available) {
+	clusterMapImpl_t*    pCM      = pServer->pClusterMap;
+	connectionContext_t* pContext = 0;
+
+	if (pServer->available == available) {
+		return;
+	}
+	pServer->available  = available;
+	pServer->failures   = 0;
+	pCM->health.serversDown += available ? -1 : 1;
+	LOG(WARN, "Server %s is %s", pServer->serverName, available ? "available again" : "not available");
+	consistentSetServerAvailableInAll(pServer->serverName, available);
+	if (!available) {
+		while ((pContext = listGetFirst(pServer->activeConnections)) != 0) {
+			connectionContextDelete(pContext, 1);
+		}
+		while ((pContext = listGetFirst(pServer->freeConnections)) != 0) {
+			connectionContextDelete(pContext, 0);
+		}
+		externalServerScheduleFlush(pServer);
+	}
+}
+
+/* Connection errors only open the circuit when health checks are on,
+ * nothing would close it otherwise.
+ */
+static void externalServerFailure(externalServer_t* pServer) {
+	clusterMapImpl_t* pCM = pServer->pClusterMap;
+
+	pServer->failures++;
+	if (pCM->health.intervalMillis && (pServer->failures >= MAX_CONNECTION_FAILURES)) {
+		externalServerSetAvailable(pServer, 0);
+	}
+}
+
+/* Fails the queued requests of a server with open circuit, the probe
+ * is kept.
+ */
+static void externalServerFailFast(externalServer_t* pServer) {
+	clusterMapImpl_t* pCM      = pServer->pClusterMap;
+	request_t*        pRequest = 0;
+	int               count    = listGetSize(pServer->unassignedRequests);
+
+	while ((count-- > 0) && (pRequest = listRemoveFirst(pServer->unassignedRequests)) != 0) {
+		if (pRequest == pServer->probe) {
+			listAddLast(pServer->unassignedRequests, pRequest);
+		}else {
+			pCM->health.fastFails++;
+			failRequest(pCM, pRequest);
+		}
+	}
+}
 
 static void connectCompleteImpl(connection_t connection, int status) {
 	connectionContext_t* pContext  = connectionGetContext(connection);
+	externalServer_t*    pServer   = pContext->pExternalServer;
+	//the socket is also writable when the connect failed, ask again
+	if ((status == 0) && (connectionConnect(connection) != 0)) {
+		status = -1;
+	}
 	if (status != 0) {
-		connectionClose(connection);
+		//connectionContextDelete closes the connection
 		connectionContextDelete(pContext, 0);
+		externalServerFailUnassigned(pServer);
+		externalServerFailure(pServer);
 	}else {
 		LOG(DEBUG, "got connect complete callback ");
-        connectionConnect(connection);
+		pServer->connectingCount--;
 		pContext->status = status_active;
-		connectionSubmitRequests(pContext->pExternalServer, pContext);
+		listAddLast(pServer->activeConnections, pContext);
+		connectionSubmitRequests(pServer, pContext);
+		if (listGetSize(pServer->unassignedRequests) > 0) {
+			externalServerScheduleFlush(pServer);
+		}
 	}
 }
 
-// forward declaration...is called form write available
-static void readAvailableImpl(connection_t connection);
-
 static void writeAvailableImpl(connection_t connection) {
 	connectionContext_t* pCContext  = connectionGetContext(connection);
 
-	if (pCContext->status != status_waiting_write) {
-		LOG(ERR, "Invalid state... ");
-	}
-
-    int err = completeWrite(pCContext);
-    if (err < 0) {
-    	externalServer_t* pServer  = pCContext->pExternalServer;
-    	listRemove(pServer->activeConnections, pCContext);
+    if (completeWrite(pCContext) < 0) {
+    	externalServer_t* pServer = pCContext->pExternalServer;
 		connectionContextDelete(pCContext, 1);
+		externalServerFailure(pServer);
     }else {
-    	if (err == 0) {
-    		//write compelete
-    		pCContext->status = status_active;
-    		if (dataStreamGetSize(pCContext->readStream) > 0) {
-    			readAvailableImpl(connection);
-    		}else {
-    			pCContext->status = status_waiting_read;
-    			connectionWaitForRead(pCContext->connection, getGlobalEventBase());
-    		}
-    	}else {
-    		pCContext->status = status_waiting_write;
-    		connectionWaitForWrite(pCContext->connection, getGlobalEventBase());
-    	}
+    	connectionContextWait(pCContext);
     }
 }
 
+/* Handles one VALUE or the END of the multi-get at the head of the
+ * pipeline. Keys without a value are reported as failed.
+ * 0 - handled, 1 - need more data, -1 - unexpected response
+ */
+static int connectionParseGetResponse(connectionContext_t* pCContext) {
+	externalServer_t* pServer     = pCContext->pExternalServer;
+	clusterMapImpl_t* pCM         = pServer->pClusterMap;
+	request_t*        pRequest    = 0;
+	char*             key         = 0;
+	dataStream_t      value       = 0;
+	u_int32_t         flags       = 0;
+	int               returnValue = 0;
+	int               found       = 0;
+
+	returnValue = responseParserParse(pCContext->parser, pCContext->readStream);
+	LOG(DEBUG, "response parser status %d", returnValue);
+	if (returnValue != 0) {
+		return returnValue;
+	}
+
+	returnValue = responseParserGetResponse(pCContext->parser, pCContext->readStream,
+			                                &key, &value, &flags);
+	LOG(DEBUG, "got resposonse %d key %s", returnValue, key);
+
+	if (returnValue == 0) {
+		//a value after all keys of the batch got one is for someone else
+		while (!pCContext->awaitingEnd &&
+				(pRequest = listRemoveFirst(pCContext->currentRequests)) != 0) {
+			int last = pRequest->lastInBatch;
+			if (0 == strcmp(pRequest->key, key)) {
+				//we got the response for the key
+				LOG(DEBUG, "giving callback for success result");
+				if (pCM->nearCache) {
+					nearCachePut(pCM->nearCache, pServer->serverName, key, value);
+				}
+				if (pRequest->luaContext) {
+					pCM->resultHandler(pRequest->luaContext, pRequest->keyContext, 0, value);
+				}
+				deleteRequest(pRequest);
+				pCContext->awaitingEnd = last;
+				found = 1;
+				break;
+			}
+			//this key is different from the key we expected
+			//the request for current key failed, so notify
+			LOG(DEBUG, "giving callback for fail result");
+			failRequest(pCM, pRequest);
+			if (last) {
+				break;
+			}
+		}
+		dataStreamDelete(value);
+		fallocatorFree(pCContext->fallocator, key);
+		return found ? 0 : -1;
+	}
+
+	LOG(DEBUG, "end of results from response parser");
+	//anything pending in this batch..not found
+	while (!pCContext->awaitingEnd &&
+			(pRequest = listRemoveFirst(pCContext->currentRequests)) != 0) {
+		int last = pRequest->lastInBatch;
+		failRequest(pCM, pRequest);
+		if (last) {
+			break;
+		}
+	}
+	pCContext->awaitingEnd = 0;
+	pCContext->pendingBatches--;
+	return 0;
+}
+
+static int connectionParseForwardResponse(connectionContext_t* pCContext, request_t* pRequest) {
+	int returnValue = responseParserForward(pCContext->parser, pCContext->readStream,
+			pRequest->multiLine, pRequest->response);
+	if (returnValue != 0) {
+		return returnValue;
+	}
+	listRemoveFirst(pCContext->currentRequests);
+	if (pRequest->lastInBatch) {
+		pCContext->pendingBatches--;
+	}
+	pRequest->forwardHandler(pRequest->luaContext, 0, pRequest->response);
+	deleteRequest(pRequest);
+	return 0;
+}
+
 static void readAvailableImpl(connection_t connection){
 	connectionContext_t* pCContext    = connectionGetContext(connection);
-	u_int32_t            bytesRead   = 0;
-	int                  returnValue = 0;
+	externalServer_t*    pServer      = pCContext->pExternalServer;
+	request_t*           pRequest     = 0;
+	u_int32_t            bytesRead    = 0;
+	int                  returnValue  = 0;
 
 	LOG(DEBUG, "got something to read on socket");
 
@@ -297,115 +673,37 @@ static void readAvailableImpl(connection_t connection){
 	if (pCContext->status == status_pooled) {
 		LOG(DEBUG, "socket was pooled..closing on read");
 		//socket is closed
-		externalServer_t* pServer = pCContext->pExternalServer;
-		listRemove(pServer->freeConnections, pCContext);
 		connectionContextDelete(pCContext, 0);
 		goto OnSuccess;
 	}
 
-	if (pCContext->status == status_waiting_read) {
-		pCContext->status = status_active;
-	}else {
-		LOG(ERR, "Invalid connection state");
-		goto OnError;
-	}
-
 	returnValue = connectionRead(pCContext->connection, pCContext->fallocator,
 			                   pCContext->readStream, 8 * 1024 , &bytesRead);
 	LOG(DEBUG, "connection read status %d bytesRead %d", returnValue, bytesRead);
 	IfTrue(returnValue >= 0, INFO, "Socket closed");
 
-doParseMore:
-
-	returnValue = responseParserParse(pCContext->parser, pCContext->readStream);
-	LOG(DEBUG, "response parser status %d", returnValue);
-	IfTrue(returnValue >= 0, INFO, "Parsing Error %d", returnValue);
-
-	if (returnValue == 1) {
-		LOG(DEBUG, "need to wait for read");
-		pCContext->status = status_waiting_read;
-		connectionWaitForRead(pCContext->connection, getGlobalEventBase());
-		goto OnSuccess;
-	}
-
-	char*         key   = 0;
-	dataStream_t  value = 0;
-	u_int32_t     flags = 0;
-
-	returnValue = responseParserGetResponse(pCContext->parser, pCContext->readStream,
-			                                &key, &value, &flags);
-	LOG(DEBUG, "got resposonse %d key %s", returnValue, key);
-
-	if (returnValue == 0) {
-		externalServer_t* pServer  = pCContext->pExternalServer;
-		clusterMapImpl_t* pCM      = pServer->pClusterMap;
-		request_t*        pRequest = 0;
-
-tryNext:
-	    pRequest = listRemoveFirst(pCContext->currentRequests);
-	    if (pRequest) {
-			if (0 == strcmp(pRequest->key, key)) {
-				//we got the response for the key
-				LOG(DEBUG, "giving callback for success result");
-				pCM->resultHandler(pRequest->luaContext, pRequest->keyContext, 0, value);
-				dataStreamDelete(value);
-				value    = 0;
-				fallocatorFree(pCContext->fallocator, key);
-				key      = 0;
-				deleteRequest(pRequest);
-				pRequest = 0;
-				goto doParseMore;
-			}else {
-				//this key is different from the key we expected
-				//the request for current key failed, so notify
-				LOG(DEBUG, "giving callback for fail result");
-
-				pCM->resultHandler(pRequest->luaContext, pRequest->keyContext,  -1, NULL);
-				deleteRequest(pRequest);
-				pRequest = 0;
-				//move on to the next key, may be its her response
-				goto tryNext;
-			}
-	    }else {
-	    	// no more request in the currentRequests list?
-            // what this means is that we got a response for a key
-	    	// which we didn't asked for...
-	    	// that is strange.., some server issue..we can't do much
-	    	dataStreamDelete(value);
-	    	value = 0;
-	        fallocatorFree(pCContext->fallocator, key);
-	    	key   = 0;
-	    	// now so just close this connection
-
-	    	externalServer_t* pServer = pCContext->pExternalServer;
-			listRemove(pServer->activeConnections, pCContext);
-			connectionContextDelete(pCContext, 0);
-			pCContext = 0;
-	    }
-	}else {
-		LOG(DEBUG, "end of results from response parser");
-		// we go END response from parser
-		externalServer_t* pServer = pCContext->pExternalServer;
-		clusterMapImpl_t* pCM      = pServer->pClusterMap;
-		request_t*        pRequest = 0;
-		//anything pending in the currentRequests..not found
-		while ((pRequest = listRemoveLast(pCContext->currentRequests)) != 0) {
-			//report error
-			pCM->resultHandler(pRequest->luaContext, pRequest->keyContext, -1,  NULL);
-			deleteRequest(pRequest);
+	while (1) {
+		pRequest = listGetFirst(pCContext->currentRequests);
+		if (pCContext->awaitingEnd || (pRequest && !pRequest->forwardHandler)) {
+			returnValue = connectionParseGetResponse(pCContext);
+		}else if (pRequest) {
+			returnValue = connectionParseForwardResponse(pCContext, pRequest);
+		}else {
+			break;
+		}
+		IfTrue(returnValue >= 0, INFO, "Unexpected response from server %s", pServer->serverName);
+		if (returnValue == 1) {
+			break;
 		}
-		// add this connections to free connections list
-	    listRemove(pServer->activeConnections, pCContext);
-	    connectionSubmitRequests(pServer, pCContext);
+		pServer->failures = 0;
 	}
+	IfTrue((pCContext->pendingBatches > 0) || (dataStreamGetSize(pCContext->readStream) == 0),
+			INFO, "Unexpected response from server %s", pServer->serverName);
+	connectionSubmitRequests(pServer, pCContext);
 	goto OnSuccess;
 OnError:
-	if (pCContext) {
-		externalServer_t* pServer = pCContext->pExternalServer;
-		listRemove(pServer->activeConnections, pCContext);
-		connectionContextDelete(pCContext, 1);
-		pCContext = 0;
-	}
+	connectionContextDelete(pCContext, 1);
+	externalServerFailure(pServer);
 OnSuccess:
 	return;
 }
@@ -442,7 +740,6 @@ static void externalServerDelete(externalServer_t* pServer) {
 	}
 }
 
-
 static externalServer_t* externalServerCreate(char* serverName, clusterMapImpl_t* pCM) {
 	externalServer_t* pServer = ALLOCATE_1(externalServer_t);
 	char* serverNameCopy      = 0;
@@ -476,6 +773,7 @@ static externalServer_t* externalServerCreate(char* serverName, clusterMapImpl_t
 											 OFFSET(request_t, pPrev));
 	IfTrue(pServer->unassignedRequests, ERR, "Error allocating memory");
 	pServer->pClusterMap = pCM;
+	pServer->available   = 1;
 	goto OnSuccess;
 OnError:
 	if (serverNameCopy) {
@@ -490,126 +788,467 @@ OnSuccess:
 }
 
 
-#define MAX_MULTI_GET_REQUESTS         16
+static void externalServerConnect(externalServer_t* pServer) {
+	connectionContext_t* pCContext     = 0;
+	connection_t         newConnection = 0;
+	int                  err           = 0;
+
+	LOG(DEBUG, "creating new external connection");
+	newConnection = connectionClientCreate(pServer->serverIP, pServer->serverPort,
+			                               createConnectionHandler());
+	IfTrue(newConnection, ERR, "Error creating new connection to %s", pServer->serverName);
+	//got a new connection
+	pCContext = connectionContextCreate(newConnection, pServer);
+	IfTrue(pCContext, ERR, "Error allocting memory for connection context");
+	connectionSetContext(newConnection, pCContext);
+	newConnection = 0;
+	pCContext->status = status_connecting;
+	pServer->connectingCount++;
+
+	err = connectionConnect(pCContext->connection);
+	IfTrue(err >= 0, ERR, "connect failed");
+	if (err == 1) {
+		LOG(DEBUG, "waiting for connect to complete");
+		connectionWaitForConnect(pCContext->connection, getGlobalEventBase());
+	}else {
+		connectCompleteImpl(pCContext->connection, 0);
+	}
+	goto OnSuccess;
+OnError:
+	if (newConnection) {
+		connectionClose(newConnection);
+	}
+	if (pCContext) {
+		connectionContextDelete(pCContext, 0);
+	}
+OnSuccess:
+	return;
+}
 
-static int connectionSubmitRequests(externalServer_t* pServer, connectionContext_t* pCContext) {
-	//we have a free connection
-	int  count = MAX_MULTI_GET_REQUESTS;
-	while (count-- > 0) {
-		request_t* pRequest = listRemoveFirst(pServer->unassignedRequests);
-		if (!pRequest) {
-			break;
+/* The active connection with the fewest batches in flight, 0 if all of
+ * them are full.
+ */
+static connectionContext_t* externalServerLeastLoaded(externalServer_t* pServer) {
+	connectionContext_t* pBest    = 0;
+	connectionContext_t* pCurrent = listGetFirst(pServer->activeConnections);
+
+	while (pCurrent) {
+		if ((pCurrent->pendingBatches < MAX_PIPELINED_BATCHES) &&
+				(!pBest || (pCurrent->pendingBatches < pBest->pendingBatches))) {
+			pBest = pCurrent;
 		}
-		listAddLast(pCContext->currentRequests, pRequest);
+		pCurrent = listGetNext(pServer->activeConnections, pCurrent);
 	}
-	if (listGetSize(pCContext->currentRequests) > 0) {
-		listAddLast(pServer->activeConnections, pCContext);
-		int bytesWritten = connectionMakeGetRequest(pCContext);
-		if (bytesWritten > 0) {
-			int err = completeWrite(pCContext);
-			if (err == 0) {
-				pCContext->status = status_waiting_read;
-				connectionWaitForRead(pCContext->connection, getGlobalEventBase());
-			}else {
-				if (err == 1) {
-					pCContext->status = status_waiting_write;
-					connectionWaitForWrite(pCContext->connection, getGlobalEventBase());
-				}else {
-					// error writing to server/ connection closed ?
-					listRemove(pServer->activeConnections, pCContext);
-					connectionContextDelete(pCContext, 1);
-				}
+	return pBest;
+}
+
+/* Hands the unassigned requests to the connections. Pooled connections
+ * are used first, then the pipelines of the active ones are filled and
+ * only then a new connection is made. Requests which don't fit wait
+ * for a connection to get some response.
+ */
+static void externalServerFlush(externalServer_t* pServer) {
+	connectionContext_t* pCContext = 0;
+
+	pServer->flushScheduled = 0;
+	if (!pServer->available) {
+		externalServerFailFast(pServer);
+	}
+	while (listGetSize(pServer->unassignedRequests) > 0) {
+		pCContext = listRemoveFirst(pServer->freeConnections);
+		if (pCContext) {
+			pCContext->status = status_active;
+			listAddLast(pServer->activeConnections, pCContext);
+		}else {
+			pCContext = externalServerLeastLoaded(pServer);
+		}
+		if (!pCContext) {
+			if ((pServer->connectingCount == 0) &&
+					(listGetSize(pServer->activeConnections) < MAX_CONCURRENT_CONNECTIONS)) {
+				externalServerConnect(pServer);
 			}
+			break;
 		}
-	}else {
-		//pooled connections also wait for read, incase they are close by the server
-		pCContext->status = status_pooled;
-		listAddLast(pServer->freeConnections, pCContext);
-		connectionWaitForRead(pCContext->connection, getGlobalEventBase());
+		connectionSubmitRequests(pServer, pCContext);
+	}
+	if (listGetSize(pServer->unassignedRequests) > 0) {
+		externalServerFailUnassigned(pServer);
 	}
-	return 0;
 }
 
-#define MAX_CONCURRENT_CONNECTIONS     64
+static void externalServerFlushCallback(int fd, short which, void* arg) {
+	externalServerFlush(arg);
+}
 
-/*
- * Request is always submitted (May be later we need to put a limit)
- * 0 - submitted and assigned to a connection
- * 1 - submitted but not assigned because no available connection
+/* Results are never given before clusterMapGet/clusterMapForward
+ * return, the lua script has to yield first.
  */
+static void externalServerScheduleFlush(externalServer_t* pServer) {
+	struct timeval now = {0, 0};
 
-static int externalServerSubmit(externalServer_t* pServer, request_t* pRequest) {
-	int                  returnValue   = 0;
-	connectionContext_t* pCContext     = 0;
-	connection_t         newConnection = 0;
+	if (pServer->flushScheduled) {
+		return;
+	}
+	if (0 == event_base_once(getGlobalEventBase(), -1, EV_TIMEOUT,
+			externalServerFlushCallback, pServer, &now)) {
+		pServer->flushScheduled = 1;
+	}else {
+		LOG(ERR, "Error scheduling requests for %s", pServer->serverName);
+	}
+}
 
+static void externalServerSubmit(externalServer_t* pServer, request_t* pRequest) {
+	pRequest->pServer = pServer;
 	listAddLast(pServer->unassignedRequests, pRequest);
-	pCContext = listRemoveFirst(pServer->freeConnections);
+	externalServerScheduleFlush(pServer);
+}
 
-	if (pCContext) {
-		connectionWaitCancel(pCContext->connection, getGlobalEventBase());
-	}
-
-	if (!pCContext) {
-		//check if we have reached max concurrent connections limit
-		// if not, create a new connection
-		if (listGetSize(pServer->activeConnections) < MAX_CONCURRENT_CONNECTIONS) {
-			LOG(DEBUG, "creating new external connection");
-			newConnection = connectionClientCreate(pServer->serverIP,
-												pServer->serverPort,
-												createConnectionHandler());
-			IfTrue(newConnection, ERR, "Error creating new connection to %s", pServer->serverName);
-			//got a new connection
-			pCContext = connectionContextCreate(newConnection, pServer);
-			IfTrue(pCContext, ERR, "Error allocting memory for connection context");
-			connectionSetContext(newConnection, pCContext);
-			newConnection = 0;
-
-			int err = connectionConnect(pCContext->connection);
-			IfTrue(err >= 0, ERR, "connect failed");
-
-			if (err == 1) {
-				LOG(DEBUG, "waiting for connect to complete");
-				pCContext->status = status_connecting;
-				connectionWaitForConnect(pCContext->connection, getGlobalEventBase());
-				goto OnSuccess;
+
+static externalServer_t* clusterMapGetServer(clusterMapImpl_t* pCM, char* server) {
+	externalServer_t* pEServer = mapGetElement(pCM->serverMap, server);
+	if (!pEServer) {
+		pEServer = externalServerCreate(server, pCM);
+		if (pEServer) {
+			mapPutElement(pCM->serverMap, server, pEServer);
+			listAddLast(pCM->servers, pEServer);
+		}
+	}
+	return pEServer;
+}
+
+/* A probe which timed out was already counted */
+static void externalServerProbeHandler(void* context, int status, dataStream_t response) {
+	externalServer_t* pServer  = context;
+	clusterMapImpl_t* pCM      = pServer->pClusterMap;
+	char*             line     = 0;
+	int               timedOut = pServer->probeTimedOut;
+
+	pServer->probe         = 0;
+	pServer->probeTimedOut = 0;
+	if (timedOut) {
+		return;
+	}
+	if ((status == 0) && response) {
+		line = dataStreamToString(response);
+	}
+	if (line && (0 == strncmp(line, "VERSION", 7))) {
+		pServer->failures = 0;
+		externalServerSetAvailable(pServer, 1);
+	}else {
+		//connection errors are counted where they happen
+		pCM->health.probeFailures++;
+	}
+	if (line) {
+		FREE(line);
+	}
+}
+
+/* Sends a version to every server known to the clusterMap, one probe
+ * in flight per server. A probe not answered in time opens the circuit
+ * right away, the server accepts connections but doesn't answer.
+ */
+static void clusterMapHealthCallback(int fd, short which, void* arg) {
+	clusterMapImpl_t* pCM     = arg;
+	externalServer_t* pServer = listGetFirst(pCM->servers);
+	u_int64_t         now     = currentTimeInMillis();
+
+	for (; pServer; pServer = listGetNext(pCM->servers, pServer)) {
+		if (pServer->probe) {
+			if (!pServer->probeTimedOut &&
+					(now - pServer->probeSentAt >= pCM->health.timeoutMillis)) {
+				LOG(INFO, "Health check of %s timed out", pServer->serverName);
+				pServer->probeTimedOut = 1;
+				pCM->health.probeFailures++;
+				externalServerSetAvailable(pServer, 0);
 			}
-		}else {
-			//if we have reached max connection limit, we will let the request rest
-			//in the queue. Whenever one of the current connections get free, we will
-			//use that to send the request.
-			returnValue = 1;
-			goto OnSuccess;
+			continue;
+		}
+		if (!pServer->available) {
+			//rings created since the circuit opened
+			consistentSetServerAvailableInAll(pServer->serverName, 0);
+		}
+		pServer->probe = createForwardRequest(pCM->probeRequest, 0, pServer,
+				externalServerProbeHandler);
+		if (pServer->probe) {
+			pServer->probeSentAt = now;
+			pCM->health.probes++;
+			externalServerSubmit(pServer, pServer->probe);
 		}
 	}
+}
 
-	if (pCContext) {
-		pCContext->status = status_active;
-		connectionSubmitRequests(pServer, pCContext);
+static void clusterMapHitsCallback(int fd, short which, void* arg) {
+	clusterMapImpl_t* pCM      = arg;
+	request_t*        pRequest = 0;
+	int               count    = listGetSize(pCM->nearCacheHits);
+
+	//scripts resumed here can add more hits, they go in the next round
+	pCM->hitsScheduled = 0;
+	while ((count-- > 0) && (pRequest = listRemoveFirst(pCM->nearCacheHits)) != 0) {
+		pCM->resultHandler(pRequest->luaContext, pRequest->keyContext, 0, pRequest->response);
+		deleteRequest(pRequest);
 	}
-	goto OnSuccess;
-OnError:
-	if (newConnection) {
-		connectionClose(newConnection);
+}
+
+/* 1 - answered from the nearCache, 0 - not in the nearCache */
+static int clusterMapGetFromNearCache(clusterMapImpl_t* pCM, request_t* pRequest,
+		externalServer_t* pEServer) {
+	struct timeval now    = {0, 0};
+	int            result = 0;
+
+	pRequest->response = dataStreamCreate();
+	if (!pRequest->response) {
+		return 0;
 	}
-	if (pCContext) {
-		connectionContextDelete(pCContext, 0);
+	result = nearCacheGet(pCM->nearCache, pEServer->serverName, pRequest->key, pRequest->response);
+	if (result == NEAR_CACHE_MISS) {
+		dataStreamDelete(pRequest->response);
+		pRequest->response = 0;
+		return 0;
+	}
+	if (!pCM->hitsScheduled) {
+		if (0 != event_base_once(getGlobalEventBase(), -1, EV_TIMEOUT,
+				clusterMapHitsCallback, pCM, &now)) {
+			LOG(ERR, "Error scheduling near cache results");
+			dataStreamDelete(pRequest->response);
+			pRequest->response = 0;
+			return 0;
+		}
+		pCM->hitsScheduled = 1;
+	}
+	listAddLast(pCM->nearCacheHits, pRequest);
+	return 1;
+}
+
+/* The answer of an expired request may still come, it is read and
+ * dropped, only a get updates the nearCache.
+ */
+static void ignoreForwardResponse(void* context, int status, dataStream_t response) {
+}
+
+/* Requests not yet written are failed and deleted. Requests already
+ * written stay in the pipeline of their connection, only the caller is
+ * told they failed.
+ */
+static void clusterMapExpire(clusterMapImpl_t* pCM, request_t* pRequest) {
+	clusterMapForwardHandler_t handler = pRequest->forwardHandler;
+	void*                      context = pRequest->luaContext;
+
+	listRemove(pCM->pending, pRequest);
+	pRequest->tracked = 0;
+	pCM->requests.timeouts++;
+	if (!pRequest->sent) {
+		listRemove(pRequest->pServer->unassignedRequests, pRequest);
+		failRequest(pCM, pRequest);
+		return;
+	}
+	pRequest->luaContext = 0;
+	if (handler) {
+		pRequest->forwardHandler = ignoreForwardResponse;
+		handler(context, -1, NULL);
+	}else if (context) {
+		pCM->resultHandler(context, pRequest->keyContext, -1, NULL);
+	}
+}
+
+static void clusterMapScheduleDeadline(clusterMapImpl_t* pCM, u_int64_t now) {
+	request_t*     pRequest = listGetFirst(pCM->pending);
+	u_int64_t      millis   = 0;
+	struct timeval timeout  = {0, 0};
+
+	if (pRequest && pCM->deadlineTimer && pCM->requests.deadlineMillis) {
+		millis          = (pRequest->deadline > now) ? (pRequest->deadline - now) : 0;
+		timeout.tv_sec  = millis / 1000;
+		timeout.tv_usec = (millis % 1000) * 1000;
+		event_add(pCM->deadlineTimer, &timeout);
 	}
-	returnValue = 1;
-OnSuccess:
-	return returnValue;
 }
 
+static void clusterMapDeadlineCallback(int fd, short which, void* arg) {
+	clusterMapImpl_t* pCM      = arg;
+	request_t*        pRequest = 0;
+	u_int64_t         now      = currentTimeInMillis();
+
+	//scripts resumed here can make more requests, they expire later
+	while (((pRequest = listGetFirst(pCM->pending)) != 0) && (pRequest->deadline <= now)) {
+		clusterMapExpire(pCM, pRequest);
+	}
+	clusterMapScheduleDeadline(pCM, now);
+}
+
+/* 0 - tracked, -1 - too many requests in flight */
+static int clusterMapTrack(clusterMapImpl_t* pCM, request_t* pRequest) {
+	u_int64_t now = 0;
+
+	if (pCM->requests.maxInFlight && (listGetSize(pCM->pending) >= pCM->requests.maxInFlight)) {
+		pCM->requests.rejected++;
+		return -1;
+	}
+	listAddLast(pCM->pending, pRequest);
+	pRequest->tracked = 1;
+	if (pCM->requests.deadlineMillis) {
+		now                = currentTimeInMillis();
+		pRequest->deadline = now + pCM->requests.deadlineMillis;
+		if (listGetSize(pCM->pending) == 1) {
+			clusterMapScheduleDeadline(pCM, now);
+		}
+	}
+	return 0;
+}
 
 clusterMap_t clusterMapCreate(clusterMapResultHandler_t resultHandler) {
 	clusterMapImpl_t* pCM = ALLOCATE_1(clusterMapImpl_t);
 	if (pCM) {
 		pCM->resultHandler   = resultHandler;
 		pCM->serverMap       = mapCreate();
+		pCM->nearCacheHits   = listCreate(OFFSET(request_t, pNext), OFFSET(request_t, pPrev));
+		pCM->servers         = listCreate(OFFSET(externalServer_t, pNext),
+				OFFSET(externalServer_t, pPrev));
+		pCM->pending         = listCreate(OFFSET(request_t, pDeadlineNext),
+				OFFSET(request_t, pDeadlinePrev));
 	}
 	return pCM;
 }
 
+int clusterMapSetHealthCheck(clusterMap_t clusterMap, u_int32_t intervalMillis,
+		u_int32_t timeoutMillis) {
+	clusterMapImpl_t* pCM      = CLUSTER_MAP(clusterMap);
+	externalServer_t* pServer  = 0;
+	char*             buffer   = 0;
+	struct timeval    interval = {intervalMillis / 1000, (intervalMillis % 1000) * 1000};
+
+	IfTrue(pCM && pCM->servers, ERR, "Null argument found");
+	if (!pCM->healthTimer && (intervalMillis == 0)) {
+		return 0;
+	}
+	if (!pCM->healthTimer) {
+		pCM->fallocator = fallocatorCreate();
+		IfTrue(pCM->fallocator, ERR, "Error creating fallocator");
+		buffer = dataStreamBufferAllocate(NULL, pCM->fallocator, strlen(VERSION_COMMAND));
+		IfTrue(buffer, ERR, "Error allocating memory");
+		memcpy(buffer, VERSION_COMMAND, strlen(VERSION_COMMAND));
+		pCM->probeRequest = dataStreamCreate();
+		IfTrue(pCM->probeRequest, ERR, "Error allocating memory");
+		IfTrue(0 == dataStreamAppendData(pCM->probeRequest, buffer, 0, strlen(VERSION_COMMAND)),
+				ERR, "Error creating probe request");
+		dataStreamBufferFree(buffer);
+		buffer = 0;
+		pCM->healthTimer = event_new(getGlobalEventBase(), -1, EV_PERSIST,
+				clusterMapHealthCallback, pCM);
+		IfTrue(pCM->healthTimer, ERR, "Error creating health check timer");
+	}
+	event_del(pCM->healthTimer);
+	pCM->health.intervalMillis = intervalMillis;
+	pCM->health.timeoutMillis  = timeoutMillis ? timeoutMillis : intervalMillis;
+	if (intervalMillis > 0) {
+		event_add(pCM->healthTimer, &interval);
+	}else {
+		for (pServer = listGetFirst(pCM->servers); pServer;
+				pServer = listGetNext(pCM->servers, pServer)) {
+			externalServerSetAvailable(pServer, 1);
+		}
+	}
+	return 0;
+OnError:
+	if (buffer) {
+		dataStreamBufferFree(buffer);
+	}
+	return -1;
+}
+
+int clusterMapGetHealthStats(clusterMap_t clusterMap, clusterMapHealthStats_t* pStats) {
+	clusterMapImpl_t* pCM = CLUSTER_MAP(clusterMap);
+
+	memset(pStats, 0, sizeof(clusterMapHealthStats_t));
+	if (!pCM || !pCM->health.intervalMillis) {
+		return -1;
+	}
+	*pStats         = pCM->health;
+	pStats->servers = listGetSize(pCM->servers);
+	return 0;
+}
+
+int clusterMapSetLimits(clusterMap_t clusterMap, u_int32_t deadlineMillis, u_int32_t maxInFlight) {
+	clusterMapImpl_t* pCM = CLUSTER_MAP(clusterMap);
+
+	IfTrue(pCM && pCM->pending, ERR, "Null argument found");
+	if (!pCM->deadlineTimer && deadlineMillis) {
+		pCM->deadlineTimer = evtimer_new(getGlobalEventBase(), clusterMapDeadlineCallback, pCM);
+		IfTrue(pCM->deadlineTimer, ERR, "Error creating deadline timer");
+	}
+	pCM->requests.deadlineMillis = deadlineMillis;
+	pCM->requests.maxInFlight    = maxInFlight;
+	if (pCM->deadlineTimer && !deadlineMillis) {
+		event_del(pCM->deadlineTimer);
+	}
+	return 0;
+OnError:
+	return -1;
+}
+
+void clusterMapGetRequestStats(clusterMap_t clusterMap, clusterMapRequestStats_t* pStats) {
+	clusterMapImpl_t* pCM = CLUSTER_MAP(clusterMap);
+
+	memset(pStats, 0, sizeof(clusterMapRequestStats_t));
+	if (pCM && pCM->pending) {
+		*pStats          = pCM->requests;
+		pStats->inFlight = listGetSize(pCM->pending);
+	}
+}
+
+void clusterMapVisitServers(clusterMap_t clusterMap, clusterMapServerVisitor_t visitor, void* context) {
+	clusterMapImpl_t* pCM     = CLUSTER_MAP(clusterMap);
+	externalServer_t* pServer = 0;
+
+	if (pCM) {
+		for (pServer = listGetFirst(pCM->servers); pServer;
+				pServer = listGetNext(pCM->servers, pServer)) {
+			visitor(context, pServer->serverName, pServer->available,
+					listGetSize(pServer->activeConnections) + listGetSize(pServer->freeConnections),
+					listGetSize(pServer->unassignedRequests));
+		}
+	}
+}
+
+int clusterMapSetNearCache(clusterMap_t clusterMap, u_int32_t ttlMillis) {
+	clusterMapImpl_t* pCM = CLUSTER_MAP(clusterMap);
+
+	IfTrue(pCM && pCM->nearCacheHits, ERR, "Null argument found");
+	if (pCM->nearCache) {
+		nearCacheSetTTL(pCM->nearCache, ttlMillis);
+	}else if (ttlMillis > 0) {
+		pCM->nearCache = nearCacheCreate(ttlMillis, CLUSTER_MAP_NEAR_CACHE_BYTES);
+		IfTrue(pCM->nearCache, ERR, "Error creating near cache");
+	}
+	return 0;
+OnError:
+	return -1;
+}
+
+void clusterMapInvalidate(clusterMap_t clusterMap, char* server, char* key) {
+	clusterMapImpl_t* pCM = CLUSTER_MAP(clusterMap);
+	if (pCM && pCM->nearCache) {
+		nearCacheInvalidate(pCM->nearCache, server, key);
+	}
+}
+
+int clusterMapGetNearCacheStats(clusterMap_t clusterMap, nearCacheStats_t* pStats) {
+	clusterMapImpl_t* pCM = CLUSTER_MAP(clusterMap);
+	if (!pCM || !pCM->nearCache) {
+		return -1;
+	}
+	nearCacheGetStats(pCM->nearCache, pStats);
+	return 0;
+}
+
+int clusterMapPushToNearCache(clusterMap_t clusterMap, char* server, char* key, dataStream_t value) {
+	clusterMapImpl_t* pCM = CLUSTER_MAP(clusterMap);
+	if (!pCM || !pCM->nearCache) {
+		return -1;
+	}
+	return nearCachePush(pCM->nearCache, server, key, value);
+}
+
 /*
  *  1 - if request is not submitted since local server can handle it
  *  0 - if request is submitted successfully
@@ -628,12 +1267,42 @@ int clusterMapGet(clusterMap_t clusterMap, void* luaContext,  void* keyContext,
 	newRequest = createRequest(key, luaContext, keyContext);
 	IfTrue(newRequest, ERR, "Error allocting memory for new request");
 
-	pEServer = mapGetElement(pCM->serverMap, server);
-	if (!pEServer) {
-		pEServer = externalServerCreate(server, pCM);
-		IfTrue(pEServer, ERR, "Error creating server entry for server %s", server);
-		mapPutElement(pCM->serverMap, server, pEServer);
+	pEServer = clusterMapGetServer(pCM, server);
+	IfTrue(pEServer, ERR, "Error creating server entry for server %s", server);
+	if (!pCM->nearCache || !clusterMapGetFromNearCache(pCM, newRequest, pEServer)) {
+		newRequest->pServer = pEServer;
+		IfTrue(0 == clusterMapTrack(pCM, newRequest), DEBUG, "Too many requests in flight");
+		externalServerSubmit(pEServer, newRequest);
 	}
+	goto OnSuccess;
+OnError:
+	if (newRequest) {
+		deleteRequest(newRequest);
+		newRequest = 0;
+	}
+	returnValue = -1;
+OnSuccess:
+	return returnValue;
+}
+
+/*
+ *  0 - if request is submitted, the handler is always called
+ * -1 - in case of error submitting request, the handler is not called
+ */
+int clusterMapForward(clusterMap_t clusterMap, void* context, clusterMapForwardHandler_t handler,
+		char* server, dataStream_t request, int multiLine) {
+	clusterMapImpl_t* pCM         = CLUSTER_MAP(clusterMap);
+	request_t*        newRequest  = 0;
+	externalServer_t* pEServer    = 0;
+	int               returnValue = 0;
+
+	IfTrue(pCM && handler && server && request, ERR, "Null argument found");
+	newRequest = createForwardRequest(request, multiLine, context, handler);
+	IfTrue(newRequest, ERR, "Error allocting memory for new request");
+	pEServer = clusterMapGetServer(pCM, server);
+	IfTrue(pEServer, ERR, "Error creating server entry for server %s", server);
+	newRequest->pServer = pEServer;
+	IfTrue(0 == clusterMapTrack(pCM, newRequest), DEBUG, "Too many requests in flight");
 	externalServerSubmit(pEServer, newRequest);
 	goto OnSuccess;
 OnError:
@@ -3,6 +3,7 @@
 
 #include "../common/common.h"
 #include "../datastream/datastream.h"
+#include "nearcache.h"
 
 /* This is the primary interface to access the cluster wide map
  * of key value pairs. It is actually the visible part of the
@@ -30,9 +31,95 @@ typedef void* clusterMap_t;
 typedef void (*clusterMapResultHandler_t)(void* luaContext, void* keyContext,
 		                           int status, dataStream_t data);
 
+/* Called with the complete raw response of a forwarded request.
+ * response is readOnly and only valid during the call.
+ */
+typedef void (*clusterMapForwardHandler_t)(void* context, int status, dataStream_t response);
+
 clusterMap_t       clusterMapCreate(clusterMapResultHandler_t resultHandler);
 
+/* Gets for the same server made in one event loop iteration are sent
+ * together as multi-gets of up to 16 keys. Every connection keeps up
+ * to 16 such batches in flight, new connections are opened only when
+ * all of them are full. resultHandler is never called from inside
+ * clusterMapGet.
+ */
 int                clusterMapGet(clusterMap_t clusterMap,
 					   void* luaContext, void* keyContext, char* server, char* key);
 
+/* Sends request as it is to the server. Forwarded requests share the
+ * connections and the pipeline of clusterMapGet, the responses are
+ * matched by order. multiLine is set for get/gets requests, see
+ * responseParserForward. The clusterMap keeps a reference to request.
+ */
+int                clusterMapForward(clusterMap_t clusterMap, void* context,
+		               clusterMapForwardHandler_t handler, char* server,
+		               dataStream_t request, int multiLine);
+
+/* Keeps the values got by clusterMapGet for ttlMillis, see nearcache.h.
+ * Disabled by default, a ttl of 0 disables it again.
+ */
+#define CLUSTER_MAP_NEAR_CACHE_BYTES   (16 * 1024 * 1024)
+
+int                clusterMapSetNearCache(clusterMap_t clusterMap, u_int32_t ttlMillis);
+/* drops the nearCache copy after a write to the server */
+void               clusterMapInvalidate(clusterMap_t clusterMap, char* server, char* key);
+/* -1 if the nearCache is not enabled */
+int                clusterMapGetNearCacheStats(clusterMap_t clusterMap, nearCacheStats_t* pStats);
+/* Keeps a value pushed by the server owning it, see hotpush.h. Returns
+ * the hits of the copy replaced, -1 if the nearCache is not enabled.
+ */
+int                clusterMapPushToNearCache(clusterMap_t clusterMap, char* server, char* key,
+		               dataStream_t value);
+
+/* Health checks: every intervalMillis a version is sent to each server
+ * the clusterMap knows about. A server which doesn't answer within
+ * timeoutMillis, or has 3 connection errors in a row, is marked not
+ * available in every ring (consistentSetServerAvailableInAll) and its
+ * requests fail without being sent till a probe is answered again.
+ * An interval of 0 disables the checks, the default.
+ */
+typedef struct {
+	u_int64_t probes;
+	u_int64_t probeFailures;
+	u_int64_t fastFails;       //requests failed without being sent
+	u_int32_t servers;
+	u_int32_t serversDown;
+	u_int32_t intervalMillis;
+	u_int32_t timeoutMillis;
+} clusterMapHealthStats_t;
+
+int                clusterMapSetHealthCheck(clusterMap_t clusterMap, u_int32_t intervalMillis,
+		               u_int32_t timeoutMillis);
+/* -1 if health checks are not enabled */
+int                clusterMapGetHealthStats(clusterMap_t clusterMap, clusterMapHealthStats_t* pStats);
+
+/* Deadlines and backpressure: a get or forwarded request not answered
+ * in deadlineMillis fails, the handler is called with status -1 and a
+ * late answer is dropped. Multi-gets resume with nil for the keys which
+ * timed out. With more than maxInFlight requests waiting for an answer
+ * clusterMapGet and clusterMapForward return -1 right away. 0 disables
+ * either limit, the default. Health probes are not counted.
+ */
+typedef struct {
+	u_int32_t inFlight;
+	u_int32_t maxInFlight;
+	u_int32_t deadlineMillis;
+	u_int64_t timeouts;
+	u_int64_t rejected;        //over maxInFlight
+} clusterMapRequestStats_t;
+
+int                clusterMapSetLimits(clusterMap_t clusterMap, u_int32_t deadlineMillis,
+		               u_int32_t maxInFlight);
+void               clusterMapGetRequestStats(clusterMap_t clusterMap, clusterMapRequestStats_t* pStats);
+
+/* Calls visitor for every server the clusterMap has sent requests to,
+ * with its open connections and the requests waiting for one.
+ */
+typedef void (*clusterMapServerVisitor_t)(void* context, const char* server, int available,
+		               u_int32_t connections, u_int32_t queued);
+
+void               clusterMapVisitServers(clusterMap_t clusterMap, clusterMapServerVisitor_t visitor,
+		               void* context);
+
 #endif /* CLUSTER_CLUSTERMAP_H_ */
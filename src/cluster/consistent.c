@@ -12,22 +12,54 @@ typedef struct point_t {
 typedef struct server_t {
 	int       available;
 	char*     serverName;
+	u_int64_t seed;
 } server_t;
 
+/* The ring which is searched has only the points of the available
+ * servers, split in two arrays so that the search touches only the
+ * hashes. Unavailable servers are skipped by rebuilding the ring when
+ * availability changes instead of walking it on every lookup.
+ */
 typedef struct consistentImpl_t {
+	struct consistentImpl_t* pNext;
+	struct consistentImpl_t* pPrev;
+	int            mode;
 	u_int32_t      spread;
 	u_int32_t      serverCount;
+	u_int32_t      availableCount;
     server_t*      servers;
     point_t*       points;
     int            pointsCount;
+    u_int32_t*     ringHashes;
+    u_int32_t*     ringServers;
+    u_int32_t      ringCount;
 } consistentImpl_t;
 
 #define CONSISTENT(x) (consistentImpl_t*)(x)
 
+//every ring which exists, for consistentSetServerAvailableInAll
+static consistentImpl_t* allRings = 0;
+
+static const char* modeNames[] = { "ketama", "jump", "rendezvous" };
+
 static u_int32_t hashcode( consistentImpl_t* pC, const char* key, u_int32_t keyLength) {
 	return hash((u_int32_t*)key, (size_t)(keyLength), 0xFEEDDEED);
 }
 
+static u_int64_t hashcode64(const char* key, u_int32_t keyLength) {
+	return (((u_int64_t)hash(key, keyLength, 0xFEEDDEED)) << 32) | hash(key, keyLength, 0x9E3779B9);
+}
+
+/* murmur3 finalizer */
+static inline u_int64_t mix64(u_int64_t k) {
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
 static int pointsCompare(const void* aa, const void* bb) {
 	point_t* a = (point_t*)aa;
 	point_t* b = (point_t*)bb;
@@ -36,6 +68,20 @@ static int pointsCompare(const void* aa, const void* bb) {
 
 #define MAX_SERVER_NAME_SIZE 32
 
+static void buildRing(consistentImpl_t* pC) {
+	u_int32_t count = 0;
+
+	for (int i = 0; i < pC->pointsCount; i++) {
+		u_int32_t serverIndex = pC->points[i].serverIndex;
+		if (pC->servers[serverIndex].available) {
+			pC->ringHashes[count]  = pC->points[i].hashPoint;
+			pC->ringServers[count] = serverIndex;
+			count++;
+		}
+	}
+	pC->ringCount = count;
+}
+
 static int calculatePoints(consistentImpl_t* pC) {
 	char key[MAX_SERVER_NAME_SIZE];
 	int length       = 0, returnValue = 0;
@@ -50,6 +96,11 @@ static int calculatePoints(consistentImpl_t* pC) {
 		pC->points = calloc(requiredSize, sizeof(point_t));
 		IfTrue(pC->points, ERR, "Error allocating memory for points");
 		pC->pointsCount = requiredSize;
+		free(pC->ringHashes);
+		free(pC->ringServers);
+		pC->ringHashes  = calloc(requiredSize, sizeof(u_int32_t));
+		pC->ringServers = calloc(requiredSize, sizeof(u_int32_t));
+		IfTrue(pC->ringHashes && pC->ringServers, ERR, "Error allocating memory for ring");
 	}
 
 	for (int i = 0; i < pC->serverCount; i++) {
@@ -62,6 +113,7 @@ static int calculatePoints(consistentImpl_t* pC) {
 		}
 	}
 	qsort(pC->points, pC->pointsCount, sizeof(point_t), pointsCompare);
+	buildRing(pC);
 
 	goto OnSuccess;
 OnError:
@@ -106,7 +158,7 @@ static int parseAndSetServerNames(consistentImpl_t* pC, char* serverNames) {
     serverNamesCopy = strdup(serverNames);
     IfTrue(serverNamesCopy, ERR,  "Error copying server names");
 
-    array = calloc(size, sizeof(char*));
+    array = calloc(size, sizeof(server_t));
     IfTrue(array, ERR,  "Error allocating memory");
 
     token = strtok(serverNamesCopy, DELIM);
@@ -115,6 +167,7 @@ static int parseAndSetServerNames(consistentImpl_t* pC, char* serverNames) {
     	array[count].serverName = strdup(token);
     	IfTrue(array[count].serverName, ERR,  "Error allocating memory");
     	array[count].available = 1;
+    	array[count].seed      = mix64(hashcode64(token, strlen(token)));
     	count++;
     	if (count == size) {
     		server_t* newArray = realloc(array, sizeof(server_t) * size * 2);
@@ -125,8 +178,9 @@ static int parseAndSetServerNames(consistentImpl_t* pC, char* serverNames) {
     	token = strtok(NULL, DELIM);
     }
     freeServers(pC);
-    pC->servers     = array;
-    pC->serverCount = count;
+    pC->servers        = array;
+    pC->serverCount    = count;
+    pC->availableCount = count;
     goto OnSuccess;
 OnError:
 	if (array) {
@@ -155,16 +209,25 @@ OnSuccess:
  * Bigger todo is to have some way to specify weightage
  * with the servers.
  */
-consistent_t consistentCreate(char* serverNames) {
+consistent_t consistentCreateWithMode(char* serverNames, int mode) {
 	consistentImpl_t* pC = ALLOCATE_1(consistentImpl_t);
 
 	IfTrue(pC, ERR, "Error allocating memory");
+	IfTrue((mode >= CONSISTENT_MODE_KETAMA) && (mode <= CONSISTENT_MODE_RENDEZVOUS),
+			ERR, "Invalid mode %d", mode);
 
+	pC->mode      = mode;
 	pC->spread    = SPREAD;
 
 	IfTrue( 0 == parseAndSetServerNames(pC, serverNames), ERR, "Error setting server names");
-	IfTrue( 0 == calculatePoints(pC), ERR, "Error calculating points");
-
+	if (mode == CONSISTENT_MODE_KETAMA) {
+		IfTrue( 0 == calculatePoints(pC), ERR, "Error calculating points");
+	}
+	pC->pNext = allRings;
+	if (allRings) {
+		allRings->pPrev = pC;
+	}
+	allRings = pC;
 	goto OnSuccess;
 OnError:
 	consistentDelete(pC);
@@ -173,81 +236,146 @@ OnSuccess:
     return pC;
 }
 
+consistent_t consistentCreate(char* serverNames) {
+	return consistentCreateWithMode(serverNames, CONSISTENT_MODE_KETAMA);
+}
+
+int consistentModeFromName(const char* modeName) {
+	for (int i = 0; i < sizeof(modeNames) / sizeof(modeNames[0]); i++) {
+		if (0 == strcmp(modeName, modeNames[i])) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+const char* consistentGetModeName(consistent_t consistent) {
+	consistentImpl_t* pC = CONSISTENT(consistent);
+	return modeNames[pC->mode];
+}
+
 void  consistentDelete(consistent_t consistent) {
 	consistentImpl_t* pC = CONSISTENT(consistent);
 	if (pC) {
+		if (pC->pPrev) {
+			pC->pPrev->pNext = pC->pNext;
+		}else if (allRings == pC) {
+			allRings = pC->pNext;
+		}
+		if (pC->pNext) {
+			pC->pNext->pPrev = pC->pPrev;
+		}
 		freeServers(pC);
 		if (pC->points) {
 			free(pC->points);
 			pC->points = 0;
 		}
+		free(pC->ringHashes);
+		free(pC->ringServers);
 		free(pC);
 	}
 }
 
+/* Index of the first hash which is >= value, count if there is none.
+ * The loop has a fixed number of iterations for a given count and the
+ * comparison compiles to a conditional move, so there are no branch
+ * mispredictions on the random key hashes.
+ */
+static inline u_int32_t ringLowerBound(const u_int32_t* hashes, u_int32_t count, u_int32_t value) {
+	const u_int32_t* base = hashes;
+	u_int32_t        n    = count;
+
+	while (n > 1) {
+		u_int32_t half = n >> 1;
+		__builtin_prefetch(base + (half >> 1));
+		__builtin_prefetch(base + half + (half >> 1));
+		base = (base[half] < value) ? base + half : base;
+		n   -= half;
+	}
+	return (base - hashes) + (*base < value);
+}
 
-const char* consistentFindServer(consistent_t consistent, char* key) {
-	consistentImpl_t* pC = CONSISTENT(consistent);
-	u_int32_t hashValue  = hashcode(pC, key, strlen(key));
-
-	int highp = pC->pointsCount, lowp  = 0, midp = 0;
-	u_int32_t midval, midval1;
-	char* server      = 0;
-	int   finalIndex  = 0;
-
-	// divide and conquer array search to find server with next biggest
-	// point after what this key hashes to
-	while (1) {
-		midp = (int)( ( lowp+highp ) / 2 );
-		if (midp == pC->pointsCount) {
-			// if at the end, roll back to zeroth
-			server = pC->servers[pC->points[0].serverIndex].serverName;
-			finalIndex = 0;
-			break;
-		}
-
-		midval = pC->points[midp].hashPoint;
-		midval1 = midp == 0 ? 0 : pC->points[midp-1].hashPoint;
+static const char* findKetama(consistentImpl_t* pC, char* key, u_int32_t keyLength) {
+	u_int32_t index = 0;
 
-		if (hashValue <= midval && hashValue > midval1) {
-			server = pC->servers[pC->points[midp].serverIndex].serverName;
-			finalIndex = midp;
-			break;
-		}
+	if (pC->ringCount == 0) {
+		return 0;
+	}
+	index = ringLowerBound(pC->ringHashes, pC->ringCount, hashcode(pC, key, keyLength));
+	if (index == pC->ringCount) {
+		// past the last point, roll back to zeroth
+		index = 0;
+	}
+	return pC->servers[pC->ringServers[index]].serverName;
+}
 
-		if (midval < hashValue) {
-			lowp = midp + 1;
-		}else {
-			highp = midp - 1;
-		}
+/* Lamping and Veach, "A Fast, Minimal Memory, Consistent Hash Algorithm" */
+static inline int32_t jumpConsistentHash(u_int64_t key, int32_t buckets) {
+	int64_t b = -1, j = 0;
 
-		if (lowp > highp) {
-			server = pC->servers[pC->points[0].serverIndex].serverName;
-			finalIndex = 0;
-			break;
-		}
+	while (j < buckets) {
+		b   = j;
+		key = key * 2862933555777941757ULL + 1;
+		j   = (b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1));
 	}
+	return (int32_t)b;
+}
+
+/* An unavailable bucket is retried with a rehashed key, so its keys are
+ * spread over the remaining servers instead of all moving to one.
+ */
+static const char* findJump(consistentImpl_t* pC, char* key, u_int32_t keyLength) {
+	u_int64_t keyHash = hashcode64(key, keyLength);
+	int32_t   bucket  = 0;
 
-	//we found the server check if it is available
-	if (pC->servers[finalIndex].available) {
-		return server;
+	if (pC->availableCount == 0) {
+		return 0;
 	}
-	// the current server is not available..find the next available
-	// and return that one
-	int next = finalIndex + 1;
-	while (next != finalIndex) {
-		if (next < pC->pointsCount) {
-			if (pC->servers[pC->points[next].serverIndex].available) {
-				return pC->servers[pC->points[next].serverIndex].serverName;
-			}
-			next++;
-		}else {
-			next = 0;
+	for (int attempt = 0; attempt < pC->serverCount; attempt++) {
+		bucket = jumpConsistentHash(keyHash, pC->serverCount);
+		if (pC->servers[bucket].available) {
+			return pC->servers[bucket].serverName;
+		}
+		keyHash = mix64(keyHash + attempt + 1);
+	}
+	for (int i = 1; i < pC->serverCount; i++) {
+		int32_t next = (bucket + i) % pC->serverCount;
+		if (pC->servers[next].available) {
+			return pC->servers[next].serverName;
 		}
 	}
 	return 0;
 }
 
+static const char* findRendezvous(consistentImpl_t* pC, char* key, u_int32_t keyLength) {
+	u_int64_t keyHash   = hashcode64(key, keyLength);
+	u_int64_t bestScore = 0;
+	int       best      = -1;
+
+	for (int i = 0; i < pC->serverCount; i++) {
+		u_int64_t score = mix64(keyHash ^ pC->servers[i].seed);
+		if (pC->servers[i].available && ((best < 0) || (score > bestScore))) {
+			bestScore = score;
+			best      = i;
+		}
+	}
+	return (best < 0) ? 0 : pC->servers[best].serverName;
+}
+
+const char* consistentFindServer(consistent_t consistent, char* key) {
+	consistentImpl_t* pC        = CONSISTENT(consistent);
+	u_int32_t         keyLength = strlen(key);
+
+	switch (pC->mode) {
+	case CONSISTENT_MODE_JUMP:
+		return findJump(pC, key, keyLength);
+	case CONSISTENT_MODE_RENDEZVOUS:
+		return findRendezvous(pC, key, keyLength);
+	default:
+		return findKetama(pC, key, keyLength);
+	}
+}
+
 int consistentGetServerCount(consistent_t consistent) {
 	consistentImpl_t* pC = CONSISTENT(consistent);
 	if (pC) {
@@ -271,8 +399,15 @@ static int consistentGetServerIndex(consistent_t consistent, char* serverName) {
 int consistentSetServerAvailable(consistent_t consistent, char* serverName, int available) {
 	consistentImpl_t* pC = CONSISTENT(consistent);
 	int index = consistentGetServerIndex(consistent, serverName);
-	if (pC && (index <= pC->serverCount) && (index >= 0)) {
-		pC->servers[index].available = available;
+	if (pC && (index < pC->serverCount) && (index >= 0)) {
+		available = available ? 1 : 0;
+		if (pC->servers[index].available != available) {
+			pC->servers[index].available = available;
+			pC->availableCount += available ? 1 : -1;
+			if (pC->mode == CONSISTENT_MODE_KETAMA) {
+				buildRing(pC);
+			}
+		}
 		return 0;
 	}
 	return -1;
@@ -281,8 +416,14 @@ int consistentSetServerAvailable(consistent_t consistent, char* serverName, int
 int consistentIsServerAvailable(consistent_t consistent, char* serverName) {
 	consistentImpl_t* pC = CONSISTENT(consistent);
 	int index = consistentGetServerIndex(consistent, serverName);
-	if (pC && (index <= pC->serverCount) && (index >= 0)) {
+	if (pC && (index < pC->serverCount) && (index >= 0)) {
 		return pC->servers[index].available;
 	}
 	return 0;
 }
+
+void consistentSetServerAvailableInAll(char* serverName, int available) {
+	for (consistentImpl_t* pC = allRings; pC; pC = pC->pNext) {
+		consistentSetServerAvailable(pC, serverName, available);
+	}
+}
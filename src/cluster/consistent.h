@@ -16,15 +16,37 @@ typedef void* consistent_t;
  * As cacheismo is single threaded, cacheismo cluster
  * will many times exist on a single machine also. Don't
  * see much point in optimizing this path.
+ *
+ * Three ways of mapping keys to servers are supported
+ *  ketama     - ring of 160 points per server, O(log n) lookup.
+ *  jump       - jump consistent hash, O(log n) and no memory, but
+ *               servers can only be added or removed at the end of
+ *               the list. The order of the list matters.
+ *  rendezvous - highest random weight, O(n) lookup, moves the least
+ *               keys when any server is removed.
+ * Every server in the cluster must use the same list and mode.
  */
 
+enum consistentMode_t {
+	CONSISTENT_MODE_KETAMA = 0,
+	CONSISTENT_MODE_JUMP,
+	CONSISTENT_MODE_RENDEZVOUS
+};
+
 /* comma or while space separated ip:port */
 consistent_t consistentCreate(char* serverNames);
+consistent_t consistentCreateWithMode(char* serverNames, int mode);
+/* -1 if the name is not one of ketama, jump or rendezvous */
+int          consistentModeFromName(const char* modeName);
+const char*  consistentGetModeName(consistent_t consistent);
 int          consistentGetServerCount(consistent_t consistent);
 
 /* If server is marked unavailable, next server will be returned when lookup is done */
 /* 0 if not available 1 if available */
 int          consistentSetServerAvailable(consistent_t consistent, char* serverName, int available);
+/* Marks the server in every ring which has it, the scripts' rings and
+ * the proxy ring. Used by the clusterMap health checks. */
+void         consistentSetServerAvailableInAll(char* serverName, int available);
 /* 1 if available 0 if not */
 int          consistentIsServerAvailable(consistent_t consistent, char* serverName);
 void         consistentDelete(consistent_t consistent);
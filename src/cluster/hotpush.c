@@ -0,0 +1,449 @@
+#include "hotpush.h"
+#include "clustermap.h"
+#include "../cacheitem/cacheitem.h"
+#include "../cacheismo.h"
+#include <time.h>
+
+#define HOTPUSH_MAX_HEADER   (HOTPUSH_MAX_KEY + 128)
+
+typedef struct {
+	char       key[HOTPUSH_MAX_KEY + 1];
+	u_int32_t  keyLength;
+	u_int32_t  count;          //sampled hits in this second
+} candidate_t;
+
+/* item is 0 after a delete till the flush, which sends the neardelete */
+typedef struct {
+	char        key[HOTPUSH_MAX_KEY + 1];
+	u_int32_t   keyLength;
+	cacheItem_t item;
+	int         dirty;         //to be sent by the next flush
+	int         checked;       //the first check is skipped
+	u_int32_t   samples;       //sampled hits since the last check
+	u_int64_t   peerHits;      //reported since the last check
+	u_int64_t   checkedAt;     //millis
+	u_int64_t   pushedAt;
+} hotKey_t;
+
+typedef struct {
+	hashMap_t      hashMap;
+	char*          self;
+	u_int32_t      pushMillis;
+	char**         peers;
+	u_int32_t      peerCount;
+	fallocator_t   fallocator;     //for the request lines
+	u_int32_t      lookups;
+	u_int64_t      windowStart;
+	u_int32_t      candidateCount;
+	candidate_t    candidates[HOTPUSH_CANDIDATES];
+	u_int32_t      hotCount;
+	hotKey_t       hot[HOTPUSH_MAX_KEYS];
+	int            flushScheduled;
+	struct event*  timer;
+	hotPushStats_t stats;
+} hotPushImpl_t;
+
+/* answers to a nearset are matched to the key by name, it may not be
+ * hot any more */
+typedef struct {
+	hotPushImpl_t* pHP;
+	char           key[HOTPUSH_MAX_KEY + 1];
+} pushContext_t;
+
+#define HOT_PUSH(x) ((hotPushImpl_t*)(x))
+
+static u_int64_t currentTimeInMillis(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((u_int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static hotKey_t* findHotKey(hotPushImpl_t* pHP, char* key, u_int32_t keyLength) {
+	for (u_int32_t i = 0; i < pHP->hotCount; i++) {
+		hotKey_t* pKey = &pHP->hot[i];
+		if ((pKey->keyLength == keyLength) && (0 == memcmp(pKey->key, key, keyLength))) {
+			return pKey;
+		}
+	}
+	return 0;
+}
+
+static void removeHotKey(hotPushImpl_t* pHP, hotKey_t* pKey) {
+	if (pKey->item) {
+		cacheItemDelete(getGlobalChunkpool(), pKey->item);
+	}
+	pHP->hotCount--;
+	*pKey = pHP->hot[pHP->hotCount];
+}
+
+static int appendString(hotPushImpl_t* pHP, dataStream_t request, char* value, u_int32_t length) {
+	char* buffer = dataStreamBufferAllocate(NULL, pHP->fallocator, length);
+	int   err    = 0;
+
+	if (!buffer) {
+		return -1;
+	}
+	memcpy(buffer, value, length);
+	err = dataStreamAppendData(request, buffer, 0, length);
+	dataStreamBufferFree(buffer);
+	return err;
+}
+
+static void pushHandler(void* context, int status, dataStream_t response) {
+	pushContext_t* pContext = context;
+	hotPushImpl_t* pHP      = pContext->pHP;
+	hotKey_t*      pKey     = 0;
+	char*          line     = 0;
+	u_int64_t      hits     = 0;
+
+	if ((status == 0) && response) {
+		line = dataStreamToString(response);
+	}
+	if (line && (0 == strncmp(line, "NEARSET ", 8))) {
+		hits = strtoull(line + 8, 0, 10);
+		pHP->stats.peerHits += hits;
+		pKey = findHotKey(pHP, pContext->key, strlen(pContext->key));
+		if (pKey) {
+			pKey->peerHits += hits;
+		}
+	}else {
+		pHP->stats.failures++;
+	}
+	if (line) {
+		FREE(line);
+	}
+	FREE(pContext);
+}
+
+static void invalidateHandler(void* context, int status, dataStream_t response) {
+	hotPushImpl_t* pHP = context;
+
+	if (status != 0) {
+		pHP->stats.failures++;
+	}
+}
+
+/* The data of the item is not copied, the requests share its buffers */
+static void pushHotKey(hotPushImpl_t* pHP, hotKey_t* pKey) {
+	dataStream_t   request  = 0;
+	pushContext_t* pContext = 0;
+	char           header[HOTPUSH_MAX_HEADER];
+	int            length   = 0;
+
+	if (pKey->item) {
+		length = snprintf(header, sizeof(header), "nearset %s %s %u\r\n", pHP->self, pKey->key,
+				cacheItemGetDataLength(pKey->item));
+	}else {
+		length = snprintf(header, sizeof(header), "neardelete %s %s\r\n", pHP->self, pKey->key);
+	}
+	IfTrue((length > 0) && (length < sizeof(header)), WARN, "Key too long for near cache push");
+	request = dataStreamCreate();
+	IfTrue(request, WARN, "Error allocating memory");
+	IfTrue(0 == appendString(pHP, request, header, length), WARN, "Error copying request");
+	if (pKey->item) {
+		IfTrue(0 == dataStreamAppendDataStream(request, cacheItemGetDataStream(pKey->item)),
+				WARN, "Error appending data");
+		IfTrue(0 == appendString(pHP, request, "\r\n", 2), WARN, "Error copying request");
+	}
+
+	for (u_int32_t i = 0; i < pHP->peerCount; i++) {
+		if (!pKey->item) {
+			pHP->stats.invalidations++;
+			if (0 != clusterMapForward(getGlobalClusterMap(), pHP, invalidateHandler,
+					pHP->peers[i], request, 0)) {
+				pHP->stats.failures++;
+			}
+			continue;
+		}
+		pContext = ALLOCATE_1(pushContext_t);
+		if (!pContext) {
+			pHP->stats.failures++;
+			continue;
+		}
+		pContext->pHP = pHP;
+		memcpy(pContext->key, pKey->key, pKey->keyLength + 1);
+		pHP->stats.pushes++;
+		if (0 != clusterMapForward(getGlobalClusterMap(), pContext, pushHandler,
+				pHP->peers[i], request, 0)) {
+			pHP->stats.failures++;
+			FREE(pContext);
+		}
+	}
+OnError:
+	//clusterMap keeps its own reference
+	if (request) {
+		dataStreamDelete(request);
+	}
+}
+
+/* Sends the changed keys. The deleted ones are not hot any more. */
+static void hotPushFlush(hotPushImpl_t* pHP) {
+	u_int64_t now = currentTimeInMillis();
+	u_int32_t i   = 0;
+
+	pHP->flushScheduled = 0;
+	while (i < pHP->hotCount) {
+		hotKey_t* pKey = &pHP->hot[i];
+		if (!pKey->dirty) {
+			i++;
+			continue;
+		}
+		pushHotKey(pHP, pKey);
+		if (!pKey->item) {
+			removeHotKey(pHP, pKey);
+			continue;
+		}
+		pKey->dirty    = 0;
+		pKey->pushedAt = now;
+		i++;
+	}
+	pHP->stats.hotKeys = pHP->hotCount;
+}
+
+static void hotPushFlushCallback(int fd, short which, void* arg) {
+	hotPushFlush(arg);
+}
+
+/* Changes made in one event loop iteration go out together */
+static void hotPushScheduleFlush(hotPushImpl_t* pHP) {
+	struct timeval now = {0, 0};
+
+	if (pHP->flushScheduled) {
+		return;
+	}
+	if (0 == event_base_once(getGlobalEventBase(), -1, EV_TIMEOUT,
+			hotPushFlushCallback, pHP, &now)) {
+		pHP->flushScheduled = 1;
+	}else {
+		LOG(ERR, "Error scheduling near cache push");
+	}
+}
+
+static void addHotKey(hotPushImpl_t* pHP, candidate_t* pCandidate, cacheItem_t item) {
+	hotKey_t* pKey = 0;
+
+	if ((pHP->hotCount == HOTPUSH_MAX_KEYS) ||
+			(cacheItemGetDataLength(item) > HOTPUSH_MAX_VALUE)) {
+		return;
+	}
+	pKey = &pHP->hot[pHP->hotCount++];
+	memset(pKey, 0, sizeof(hotKey_t));
+	memcpy(pKey->key, pCandidate->key, pCandidate->keyLength + 1);
+	pKey->keyLength = pCandidate->keyLength;
+	pKey->item      = item;
+	pKey->dirty     = 1;
+	pKey->checkedAt = currentTimeInMillis();
+	cacheItemAddReference(item);
+	hotPushScheduleFlush(pHP);
+}
+
+/* Only hits are counted, a key which is not here can't be pushed */
+static void hotPushLookupListener(void* context, char* key, u_int32_t keyLength, void* value) {
+	hotPushImpl_t* pHP       = HOT_PUSH(context);
+	hotKey_t*      pKey      = 0;
+	candidate_t*   pCand     = 0;
+	u_int32_t      minIndex  = 0;
+	u_int32_t      threshold = HOTPUSH_HOT_GETS_PER_SEC / HOTPUSH_SAMPLE_RATE;
+
+	if (!value || (++pHP->lookups & (HOTPUSH_SAMPLE_RATE - 1)) ||
+			(keyLength == 0) || (keyLength > HOTPUSH_MAX_KEY)) {
+		return;
+	}
+	pKey = findHotKey(pHP, key, keyLength);
+	if (pKey) {
+		pKey->samples++;
+		return;
+	}
+	for (u_int32_t i = 0; i < pHP->candidateCount; i++) {
+		if ((pHP->candidates[i].keyLength == keyLength) &&
+				(0 == memcmp(pHP->candidates[i].key, key, keyLength))) {
+			pCand = &pHP->candidates[i];
+			break;
+		}
+		if (pHP->candidates[i].count < pHP->candidates[minIndex].count) {
+			minIndex = i;
+		}
+	}
+	if (!pCand) {
+		if (pHP->candidateCount < HOTPUSH_CANDIDATES) {
+			minIndex = pHP->candidateCount++;
+			pHP->candidates[minIndex].count = 0;
+		}
+		pCand = &pHP->candidates[minIndex];
+		memcpy(pCand->key, key, keyLength);
+		pCand->key[keyLength] = 0;
+		pCand->keyLength      = keyLength;
+	}
+	if (++pCand->count >= threshold) {
+		addHotKey(pHP, pCand, value);
+	}
+}
+
+static void hotPushListener(void* context, int event, void* value) {
+	hotPushImpl_t* pHP  = HOT_PUSH(context);
+	hotKey_t*      pKey = 0;
+
+	if (pHP->hotCount == 0) {
+		return;
+	}
+	pKey = findHotKey(pHP, cacheItemGetKey(value), cacheItemGetKeyLength(value));
+	if (!pKey) {
+		return;
+	}
+	if (event == HASHMAP_EVENT_PUT) {
+		if (pKey->item) {
+			cacheItemDelete(getGlobalChunkpool(), pKey->item);
+		}
+		pKey->item = value;
+		cacheItemAddReference(value);
+	}else if (pKey->item == value) {
+		cacheItemDelete(getGlobalChunkpool(), pKey->item);
+		pKey->item = 0;
+	}else {
+		return;
+	}
+	pKey->dirty = 1;
+	hotPushScheduleFlush(pHP);
+}
+
+/* Starts a new sketch every second. Every ttl/2 a hot key is sent
+ * again if it was read often enough since the last check, here or on
+ * the peers, and dropped otherwise. The peers report the hits of a
+ * copy when it is replaced, so the first check after a key gets hot
+ * has none of them and is skipped.
+ */
+static void hotPushTimerCallback(int fd, short which, void* arg) {
+	hotPushImpl_t* pHP     = arg;
+	u_int64_t      now     = currentTimeInMillis();
+	u_int64_t      elapsed = 0;
+	u_int64_t      hits    = 0;
+	u_int32_t      i       = 0;
+
+	if ((now - pHP->windowStart) >= 1000) {
+		pHP->windowStart    = now;
+		pHP->candidateCount = 0;
+	}
+	while (i < pHP->hotCount) {
+		hotKey_t* pKey = &pHP->hot[i];
+		elapsed = now - pKey->checkedAt;
+		if (elapsed >= pHP->pushMillis) {
+			hits = ((u_int64_t)pKey->samples * HOTPUSH_SAMPLE_RATE) + pKey->peerHits;
+			if (pKey->checked && ((hits * 1000) < ((u_int64_t)HOTPUSH_HOT_GETS_PER_SEC * elapsed))) {
+				removeHotKey(pHP, pKey);
+				continue;
+			}
+			pKey->checked   = 1;
+			pKey->samples   = 0;
+			pKey->peerHits  = 0;
+			pKey->checkedAt = now;
+		}
+		if ((now - pKey->pushedAt) >= pHP->pushMillis) {
+			pKey->dirty = 1;
+		}
+		i++;
+	}
+	hotPushFlush(pHP);
+}
+
+hotPush_t hotPushCreate(hashMap_t hashMap, char* self, u_int32_t ttlMillis) {
+	hotPushImpl_t* pHP      = ALLOCATE_1(hotPushImpl_t);
+	u_int32_t      interval = 0;
+	struct timeval tv       = {0, 0};
+
+	IfTrue(pHP, ERR, "Error allocating memory");
+	IfTrue(hashMap && self && (ttlMillis > 0), ERR, "Invalid argument");
+	pHP->hashMap    = hashMap;
+	pHP->self       = strdup(self);
+	IfTrue(pHP->self, ERR, "Error allocating memory");
+	pHP->fallocator = fallocatorCreate();
+	IfTrue(pHP->fallocator, ERR, "Error creating fallocator");
+	pHP->pushMillis  = (ttlMillis > 1) ? (ttlMillis / 2) : 1;
+	pHP->windowStart = currentTimeInMillis();
+
+	IfTrue(0 == hashMapAddListener(hashMap, hotPushListener, pHP), ERR,
+			"Error adding hashMap listener");
+	IfTrue(0 == hashMapAddLookupListener(hashMap, hotPushLookupListener, pHP), ERR,
+			"Error adding hashMap lookup listener");
+	interval   = (pHP->pushMillis < 1000) ? pHP->pushMillis : 1000;
+	tv.tv_sec  = interval / 1000;
+	tv.tv_usec = (interval % 1000) * 1000;
+	pHP->timer = event_new(getGlobalEventBase(), -1, EV_PERSIST, hotPushTimerCallback, pHP);
+	IfTrue(pHP->timer, ERR, "Error creating near cache push timer");
+	event_add(pHP->timer, &tv);
+	goto OnSuccess;
+OnError:
+	if (pHP) {
+		hashMapRemoveListener(hashMap, hotPushListener, pHP);
+		if (pHP->fallocator) {
+			fallocatorDelete(pHP->fallocator);
+		}
+		if (pHP->self) {
+			FREE(pHP->self);
+		}
+		FREE(pHP);
+		pHP = 0;
+	}
+OnSuccess:
+	return pHP;
+}
+
+int hotPushSetPeers(hotPush_t hotPush, const char* servers) {
+	hotPushImpl_t* pHP    = HOT_PUSH(hotPush);
+	char*          copy   = 0;
+	char*          server = 0;
+	char*          save   = 0;
+	char**         peers  = 0;
+	u_int32_t      count  = 0;
+	u_int32_t      size   = 1;
+
+	IfTrue(pHP && servers, ERR, "Null argument");
+	for (const char* c = servers; *c; c++) {
+		if (*c == ',') {
+			size++;
+		}
+	}
+	copy  = strdup(servers);
+	IfTrue(copy, ERR, "Error allocating memory");
+	peers = ALLOCATE_N(size, char*);
+	IfTrue(peers, ERR, "Error allocating memory");
+	for (server = strtok_r(copy, ",", &save); server; server = strtok_r(0, ",", &save)) {
+		if (0 == strcmp(server, pHP->self)) {
+			continue;
+		}
+		peers[count] = strdup(server);
+		IfTrue(peers[count], ERR, "Error allocating memory");
+		count++;
+	}
+	FREE(copy);
+	for (u_int32_t i = 0; i < pHP->peerCount; i++) {
+		FREE(pHP->peers[i]);
+	}
+	if (pHP->peers) {
+		FREE(pHP->peers);
+	}
+	pHP->peers       = peers;
+	pHP->peerCount   = count;
+	pHP->stats.peers = count;
+	return 0;
+OnError:
+	if (peers) {
+		for (u_int32_t i = 0; i < count; i++) {
+			FREE(peers[i]);
+		}
+		FREE(peers);
+	}
+	if (copy) {
+		FREE(copy);
+	}
+	return -1;
+}
+
+void hotPushGetStats(hotPush_t hotPush, hotPushStats_t* pStats) {
+	hotPushImpl_t* pHP = HOT_PUSH(hotPush);
+
+	if (pHP) {
+		*pStats = pHP->stats;
+	}else {
+		memset(pStats, 0, sizeof(hotPushStats_t));
+	}
+}
@@ -0,0 +1,60 @@
+#ifndef CLUSTER_HOTPUSH_H_
+#define CLUSTER_HOTPUSH_H_
+
+#include "../common/common.h"
+#include "../hashmap/hashmap.h"
+
+/* Pushing hot keys from their owner to the near caches of the peers
+ *
+ * One in HOTPUSH_SAMPLE_RATE hits of the hashMap is counted in a space
+ * saving sketch of HOTPUSH_CANDIDATES keys (see keysampler.h) which
+ * starts over every second. A key read more than
+ * HOTPUSH_HOT_GETS_PER_SEC times in a second is hot, up to
+ * HOTPUSH_MAX_KEYS keys are hot at a time.
+ *
+ * The value of a hot key is sent to every peer as
+ *   nearset <self> <key> <bytes>\r\n<data>\r\n
+ * which keeps it in the near cache of the peer as if it was got from
+ * self, and sent again every ttlMillis/2 so that it never expires
+ * there. A put of a hot key is sent at once. A delete, expiry or
+ * eviction sends
+ *   neardelete <self> <key>\r\n
+ * and the key is not hot any more. A delete followed by a put in the
+ * same event loop iteration, as a set does it, is sent as the put.
+ *
+ * Peers reading the key from their near cache don't ask this server,
+ * so they answer a nearset with the hits of the copy it replaced,
+ * NEARSET <hits>. A key whose hits here and on the peers in the last
+ * ttlMillis/2 are below the threshold is not hot any more, it is not
+ * sent again and the copies on the peers expire.
+ *
+ * All the servers should run with the same near cache ttl (-n). The
+ * pushes share the pooled connections of the clusterMap, two of them
+ * are not ordered, a copy on a peer can be stale for up to the ttl as
+ * any other value in the near cache.
+ */
+
+#define HOTPUSH_SAMPLE_RATE        8          //power of two
+#define HOTPUSH_CANDIDATES         32
+#define HOTPUSH_MAX_KEYS           16
+#define HOTPUSH_HOT_GETS_PER_SEC   1000
+#define HOTPUSH_MAX_KEY            250
+#define HOTPUSH_MAX_VALUE          (1024 * 1024)
+
+typedef void* hotPush_t;
+
+typedef struct {
+	u_int32_t hotKeys;
+	u_int32_t peers;
+	u_int64_t pushes;          //nearset sent, one per peer
+	u_int64_t invalidations;   //neardelete sent, one per peer
+	u_int64_t failures;        //not sent or not answered
+	u_int64_t peerHits;        //reported by the peers
+} hotPushStats_t;
+
+hotPush_t hotPushCreate(hashMap_t hashMap, char* self, u_int32_t ttlMillis);
+/* comma separated ip:port, self is left out. 0 on success */
+int       hotPushSetPeers(hotPush_t hotPush, const char* servers);
+void      hotPushGetStats(hotPush_t hotPush, hotPushStats_t* pStats);
+
+#endif /* CLUSTER_HOTPUSH_H_ */
@@ -0,0 +1,423 @@
+#include <time.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "membership.h"
+#include "clustermap.h"
+#include "../common/list.h"
+#include "../common/map.h"
+#include "../datastream/datastream.h"
+#include "../fallocator/fallocator.h"
+#include "../cacheismo.h"
+
+#define MEMBERSHIP(x) ((membershipImpl_t*)(x))
+
+#define MEMBERSHIP_MAX_NAME        64
+//",ip:port=heartbeat" per member
+#define MEMBERSHIP_MAX_ENTRY       (MEMBERSHIP_MAX_NAME + 24)
+
+#define GOSSIP_REQUEST             "gossip "
+#define GOSSIP_RESPONSE            "GOSSIP "
+
+typedef struct member_t {
+	struct member_t* pNext;
+	struct member_t* pPrev;
+	char             name[MEMBERSHIP_MAX_NAME];
+	u_int64_t        heartbeat;
+	u_int64_t        updatedAt;   //millis, when the heartbeat last went up
+	int              alive;
+	int              seed;        //seeds are never forgotten
+} member_t;
+
+/* The clusterMap is only used for the gossip requests, with a deadline
+ * of one interval. current is the list last given to changed.
+ */
+typedef struct {
+	member_t*           self;
+	list_t              members;      //list of member_t, self first
+	map_t               byName;       //name -> member_t
+	clusterMap_t        clusterMap;
+	fallocator_t        fallocator;
+	struct event*       timer;
+	membershipChanged_t changed;
+	void*               context;
+	char*               current;
+	int                 dirty;        //alive set changed since it was reported
+	u_int64_t           changedAt;
+	u_int64_t           startedAt;
+	membershipStats_t   stats;
+} membershipImpl_t;
+
+static u_int64_t currentTimeInMillis(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((u_int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static u_int64_t wallClockInMillis(void) {
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return ((u_int64_t)tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+}
+
+static void setAlive(membershipImpl_t* pM, member_t* pMember, int alive, u_int64_t now) {
+	if (pMember->alive != alive) {
+		LOG(WARN, "Member %s is %s", pMember->name, alive ? "alive" : "dead");
+		pMember->alive = alive;
+		pM->stats.alive += alive ? 1 : -1;
+		pM->dirty      = 1;
+		pM->changedAt  = now;
+	}
+}
+
+static int isValidName(const char* name, int length) {
+	if ((length <= 0) || (length >= MEMBERSHIP_MAX_NAME)) {
+		return 0;
+	}
+	for (int i = 0; i < length; i++) {
+		if ((name[i] <= ' ') || (name[i] == ',') || (name[i] == '=')) {
+			return 0;
+		}
+	}
+	return (memchr(name, ':', length) != 0);
+}
+
+static member_t* memberAdd(membershipImpl_t* pM, const char* name, int length) {
+	member_t* pMember = 0;
+
+	if (!isValidName(name, length) || (listGetSize(pM->members) >= MEMBERSHIP_MAX_MEMBERS)) {
+		return 0;
+	}
+	pMember = ALLOCATE_1(member_t);
+	IfTrue(pMember, WARN, "Error allocating memory");
+	memcpy(pMember->name, name, length);
+	IfTrue(0 == mapPutElement(pM->byName, pMember->name, pMember), WARN, "Error adding member");
+	listAddLast(pM->members, pMember);
+	pM->stats.members++;
+	return pMember;
+OnError:
+	if (pMember) {
+		FREE(pMember);
+	}
+	return 0;
+}
+
+static void memberDelete(membershipImpl_t* pM, member_t* pMember) {
+	LOG(INFO, "Forgetting member %s", pMember->name);
+	listRemove(pM->members, pMember);
+	mapDeleteElement(pM->byName, pMember->name);
+	pM->stats.members--;
+	FREE(pMember);
+}
+
+/* ip:port=heartbeat,... from another server. A higher heartbeat is news
+ * about the member, the same or a lower one is old news.
+ */
+static void membershipMergeList(membershipImpl_t* pM, char* members) {
+	u_int64_t now   = currentTimeInMillis();
+	char*     entry = members;
+
+	while (entry && *entry) {
+		char*     end       = strchr(entry, ',');
+		int       length    = end ? (end - entry) : strlen(entry);
+		char*     separator = memchr(entry, '=', length);
+		member_t* pMember   = 0;
+		u_int64_t heartbeat = 0;
+		char      name[MEMBERSHIP_MAX_NAME];
+
+		if (separator && ((separator - entry) < MEMBERSHIP_MAX_NAME)) {
+			memcpy(name, entry, separator - entry);
+			name[separator - entry] = 0;
+			heartbeat = strtoull(separator + 1, 0, 10);
+			pMember   = mapGetElement(pM->byName, name);
+			if (!pMember && heartbeat) {
+				pMember = memberAdd(pM, name, separator - entry);
+			}
+		}
+		if (pMember == pM->self) {
+			//we were restarted with the clock behind
+			if (heartbeat > pMember->heartbeat) {
+				pMember->heartbeat = heartbeat;
+			}
+		}else if (pMember && (heartbeat > pMember->heartbeat)) {
+			pMember->heartbeat = heartbeat;
+			pMember->updatedAt = now;
+			setAlive(pM, pMember, 1, now);
+		}
+		entry = end ? (end + 1) : 0;
+	}
+}
+
+/* this server and the members alive, to be sent to others */
+static char* membershipDigest(membershipImpl_t* pM) {
+	member_t* pMember = 0;
+	char*     digest  = ALLOCATE_N(listGetSize(pM->members) * MEMBERSHIP_MAX_ENTRY + 1, char);
+	int       length  = 0;
+
+	if (digest) {
+		for (pMember = listGetFirst(pM->members); pMember;
+				pMember = listGetNext(pM->members, pMember)) {
+			if (pMember->alive) {
+				length += sprintf(digest + length, "%s%s=%llu", length ? "," : "", pMember->name,
+						(unsigned long long)pMember->heartbeat);
+			}
+		}
+	}
+	return digest;
+}
+
+static int compareNames(const void* a, const void* b) {
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/* the alive members, sorted */
+static char* membershipAliveList(membershipImpl_t* pM) {
+	member_t* pMember = 0;
+	char**    names   = ALLOCATE_N(listGetSize(pM->members), char*);
+	char*     list    = ALLOCATE_N(listGetSize(pM->members) * MEMBERSHIP_MAX_NAME + 1, char);
+	int       count   = 0;
+	int       length  = 0;
+
+	IfTrue(names && list, WARN, "Error allocating memory");
+	for (pMember = listGetFirst(pM->members); pMember;
+			pMember = listGetNext(pM->members, pMember)) {
+		if (pMember->alive) {
+			names[count++] = pMember->name;
+		}
+	}
+	qsort(names, count, sizeof(char*), compareNames);
+	for (int i = 0; i < count; i++) {
+		length += sprintf(list + length, "%s%s", i ? "," : "", names[i]);
+	}
+	goto OnSuccess;
+OnError:
+	if (list) {
+		FREE(list);
+		list = 0;
+	}
+OnSuccess:
+	if (names) {
+		FREE(names);
+	}
+	return list;
+}
+
+static void membershipResponseHandler(void* context, int status, dataStream_t response) {
+	membershipImpl_t* pM   = context;
+	char*             line = 0;
+
+	if ((status == 0) && response) {
+		line = dataStreamToString(response);
+	}
+	if (line && (0 == strncmp(line, GOSSIP_RESPONSE, strlen(GOSSIP_RESPONSE)))) {
+		line[strcspn(line, "\r\n")] = 0;
+		membershipMergeList(pM, line + strlen(GOSSIP_RESPONSE));
+	}else {
+		pM->stats.failed++;
+	}
+	if (line) {
+		FREE(line);
+	}
+}
+
+static void membershipSend(membershipImpl_t* pM, member_t* pMember) {
+	dataStream_t request = 0;
+	char*        digest  = 0;
+	char*        buffer  = 0;
+	int          length  = 0;
+
+	digest = membershipDigest(pM);
+	IfTrue(digest, WARN, "Error allocating memory");
+	length = strlen(GOSSIP_REQUEST) + strlen(digest) + 2;
+	buffer = dataStreamBufferAllocate(NULL, pM->fallocator, length + 1);
+	IfTrue(buffer, WARN, "Error allocating memory");
+	sprintf(buffer, "%s%s\r\n", GOSSIP_REQUEST, digest);
+
+	request = dataStreamCreate();
+	IfTrue(request, WARN, "Error allocating memory");
+	IfTrue(0 == dataStreamAppendData(request, buffer, 0, length), WARN, "Error creating request");
+	IfTrue(0 == clusterMapForward(pM->clusterMap, pM, membershipResponseHandler, pMember->name,
+			request, 0), INFO, "Error sending gossip to %s", pMember->name);
+	pM->stats.sent++;
+OnError:
+	if (request) {
+		dataStreamDelete(request);
+	}
+	if (buffer) {
+		dataStreamBufferFree(buffer);
+	}
+	if (digest) {
+		FREE(digest);
+	}
+}
+
+/* a random member other than this server, alive or not */
+static member_t* membershipPick(membershipImpl_t* pM, int alive) {
+	member_t* pMember = 0;
+	member_t* pPicked = 0;
+	int       seen    = 0;
+
+	//reservoir sampling, the list is short
+	for (pMember = listGetFirst(pM->members); pMember;
+			pMember = listGetNext(pM->members, pMember)) {
+		if ((pMember != pM->self) && (pMember->alive == alive) && ((random() % ++seen) == 0)) {
+			pPicked = pMember;
+		}
+	}
+	return pPicked;
+}
+
+static void membershipTimerCallback(int fd, short which, void* arg) {
+	membershipImpl_t* pM       = arg;
+	member_t*         pMember  = 0;
+	member_t*         pNext    = 0;
+	member_t*         pTarget  = 0;
+	u_int64_t         now      = currentTimeInMillis();
+	u_int64_t         interval = pM->stats.intervalMillis;
+	u_int64_t         wall     = wallClockInMillis();
+	char*             list     = 0;
+
+	pM->stats.rounds++;
+	pM->self->heartbeat = (wall > pM->self->heartbeat) ? wall : (pM->self->heartbeat + 1);
+	pM->self->updatedAt = now;
+
+	for (pMember = listGetFirst(pM->members); pMember; pMember = pNext) {
+		pNext = listGetNext(pM->members, pMember);
+		if (pMember == pM->self) {
+			continue;
+		}
+		if (pMember->alive && (now - pMember->updatedAt >= MEMBERSHIP_FAIL_ROUNDS * interval)) {
+			setAlive(pM, pMember, 0, now);
+		}else if (!pMember->alive && !pMember->seed &&
+				(now - pMember->updatedAt >= MEMBERSHIP_FORGET_ROUNDS * interval)) {
+			memberDelete(pM, pMember);
+		}
+	}
+
+	if (pM->dirty && (now - pM->changedAt >= MEMBERSHIP_SETTLE_ROUNDS * interval)) {
+		pM->dirty = 0;
+		list = membershipAliveList(pM);
+		if (list && (!pM->current || (0 != strcmp(list, pM->current)))) {
+			if (pM->current) {
+				FREE(pM->current);
+			}
+			pM->current             = list;
+			list                    = 0;
+			pM->stats.version++;
+			pM->stats.settledMillis = now - pM->startedAt;
+			LOG(WARN, "Members changed to [%s]", pM->current);
+			pM->changed(pM->context, pM->current);
+		}
+		if (list) {
+			FREE(list);
+		}
+	}
+
+	if (((pM->stats.rounds % MEMBERSHIP_SEED_ROUNDS) == 0) || (pM->stats.alive <= 1)) {
+		pTarget = membershipPick(pM, 0);
+	}
+	if (!pTarget) {
+		pTarget = membershipPick(pM, 1);
+	}
+	if (pTarget) {
+		membershipSend(pM, pTarget);
+	}
+}
+
+membership_t membershipCreate(char* self, char* seeds, u_int32_t intervalMillis,
+		membershipChanged_t changed, void* context) {
+	membershipImpl_t* pM       = ALLOCATE_1(membershipImpl_t);
+	member_t*         pMember  = 0;
+	char*             copy     = 0;
+	char*             seed     = 0;
+	char*             state    = 0;
+	struct timeval    interval = {intervalMillis / 1000, (intervalMillis % 1000) * 1000};
+
+	IfTrue(pM, ERR, "Error allocating memory");
+	IfTrue(self && seeds && changed && (intervalMillis > 0), ERR, "Null argument");
+	pM->members = listCreate(OFFSET(member_t, pNext), OFFSET(member_t, pPrev));
+	IfTrue(pM->members, ERR, "Error allocating memory");
+	pM->byName = mapCreate();
+	IfTrue(pM->byName, ERR, "Error allocating memory");
+	pM->self = memberAdd(pM, self, strlen(self));
+	IfTrue(pM->self, ERR, "Invalid name of this server [%s]", self);
+	pM->self->heartbeat = wallClockInMillis();
+	setAlive(pM, pM->self, 1, currentTimeInMillis());
+
+	copy = strdup(seeds);
+	IfTrue(copy, ERR, "Error allocating memory");
+	for (seed = strtok_r(copy, ", ", &state); seed; seed = strtok_r(0, ", ", &state)) {
+		pMember = mapGetElement(pM->byName, seed);
+		if (!pMember) {
+			pMember = memberAdd(pM, seed, strlen(seed));
+		}
+		IfTrue(pMember, ERR, "Invalid seed [%s]", seed);
+		pMember->seed = 1;
+	}
+	FREE(copy);
+	copy = 0;
+
+	pM->clusterMap = clusterMapCreate(0);
+	IfTrue(pM->clusterMap, ERR, "Error creating cluster map");
+	IfTrue(0 == clusterMapSetLimits(pM->clusterMap, intervalMillis, 0), ERR,
+			"Error setting gossip deadline");
+	pM->fallocator = fallocatorCreate();
+	IfTrue(pM->fallocator, ERR, "Error creating fallocator");
+	pM->timer = event_new(getGlobalEventBase(), -1, EV_PERSIST, membershipTimerCallback, pM);
+	IfTrue(pM->timer, ERR, "Error creating gossip timer");
+	pM->changed              = changed;
+	pM->context              = context;
+	pM->stats.intervalMillis = intervalMillis;
+	pM->startedAt            = currentTimeInMillis();
+	pM->changedAt            = pM->startedAt;
+	srandom(getpid() ^ pM->self->heartbeat);
+	event_add(pM->timer, &interval);
+	goto OnSuccess;
+OnError:
+	if (copy) {
+		FREE(copy);
+	}
+	//the clusterMap is not deleted, nothing was sent with it
+	if (pM) {
+		if (pM->members) {
+			while ((pMember = listGetFirst(pM->members)) != 0) {
+				memberDelete(pM, pMember);
+			}
+			listFree(pM->members);
+		}
+		if (pM->byName) {
+			mapDelete(pM->byName);
+		}
+		if (pM->fallocator) {
+			fallocatorDelete(pM->fallocator);
+		}
+		FREE(pM);
+		pM = 0;
+	}
+OnSuccess:
+	return pM;
+}
+
+char* membershipMerge(membership_t membership, char* members) {
+	membershipImpl_t* pM = MEMBERSHIP(membership);
+
+	if (!pM || !members) {
+		return 0;
+	}
+	pM->stats.received++;
+	membershipMergeList(pM, members);
+	return membershipDigest(pM);
+}
+
+const char* membershipGetMembers(membership_t membership) {
+	membershipImpl_t* pM = MEMBERSHIP(membership);
+	return pM ? pM->current : 0;
+}
+
+void membershipGetStats(membership_t membership, membershipStats_t* pStats) {
+	membershipImpl_t* pM = MEMBERSHIP(membership);
+
+	memset(pStats, 0, sizeof(membershipStats_t));
+	if (pM) {
+		*pStats = pM->stats;
+	}
+}
@@ -0,0 +1,63 @@
+#ifndef CLUSTER_MEMBERSHIP_H_
+#define CLUSTER_MEMBERSHIP_H_
+
+#include "../common/common.h"
+
+/* Cluster membership by gossip
+ *
+ * Every server is started with its own name (-x ip:port) and a few seed
+ * servers (-g ip:port,...). Every intervalMillis it raises its own
+ * heartbeat and sends the members it believes alive, with the highest
+ * heartbeat it has seen for each, to one random alive member
+ *   gossip ip:port=heartbeat,ip:port=heartbeat,...
+ * The other server merges the list into its own and answers with its
+ * own list in the same form, GOSSIP ip:port=heartbeat,..., which is
+ * merged in turn. Every few rounds, or when no member is alive, a seed
+ * or a dead member is asked instead, so partitions heal and restarted
+ * servers are found again.
+ *
+ * A member whose heartbeat did not go up for MEMBERSHIP_FAIL_ROUNDS
+ * intervals is dead, it is not sent to others any more and forgotten
+ * after MEMBERSHIP_FORGET_ROUNDS. The heartbeat starts from the wall
+ * clock, a restarted server is never mistaken for its old self.
+ *
+ * Once the set of alive members did not change for
+ * MEMBERSHIP_SETTLE_ROUNDS intervals, changed is called with the sorted
+ * comma separated list, the same on every server. Servers joining
+ * together end up in one ring change instead of one per server.
+ */
+
+#define MEMBERSHIP_FAIL_ROUNDS     5
+#define MEMBERSHIP_FORGET_ROUNDS   60
+#define MEMBERSHIP_SETTLE_ROUNDS   3
+#define MEMBERSHIP_SEED_ROUNDS     5
+#define MEMBERSHIP_MAX_MEMBERS     256
+
+typedef void* membership_t;
+
+typedef void (*membershipChanged_t)(void* context, char* members);
+
+typedef struct {
+	u_int32_t members;       //known, alive or dead
+	u_int32_t alive;         //including this server
+	u_int32_t version;       //changes reported
+	u_int32_t intervalMillis;
+	u_int64_t rounds;
+	u_int64_t sent;
+	u_int64_t failed;        //not answered
+	u_int64_t received;      //lists merged from requests
+	u_int64_t settledMillis; //since start, when the last change was reported
+} membershipStats_t;
+
+membership_t membershipCreate(char* self, char* seeds, u_int32_t intervalMillis,
+		         membershipChanged_t changed, void* context);
+/* Merges the list sent by another server and returns the list of this
+ * one, to be freed by the caller. 0 on error.
+ */
+char*        membershipMerge(membership_t membership, char* members);
+/* the alive members as given to changed, 0 before the first change,
+ * don't free */
+const char*  membershipGetMembers(membership_t membership);
+void         membershipGetStats(membership_t membership, membershipStats_t* pStats);
+
+#endif /* CLUSTER_MEMBERSHIP_H_ */
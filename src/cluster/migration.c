@@ -0,0 +1,195 @@
+#include "migration.h"
+#include "../cacheitem/cacheitem.h"
+#include "../fallocator/fallocator.h"
+#include "../cacheismo.h"
+
+typedef struct {
+	hashMap_t        hashMap;
+	clusterMap_t     clusterMap;
+	migrationOwner_t owner;
+	migrationDone_t  done;
+	void*            context;
+	fallocator_t     fallocator;
+	struct event*    timer;
+	int              scanning;
+	u_int32_t        scanCursor;
+	migrationStats_t stats;
+} migrationImpl_t;
+
+typedef struct {
+	migrationImpl_t* pMigration;
+	cacheItem_t      item;
+} migrationRequest_t;
+
+#define MIGRATION(x) ((migrationImpl_t*)(x))
+
+#define MIGRATION_SCAN_BUCKETS     256
+#define MIGRATION_INTERVAL_MS      10
+#define MIGRATION_MAX_PENDING      512
+#define MIGRATION_MAX_HEADER       512
+
+static void migrationCheckDone(migrationImpl_t* pMigration) {
+	if (pMigration->stats.active && !pMigration->scanning && (pMigration->stats.pending == 0)) {
+		pMigration->stats.active = 0;
+		event_del(pMigration->timer);
+		LOG(WARN, "Migration done, %llu keys moved %llu failed",
+				(unsigned long long)pMigration->stats.moved,
+				(unsigned long long)pMigration->stats.failed);
+		pMigration->done(pMigration->context);
+	}
+}
+
+/* STORED and NOT_STORED both mean the new owner has a value now */
+static void migrationResponseHandler(void* context, int status, dataStream_t response) {
+	migrationRequest_t* pRequest   = context;
+	migrationImpl_t*    pMigration = pRequest->pMigration;
+	cacheItem_t         item       = pRequest->item;
+	cacheItem_t         current    = 0;
+	char*               line       = 0;
+
+	pMigration->stats.pending--;
+	if ((status == 0) && response) {
+		line = dataStreamToString(response);
+	}
+	if (line && ((0 == strncmp(line, "STORED", 6)) || (0 == strncmp(line, "NOT_STORED", 10)))) {
+		current = hashMapGetElement(pMigration->hashMap, cacheItemGetKey(item),
+				cacheItemGetKeyLength(item));
+		if (current == item) {
+			hashMapDeleteElement(pMigration->hashMap, cacheItemGetKey(item),
+					cacheItemGetKeyLength(item));
+		}
+		if (current) {
+			cacheItemDelete(getGlobalChunkpool(), current);
+		}
+		pMigration->stats.moved++;
+	}else {
+		pMigration->stats.failed++;
+	}
+	if (line) {
+		FREE(line);
+	}
+	cacheItemDelete(getGlobalChunkpool(), item);
+	FREE(pRequest);
+	migrationCheckDone(pMigration);
+}
+
+static int migrationSend(migrationImpl_t* pMigration, const char* server, cacheItem_t item) {
+	migrationRequest_t* pRequest = 0;
+	dataStream_t        request  = 0;
+	char*               buffer   = 0;
+	int                 length   = 0;
+	int                 result   = -1;
+
+	buffer = dataStreamBufferAllocate(NULL, pMigration->fallocator, MIGRATION_MAX_HEADER);
+	IfTrue(buffer, WARN, "Error allocating memory");
+	length = snprintf(buffer, MIGRATION_MAX_HEADER - 2, "ladd %s %u %u %u\r\n", cacheItemGetKey(item),
+			cacheItemGetFlags(item), cacheItemGetTTL(item), cacheItemGetDataLength(item));
+	IfTrue((length > 0) && (length < (MIGRATION_MAX_HEADER - 2)), WARN, "Key too long for migration");
+	memcpy(buffer + length, "\r\n", 2);
+
+	request = dataStreamCreate();
+	IfTrue(request, WARN, "Error allocating memory");
+	IfTrue(0 == dataStreamAppendData(request, buffer, 0, length), WARN, "Error creating request");
+	IfTrue(0 == dataStreamAppendDataStream(request, cacheItemGetDataStream(item)), WARN,
+			"Error appending data");
+	IfTrue(0 == dataStreamAppendData(request, buffer, length, 2), WARN, "Error creating request");
+
+	pRequest = ALLOCATE_1(migrationRequest_t);
+	IfTrue(pRequest, WARN, "Error allocating memory");
+	pRequest->pMigration = pMigration;
+	pRequest->item       = item;
+	IfTrue(0 == clusterMapForward(pMigration->clusterMap, pRequest, migrationResponseHandler,
+			(char*)server, request, 0), WARN, "Error sending %s to %s", cacheItemGetKey(item), server);
+	cacheItemAddReference(item);
+	pRequest = 0;
+	pMigration->stats.pending++;
+	pMigration->stats.sent++;
+	result = 0;
+OnError:
+	if (pRequest) {
+		FREE(pRequest);
+	}
+	if (request) {
+		dataStreamDelete(request);
+	}
+	if (buffer) {
+		dataStreamBufferFree(buffer);
+	}
+	return result;
+}
+
+static void migrationVisitor(void* context, void* value) {
+	migrationImpl_t* pMigration = context;
+	const char*      server     = pMigration->owner(pMigration->context, cacheItemGetKey(value));
+
+	pMigration->stats.scanned++;
+	if (server && (0 != migrationSend(pMigration, server, value))) {
+		pMigration->stats.failed++;
+	}
+}
+
+static void migrationTimerCallback(int fd, short which, void* arg) {
+	migrationImpl_t* pMigration = arg;
+
+	if (pMigration->scanning && (pMigration->stats.pending < MIGRATION_MAX_PENDING)) {
+		pMigration->scanCursor = hashMapScan(pMigration->hashMap, pMigration->scanCursor,
+				MIGRATION_SCAN_BUCKETS, migrationVisitor, pMigration);
+		if (pMigration->scanCursor == 0) {
+			pMigration->scanning = 0;
+		}
+	}
+	migrationCheckDone(pMigration);
+}
+
+migration_t migrationCreate(hashMap_t hashMap, clusterMap_t clusterMap, migrationOwner_t owner,
+		migrationDone_t done, void* context) {
+	migrationImpl_t* pMigration = ALLOCATE_1(migrationImpl_t);
+
+	IfTrue(pMigration, ERR, "Error allocating memory");
+	IfTrue(hashMap && clusterMap && owner && done, ERR, "Null argument");
+	pMigration->hashMap    = hashMap;
+	pMigration->clusterMap = clusterMap;
+	pMigration->owner      = owner;
+	pMigration->done       = done;
+	pMigration->context    = context;
+	pMigration->fallocator = fallocatorCreate();
+	IfTrue(pMigration->fallocator, ERR, "Error creating fallocator");
+	pMigration->timer = event_new(getGlobalEventBase(), -1, EV_PERSIST, migrationTimerCallback,
+			pMigration);
+	IfTrue(pMigration->timer, ERR, "Error creating migration timer");
+	goto OnSuccess;
+OnError:
+	if (pMigration) {
+		if (pMigration->fallocator) {
+			fallocatorDelete(pMigration->fallocator);
+		}
+		FREE(pMigration);
+		pMigration = 0;
+	}
+OnSuccess:
+	return pMigration;
+}
+
+void migrationStart(migration_t migration) {
+	migrationImpl_t* pMigration = MIGRATION(migration);
+	struct timeval   interval   = {0, MIGRATION_INTERVAL_MS * 1000};
+
+	if (pMigration) {
+		pMigration->scanning   = 1;
+		pMigration->scanCursor = 0;
+		pMigration->stats.migrations++;
+		if (!pMigration->stats.active) {
+			pMigration->stats.active = 1;
+			event_add(pMigration->timer, &interval);
+		}
+	}
+}
+
+void migrationGetStats(migration_t migration, migrationStats_t* pStats) {
+	migrationImpl_t* pMigration = MIGRATION(migration);
+
+	memset(pStats, 0, sizeof(migrationStats_t));
+	if (pMigration) {
+		*pStats = pMigration->stats;
+	}
+}
@@ -0,0 +1,48 @@
+#ifndef CLUSTER_MIGRATION_H_
+#define CLUSTER_MIGRATION_H_
+
+#include "../common/common.h"
+#include "../hashmap/hashmap.h"
+#include "clustermap.h"
+
+/* Moving keys to their new owner after a ring change
+ *
+ * The hashMap is scanned MIGRATION_SCAN_BUCKETS buckets every
+ * MIGRATION_INTERVAL_MS, only while less than MIGRATION_MAX_PENDING
+ * keys are waiting for the answer, so the clients of this server are
+ * served in between and the new owners are not flooded. Every item
+ * owned by another server is sent to it with ladd, an add the new
+ * owner never forwards even if it does not know about the new ring yet.
+ * A value written to the new owner after the ring change is never
+ * overwritten. Once the new owner has a value, the local copy is
+ * deleted unless it was replaced in the meantime.
+ *
+ * The item data is not copied, the request keeps a reference to the
+ * item till the answer comes.
+ */
+
+typedef void* migration_t;
+
+/* the server owning the key now, 0 if it stays here */
+typedef const char* (*migrationOwner_t)(void* context, char* key);
+/* called once the scan is over and every key sent is answered */
+typedef void (*migrationDone_t)(void* context);
+
+typedef struct {
+	u_int32_t active;
+	u_int32_t pending;      //sent, answer not yet in
+	u_int64_t migrations;   //started
+	u_int64_t scanned;      //items looked at
+	u_int64_t sent;
+	u_int64_t moved;        //deleted here after the new owner got them
+	u_int64_t failed;       //kept here, the new owner didn't answer
+	u_int64_t dualReads;    //filled by the proxy
+} migrationStats_t;
+
+migration_t migrationCreate(hashMap_t hashMap, clusterMap_t clusterMap, migrationOwner_t owner,
+		        migrationDone_t done, void* context);
+/* starts again from the first bucket if already active */
+void        migrationStart(migration_t migration);
+void        migrationGetStats(migration_t migration, migrationStats_t* pStats);
+
+#endif /* CLUSTER_MIGRATION_H_ */
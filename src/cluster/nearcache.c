@@ -0,0 +1,254 @@
+#include <time.h>
+#include "nearcache.h"
+#include "../common/map.h"
+#include "../common/list.h"
+#include "../fallocator/fallocator.h"
+
+#define NEAR_CACHE(x) (nearCacheImpl_t*)(x)
+
+#define NEAR_CACHE_MAX_NAME_SIZE      512
+#define NEAR_CACHE_COPY_SIZE          (32 * 1024)
+
+typedef struct nearCacheEntry_t {
+	struct nearCacheEntry_t* pNext;
+	struct nearCacheEntry_t* pPrev;
+	char*                    name;       //"server key"
+	char*                    data;
+	u_int32_t                length;
+	u_int64_t                expiresAt;  //millis
+	u_int32_t                hits;       //since it was put
+} nearCacheEntry_t;
+
+typedef struct {
+	map_t        entries;      //name -> nearCacheEntry_t
+	list_t       lruList;      //most recently used first
+	fallocator_t fallocator;   //for the copies given to the caller
+	u_int32_t    ttlMillis;
+	u_int32_t    maxBytes;
+	u_int32_t    bytes;
+	u_int64_t    hits;
+	u_int64_t    misses;
+	u_int64_t    pushes;
+	u_int64_t    evictions;
+} nearCacheImpl_t;
+
+static u_int64_t currentTimeInMillis(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((u_int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static int makeName(char* name, char* server, char* key) {
+	int length = snprintf(name, NEAR_CACHE_MAX_NAME_SIZE, "%s %s", server, key);
+	return (length > 0) && (length < NEAR_CACHE_MAX_NAME_SIZE);
+}
+
+static u_int32_t entrySize(nearCacheEntry_t* pEntry) {
+	return sizeof(nearCacheEntry_t) + strlen(pEntry->name) + pEntry->length;
+}
+
+static void entryDelete(nearCacheImpl_t* pNC, nearCacheEntry_t* pEntry) {
+	pNC->bytes -= entrySize(pEntry);
+	listRemove(pNC->lruList, pEntry);
+	mapDeleteElement(pNC->entries, pEntry->name);
+	FREE(pEntry->name);
+	if (pEntry->data) {
+		FREE(pEntry->data);
+	}
+	FREE(pEntry);
+}
+
+static int appendCopy(dataStream_t value, fallocator_t fallocator, char* data, u_int32_t length) {
+	while (length > 0) {
+		u_int32_t size   = (length > NEAR_CACHE_COPY_SIZE) ? NEAR_CACHE_COPY_SIZE : length;
+		char*     buffer = dataStreamBufferAllocate(NULL, fallocator, size);
+		int       err    = 0;
+
+		if (!buffer) {
+			return -1;
+		}
+		memcpy(buffer, data, size);
+		err = dataStreamAppendData(value, buffer, 0, size);
+		dataStreamBufferFree(buffer);
+		if (err != 0) {
+			return -1;
+		}
+		data   += size;
+		length -= size;
+	}
+	return 0;
+}
+
+nearCache_t nearCacheCreate(u_int32_t ttlMillis, u_int32_t maxBytes) {
+	nearCacheImpl_t* pNC = ALLOCATE_1(nearCacheImpl_t);
+
+	IfTrue(pNC, ERR, "Error allocating memory");
+	pNC->entries = mapCreate();
+	IfTrue(pNC->entries, ERR, "Error allocating memory");
+	pNC->lruList = listCreate(OFFSET(nearCacheEntry_t, pNext), OFFSET(nearCacheEntry_t, pPrev));
+	IfTrue(pNC->lruList, ERR, "Error allocating memory");
+	pNC->fallocator = fallocatorCreate();
+	IfTrue(pNC->fallocator, ERR, "Error creating fallocator");
+	pNC->ttlMillis = ttlMillis;
+	pNC->maxBytes  = maxBytes;
+	goto OnSuccess;
+OnError:
+	if (pNC) {
+		nearCacheDelete(pNC);
+		pNC = 0;
+	}
+OnSuccess:
+	return pNC;
+}
+
+void nearCacheDelete(nearCache_t nearCache) {
+	nearCacheImpl_t*  pNC    = NEAR_CACHE(nearCache);
+	nearCacheEntry_t* pEntry = 0;
+
+	if (pNC) {
+		if (pNC->lruList) {
+			while ((pEntry = listGetFirst(pNC->lruList)) != 0) {
+				entryDelete(pNC, pEntry);
+			}
+			listFree(pNC->lruList);
+		}
+		if (pNC->entries) {
+			mapDelete(pNC->entries);
+		}
+		if (pNC->fallocator) {
+			fallocatorDelete(pNC->fallocator);
+		}
+		FREE(pNC);
+	}
+}
+
+void nearCacheSetTTL(nearCache_t nearCache, u_int32_t ttlMillis) {
+	nearCacheImpl_t* pNC = NEAR_CACHE(nearCache);
+	if (pNC) {
+		pNC->ttlMillis = ttlMillis;
+	}
+}
+
+int nearCacheGet(nearCache_t nearCache, char* server, char* key, dataStream_t value) {
+	nearCacheImpl_t*  pNC    = NEAR_CACHE(nearCache);
+	nearCacheEntry_t* pEntry = 0;
+	u_int64_t         now    = 0;
+	char              name[NEAR_CACHE_MAX_NAME_SIZE];
+
+	if (!pNC || (pNC->ttlMillis == 0) || !makeName(name, server, key)) {
+		return NEAR_CACHE_MISS;
+	}
+	now    = currentTimeInMillis();
+	pEntry = mapGetElement(pNC->entries, name);
+	if (pEntry && (pEntry->expiresAt <= now)) {
+		entryDelete(pNC, pEntry);
+		pEntry = 0;
+	}
+	if (!pEntry || (0 != appendCopy(value, pNC->fallocator, pEntry->data, pEntry->length))) {
+		pNC->misses++;
+		return NEAR_CACHE_MISS;
+	}
+	pNC->hits++;
+	pEntry->hits++;
+	listRemove(pNC->lruList, pEntry);
+	listAddFirst(pNC->lruList, pEntry);
+	return NEAR_CACHE_HIT;
+}
+
+/* returns the hits of the entry replaced */
+static u_int32_t entryPut(nearCacheImpl_t* pNC, char* server, char* key, dataStream_t value) {
+	nearCacheEntry_t* pEntry = 0;
+	char*             data   = 0;
+	u_int32_t         length = dataStreamGetSize(value);
+	u_int32_t         hits   = 0;
+	char              name[NEAR_CACHE_MAX_NAME_SIZE];
+
+	//values too big to be worth keeping are not kept
+	if (!pNC || (pNC->ttlMillis == 0) || (length > (pNC->maxBytes / 16)) ||
+			!makeName(name, server, key)) {
+		return 0;
+	}
+	data = dataStreamToString(value);
+	IfTrue(data, WARN, "Error copying value");
+
+	pEntry = mapGetElement(pNC->entries, name);
+	if (pEntry) {
+		hits        = pEntry->hits;
+		pNC->bytes -= entrySize(pEntry);
+		FREE(pEntry->data);
+		listRemove(pNC->lruList, pEntry);
+	}else {
+		pEntry = ALLOCATE_1(nearCacheEntry_t);
+		IfTrue(pEntry, WARN, "Error allocating memory");
+		pEntry->name = strdup(name);
+		if (!pEntry->name || (0 != mapPutElement(pNC->entries, name, pEntry))) {
+			LOG(WARN, "Error adding near cache entry");
+			if (pEntry->name) {
+				FREE(pEntry->name);
+			}
+			FREE(pEntry);
+			goto OnError;
+		}
+	}
+	pEntry->data      = data;
+	pEntry->length    = length;
+	pEntry->expiresAt = currentTimeInMillis() + pNC->ttlMillis;
+	pEntry->hits      = 0;
+	data              = 0;
+	listAddFirst(pNC->lruList, pEntry);
+	pNC->bytes += entrySize(pEntry);
+
+	while ((pNC->bytes > pNC->maxBytes) && ((pEntry = listGetLast(pNC->lruList)) != 0)) {
+		entryDelete(pNC, pEntry);
+		pNC->evictions++;
+	}
+	goto OnSuccess;
+OnError:
+	if (data) {
+		FREE(data);
+	}
+OnSuccess:
+	return hits;
+}
+
+void nearCachePut(nearCache_t nearCache, char* server, char* key, dataStream_t value) {
+	entryPut(NEAR_CACHE(nearCache), server, key, value);
+}
+
+u_int32_t nearCachePush(nearCache_t nearCache, char* server, char* key, dataStream_t value) {
+	nearCacheImpl_t* pNC = NEAR_CACHE(nearCache);
+
+	if (!pNC) {
+		return 0;
+	}
+	pNC->pushes++;
+	return entryPut(pNC, server, key, value);
+}
+
+void nearCacheInvalidate(nearCache_t nearCache, char* server, char* key) {
+	nearCacheImpl_t*  pNC    = NEAR_CACHE(nearCache);
+	nearCacheEntry_t* pEntry = 0;
+	char              name[NEAR_CACHE_MAX_NAME_SIZE];
+
+	if (pNC && makeName(name, server, key)) {
+		pEntry = mapGetElement(pNC->entries, name);
+		if (pEntry) {
+			entryDelete(pNC, pEntry);
+		}
+	}
+}
+
+void nearCacheGetStats(nearCache_t nearCache, nearCacheStats_t* pStats) {
+	nearCacheImpl_t* pNC = NEAR_CACHE(nearCache);
+
+	memset(pStats, 0, sizeof(nearCacheStats_t));
+	if (pNC) {
+		pStats->hits      = pNC->hits;
+		pStats->misses    = pNC->misses;
+		pStats->pushes    = pNC->pushes;
+		pStats->evictions = pNC->evictions;
+		pStats->entries   = mapSize(pNC->entries);
+		pStats->bytes     = pNC->bytes;
+		pStats->ttlMillis = pNC->ttlMillis;
+	}
+}
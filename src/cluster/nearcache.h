@@ -0,0 +1,54 @@
+#ifndef CLUSTER_NEARCACHE_H_
+#define CLUSTER_NEARCACHE_H_
+
+#include "../common/common.h"
+#include "../datastream/datastream.h"
+
+/* Near cache for values got from other servers
+ *
+ * The clusterMap keeps the values returned by other servers for
+ * ttlMillis, gets for the same server and key in that time are answered
+ * locally. This flattens the load a single very popular key puts on the
+ * server owning it, every other server asks it once per ttl.
+ *
+ * The owner of a hot key also pushes its value to the other servers
+ * before their copy expires and when it changes, see hotpush.h. Every
+ * entry counts its hits since it was put, nearCachePush returns the
+ * hits of the copy it replaces so the owner knows the key is still
+ * read even though the other servers don't ask it any more.
+ *
+ * Values are copied, the cache never holds more than maxBytes of them,
+ * least recently used entries are dropped first.
+ */
+
+typedef void* nearCache_t;
+
+enum nearCacheResult_t {
+	NEAR_CACHE_MISS = 0,
+	NEAR_CACHE_HIT
+};
+
+typedef struct {
+	u_int64_t hits;
+	u_int64_t misses;
+	u_int64_t pushes;          //values pushed by their owner
+	u_int64_t evictions;       //dropped to stay within maxBytes
+	u_int32_t entries;
+	u_int32_t bytes;
+	u_int32_t ttlMillis;
+} nearCacheStats_t;
+
+nearCache_t nearCacheCreate(u_int32_t ttlMillis, u_int32_t maxBytes);
+void        nearCacheDelete(nearCache_t nearCache);
+void        nearCacheSetTTL(nearCache_t nearCache, u_int32_t ttlMillis);
+
+/* On a hit a copy of the value is appended to value. */
+int         nearCacheGet(nearCache_t nearCache, char* server, char* key, dataStream_t value);
+void        nearCachePut(nearCache_t nearCache, char* server, char* key, dataStream_t value);
+/* nearCachePut of a value sent by server itself, returns the hits of the
+ * copy replaced, 0 if there was none */
+u_int32_t   nearCachePush(nearCache_t nearCache, char* server, char* key, dataStream_t value);
+void        nearCacheInvalidate(nearCache_t nearCache, char* server, char* key);
+void        nearCacheGetStats(nearCache_t nearCache, nearCacheStats_t* pStats);
+
+#endif /* CLUSTER_NEARCACHE_H_ */
@@ -0,0 +1,461 @@
+#include <time.h>
+#include "proxy.h"
+#include "consistent.h"
+#include "migration.h"
+#include "../datastream/datastream.h"
+#include "../cacheismo.h"
+
+/* The forwarded requests are rebuilt from the parsed command. The data
+ * of storage commands is not copied, the request shares the buffers of
+ * the client connection. noreply is never forwarded, the response is
+ * needed to match the pipelined requests. The caller drops it.
+ */
+
+/* previous is the ring before the last change, kept till the keys
+ * are moved. The deletes sent to the previous owners use fallocator,
+ * they are not tied to any client connection.
+ */
+
+//the other servers may still be moving keys here after the local scan
+//is over, the previous ring is kept till no key came in for this long
+#define PROXY_MOVE_QUIET_MILLIS 5000
+
+typedef struct proxyImpl_t {
+	consistent_t  consistent;
+	consistent_t  previous;
+	clusterMap_t  clusterMap;
+	migration_t   migration;
+	fallocator_t  fallocator;
+	char*         self;
+	int           localVirtualKeys;
+	u_int64_t     dualReads;
+	u_int64_t     movedInAt;        //last key moved here
+	u_int64_t     migrationDoneAt;  //0 while the local scan is running
+} proxyImpl_t;
+
+#define PROXY(x) ((proxyImpl_t*)(x))
+
+#define MAX_REQUEST_LINE_SIZE  96
+
+proxy_t proxyCreate(char* servers, char* self, int localVirtualKeys) {
+	proxyImpl_t* pProxy = ALLOCATE_1(proxyImpl_t);
+
+	IfTrue(pProxy, ERR, "Error allocating memory");
+	pProxy->consistent = consistentCreate(servers);
+	IfTrue(pProxy->consistent, ERR, "Error creating ring from [%s]", servers);
+	pProxy->clusterMap = clusterMapCreate(0);
+	IfTrue(pProxy->clusterMap, ERR, "Error creating cluster map");
+	pProxy->fallocator = fallocatorCreate();
+	IfTrue(pProxy->fallocator, ERR, "Error creating fallocator");
+	if (self) {
+		pProxy->self = strdup(self);
+		IfTrue(pProxy->self, ERR, "Error allocating memory");
+	}
+	pProxy->localVirtualKeys = localVirtualKeys;
+	goto OnSuccess;
+OnError:
+	if (pProxy) {
+		proxyDelete(pProxy);
+		pProxy = 0;
+	}
+OnSuccess:
+	return pProxy;
+}
+
+/* The cluster map, the migration and the fallocator are not deleted,
+ * they have to outlive the requests which are still pending.
+ */
+void proxyDelete(proxy_t proxy) {
+	proxyImpl_t* pProxy = PROXY(proxy);
+	if (pProxy) {
+		if (pProxy->consistent) {
+			consistentDelete(pProxy->consistent);
+		}
+		if (pProxy->previous) {
+			consistentDelete(pProxy->previous);
+		}
+		if (pProxy->self) {
+			FREE(pProxy->self);
+		}
+		FREE(pProxy);
+	}
+}
+
+static u_int64_t currentTimeInMillis(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((u_int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static const char* ringFindServer(proxyImpl_t* pProxy, consistent_t consistent, char* key) {
+	const char* server = consistentFindServer(consistent, key);
+
+	if (!server || (pProxy->self && (0 == strcmp(server, pProxy->self)))) {
+		return 0;
+	}
+	return server;
+}
+
+/* virtual keys (type:op:key...) and the objects the scripts store for
+ * them (type$key) stay on this server, they are never forwarded or moved
+ */
+static int isVirtualKey(proxyImpl_t* pProxy, char* key) {
+	return pProxy->localVirtualKeys && (strchr(key, ':') || strchr(key, '$'));
+}
+
+const char* proxyFindServer(proxy_t proxy, char* key) {
+	proxyImpl_t* pProxy = PROXY(proxy);
+
+	if (isVirtualKey(pProxy, key)) {
+		return 0;
+	}
+	return ringFindServer(pProxy, pProxy->consistent, key);
+}
+
+static int isLocalKey(char* key) {
+	cacheItem_t item = hashMapGetElement(getGlobalHashMap(), key, strlen(key));
+	if (item) {
+		cacheItemDelete(getGlobalChunkpool(), item);
+		return 1;
+	}
+	return 0;
+}
+
+static void proxyIgnoreResponse(void* context, int status, dataStream_t response) {
+	if (status != 0) {
+		LOG(INFO, "Error deleting moved key on its previous owner");
+	}
+}
+
+static void proxyDeleteOnServer(proxyImpl_t* pProxy, const char* server, char* key) {
+	dataStream_t request = 0;
+	char*        buffer  = 0;
+	int          length  = strlen(key) + 10; // "ldelete " + key + "\r\n"
+
+	buffer = dataStreamBufferAllocate(NULL, pProxy->fallocator, length + 1);
+	IfTrue(buffer, WARN, "Error allocating memory");
+	sprintf(buffer, "ldelete %s\r\n", key);
+	request = dataStreamCreate();
+	IfTrue(request, WARN, "Error allocating memory");
+	IfTrue(0 == dataStreamAppendData(request, buffer, 0, length), WARN, "Error creating request");
+	IfTrue(0 == clusterMapForward(pProxy->clusterMap, 0, proxyIgnoreResponse, (char*)server,
+			request, 0), WARN, "Error deleting %s on %s", key, server);
+OnError:
+	if (request) {
+		dataStreamDelete(request);
+	}
+	if (buffer) {
+		dataStreamBufferFree(buffer);
+	}
+}
+
+/* Where the command for key goes while the keys move after a ring
+ * change (dual read). A key moving away is read here as long as it is
+ * still here. A key moving here is read from the previous owner with
+ * lget, which it never forwards, as long as it is not here yet. Writes
+ * go to the new owner, the copy left on the previous owner is deleted
+ * so that it is neither read nor moved later.
+ */
+static const char* proxyRoute(proxyImpl_t* pProxy, command_t* pCommand, char* key, int* pDualRead) {
+	const char* server   = proxyFindServer(pProxy, key);
+	const char* previous = 0;
+	int         read     = proxyIsMultiLine(pCommand);
+
+	*pDualRead = 0;
+	if (pProxy->previous && pProxy->migrationDoneAt) {
+		u_int64_t now = currentTimeInMillis();
+		if ((now - pProxy->migrationDoneAt > PROXY_MOVE_QUIET_MILLIS) &&
+				(now - pProxy->movedInAt > PROXY_MOVE_QUIET_MILLIS)) {
+			consistentDelete(pProxy->previous);
+			pProxy->previous = 0;
+			LOG(WARN, "No keys moved here for a while, dual read over");
+		}
+	}
+	if (!pProxy->previous || isVirtualKey(pProxy, key)) {
+		return server;
+	}
+	previous = ringFindServer(pProxy, pProxy->previous, key);
+	if (server && !previous) {
+		if (read && isLocalKey(key)) {
+			pProxy->dualReads++;
+			return 0;
+		}
+		if (!read) {
+			hashMapDeleteElement(getGlobalHashMap(), key, strlen(key));
+		}
+	}else if (!server && previous) {
+		if (read && !isLocalKey(key)) {
+			pProxy->dualReads++;
+			*pDualRead = 1;
+			return previous;
+		}
+		if (!read) {
+			proxyDeleteOnServer(pProxy, previous, key);
+		}
+	}
+	return server;
+}
+
+static const char* proxyMigrationOwner(void* context, char* key) {
+	return proxyFindServer(context, key);
+}
+
+static void proxyMigrationDone(void* context) {
+	PROXY(context)->migrationDoneAt = currentTimeInMillis();
+}
+
+int proxyChangeRing(proxy_t proxy, char* servers) {
+	proxyImpl_t* pProxy = PROXY(proxy);
+	consistent_t ring   = 0;
+	int          mode   = 0;
+
+	IfTrue(pProxy && servers, WARN, "Null argument");
+	mode = consistentModeFromName(consistentGetModeName(pProxy->consistent));
+	ring = consistentCreateWithMode(servers, mode);
+	IfTrue(ring, WARN, "Error creating ring from [%s]", servers);
+	if (!pProxy->migration) {
+		pProxy->migration = migrationCreate(getGlobalHashMap(), pProxy->clusterMap,
+				proxyMigrationOwner, proxyMigrationDone, pProxy);
+		IfTrue(pProxy->migration, WARN, "Error creating migration");
+	}
+	//keys still on the owner before the last change are only found by the scan
+	if (pProxy->previous) {
+		consistentDelete(pProxy->previous);
+	}
+	pProxy->previous        = pProxy->consistent;
+	pProxy->consistent      = ring;
+	pProxy->movedInAt       = currentTimeInMillis();
+	pProxy->migrationDoneAt = 0;
+	migrationStart(pProxy->migration);
+	LOG(WARN, "Ring changed to [%s], moving keys", servers);
+	return 0;
+OnError:
+	if (ring) {
+		consistentDelete(ring);
+	}
+	return -1;
+}
+
+void proxyGetMigrationStats(proxy_t proxy, migrationStats_t* pStats) {
+	proxyImpl_t* pProxy = PROXY(proxy);
+
+	migrationGetStats(pProxy ? pProxy->migration : 0, pStats);
+	if (pProxy) {
+		pStats->dualReads = pProxy->dualReads;
+	}
+}
+
+int proxyIsMultiLine(command_t* pCommand) {
+	switch (pCommand->command) {
+	case COMMAND_GET:
+	case COMMAND_BGET:
+	case COMMAND_GETS:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static const char* commandName(enum commands_enum_t command) {
+	switch (command) {
+	case COMMAND_GET:     return "get";
+	case COMMAND_BGET:    return "get";
+	case COMMAND_GETS:    return "gets";
+	case COMMAND_ADD:     return "add";
+	case COMMAND_SET:     return "set";
+	case COMMAND_REPLACE: return "replace";
+	case COMMAND_PREPEND: return "prepend";
+	case COMMAND_APPEND:  return "append";
+	case COMMAND_CAS:     return "cas";
+	case COMMAND_INCR:    return "incr";
+	case COMMAND_DECR:    return "decr";
+	case COMMAND_DELETE:  return "delete";
+	default:              return 0;
+	}
+}
+
+static dataStream_t proxyRequestCreate(fallocator_t fallocator, command_t* pCommand,
+		char** keys, int count, int dualRead) {
+	dataStream_t request = 0;
+	char*        buffer  = 0;
+	const char*  name    = dualRead ? "lget" : commandName(pCommand->command);
+	u_int32_t    size    = MAX_REQUEST_LINE_SIZE;
+	int          length  = 0;
+
+	for (int i = 0; i < count; i++) {
+		size += strlen(keys[i]) + 1;
+	}
+	buffer = dataStreamBufferAllocate(NULL, fallocator, size);
+	IfTrue(buffer, WARN, "Error allocating memory");
+
+	switch (pCommand->command) {
+	case COMMAND_GET:
+	case COMMAND_BGET:
+	case COMMAND_GETS:
+		length = sprintf(buffer, "%s", name);
+		for (int i = 0; i < count; i++) {
+			length += sprintf(buffer + length, " %s", keys[i]);
+		}
+		length += sprintf(buffer + length, "\r\n");
+		break;
+	case COMMAND_CAS:
+		length = sprintf(buffer, "%s %s %u %u %u %llu\r\n", name, keys[0], pCommand->flags,
+				pCommand->expiryTime, pCommand->dataLength, (unsigned long long)pCommand->cas);
+		break;
+	case COMMAND_INCR:
+	case COMMAND_DECR:
+		length = sprintf(buffer, "%s %s %llu\r\n", name, keys[0], (unsigned long long)pCommand->delta);
+		break;
+	case COMMAND_DELETE:
+		length = sprintf(buffer, "%s %s\r\n", name, keys[0]);
+		break;
+	default:
+		length = sprintf(buffer, "%s %s %u %u %u\r\n", name, keys[0], pCommand->flags,
+				pCommand->expiryTime, pCommand->dataLength);
+		break;
+	}
+	request = dataStreamCreate();
+	IfTrue(request, WARN, "Error allocating memory");
+	IfTrue(0 == dataStreamAppendData(request, buffer, 0, length), WARN, "Error appending request");
+	if (pCommand->dataStream) {
+		IfTrue(0 == dataStreamAppendDataStream(request, pCommand->dataStream), WARN, "Error appending data");
+		memcpy(buffer + length, "\r\n", 2);
+		IfTrue(0 == dataStreamAppendData(request, buffer, length, 2), WARN, "Error appending request");
+	}
+	goto OnSuccess;
+OnError:
+	if (request) {
+		dataStreamDelete(request);
+		request = 0;
+	}
+OnSuccess:
+	if (buffer) {
+		dataStreamBufferFree(buffer);
+	}
+	return request;
+}
+
+static int proxyForwardKeys(proxyImpl_t* pProxy, fallocator_t fallocator, command_t* pCommand,
+		const char* server, int dualRead, char** keys, int count, void* context,
+		proxyResponseHandler_t handler, u_int32_t* pPending) {
+	dataStream_t request     = 0;
+	int          returnValue = 0;
+
+	request = proxyRequestCreate(fallocator, pCommand, keys, count, dualRead);
+	IfTrue(request, WARN, "Error creating request for %s", server);
+	(*pPending)++;
+	returnValue = clusterMapForward(pProxy->clusterMap, context, handler, (char*)server,
+			request, proxyIsMultiLine(pCommand));
+	if (returnValue != 0) {
+		(*pPending)--;
+		LOG(WARN, "Error forwarding request to %s", server);
+	}
+	dataStreamDelete(request);
+	return returnValue;
+OnError:
+	return -1;
+}
+
+/* A failed group in a multi-get is reported as a miss of its keys */
+static int proxyForwardMultiGet(proxyImpl_t* pProxy, fallocator_t fallocator, command_t* pCommand,
+		void* context, proxyResponseHandler_t handler, u_int32_t* pPending) {
+	int           count     = pCommand->multiGetKeysCount;
+	char**        keys      = pCommand->multiGetKeys;
+	const char**  servers   = 0;
+	char**        group     = 0;
+	int*          dualRead  = 0;
+	int           forwarded = 0;
+	int           local     = 0;
+
+	servers  = fallocatorMalloc(fallocator, count * sizeof(char*));
+	IfTrue(servers, WARN, "Error allocating memory");
+	group    = fallocatorMalloc(fallocator, count * sizeof(char*));
+	IfTrue(group, WARN, "Error allocating memory");
+	dualRead = fallocatorMalloc(fallocator, count * sizeof(int));
+	IfTrue(dualRead, WARN, "Error allocating memory");
+
+	//the names of the previous ring are other pointers, so keys read
+	//from the previous owner are never grouped with the others
+	for (int i = 0; i < count; i++) {
+		servers[i] = proxyRoute(pProxy, pCommand, keys[i], &dualRead[i]);
+	}
+	for (int i = 0; i < count; i++) {
+		const char* server     = servers[i];
+		int         dual       = dualRead[i];
+		int         groupCount = 0;
+		if (!server) {
+			continue;
+		}
+		for (int j = i; j < count; j++) {
+			if (servers[j] == server) {
+				group[groupCount++] = keys[j];
+				servers[j] = 0;
+				keys[j]    = 0;
+			}
+		}
+		if (0 == proxyForwardKeys(pProxy, fallocator, pCommand, server, dual, group, groupCount,
+				context, handler, pPending)) {
+			forwarded++;
+		}
+		for (int j = 0; j < groupCount; j++) {
+			fallocatorFree(fallocator, group[j]);
+		}
+	}
+	for (int i = 0; i < count; i++) {
+		if (keys[i]) {
+			keys[local++] = keys[i];
+		}
+	}
+	pCommand->multiGetKeysCount = local;
+	goto OnSuccess;
+OnError:
+	forwarded = -1;
+OnSuccess:
+	if (servers) {
+		fallocatorFree(fallocator, servers);
+	}
+	if (group) {
+		fallocatorFree(fallocator, group);
+	}
+	if (dualRead) {
+		fallocatorFree(fallocator, dualRead);
+	}
+	return forwarded;
+}
+
+/* Returns the number of forwarded requests, 0 if the command is local */
+int proxyForward(proxy_t proxy, fallocator_t fallocator, command_t* pCommand,
+		void* context, proxyResponseHandler_t handler, u_int32_t* pPending) {
+	proxyImpl_t* pProxy   = PROXY(proxy);
+	const char*  server   = 0;
+	int          dualRead = 0;
+
+	if (pCommand->command == COMMAND_LADD) {
+		pProxy->movedInAt = currentTimeInMillis();
+	}
+	if (!commandName(pCommand->command)) {
+		return 0;
+	}
+	if (pCommand->multiGetKeysCount > 0) {
+		return proxyForwardMultiGet(pProxy, fallocator, pCommand, context, handler, pPending);
+	}
+	if (!pCommand->key || !(server = proxyRoute(pProxy, pCommand, pCommand->key, &dualRead))) {
+		return 0;
+	}
+	if (0 != proxyForwardKeys(pProxy, fallocator, pCommand, server, dualRead, &pCommand->key, 1,
+			context, handler, pPending)) {
+		return -1;
+	}
+	if (proxyIsMultiLine(pCommand)) {
+		//the value comes from the other server, nothing left to do locally
+		fallocatorFree(fallocator, pCommand->key);
+		pCommand->key     = 0;
+		pCommand->keySize = 0;
+	}
+	return 1;
+}
+
+clusterMap_t proxyGetClusterMap(proxy_t proxy) {
+	proxyImpl_t* pProxy = PROXY(proxy);
+	return pProxy ? pProxy->clusterMap : 0;
+}
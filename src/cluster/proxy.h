@@ -0,0 +1,57 @@
+#ifndef CLUSTER_PROXY_H_
+#define CLUSTER_PROXY_H_
+
+#include "../common/common.h"
+#include "../common/commands.h"
+#include "../fallocator/fallocator.h"
+#include "clustermap.h"
+#include "migration.h"
+
+/* Proxy mode
+ *
+ * Every server is started with the same ring of servers (-P) and its
+ * own name in the ring (-x). Commands for keys owned by another server
+ * are forwarded to it as they are, the response is given back to the
+ * client without running any script. A multi-get is split per server,
+ * the keys owned by this server are left in the command for the local
+ * scripts.
+ *
+ * With virtual keys enabled, keys containing ':' and the objects the
+ * scripts store for them (type$key) are always handled locally and are
+ * never moved by a ring change, the scripts decide where the data lives.
+ *
+ * The ring can be changed while running ("ring ip:port,..." sent to
+ * every server). Keys owned by another server in the new ring are moved
+ * to it in the background, see migration.h. Till that is over, and no
+ * key was moved here by the other servers for PROXY_MOVE_QUIET_MILLIS,
+ * the previous ring is kept and gets are served from wherever the key
+ * is now, see proxyRoute.
+ */
+
+typedef void* proxy_t;
+
+typedef clusterMapForwardHandler_t proxyResponseHandler_t;
+
+proxy_t       proxyCreate(char* servers, char* self, int localVirtualKeys);
+void          proxyDelete(proxy_t proxy);
+/* the server which owns the key, 0 if it is this server */
+const char*   proxyFindServer(proxy_t proxy, char* key);
+/* Forwards the remote part of the command and removes it from the
+ * command. pPending is incremented for every forwarded request before
+ * it is sent, handler is called once for each of them, possibly before
+ * this returns. Returns the number of forwarded requests, 0 if the
+ * command is local and -1 on error.
+ */
+int           proxyForward(proxy_t proxy, fallocator_t fallocator, command_t* pCommand,
+		          void* context, proxyResponseHandler_t handler, u_int32_t* pPending);
+/* Switches to the new ring, in the mode of the current one, and starts
+ * moving the keys. 0 on success.
+ */
+int           proxyChangeRing(proxy_t proxy, char* servers);
+void          proxyGetMigrationStats(proxy_t proxy, migrationStats_t* pStats);
+/* the clusterMap the requests are forwarded with */
+clusterMap_t  proxyGetClusterMap(proxy_t proxy);
+/* 1 if the response to the command is a list of values ended by END */
+int           proxyIsMultiLine(command_t* pCommand);
+
+#endif /* CLUSTER_PROXY_H_ */
@@ -0,0 +1,450 @@
+#include "replication.h"
+#include "../io/connection.h"
+#include "../cacheitem/cacheitem.h"
+#include "../cacheismo.h"
+#include <time.h>
+
+enum replication_status_t {
+	replication_disconnected = 0,
+	replication_connecting,
+	replication_connected
+};
+
+/* Only one connection to the follower. The follower answers every
+ * command with one line, so the responses are just counted. The
+ * version ping is the sent'th command of the connection, when that
+ * many responses are in the follower has caught up with the ping.
+ * sent and acked start again with every connection, the commands
+ * lost with the previous one are never answered.
+ */
+typedef struct {
+	char*                     followerName;
+	char*                     followerIP;
+	int                       followerPort;
+	hashMap_t                 hashMap;
+	enum replication_status_t status;
+	connection_t              connection;
+	int                       waiting;
+	fallocator_t              fallocator;
+	dataStream_t              readStream;
+	dataStream_t              writeStream;
+	u_int32_t                 scanCursor;
+	int                       flushScheduled;
+	u_int64_t                 sent;
+	u_int64_t                 acked;
+	u_int64_t                 pingCommand;
+	u_int64_t                 pingMicros;
+	u_int64_t                 connectMicros;
+	struct event*             timer;
+	replicationStats_t        stats;
+} replicationImpl_t;
+
+#define REPLICATION(x) ((replicationImpl_t*)(x))
+
+#define REPLICATION_MAX_BACKLOG        (32 * 1024 * 1024)
+#define REPLICATION_SCAN_BACKLOG       (1024 * 1024)
+#define REPLICATION_SCAN_BUCKETS       1024
+#define REPLICATION_PING_INTERVAL_MS   100
+#define REPLICATION_RECONNECT_MS       1000
+#define REPLICATION_MAX_HEADER         512
+
+#define FLUSH_ALL_COMMAND  "flush_all\r\n"
+#define VERSION_COMMAND    "version\r\n"
+
+static u_int64_t currentTimeInMicros(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((u_int64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+/* Safe to call from the connection callbacks and from the hashMap
+ * listener, the pending event is cancelled before the close.
+ */
+static void replicationDisconnect(replicationImpl_t* pRepl) {
+	if (pRepl->connection) {
+		if (pRepl->waiting) {
+			connectionWaitCancel(pRepl->connection, getGlobalEventBase());
+		}
+		connectionClose(pRepl->connection);
+		pRepl->connection = 0;
+	}
+	if (pRepl->readStream) {
+		dataStreamDelete(pRepl->readStream);
+		pRepl->readStream = 0;
+	}
+	if (pRepl->writeStream) {
+		dataStreamDelete(pRepl->writeStream);
+		pRepl->writeStream = 0;
+	}
+	if (pRepl->fallocator) {
+		fallocatorDelete(pRepl->fallocator);
+		pRepl->fallocator = 0;
+	}
+	if (pRepl->status == replication_connected) {
+		LOG(WARN, "Lost connection to follower %s", pRepl->followerName);
+	}
+	pRepl->status          = replication_disconnected;
+	pRepl->waiting         = 0;
+	pRepl->sent            = 0;
+	pRepl->acked           = 0;
+	pRepl->pingCommand     = 0;
+	pRepl->stats.connected = 0;
+	pRepl->stats.resyncing = 0;
+}
+
+static int replicationAppendString(replicationImpl_t* pRepl, char* value, u_int32_t length) {
+	u_int32_t offset = 0;
+	void*     buffer = 0;
+
+	buffer = connectionGetBuffer(pRepl->connection, pRepl->fallocator, length, &offset);
+	IfTrue(buffer, WARN, "Error allocating replication buffer");
+	memcpy((char*)buffer+offset, value, length);
+	return dataStreamAppendData(pRepl->writeStream, buffer, offset, length);
+OnError:
+	return -1;
+}
+
+/* The data of the item is not copied, the log keeps a reference to
+ * its buffers till it is written.
+ */
+static int replicationAppendSet(replicationImpl_t* pRepl, cacheItem_t item) {
+	char header[REPLICATION_MAX_HEADER];
+	int  length = 0;
+
+	length = snprintf(header, sizeof(header), "set %s %u %u %u\r\n", cacheItemGetKey(item),
+			cacheItemGetFlags(item), cacheItemGetTTL(item), cacheItemGetDataLength(item));
+	IfTrue(length < sizeof(header), WARN, "Key too long for replication");
+	IfTrue(0 == replicationAppendString(pRepl, header, length), WARN, "Error appending header");
+	IfTrue(0 == dataStreamAppendDataStream(pRepl->writeStream, cacheItemGetDataStream(item)),
+			WARN, "Error appending data");
+	IfTrue(0 == replicationAppendString(pRepl, "\r\n", 2), WARN, "Error appending header");
+	pRepl->stats.commandsSent++;
+	pRepl->sent++;
+	return 0;
+OnError:
+	return -1;
+}
+
+static int replicationAppendDelete(replicationImpl_t* pRepl, cacheItem_t item) {
+	char header[REPLICATION_MAX_HEADER];
+	int  length = 0;
+
+	length = snprintf(header, sizeof(header), "delete %s\r\n", cacheItemGetKey(item));
+	IfTrue(length < sizeof(header), WARN, "Key too long for replication");
+	IfTrue(0 == replicationAppendString(pRepl, header, length), WARN, "Error appending delete");
+	pRepl->stats.commandsSent++;
+	pRepl->sent++;
+	return 0;
+OnError:
+	return -1;
+}
+
+static void replicationWait(replicationImpl_t* pRepl) {
+	if (pRepl->waiting) {
+		connectionWaitCancel(pRepl->connection, getGlobalEventBase());
+	}
+	if (dataStreamGetSize(pRepl->writeStream) > 0) {
+		connectionWaitForReadWrite(pRepl->connection, getGlobalEventBase());
+	}else {
+		connectionWaitForRead(pRepl->connection, getGlobalEventBase());
+	}
+	pRepl->waiting = 1;
+}
+
+static void replicationScheduleFlush(replicationImpl_t* pRepl);
+
+static void replicationVisitor(void* context, void* value) {
+	replicationImpl_t* pRepl = context;
+
+	if ((pRepl->status == replication_connected) &&
+			(0 != replicationAppendSet(pRepl, value))) {
+		replicationDisconnect(pRepl);
+	}
+}
+
+/* Continues the resync while the log is short and writes what the
+ * socket takes. The scan goes a slice at a time, so that the clients
+ * of this server are served in between.
+ */
+static void replicationFlush(replicationImpl_t* pRepl) {
+	u_int32_t size    = 0;
+	u_int32_t written = 0;
+
+	pRepl->flushScheduled = 0;
+	if (pRepl->status != replication_connected) {
+		return;
+	}
+	if (pRepl->stats.resyncing && (dataStreamGetSize(pRepl->writeStream) < REPLICATION_SCAN_BACKLOG)) {
+		pRepl->scanCursor = hashMapScan(pRepl->hashMap, pRepl->scanCursor, REPLICATION_SCAN_BUCKETS,
+				replicationVisitor, pRepl);
+		if (pRepl->status != replication_connected) {
+			return;
+		}
+		if (pRepl->scanCursor == 0) {
+			pRepl->stats.resyncing = 0;
+			LOG(INFO, "Sent all items to follower %s", pRepl->followerName);
+		}
+	}
+	size = dataStreamGetSize(pRepl->writeStream);
+	if (size > 0) {
+		IfTrue(connectionWrite(pRepl->connection, pRepl->fallocator, pRepl->writeStream,
+				size, &written) >= 0, INFO, "Error writing to follower %s", pRepl->followerName);
+		if (written > 0) {
+			dataStreamTruncateFromStart(pRepl->writeStream, (size - written));
+			pRepl->stats.bytesSent += written;
+		}
+	}
+	if (pRepl->stats.resyncing && (dataStreamGetSize(pRepl->writeStream) < REPLICATION_SCAN_BACKLOG)) {
+		replicationScheduleFlush(pRepl);
+	}
+	replicationWait(pRepl);
+	return;
+OnError:
+	replicationDisconnect(pRepl);
+}
+
+static void replicationFlushCallback(int fd, short which, void* arg) {
+	replicationFlush(arg);
+}
+
+/* Writes made by the scripts of one event loop iteration go out together */
+static void replicationScheduleFlush(replicationImpl_t* pRepl) {
+	struct timeval now = {0, 0};
+
+	if (pRepl->flushScheduled) {
+		return;
+	}
+	if (0 == event_base_once(getGlobalEventBase(), -1, EV_TIMEOUT,
+			replicationFlushCallback, pRepl, &now)) {
+		pRepl->flushScheduled = 1;
+	}else {
+		LOG(ERR, "Error scheduling replication write");
+	}
+}
+
+static void readAvailableImpl(connection_t connection) {
+	replicationImpl_t* pRepl     = connectionGetContext(connection);
+	u_int32_t          bytesRead = 0;
+	int                eol       = 0;
+
+	pRepl->waiting = 0;
+	IfTrue(connectionRead(pRepl->connection, pRepl->fallocator, pRepl->readStream,
+			8 * 1024, &bytesRead) >= 0, INFO, "Follower %s closed connection", pRepl->followerName);
+
+	while ((eol = dataStreamFindEndOfLine(pRepl->readStream)) >= 0) {
+		dataStreamTruncateFromStart(pRepl->readStream,
+				dataStreamGetSize(pRepl->readStream) - (eol + 2));
+		pRepl->stats.commandsAcked++;
+		pRepl->acked++;
+		if (pRepl->pingCommand && (pRepl->acked >= pRepl->pingCommand)) {
+			pRepl->stats.lagMicros = currentTimeInMicros() - pRepl->pingMicros;
+			if (pRepl->stats.lagMicros > pRepl->stats.maxLagMicros) {
+				pRepl->stats.maxLagMicros = pRepl->stats.lagMicros;
+			}
+			pRepl->pingCommand = 0;
+		}
+	}
+	replicationFlush(pRepl);
+	return;
+OnError:
+	replicationDisconnect(pRepl);
+}
+
+static void writeAvailableImpl(connection_t connection) {
+	replicationImpl_t* pRepl = connectionGetContext(connection);
+
+	pRepl->waiting = 0;
+	replicationFlush(pRepl);
+}
+
+/* The follower is emptied first, then the resync starts */
+static void connectCompleteImpl(connection_t connection, int status) {
+	replicationImpl_t* pRepl = connectionGetContext(connection);
+
+	pRepl->waiting = 0;
+	//the socket is also writable when the connect failed, ask again
+	if ((status == 0) && (connectionConnect(connection) != 0)) {
+		status = -1;
+	}
+	IfTrue(status == 0, INFO, "Error connecting to follower %s", pRepl->followerName);
+	pRepl->status           = replication_connected;
+	pRepl->scanCursor       = 0;
+	pRepl->sent             = 0;
+	pRepl->acked            = 0;
+	pRepl->pingCommand      = 0;
+	pRepl->stats.connected  = 1;
+	pRepl->stats.resyncing  = 1;
+	pRepl->stats.resyncs++;
+	LOG(INFO, "Connected to follower %s, sending all items", pRepl->followerName);
+	IfTrue(0 == replicationAppendString(pRepl, FLUSH_ALL_COMMAND, strlen(FLUSH_ALL_COMMAND)),
+			WARN, "Error appending flush_all");
+	pRepl->stats.commandsSent++;
+	pRepl->sent++;
+	replicationFlush(pRepl);
+	return;
+OnError:
+	replicationDisconnect(pRepl);
+}
+
+static connectionHandler_t* pReplicationConnectionHandler = 0;
+
+static connectionHandler_t* createConnectionHandler() {
+	if (pReplicationConnectionHandler) {
+		return pReplicationConnectionHandler;
+	}
+	pReplicationConnectionHandler = ALLOCATE_1(connectionHandler_t);
+	pReplicationConnectionHandler->newConnection   = 0;
+	pReplicationConnectionHandler->readAvailable   = &readAvailableImpl;
+	pReplicationConnectionHandler->writeAvailable  = &writeAvailableImpl;
+	pReplicationConnectionHandler->connectComplete = &connectCompleteImpl;
+	return pReplicationConnectionHandler;
+}
+
+static void replicationConnect(replicationImpl_t* pRepl) {
+	int err = 0;
+
+	pRepl->connectMicros = currentTimeInMicros();
+	pRepl->connection    = connectionClientCreate(pRepl->followerIP, pRepl->followerPort,
+			createConnectionHandler());
+	IfTrue(pRepl->connection, ERR, "Error creating connection to follower %s", pRepl->followerName);
+	connectionSetContext(pRepl->connection, pRepl);
+	pRepl->readStream  = dataStreamCreate();
+	IfTrue(pRepl->readStream, WARN, "Error creating read stream");
+	pRepl->writeStream = dataStreamCreate();
+	IfTrue(pRepl->writeStream, WARN, "Error creating write stream");
+	pRepl->fallocator  = fallocatorCreate();
+	IfTrue(pRepl->fallocator, WARN, "Error creating fallocator");
+	pRepl->status      = replication_connecting;
+
+	err = connectionConnect(pRepl->connection);
+	IfTrue(err >= 0, INFO, "Error connecting to follower %s", pRepl->followerName);
+	if (err == 1) {
+		connectionWaitForConnect(pRepl->connection, getGlobalEventBase());
+		pRepl->waiting = 1;
+	}else {
+		connectCompleteImpl(pRepl->connection, 0);
+	}
+	return;
+OnError:
+	replicationDisconnect(pRepl);
+}
+
+/* Reconnects and sends the lag ping. Only one ping is in flight. */
+static void replicationTimerCallback(int fd, short which, void* arg) {
+	replicationImpl_t* pRepl = arg;
+	u_int64_t          now   = currentTimeInMicros();
+
+	if (pRepl->status == replication_disconnected) {
+		if ((now - pRepl->connectMicros) >= (REPLICATION_RECONNECT_MS * 1000)) {
+			replicationConnect(pRepl);
+		}
+	}else if ((pRepl->status == replication_connected) && !pRepl->pingCommand) {
+		if (0 == replicationAppendString(pRepl, VERSION_COMMAND, strlen(VERSION_COMMAND))) {
+			pRepl->stats.commandsSent++;
+			pRepl->sent++;
+			pRepl->pingCommand = pRepl->sent;
+			pRepl->pingMicros  = now;
+			replicationScheduleFlush(pRepl);
+		}
+	}
+}
+
+/* Changes are ignored till the connection is made, the resync which
+ * follows sends the current state anyway.
+ */
+static void replicationListener(void* context, int event, void* value) {
+	replicationImpl_t* pRepl = context;
+	int                err   = 0;
+
+	if (pRepl->status != replication_connected) {
+		return;
+	}
+	if (event == HASHMAP_EVENT_PUT) {
+		err = replicationAppendSet(pRepl, value);
+	}else {
+		err = replicationAppendDelete(pRepl, value);
+	}
+	IfTrue(err == 0, WARN, "Error adding to replication log");
+	IfTrue(dataStreamGetSize(pRepl->writeStream) <= REPLICATION_MAX_BACKLOG, WARN,
+			"Replication backlog full, follower %s will be resynced", pRepl->followerName);
+	replicationScheduleFlush(pRepl);
+	return;
+OnError:
+	replicationDisconnect(pRepl);
+}
+
+replication_t replicationCreate(char* follower, hashMap_t hashMap) {
+	replicationImpl_t* pRepl = ALLOCATE_1(replicationImpl_t);
+	char*              copy  = 0;
+	char*              ip    = 0;
+	char*              port  = 0;
+	struct timeval     interval = {0, REPLICATION_PING_INTERVAL_MS * 1000};
+
+	IfTrue(pRepl, ERR, "Error allocating memory");
+	IfTrue(follower && hashMap, ERR, "Null argument");
+	pRepl->hashMap      = hashMap;
+	pRepl->followerName = strdup(follower);
+	IfTrue(pRepl->followerName, ERR, "Error allocating memory");
+	copy = strdup(follower);
+	IfTrue(copy, ERR, "Error allocating memory");
+	ip   = strtok(copy, ":");
+	IfTrue(ip, ERR, "Error parsing follower %s", follower);
+	port = strtok(0, ":");
+	IfTrue(port && (atoi(port) > 0), ERR, "Error parsing follower port %s", follower);
+	pRepl->followerIP   = strdup(ip);
+	IfTrue(pRepl->followerIP, ERR, "Error allocating memory");
+	pRepl->followerPort = atoi(port);
+	FREE(copy);
+	copy = 0;
+
+	IfTrue(0 == hashMapAddListener(hashMap, replicationListener, pRepl), ERR,
+			"Error adding replication listener");
+	pRepl->timer = event_new(getGlobalEventBase(), -1, EV_PERSIST, replicationTimerCallback, pRepl);
+	IfTrue(pRepl->timer, ERR, "Error creating replication timer");
+	event_add(pRepl->timer, &interval);
+	replicationConnect(pRepl);
+	goto OnSuccess;
+OnError:
+	if (copy) {
+		FREE(copy);
+	}
+	if (pRepl) {
+		replicationDelete(pRepl);
+		pRepl = 0;
+	}
+OnSuccess:
+	return pRepl;
+}
+
+void replicationDelete(replication_t replication) {
+	replicationImpl_t* pRepl = REPLICATION(replication);
+
+	if (pRepl) {
+		if (pRepl->hashMap) {
+			hashMapRemoveListener(pRepl->hashMap, replicationListener, pRepl);
+		}
+		if (pRepl->timer) {
+			event_free(pRepl->timer);
+		}
+		replicationDisconnect(pRepl);
+		if (pRepl->followerName) {
+			FREE(pRepl->followerName);
+		}
+		if (pRepl->followerIP) {
+			FREE(pRepl->followerIP);
+		}
+		FREE(pRepl);
+	}
+}
+
+void replicationGetStats(replication_t replication, replicationStats_t* pStats) {
+	replicationImpl_t* pRepl = REPLICATION(replication);
+
+	memset(pStats, 0, sizeof(replicationStats_t));
+	if (pRepl) {
+		*pStats = pRepl->stats;
+		if (pRepl->writeStream) {
+			pStats->backlogBytes = dataStreamGetSize(pRepl->writeStream);
+		}
+	}
+}
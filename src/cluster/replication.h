@@ -0,0 +1,44 @@
+#ifndef CLUSTER_REPLICATION_H_
+#define CLUSTER_REPLICATION_H_
+
+#include "../common/common.h"
+#include "../hashmap/hashmap.h"
+
+/* Asynchronous leader -> follower replication
+ *
+ * The leader (started with -f ip:port) listens to the puts and deletes
+ * of its hashMap and sends them to the follower as plain set/delete
+ * commands. The follower is a normal cacheismo, it serves reads and
+ * can take writes the moment clients are pointed to it.
+ *
+ * Every time the connection is made the follower is flushed and all
+ * the items are sent again by scanning the hashMap, writes made while
+ * the scan is running are sent as they happen. The replication log is
+ * the write stream of the connection, it shares the buffers of the
+ * items. If it grows beyond REPLICATION_MAX_BACKLOG the connection is
+ * dropped and a full resync is done on reconnect.
+ *
+ * Lag is measured by sending a version command behind the log every
+ * REPLICATION_PING_INTERVAL_MS, the follower answers it only after
+ * everything written before it is applied.
+ */
+
+typedef void* replication_t;
+
+typedef struct {
+	u_int32_t connected;
+	u_int32_t resyncing;       //full scan in progress
+	u_int64_t resyncs;         //connections made
+	u_int64_t commandsSent;    //set/delete/flush_all/version added to the log
+	u_int64_t commandsAcked;   //responses from the follower
+	u_int64_t bytesSent;       //written to the socket
+	u_int32_t backlogBytes;    //in the log, not yet written
+	u_int32_t lagMicros;       //last measured
+	u_int32_t maxLagMicros;
+} replicationStats_t;
+
+replication_t replicationCreate(char* follower, hashMap_t hashMap);
+void          replicationDelete(replication_t replication);
+void          replicationGetStats(replication_t replication, replicationStats_t* pStats);
+
+#endif /* CLUSTER_REPLICATION_H_ */
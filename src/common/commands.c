@@ -8,6 +8,10 @@ void commandDelete(fallocator_t fallocator, command_t* pCommand) {
 			fallocatorFree(fallocator, pCommand->key);
 			pCommand->key = 0;
 		}
+		if (pCommand->server) {
+			fallocatorFree(fallocator, pCommand->server);
+			pCommand->server = 0;
+		}
 		if (pCommand->dataStream) {
 			dataStreamDelete(pCommand->dataStream);
 			pCommand->dataStream = 0;
@@ -22,7 +22,17 @@ enum commands_enum_t {
 	COMMAND_FLUSH_ALL,
 	COMMAND_VERSION,
 	COMMAND_QUIT,
-	COMMAND_VERBOSITY
+	COMMAND_VERBOSITY,
+	COMMAND_RELOAD,
+	COMMAND_LGET,     //get which is never forwarded by the proxy
+	COMMAND_LADD,     //add which is never forwarded, used for moving keys
+	COMMAND_LDELETE,  //delete which is never forwarded
+	COMMAND_RING,
+	COMMAND_GOSSIP,   //member list of another server, see membership.h
+	COMMAND_SNAPSHOT,
+	COMMAND_SLOWLOG,
+	COMMAND_NEARSET,     //value of a hot key pushed by its owner, see hotpush.h
+	COMMAND_NEARDELETE
 };
 
 enum response_enum_t {
@@ -42,6 +52,7 @@ typedef struct {
 	enum commands_enum_t command;
 	char*                key;
 	u_int32_t            keySize;
+	char*                server;   //owner of the key for nearset and neardelete
 	u_int64_t            cas;
 	u_int64_t            delta;
 	u_int32_t            noreply;
@@ -53,6 +64,8 @@ typedef struct {
 	int                  multiGetKeysCount;
 	enum response_enum_t response;
 	void*                cacheItem;
+	u_int64_t            luaInstructions; //used by the script before it was suspended
+	u_int64_t            luaMicros;
 } command_t;
 
 void  commandDelete(fallocator_t fallocator, command_t* command);
@@ -0,0 +1,28 @@
+#include "crc32.h"
+
+static u_int32_t crcTable[256];
+static int       crcTableReady = 0;
+
+static void crcInit(void) {
+	for (u_int32_t i = 0; i < 256; i++) {
+		u_int32_t c = i;
+		for (int k = 0; k < 8; k++) {
+			c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+		}
+		crcTable[i] = c;
+	}
+	crcTableReady = 1;
+}
+
+u_int32_t crc32Update(u_int32_t crc, const void* data, size_t length) {
+	const unsigned char* p = data;
+
+	if (!crcTableReady) {
+		crcInit();
+	}
+	crc = ~crc;
+	while (length--) {
+		crc = crcTable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
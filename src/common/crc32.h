@@ -0,0 +1,12 @@
+#ifndef COMMON_CRC32_H_
+#define COMMON_CRC32_H_
+
+#include "common.h"
+
+/* CRC-32 as in zlib, table driven. Start with crc 0 and feed the
+ * previous result back in to checksum data in pieces.
+ */
+
+u_int32_t crc32Update(u_int32_t crc, const void* data, size_t length);
+
+#endif /* COMMON_CRC32_H_ */
@@ -0,0 +1,76 @@
+#include "hdrhistogram.h"
+
+/* shift is how many low bits the bucket ignores, the sub bucket is the
+ * top seven bits of the value, 64 to 127 once shifted */
+static inline int bucketOf(u_int64_t value) {
+	int shift = 0;
+
+	if (value < 2 * HDR_SUB_BUCKETS) {
+		return value;
+	}
+	shift = (63 - __builtin_clzll(value)) - 6;
+	return (shift * HDR_SUB_BUCKETS) + (value >> shift);
+}
+
+u_int64_t hdrHistogramBucketLimit(int bucket) {
+	int       shift = 0;
+	u_int64_t sub   = 0;
+
+	if (bucket < 2 * HDR_SUB_BUCKETS) {
+		return bucket;
+	}
+	shift = (bucket / HDR_SUB_BUCKETS) - 1;
+	sub   = (bucket % HDR_SUB_BUCKETS) + HDR_SUB_BUCKETS;
+	return ((sub + 1) << shift) - 1;
+}
+
+void hdrHistogramAdd(hdrHistogram_t* pHistogram, u_int64_t value) {
+	if ((pHistogram->count == 0) || (value < pHistogram->min)) {
+		pHistogram->min = value;
+	}
+	if (value > pHistogram->max) {
+		pHistogram->max = value;
+	}
+	pHistogram->count++;
+	pHistogram->sum += value;
+	pHistogram->buckets[bucketOf(value)]++;
+}
+
+void hdrHistogramMerge(hdrHistogram_t* pTo, hdrHistogram_t* pFrom) {
+	if (pFrom->count == 0) {
+		return;
+	}
+	if ((pTo->count == 0) || (pFrom->min < pTo->min)) {
+		pTo->min = pFrom->min;
+	}
+	if (pFrom->max > pTo->max) {
+		pTo->max = pFrom->max;
+	}
+	pTo->count += pFrom->count;
+	pTo->sum   += pFrom->sum;
+	for (int i = 0; i < HDR_BUCKETS; i++) {
+		pTo->buckets[i] += pFrom->buckets[i];
+	}
+}
+
+u_int64_t hdrHistogramPercentile(hdrHistogram_t* pHistogram, double percentile) {
+	u_int64_t rank  = 0;
+	u_int64_t seen  = 0;
+	u_int64_t limit = 0;
+
+	if (pHistogram->count == 0) {
+		return 0;
+	}
+	rank = (u_int64_t)((pHistogram->count * percentile) / 100);
+	if (rank < 1) {
+		rank = 1;
+	}
+	for (int i = 0; i < HDR_BUCKETS; i++) {
+		seen += pHistogram->buckets[i];
+		if (seen >= rank) {
+			limit = hdrHistogramBucketLimit(i);
+			break;
+		}
+	}
+	return (limit < pHistogram->max) ? limit : pHistogram->max;
+}
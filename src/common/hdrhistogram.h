@@ -0,0 +1,33 @@
+#ifndef COMMON_HDRHISTOGRAM_H_
+#define COMMON_HDRHISTOGRAM_H_
+
+#include "common.h"
+
+/* High dynamic range histogram
+ *
+ * Values below 128 have a bucket each. Above that every power of two
+ * range is cut in 64 buckets, so a value is known to better than 1.6%
+ * from nanoseconds to hours. Adding a value is a few instructions, so
+ * it can be used on every request, at 30KB a histogram.
+ */
+
+#define HDR_SUB_BUCKETS  64
+#define HDR_BUCKETS      ((64 - 6) * HDR_SUB_BUCKETS + 2 * HDR_SUB_BUCKETS)
+
+typedef struct {
+	u_int64_t count;
+	u_int64_t sum;
+	u_int64_t min;
+	u_int64_t max;
+	u_int64_t buckets[HDR_BUCKETS];
+} hdrHistogram_t;
+
+void      hdrHistogramAdd(hdrHistogram_t* pHistogram, u_int64_t value);
+void      hdrHistogramMerge(hdrHistogram_t* pTo, hdrHistogram_t* pFrom);
+/* percentile between 0 and 100, the highest value of its bucket but
+ * never above the maximum, 0 for an empty histogram */
+u_int64_t hdrHistogramPercentile(hdrHistogram_t* pHistogram, double percentile);
+/* the largest value counted in bucket */
+u_int64_t hdrHistogramBucketLimit(int bucket);
+
+#endif /* COMMON_HDRHISTOGRAM_H_ */
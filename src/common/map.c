@@ -67,6 +67,16 @@ void mapDelete(map_t hashMap) {
     hashMapImpl_t* pHashMap = HASHMAPIMPL(hashMap);
     if (pHashMap) {
         if (pHashMap->pBuckets) {
+            /* the keys are ours, the values belong to the caller */
+            for (u_int32_t i = 0; i < pHashMap->size; i++) {
+                hashEntry_t* pElement = pHashMap->pBuckets[i];
+                while (pElement) {
+                    hashEntry_t* pNext = pElement->pMapNext;
+                    FREE(pElement->key);
+                    FREE(pElement);
+                    pElement = pNext;
+                }
+            }
             FREE(pHashMap->pBuckets);
             pHashMap->pBuckets = 0;
         }
@@ -242,3 +252,14 @@ OnError:
 OnSuccess:
     return 0;
 }
+
+void mapVisit(map_t hashMap, mapVisitor_t visitor, void* context) {
+    hashMapImpl_t* pHashMap = HASHMAPIMPL(hashMap);
+    if (pHashMap) {
+        for (u_int32_t i = 0; i < pHashMap->size; i++) {
+            for (hashEntry_t* pElement = pHashMap->pBuckets[i]; pElement; pElement = pElement->pMapNext) {
+                visitor(context, pElement->key, pElement->value);
+            }
+        }
+    }
+}
@@ -4,6 +4,8 @@
 #include "common.h"
 
 typedef void* map_t;
+/* must not change the map */
+typedef void (*mapVisitor_t)(void* context, char* key, void* value);
 
 map_t          mapCreate(void);
 void           mapDelete(map_t map);
@@ -11,5 +13,6 @@ int            mapPutElement(map_t map, char* key, void* value);
 void*          mapGetElement(map_t map, char* key);
 int            mapDeleteElement(map_t map, char* key);
 u_int32_t      mapSize(map_t map);
+void           mapVisit(map_t map, mapVisitor_t visitor, void* context);
 
 #endif //COMMON_MAP_H_
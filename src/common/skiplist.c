@@ -61,6 +61,11 @@ void  skipListDelete(skipList_t skipList) {
 			FREE(pCurrent);
 			pCurrent = pNext;
 		}
+		while (pList->freeList) {
+			freeNode_t* pNext = pList->freeList->next;
+			FREE(pList->freeList);
+			pList->freeList = pNext;
+		}
 		FREE(pList->head);
 		FREE(pList);
 	}
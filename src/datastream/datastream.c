@@ -37,6 +37,26 @@ typedef struct {
 #define DATA_STREAM(x) ((dataStreamImpl_t*)(x))
 
 #define MIN_VECTOR_LENGTH 1
+#define MAX_COPY_BUFFER_SIZE (32 * 1024)
+#define VECTORS_PER_PAGE     128       //2KB, fits in a chunk
+#define MAX_VECTOR_PAGES     256       //a clone of up to 128MB
+
+/* The vectors of a clone are in the chunkpool, which has no chunk larger
+ * than 4KB. Up to VECTORS_PER_PAGE vectors, values up to about 512KB,
+ * they are in one chunk. A clone with more has pVector pointing to a
+ * chunk of MAX_VECTOR_PAGES pointers to pages of VECTORS_PER_PAGE vectors
+ * and vectorLength is a multiple of VECTORS_PER_PAGE.
+ */
+static inline int isPaged(dataStreamImpl_t* pDataStream) {
+	return pDataStream->chunkpool && (pDataStream->vectorLength > VECTORS_PER_PAGE);
+}
+
+static inline dataVector_t* vectorAt(dataStreamImpl_t* pDataStream, u_int32_t index) {
+	if (isPaged(pDataStream)) {
+		return &((dataVector_t**)pDataStream->pVector)[index / VECTORS_PER_PAGE][index % VECTORS_PER_PAGE];
+	}
+	return &pDataStream->pVector[index];
+}
 
 typedef struct {
 	u_int16_t refcount;
@@ -72,6 +92,9 @@ void* dataStreamBufferAllocate(chunkpool_t chunkpool, fallocator_t fallocator, u
 static void* dataStreamBufferAllocateRelaxed(chunkpool_t chunkpool, u_int32_t size, u_int32_t* actualSize) {
 	bufferImpl_t* pBuffer = 0;
 	if (chunkpool) {
+		if (size > (chunkpoolMaxMallocSize(chunkpool) - sizeof(bufferImpl_t))) {
+			size = chunkpoolMaxMallocSize(chunkpool) - sizeof(bufferImpl_t);
+		}
 		pBuffer = chunkpoolMalloc(chunkpool, sizeof(bufferImpl_t)+size);
 		if (pBuffer) {
 			pBuffer->refcount    = 1;
@@ -251,6 +274,46 @@ dataStream_t dataStreamCreate(void) {
 }
 
 
+/* doubles the vectors of a clone up to a page, then adds a page */
+static int dataStreamCloneGrow(dataStreamImpl_t* pClone) {
+	chunkpool_t    chunkpool = pClone->chunkpool;
+	dataVector_t** pPages    = 0;
+	dataVector_t*  pPage     = 0;
+	u_int32_t      pageCount = pClone->vectorLength / VECTORS_PER_PAGE;
+
+	if (pClone->vectorLength < VECTORS_PER_PAGE) {
+		u_int32_t length = pClone->vectorLength * 2;
+		if (length > VECTORS_PER_PAGE) {
+			length = VECTORS_PER_PAGE;
+		}
+		pPage = chunkpoolRealloc(chunkpool, pClone->pVector, length * sizeof(dataVector_t));
+		IfTrue(pPage, DEBUG, "Error in realloc for vector of size %ld", length * sizeof(dataVector_t));
+		pClone->pVector      = pPage;
+		pClone->vectorLength = length;
+		return 0;
+	}
+	IfTrue(pageCount < MAX_VECTOR_PAGES, DEBUG, "Clone larger than %d vectors", MAX_VECTOR_PAGES * VECTORS_PER_PAGE);
+	pPage = chunkpoolMalloc(chunkpool, VECTORS_PER_PAGE * sizeof(dataVector_t));
+	IfTrue(pPage, DEBUG, "Error allocating memory from chunkpool");
+	if (isPaged(pClone)) {
+		pPages = (dataVector_t**)pClone->pVector;
+	}else {
+		// the vectors so far become the first page
+		pPages = chunkpoolMalloc(chunkpool, MAX_VECTOR_PAGES * sizeof(dataVector_t*));
+		IfTrue(pPages, DEBUG, "Error allocating memory from chunkpool");
+		pPages[0]       = pClone->pVector;
+		pClone->pVector = (dataVector_t*)pPages;
+	}
+	pPages[pageCount]     = pPage;
+	pClone->vectorLength += VECTORS_PER_PAGE;
+	return 0;
+OnError:
+	if (pPage) {
+		chunkpoolFree(chunkpool, pPage);
+	}
+	return -1;
+}
+
 /*
  *
  */
@@ -265,6 +328,9 @@ dataStream_t dataStreamClone(chunkpool_t chunkpool, dataStream_t original) {
 	//int               j           = 0;
 
 	IfTrue(pClone, DEBUG, "Error allocating memory from chunkpool");
+	if (noOfVectors > VECTORS_PER_PAGE) {
+		noOfVectors = VECTORS_PER_PAGE;
+	}
 	pClone->chunkpool = chunkpool;
 	pClone->size      = pOriginal->size;
 	pClone->pVector   = chunkpoolMalloc(chunkpool, noOfVectors * sizeof(dataVector_t));
@@ -278,48 +344,44 @@ dataStream_t dataStreamClone(chunkpool_t chunkpool, dataStream_t original) {
 
     for (int i = 0; i < pOriginal->vectorUsed; i++) {
     	int copied = 0;
-    	while (copied < pOriginal->pVector[i].length) {
+    	while (copied < vectorAt(pOriginal, i)->length) {
 			if (!buffer) {
 				buffer = dataStreamBufferAllocateRelaxed(chunkpool, pOriginal->size - totalCopied, &bufferSize);
 				IfTrue(buffer, DEBUG, "Error allocating memory");
 				bufferUsed = 0;
 
 			}
-			if ((pOriginal->pVector[i].length - copied) <= (bufferSize - bufferUsed)) {
-				memcpy(buffer+bufferUsed, (char*)pOriginal->pVector[i].buffer + (pOriginal->pVector[i].offset + copied),
-						                 (pOriginal->pVector[i].length - copied));
-				bufferUsed  += pOriginal->pVector[i].length - copied;
-				totalCopied += pOriginal->pVector[i].length - copied;
-				copied      = pOriginal->pVector[i].length;
+			if ((vectorAt(pOriginal, i)->length - copied) <= (bufferSize - bufferUsed)) {
+				memcpy(buffer+bufferUsed, (char*)vectorAt(pOriginal, i)->buffer + (vectorAt(pOriginal, i)->offset + copied),
+						                 (vectorAt(pOriginal, i)->length - copied));
+				bufferUsed  += vectorAt(pOriginal, i)->length - copied;
+				totalCopied += vectorAt(pOriginal, i)->length - copied;
+				copied      = vectorAt(pOriginal, i)->length;
 			}else {
-				memcpy(buffer+bufferUsed, (char*)pOriginal->pVector[i].buffer + pOriginal->pVector[i].offset + copied, bufferSize - bufferUsed);
+				memcpy(buffer+bufferUsed, (char*)vectorAt(pOriginal, i)->buffer + vectorAt(pOriginal, i)->offset + copied, bufferSize - bufferUsed);
 				copied      += (bufferSize - bufferUsed);
 				totalCopied += (bufferSize - bufferUsed);
 				bufferUsed   = bufferSize;
 			}
 
 			if (bufferUsed == bufferSize) {
-				pClone->pVector[pClone->vectorUsed].buffer = buffer;
-				pClone->pVector[pClone->vectorUsed].offset = 0;
-				pClone->pVector[pClone->vectorUsed].length = bufferSize;
+				vectorAt(pClone, pClone->vectorUsed)->buffer = buffer;
+				vectorAt(pClone, pClone->vectorUsed)->offset = 0;
+				vectorAt(pClone, pClone->vectorUsed)->length = bufferSize;
 				pClone->vectorUsed++;
 				buffer = 0;
 
 				if (pClone->vectorUsed == pClone->vectorLength) {
-					dataVector_t* newVector =  chunkpoolRealloc(chunkpool, pClone->pVector, pClone->vectorLength * 2 * (sizeof(dataVector_t)));
-					IfTrue(newVector, DEBUG,  "Error in realloc for vector of size %ld",  (pClone->vectorLength * 2 * (sizeof(dataVector_t))));
-					pClone->pVector = newVector;
-					pClone->vectorLength = pClone->vectorLength * 2;
-					newVector = 0;
+					IfTrue(0 == dataStreamCloneGrow(pClone), DEBUG, "Error growing the vectors");
 				}
 			}
     	}
     }
     if (buffer) {
     	//copy the last buffer
-		pClone->pVector[pClone->vectorUsed].buffer = buffer;
-		pClone->pVector[pClone->vectorUsed].offset = 0;
-		pClone->pVector[pClone->vectorUsed].length = bufferUsed;
+		vectorAt(pClone, pClone->vectorUsed)->buffer = buffer;
+		vectorAt(pClone, pClone->vectorUsed)->offset = 0;
+		vectorAt(pClone, pClone->vectorUsed)->length = bufferUsed;
 		buffer = 0;
 		pClone->vectorUsed++;
     }
@@ -337,16 +399,64 @@ OnSuccess:
 	return pClone;
 }
 
+int dataStreamRestore(chunkpool_t chunkpool, dataStream_t dataStream) {
+	dataStreamImpl_t* pDataStream = DATA_STREAM(dataStream);
+	bufferImpl_t*     pBuffer     = 0;
+	u_int32_t         size        = 0;
+
+	IfTrue(chunkpoolIsAllocated(chunkpool, pDataStream), WARN, "Stream not in chunkpool");
+	IfTrue(pDataStream->chunkpool == chunkpool, WARN, "Stream of another chunkpool");
+	IfTrue(pDataStream->vectorUsed <= pDataStream->vectorLength, WARN, "Bad vector count");
+	IfTrue(chunkpoolIsAllocated(chunkpool, pDataStream->pVector), WARN, "Vector not in chunkpool");
+	if (isPaged(pDataStream)) {
+		dataVector_t** pPages = (dataVector_t**)pDataStream->pVector;
+		IfTrue((pDataStream->vectorLength % VECTORS_PER_PAGE) == 0, WARN, "Bad vector count");
+		IfTrue(pDataStream->vectorLength <= (MAX_VECTOR_PAGES * VECTORS_PER_PAGE), WARN, "Bad vector count");
+		for (int i = 0; i < pDataStream->vectorLength / VECTORS_PER_PAGE; i++) {
+			IfTrue(chunkpoolIsAllocated(chunkpool, pPages[i]), WARN, "Vector page not in chunkpool");
+		}
+	}
+	for (int i = 0; i < pDataStream->vectorUsed; i++) {
+		pBuffer = (bufferImpl_t*)((char*)vectorAt(pDataStream, i)->buffer - sizeof(bufferImpl_t));
+		IfTrue(chunkpoolIsAllocated(chunkpool, pBuffer), WARN, "Buffer not in chunkpool");
+		IfTrue(pBuffer->isChunkpool && (pBuffer->chunkpool == chunkpool), WARN, "Bad buffer");
+		size += vectorAt(pDataStream, i)->length;
+	}
+	IfTrue(size == pDataStream->size, WARN, "Bad stream size");
+
+	/* the requests holding references are gone with the old process */
+	for (int i = 0; i < pDataStream->vectorUsed; i++) {
+		pBuffer = (bufferImpl_t*)((char*)vectorAt(pDataStream, i)->buffer - sizeof(bufferImpl_t));
+		pBuffer->refcount = 1;
+		chunkpoolMark(chunkpool, pBuffer);
+	}
+	if (isPaged(pDataStream)) {
+		for (int i = 0; i < pDataStream->vectorLength / VECTORS_PER_PAGE; i++) {
+			chunkpoolMark(chunkpool, ((dataVector_t**)pDataStream->pVector)[i]);
+		}
+	}
+	chunkpoolMark(chunkpool, pDataStream->pVector);
+	chunkpoolMark(chunkpool, pDataStream);
+	return 0;
+OnError:
+	return -1;
+}
+
 void dataStreamDelete(dataStream_t dataStream) {
 	dataStreamImpl_t* pDataStream = DATA_STREAM(dataStream);
 	if (pDataStream) {
 		for (int i = 0; i < pDataStream->vectorUsed; i++) {
-			dataVector_t pVector = pDataStream->pVector[i];
+			dataVector_t pVector = *vectorAt(pDataStream, i);
 			if (pVector.buffer != NULL) {
 				dataStreamBufferFree(pVector.buffer);
 			}
 		}
 		if (pDataStream->chunkpool) {
+			if (isPaged(pDataStream)) {
+				for (int i = 0; i < pDataStream->vectorLength / VECTORS_PER_PAGE; i++) {
+					chunkpoolFree(pDataStream->chunkpool, ((dataVector_t**)pDataStream->pVector)[i]);
+				}
+			}
 			chunkpoolFree(pDataStream->chunkpool, pDataStream->pVector);
 			chunkpoolFree(pDataStream->chunkpool, pDataStream);
 		}else {
@@ -370,8 +480,11 @@ u_int32_t dataStreamTotalSize(dataStream_t dataStream) {
 	if (pDataStream) {
 		totalSize += sizeof(dataStreamImpl_t);
 		totalSize += pDataStream->vectorLength * sizeof(dataVector_t);
+		if (isPaged(pDataStream)) {
+			totalSize += MAX_VECTOR_PAGES * sizeof(dataVector_t*);
+		}
 		for (int i = 0; i < pDataStream->vectorUsed; i++) {
-			totalSize += pDataStream->pVector[i].length + sizeof(bufferImpl_t);
+			totalSize += vectorAt(pDataStream, i)->length + sizeof(bufferImpl_t);
 		}
 	}
 	return totalSize;
@@ -419,9 +532,9 @@ int dataStreamAppendDataStream(dataStream_t dataStream, dataStream_t toAppend) {
 
 	originalLength = dataStreamGetSize(dataStream);
 	for (int i = 0; i < pAppendStream->vectorUsed; i++) {
-		returnValue = dataStreamAppendData(pDataStream, pAppendStream->pVector[i].buffer,
-				                                        pAppendStream->pVector[i].offset,
-				                                        pAppendStream->pVector[i].length);
+		returnValue = dataStreamAppendData(pDataStream, vectorAt(pAppendStream, i)->buffer,
+				                                        vectorAt(pAppendStream, i)->offset,
+				                                        vectorAt(pAppendStream, i)->length);
 		IfTrue(returnValue == 0, ERR, "Error appending data");
 	}
 
@@ -434,6 +547,62 @@ OnSuccess:
 	return returnValue;
 }
 
+/* Unlike dataStreamAppendDataStream this does not share the buffers
+ * of toCopy. Used when toCopy belongs to a connection which might go
+ * away before dataStream is written.
+ */
+int dataStreamAppendCopy(dataStream_t dataStream, fallocator_t fallocator, dataStream_t toCopy) {
+	dataStreamImpl_t* pCopyStream    = DATA_STREAM(toCopy);
+	char*             buffer         = 0;
+	u_int32_t         remaining      = 0;
+	u_int32_t         originalLength = 0;
+	int               index          = 0;
+	u_int32_t         vectorOffset   = 0;
+	int               returnValue    = 0;
+
+	IfTrue(dataStream, ERR, "Null dataStream");
+	IfTrue(pCopyStream, ERR, "Null dataStream");
+	originalLength = dataStreamGetSize(dataStream);
+	remaining      = pCopyStream->size;
+	// vector length and offset are 16 bit, copy in bounded buffers
+	while (remaining > 0) {
+		u_int32_t bufferSize = (remaining > MAX_COPY_BUFFER_SIZE) ? MAX_COPY_BUFFER_SIZE : remaining;
+		u_int32_t copied     = 0;
+
+		buffer = dataStreamBufferAllocate(NULL, fallocator, bufferSize);
+		IfTrue(buffer, WARN, "Error allocating memory");
+		while (copied < bufferSize) {
+			dataVector_t* pVector = vectorAt(pCopyStream, index);
+			u_int32_t     length  = pVector->length - vectorOffset;
+			if (length > (bufferSize - copied)) {
+				length = bufferSize - copied;
+			}
+			memcpy(buffer+copied, ((char*)(pVector->buffer))+pVector->offset+vectorOffset, length);
+			copied       += length;
+			vectorOffset += length;
+			if (vectorOffset == pVector->length) {
+				index++;
+				vectorOffset = 0;
+			}
+		}
+		returnValue = dataStreamAppendData(dataStream, buffer, 0, copied);
+		//the stream holds its own reference now
+		dataStreamBufferFree(buffer);
+		buffer = 0;
+		IfTrue(returnValue == 0, ERR, "Error appending data");
+		remaining -= copied;
+	}
+	goto OnSuccess;
+OnError:
+	returnValue = -1;
+	//no partial appends
+	if (dataStream) {
+		dataStreamTruncateFromEnd(dataStream, originalLength);
+	}
+OnSuccess:
+	return returnValue;
+}
+
 void dataStreamPrint(dataStream_t dataStream) {
 //#if DEBUG_ME
 #if 0
@@ -460,10 +629,9 @@ char*  dataStreamToString(dataStream_t dataStream) {
 	}
 
 	for (int i = 0; i < pDataStream->vectorUsed; i++) {
-		memcpy(buffer+copied,
-				((char*)(pDataStream->pVector[i].buffer))+pDataStream->pVector[i].offset,
-				pDataStream->pVector[i].length);
-		copied += pDataStream->pVector[i].length;
+		dataVector_t* pVector = vectorAt(pDataStream, i);
+		memcpy(buffer+copied, ((char*)(pVector->buffer))+pVector->offset, pVector->length);
+		copied += pVector->length;
 	}
 	buffer[pDataStream->size] = 0;
 	return buffer;
@@ -517,7 +685,7 @@ static int calculateNumberOfVectors(dataStreamImpl_t* db, u_int32_t offset, u_in
 	for (int i = 0; i < db->vectorUsed; i++) {
 		int added = 0;
 		byteRangeStart = byteRangeEnd;
-		byteRangeEnd  += db->pVector[i].length;
+		byteRangeEnd  += vectorAt(db, i)->length;
 
 		if (!started) {
 			if (byteRangeStart > offset) {
@@ -576,25 +744,25 @@ dataStreamIterator_t dataStreamIteratorCreate(fallocator_t fallocator, dataStrea
 	for (int i = start; i <= end; i++) {
 		bool added     = false;
 		byteRangeStart = byteRangeEnd;
-		byteRangeEnd  += pDataStream->pVector[i].length;
+		byteRangeEnd  += vectorAt(pDataStream, i)->length;
 
 		//* first vector
 		if ((byteRangeStart <= offset) && (byteRangeEnd > offset)) {
-			pIterator->pVector[count].buffer = pDataStream->pVector[i].buffer;
-			pIterator->pVector[count].offset = pDataStream->pVector[i].offset + (offset - byteRangeStart);
-			pIterator->pVector[count].length = pDataStream->pVector[i].length - (offset - byteRangeStart);
+			pIterator->pVector[count].buffer = vectorAt(pDataStream, i)->buffer;
+			pIterator->pVector[count].offset = vectorAt(pDataStream, i)->offset + (offset - byteRangeStart);
+			pIterator->pVector[count].length = vectorAt(pDataStream, i)->length - (offset - byteRangeStart);
 			added = true;
-			dataStreamBufferIncrementRefCount(pDataStream->pVector[i].buffer);
+			dataStreamBufferIncrementRefCount(vectorAt(pDataStream, i)->buffer);
 		}
 
 		// last vector
 		if ((byteRangeStart < (offset+length)) && (byteRangeEnd >= (offset+length))) {
 			if (!added) {
-				pIterator->pVector[count].buffer = pDataStream->pVector[i].buffer;
-				pIterator->pVector[count].offset = pDataStream->pVector[i].offset;
-				pIterator->pVector[count].length = pDataStream->pVector[i].length - (byteRangeEnd - (offset+length));
+				pIterator->pVector[count].buffer = vectorAt(pDataStream, i)->buffer;
+				pIterator->pVector[count].offset = vectorAt(pDataStream, i)->offset;
+				pIterator->pVector[count].length = vectorAt(pDataStream, i)->length - (byteRangeEnd - (offset+length));
 				added = true;
-				dataStreamBufferIncrementRefCount(pDataStream->pVector[i].buffer);
+				dataStreamBufferIncrementRefCount(vectorAt(pDataStream, i)->buffer);
 			}else {
 				// if it is both first and last vector at the same time
 				// adjust the length of the vector
@@ -604,11 +772,11 @@ dataStreamIterator_t dataStreamIteratorCreate(fallocator_t fallocator, dataStrea
 
 		if (byteRangeStart > offset && byteRangeEnd < (offset+length)) {
 			if (!added) {
-				pIterator->pVector[count].buffer = pDataStream->pVector[i].buffer;
-				pIterator->pVector[count].offset = pDataStream->pVector[i].offset;
-				pIterator->pVector[count].length = pDataStream->pVector[i].length;
+				pIterator->pVector[count].buffer = vectorAt(pDataStream, i)->buffer;
+				pIterator->pVector[count].offset = vectorAt(pDataStream, i)->offset;
+				pIterator->pVector[count].length = vectorAt(pDataStream, i)->length;
 				added = true;
-				dataStreamBufferIncrementRefCount(pDataStream->pVector[i].buffer);
+				dataStreamBufferIncrementRefCount(vectorAt(pDataStream, i)->buffer);
 			}
 		}
 
@@ -678,9 +846,9 @@ int dataStreamFindEndOfLine(dataStream_t dataStream) {
 	IfTrue(dataStream, WARN, "Null data Stream");
 
 	for (int vi = 0; vi < pDataStream->vectorUsed; vi++) {
-		for (u_int32_t i = 0; i < pDataStream->pVector[vi].length; i++) {
+		for (u_int32_t i = 0; i < vectorAt(pDataStream, vi)->length; i++) {
 			previous = current;
-			current = *(((char*)pDataStream->pVector[vi].buffer) + ( pDataStream->pVector[vi].offset + i));
+			current = *(((char*)vectorAt(pDataStream, vi)->buffer) + ( vectorAt(pDataStream, vi)->offset + i));
 			if (current == '\n') {
 				if (previous == '\r') {
 					result =  sofar + i - 1;
@@ -690,7 +858,7 @@ int dataStreamFindEndOfLine(dataStream_t dataStream) {
 				}
 			}
 		}
-		sofar += pDataStream->pVector[vi].length;
+		sofar += vectorAt(pDataStream, vi)->length;
 	}
 	goto OnSuccess;
 OnError:
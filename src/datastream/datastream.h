@@ -20,6 +20,7 @@ u_int32_t            dataStreamGetSize(dataStream_t dataStream);
 u_int32_t            dataStreamTotalSize(dataStream_t dataStream);
 int                  dataStreamAppendData(dataStream_t dataStream, void* buffer, u_int32_t offset, u_int32_t length);
 int                  dataStreamAppendDataStream(dataStream_t dataStream, dataStream_t toAppend);
+int                  dataStreamAppendCopy(dataStream_t dataStream, fallocator_t fallocator, dataStream_t toCopy);
 int                  dataStreamFindEndOfLine(dataStream_t dataStream);
 
 int                  dataStreamTruncateFromStart(dataStream_t dataStream, u_int32_t finalSize);
@@ -42,5 +43,9 @@ char*                dataStreamIteratorGetString(fallocator_t fallocator, dataSt
 
 /* data stream clone API */
 dataStream_t         dataStreamClone(chunkpool_t chunkpool, dataStream_t dataStream);
+/* For a clone found in a restored chunkpool: marks its chunks and sets
+ * the buffer refcounts back to 1. -1 if it doesn't look like a clone.
+ */
+int                  dataStreamRestore(chunkpool_t chunkpool, dataStream_t dataStream);
 
 #endif /* IO_DATABUFFER_H_ */
@@ -49,6 +49,8 @@ typedef struct memoryBuffer_t {
 static int             MAX_BUFFER_COUNT = 4096;
 static int             freeCount        = 0;
 static memoryBuffer_t* pGlobalFreeList  = 0;
+static u_int64_t       cacheHits        = 0;
+static u_int64_t       cacheMisses      = 0;
 
 /*  Every pointer that we give to the user has a 8/4 bytes overhead to keep track of the 
  *  memoryBuffer_t it belongs to. We can optimize on this is many ways (make this zero)
@@ -81,9 +83,13 @@ static memoryBuffer_t* allocateMemoryBuffer(u_int32_t size) {
 			pGlobalFreeList->pPrev = 0;
 		}
 		freeCount--;
+		cacheHits++;
 		memset(pBuffer, 0, size + sizeof(memoryBuffer_t));
 		pBuffer->size = size;
 	}else {
+		if (size == DEFAULT_BUFFER_SIZE) {
+			cacheMisses++;
+		}
 		pBuffer = (memoryBuffer_t*)malloc(size + sizeof(memoryBuffer_t));
 		if (pBuffer) {
 			memset(pBuffer, 0, size + sizeof(memoryBuffer_t));
@@ -144,7 +150,8 @@ static void delinkBuffer(memoryBuffer_t* pBuffer, memoryBuffer_t** ppHead) {
 			pBuffer->pPrev->pNext = pBuffer->pNext;
 			pBuffer->pNext->pPrev = pBuffer->pPrev;
 		}else {
-			pBuffer->pPrev->pNext = 0;
+			*ppHead = pBuffer->pNext;
+			pBuffer->pNext->pPrev = 0;
 		}
 	}else {
 		if (pBuffer->pPrev) {
@@ -299,3 +306,11 @@ void fallocatorInit(u_int32_t bufferCount) {
 	MAX_BUFFER_COUNT = bufferCount;
 }
 
+void fallocatorGetStats(fallocatorStats_t* pStats) {
+	pStats->bufferSize     = DEFAULT_BUFFER_SIZE;
+	pStats->freeBuffers    = freeCount;
+	pStats->maxFreeBuffers = MAX_BUFFER_COUNT;
+	pStats->hits           = cacheHits;
+	pStats->misses         = cacheMisses;
+}
+
@@ -7,12 +7,25 @@
  
 typedef void* fallocator_t;
 
+/* The buffers of the default size are cached across fallocators, upto
+ * the bufferCount given to fallocatorInit. hits and misses count the
+ * buffers taken from the cache and the ones which had to be malloced.
+ */
+typedef struct {
+	u_int32_t bufferSize;
+	u_int32_t freeBuffers;
+	u_int32_t maxFreeBuffers;
+	u_int64_t hits;
+	u_int64_t misses;
+} fallocatorStats_t;
+
 void          fallocatorInit(u_int32_t bufferCount);
 fallocator_t  fallocatorCreate(void);
 void          fallocatorDelete(fallocator_t fallocator);
 void*         fallocatorMalloc(fallocator_t fallocator, u_int32_t size);
 void*         fallocatorRealloc(fallocator_t fallocator, void* pointer, u_int32_t osize, u_int32_t nsize);
 void          fallocatorFree(fallocator_t fallocator, void* pointer);
+void          fallocatorGetStats(fallocatorStats_t* pStats);
 
 
 #endif /* FALLOCATOR_H_ */
@@ -50,6 +50,18 @@ typedef struct {
 	hashEntry_t**    queue;
 }minHeapImpl_t;
 
+#define HASHMAP_MAX_LISTENERS       8
+
+typedef struct {
+	hashMapListener_t listener;
+	void*             context;
+} hashMapListenerEntry_t;
+
+typedef struct {
+	hashMapLookupListener_t listener;
+	void*                   context;
+} hashMapLookupListenerEntry_t;
+
 typedef struct hashMapImpl_t {
 	u_int32_t        count;
     u_int32_t        size;
@@ -61,6 +73,14 @@ typedef struct hashMapImpl_t {
 	minHeapImpl_t*   pMinHeap;
 	hashEntry_t*     pLRUListHead;
 	hashEntry_t*     pLRUListTail;
+	u_int32_t               listenerCount;
+	hashMapListenerEntry_t  listeners[HASHMAP_MAX_LISTENERS];
+	u_int32_t                     lookupListenerCount;
+	hashMapLookupListenerEntry_t  lookupListeners[HASHMAP_MAX_LISTENERS];
+	u_int64_t        hits;
+	u_int64_t        misses;
+	u_int64_t        expired;
+	u_int64_t        evicted;
 }hashMapImpl_t;
 
 
@@ -70,6 +90,9 @@ typedef struct hashMapImpl_t {
 #define INITIAL_MAXSPLIT_BITS       3
 #define INITIAL_MAXSPLIT_SIZE       (hashsize(INITIAL_MAXSPLIT_BITS))
 
+#define HASHMAP_BATCH_SIZE          32
+#define HASHMAP_PREFETCH_DISTANCE   4
+
 #define hashsize(n) ((u_int32_t)1<<(n))
 #define hashmask(n) (hashsize(n)-1)
 
@@ -89,6 +112,11 @@ static u_int32_t currentTimeInSeconds(void)
     return  (u_int32_t) (ts.tv_sec);
 }
 
+static void notifyListeners(hashMapImpl_t* pHashMap, int event, void* value) {
+	for (u_int32_t i = 0; i < pHashMap->listenerCount; i++) {
+		pHashMap->listeners[i].listener(pHashMap->listeners[i].context, event, value);
+	}
+}
 
 static void removeFromLRUList(hashMapImpl_t* pHashMap, hashEntry_t* pEntry) {
 	if (pEntry->pLRUPrev) {
@@ -287,6 +315,23 @@ u_int32_t hashMapSize(hashMap_t hashMap) {
 	return 0;
 }
 
+void hashMapGetStats(hashMap_t hashMap, hashMapStats_t* pStats) {
+	hashMapImpl_t* pHashMap = HASHMAPIMPL(hashMap);
+
+	memset(pStats, 0, sizeof(hashMapStats_t));
+	if (pHashMap) {
+		pStats->count         = pHashMap->count;
+		pStats->buckets       = pHashMap->size;
+		pStats->activeBuckets = pHashMap->maxSplit + pHashMap->splitAt;
+		pStats->splitAt       = pHashMap->splitAt;
+		pStats->maxSplit      = pHashMap->maxSplit;
+		pStats->hits          = pHashMap->hits;
+		pStats->misses        = pHashMap->misses;
+		pStats->expired       = pHashMap->expired;
+		pStats->evicted       = pHashMap->evicted;
+	}
+}
+
 void hashMapDelete(hashMap_t hashMap) {
     hashMapImpl_t* pHashMap = HASHMAPIMPL(hashMap);
     if (pHashMap) {
@@ -347,6 +392,48 @@ static void splitBucket(hashMapImpl_t* pHashMap) {
     pHashMap->splitAt++;
 }
 
+/* Once every bucket of the round is split, the next round splits twice
+ * as many, the bucket array is doubled if needed.
+ */
+static int endSplitRound(hashMapImpl_t* pHashMap) {
+    if (pHashMap->splitAt == pHashMap->maxSplit) {
+    	 if ((pHashMap->maxSplit*2) >= pHashMap->size) {
+			 hashEntry_t** newBuckets  = realloc(pHashMap->pBuckets, 2 * pHashMap->size * sizeof(hashEntry_t*));
+			 if (!newBuckets) {
+				 return -1;
+			 }
+			 memset(newBuckets+pHashMap->size, 0, pHashMap->size * sizeof(hashEntry_t*));
+			 pHashMap->pBuckets = newBuckets;
+			 pHashMap->size     = 2 * pHashMap->size;
+    	 }
+         pHashMap->splitAt  = 0;
+         pHashMap->maskedBits++;
+         pHashMap->maxSplit = pHashMap->maxSplit * 2;
+    }
+    return 0;
+}
+
+int hashMapReserve(hashMap_t hashMap, u_int32_t count) {
+    hashMapImpl_t* pHashMap = HASHMAPIMPL(hashMap);
+    minHeapImpl_t* pMinHeap = pHashMap->pMinHeap;
+
+    /* the splits the puts would do, done on (mostly) empty buckets */
+    while (pHashMap->maxSplit < count) {
+        splitBucket(pHashMap);
+        IfTrue(0 == endSplitRound(pHashMap), WARN, "Error reallocating memory");
+    }
+    if (pMinHeap->capacity <= count) {
+        hashEntry_t** newQueue = realloc(pMinHeap->queue, sizeof(hashEntry_t*) * (count + 1));
+        IfTrue(newQueue, WARN, "Error increasing min heap size");
+        memset(newQueue+pMinHeap->capacity, 0, sizeof(hashEntry_t*) * (count + 1 - pMinHeap->capacity));
+        pMinHeap->queue    = newQueue;
+        pMinHeap->capacity = count + 1;
+    }
+    return 0;
+OnError:
+    return -1;
+}
+
 // Delete everything that has expired..
 // many people get confused looking at stats..
 // because expired items continue to be present
@@ -365,6 +452,7 @@ u_int32_t hashMapDeleteExpired(hashMap_t hashMap) {
     	checkMagic(pEntry);
     	hashMapDeleteElement(pHashMap, pHashMap->API->getKey(pEntry->value),
     			pHashMap->API->getKeyLength(pEntry->value));
+    	pHashMap->expired++;
     }
     //printf("\nhashMapDeleteExpired freed %d bytes\n", freeSpace);
     return freeSpace;
@@ -382,6 +470,7 @@ u_int64_t  hashMapDeleteLRU(hashMap_t hashMap, u_int64_t requiredSpace) {
 		checkMagic(pEntry);
 		hashMapDeleteElement(pHashMap, pHashMap->API->getKey(pEntry->value),
 				pHashMap->API->getKeyLength(pEntry->value));
+		pHashMap->evicted++;
 		pEntry = pHashMap->pLRUListTail;
 	}
 	return freeSpace;
@@ -412,22 +501,12 @@ int hashMapPutElement(hashMap_t hashMap, void* value) {
 
     minHeapInsert(pHashMap->pMinHeap, pElement);
     makeHeadOfLRUList(pHashMap, pElement);
+    notifyListeners(pHashMap, HASHMAP_EVENT_PUT, value);
 
     if (pHashMap->count > pHashMap->maxSplit) {
         splitBucket(pHashMap);
     }
-    if (pHashMap->splitAt == pHashMap->maxSplit) {
-    	 if ((pHashMap->maxSplit*2) >= pHashMap->size) {
-			 hashEntry_t** newBuckets  = realloc(pHashMap->pBuckets, 2 * pHashMap->size * sizeof(hashEntry_t*));
-			 IfTrue(newBuckets, WARN, "Error reallocating memory");
-			 memset(newBuckets+pHashMap->size, 0, pHashMap->size * sizeof(hashEntry_t*));
-			 pHashMap->pBuckets = newBuckets;
-			 pHashMap->size     = 2 * pHashMap->size;
-    	 }
-         pHashMap->splitAt  = 0;
-         pHashMap->maskedBits++;
-         pHashMap->maxSplit = pHashMap->maxSplit * 2;
-    }
+    IfTrue(0 == endSplitRound(pHashMap), WARN, "Error reallocating memory");
     checkMagic(pElement);
     goto OnSuccess;
 OnError:
@@ -439,17 +518,15 @@ OnSuccess:
 }
 
 
-void* hashMapGetElement(hashMap_t hashMap, char* key, u_int32_t keyLength) {
-    hashMapImpl_t* pHashMap  = HASHMAPIMPL(hashMap);
+/* Looks for the key in its bucket. Expired elements are deleted instead of
+ * being returned. The element returned has an extra reference.
+ */
+static void* lookupElement(hashMapImpl_t* pHashMap, char* key, u_int32_t keyLength,
+		u_int32_t hashValue, u_int32_t currentTime) {
     hashEntry_t*   pElement  = 0;
     hashEntry_t*   pPrev     = 0;
-    u_int32_t      hashValue = 0;
     u_int32_t      bucket    = 0;
 
-    IfTrue(pHashMap, ERR, "Null argument");
-    IfTrue(key && (keyLength > 0), INFO, "Invalid argument");
-
-    hashValue = hashcode(pHashMap, key, keyLength);
     bucket    = bucketOffset(pHashMap, hashValue);
     pElement  = pHashMap->pBuckets[bucket];
 
@@ -468,7 +545,7 @@ void* hashMapGetElement(hashMap_t hashMap, char* key, u_int32_t keyLength) {
     if (pElement) {
     	//found the element in the map
     	//check if it has expired
-    	if (currentTimeInSeconds() < pHashMap->API->getExpiry(pElement->value)) {
+    	if (currentTime < pHashMap->API->getExpiry(pElement->value)) {
     	  	pHashMap->API->addReference(pElement->value);
     	  	removeFromLRUList(pHashMap, pElement);
     	    makeHeadOfLRUList(pHashMap, pElement);
@@ -483,18 +560,99 @@ void* hashMapGetElement(hashMap_t hashMap, char* key, u_int32_t keyLength) {
 			minHeapDelete(pHashMap->pMinHeap, pElement);
 	    	removeFromLRUList(pHashMap, pElement);
 	    	checkMagic(pElement);
+	    	notifyListeners(pHashMap, HASHMAP_EVENT_DELETE, pElement->value);
 			pHashMap->API->onObjectDeleted(pHashMap->API->context, pElement->value);
 			//delete the memory used by the element
 			FREE(pElement);
 			pHashMap->count--;
+			pHashMap->expired++;
 			pElement = 0;
     	}
     }
+    if (pElement) {
+    	pHashMap->hits++;
+    }else {
+    	pHashMap->misses++;
+    }
+    for (u_int32_t i = 0; i < pHashMap->lookupListenerCount; i++) {
+    	pHashMap->lookupListeners[i].listener(pHashMap->lookupListeners[i].context, key, keyLength,
+    			pElement ? pElement->value : 0);
+    }
+    return pElement ? pElement->value : 0;
+}
+
+void* hashMapGetElement(hashMap_t hashMap, char* key, u_int32_t keyLength) {
+    hashMapImpl_t* pHashMap  = HASHMAPIMPL(hashMap);
+    void*          value     = 0;
+
+    IfTrue(pHashMap, ERR, "Null argument");
+    IfTrue(key && (keyLength > 0), INFO, "Invalid argument");
+
+    value = lookupElement(pHashMap, key, keyLength, hashcode(pHashMap, key, keyLength),
+    		currentTimeInSeconds());
     goto OnSuccess;
 OnError:
     LOG(INFO, "Error looking for key %p", key);
 OnSuccess:
-    return pElement ? pElement->value : 0;
+    return value;
+}
+
+/* Batch version of hashMapGetElement for multi gets. values[i] gets the
+ * element for keys[i] or 0. The hashes of a batch are computed up front
+ * and the bucket chains of the keys a few positions ahead are prefetched
+ * while the current key is compared, so the cache misses of different
+ * keys overlap instead of being paid one after another.
+ */
+u_int32_t hashMapGetElements(hashMap_t hashMap, u_int32_t count, char** keys,
+		u_int32_t* keyLengths, void** values) {
+    hashMapImpl_t* pHashMap    = HASHMAPIMPL(hashMap);
+    u_int32_t      hashValues[HASHMAP_BATCH_SIZE];
+    u_int32_t      currentTime = currentTimeInSeconds();
+    u_int32_t      found       = 0;
+
+    IfTrue(pHashMap, ERR, "Null argument");
+    IfTrue(keys && keyLengths && values, INFO, "Invalid argument");
+
+    for (u_int32_t base = 0; base < count; base += HASHMAP_BATCH_SIZE) {
+    	u_int32_t batch = count - base;
+    	if (batch > HASHMAP_BATCH_SIZE) {
+    		batch = HASHMAP_BATCH_SIZE;
+    	}
+    	for (u_int32_t i = 0; i < batch; i++) {
+    		if (keys[base+i] && keyLengths[base+i] > 0) {
+    			hashValues[i] = hashcode(pHashMap, keys[base+i], keyLengths[base+i]);
+    			__builtin_prefetch(&pHashMap->pBuckets[bucketOffset(pHashMap, hashValues[i])]);
+    		}
+    	}
+    	for (u_int32_t i = 0; i < batch; i++) {
+    		/* first entry of the chain a few keys ahead, then its value
+    		 * (holding the key) once the entry itself is in cache */
+    		u_int32_t ahead = i + HASHMAP_PREFETCH_DISTANCE;
+    		if (ahead < batch && keys[base+ahead] && keyLengths[base+ahead] > 0) {
+    			__builtin_prefetch(pHashMap->pBuckets[bucketOffset(pHashMap, hashValues[ahead])]);
+    		}
+    		ahead = i + HASHMAP_PREFETCH_DISTANCE/2;
+    		if (ahead < batch && keys[base+ahead] && keyLengths[base+ahead] > 0) {
+    			hashEntry_t* pAhead = pHashMap->pBuckets[bucketOffset(pHashMap, hashValues[ahead])];
+    			if (pAhead) {
+    				__builtin_prefetch(pAhead->value);
+    			}
+    		}
+    		values[base+i] = 0;
+    		if (keys[base+i] && keyLengths[base+i] > 0) {
+    			values[base+i] = lookupElement(pHashMap, keys[base+i], keyLengths[base+i],
+    					hashValues[i], currentTime);
+    			if (values[base+i]) {
+    				found++;
+    			}
+    		}
+    	}
+    }
+    goto OnSuccess;
+OnError:
+    found = 0;
+OnSuccess:
+    return found;
 }
 
 int hashMapDeleteElement(hashMap_t hashMap, char* key, u_int32_t keyLength) {
@@ -533,6 +691,7 @@ int hashMapDeleteElement(hashMap_t hashMap, char* key, u_int32_t keyLength) {
     	pElement->pMapNext = 0;
     	minHeapDelete(pHashMap->pMinHeap, pElement);
     	removeFromLRUList(pHashMap, pElement);
+    	notifyListeners(pHashMap, HASHMAP_EVENT_DELETE, pElement->value);
         pHashMap->API->onObjectDeleted(pHashMap->API->context, pElement->value);
         //delete the memory used by the element
         pHashMap->count--;
@@ -545,6 +704,81 @@ OnSuccess:
     return 0;
 }
 
+int hashMapAddListener(hashMap_t hashMap, hashMapListener_t listener, void* context) {
+	hashMapImpl_t* pHashMap = HASHMAPIMPL(hashMap);
+
+	IfTrue(pHashMap && listener, ERR, "Null argument");
+	IfTrue(pHashMap->listenerCount < HASHMAP_MAX_LISTENERS, ERR, "Too many hashMap listeners");
+	pHashMap->listeners[pHashMap->listenerCount].listener = listener;
+	pHashMap->listeners[pHashMap->listenerCount].context  = context;
+	pHashMap->listenerCount++;
+	return 0;
+OnError:
+	return -1;
+}
+
+int hashMapAddLookupListener(hashMap_t hashMap, hashMapLookupListener_t listener, void* context) {
+	hashMapImpl_t* pHashMap = HASHMAPIMPL(hashMap);
+
+	IfTrue(pHashMap && listener, ERR, "Null argument");
+	IfTrue(pHashMap->lookupListenerCount < HASHMAP_MAX_LISTENERS, ERR,
+			"Too many hashMap lookup listeners");
+	pHashMap->lookupListeners[pHashMap->lookupListenerCount].listener = listener;
+	pHashMap->lookupListeners[pHashMap->lookupListenerCount].context  = context;
+	pHashMap->lookupListenerCount++;
+	return 0;
+OnError:
+	return -1;
+}
+
+int hashMapRemoveListener(hashMap_t hashMap, hashMapListener_t listener, void* context) {
+	hashMapImpl_t* pHashMap = HASHMAPIMPL(hashMap);
+
+	IfTrue(pHashMap, ERR, "Null argument");
+	for (u_int32_t i = 0; i < pHashMap->listenerCount; i++) {
+		if ((pHashMap->listeners[i].listener == listener) &&
+				(pHashMap->listeners[i].context == context)) {
+			pHashMap->listenerCount--;
+			pHashMap->listeners[i] = pHashMap->listeners[pHashMap->listenerCount];
+			return 0;
+		}
+	}
+OnError:
+	return -1;
+}
+
+/* Buckets [0, maxSplit+splitAt) are in use. A split only moves elements
+ * from a bucket to one with a higher offset, so a scan going up never
+ * misses an element that stays in the map.
+ */
+u_int32_t hashMapScan(hashMap_t hashMap, u_int32_t cursor, u_int32_t maxBuckets,
+		hashMapVisitor_t visitor, void* context) {
+	hashMapImpl_t* pHashMap    = HASHMAPIMPL(hashMap);
+	u_int32_t      currentTime = currentTimeInSeconds();
+	u_int32_t      end         = 0;
+
+	IfTrue(pHashMap && visitor, ERR, "Null argument");
+	end = cursor + maxBuckets;
+	if (end > (pHashMap->maxSplit + pHashMap->splitAt)) {
+		end = pHashMap->maxSplit + pHashMap->splitAt;
+	}
+	for (; cursor < end; cursor++) {
+		hashEntry_t* pElement = pHashMap->pBuckets[cursor];
+		while (pElement) {
+			checkMagic(pElement);
+			if (currentTime < pHashMap->API->getExpiry(pElement->value)) {
+				visitor(context, pElement->value);
+			}
+			pElement = pElement->pMapNext;
+		}
+	}
+	if (cursor < (pHashMap->maxSplit + pHashMap->splitAt)) {
+		return cursor;
+	}
+OnError:
+	return 0;
+}
+
 #define DEFAULT_RESULT_SIZE 4096
 
 u_int32_t hashMapGetPrefixMatchingKeys(hashMap_t hashMap, char* prefix, char** keys) {
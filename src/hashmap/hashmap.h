@@ -7,14 +7,62 @@
 
 typedef void* hashMap_t;
 
+enum hashMapEvent_t {
+	HASHMAP_EVENT_PUT = 1,
+	HASHMAP_EVENT_DELETE
+};
+
+/* Called after a value is put in the map and before a value leaves the
+ * map (deleted, expired or evicted). The value can be used, but not
+ * kept without addReference. The map must not be modified from here.
+ */
+typedef void (*hashMapListener_t)(void* context, int event, void* value);
+/* Called for every lookup with the key looked for and the value found,
+ * 0 for a miss. Same rules as for hashMapListener_t.
+ */
+typedef void (*hashMapLookupListener_t)(void* context, char* key, u_int32_t keyLength, void* value);
+typedef struct {
+	u_int32_t count;
+	u_int32_t buckets;       //allocated
+	u_int32_t activeBuckets; //in use, grows by one with every split
+	u_int32_t splitAt;       //next bucket to split in this round
+	u_int32_t maxSplit;      //buckets to split in this round
+	u_int64_t hits;          //lookups, including the ones of the scripts
+	u_int64_t misses;
+	u_int64_t expired;       //found expired or deleted by hashMapDeleteExpired
+	u_int64_t evicted;       //by hashMapDeleteLRU
+} hashMapStats_t;
+
+/* Called by hashMapScan for every live value. No extra reference. */
+typedef void (*hashMapVisitor_t)(void* context, void* value);
+
 hashMap_t      hashMapCreate(hashEntryAPI_t* API);
 void           hashMapDelete(hashMap_t hashMap);
 int            hashMapPutElement(hashMap_t hashMap, void* value);
 void*          hashMapGetElement(hashMap_t hashMap, char* key, u_int32_t  keyLength);
+u_int32_t      hashMapGetElements(hashMap_t hashMap, u_int32_t count, char** keys,
+		                          u_int32_t* keyLengths, void** values);
 int            hashMapDeleteElement(hashMap_t hashMap, char* key, u_int32_t  keyLength);
 u_int32_t      hashMapDeleteExpired(hashMap_t hashMap);
 u_int64_t      hashMapDeleteLRU(hashMap_t hashMap, u_int64_t requiredSpace);
 u_int32_t      hashMapSize(hashMap_t hashMap);
+void           hashMapGetStats(hashMap_t hashMap, hashMapStats_t* pStats);
+/* Grows the buckets and the expiry heap for count elements at once,
+ * before a bulk load. 0 on success */
+int            hashMapReserve(hashMap_t hashMap, u_int32_t count);
 u_int32_t      hashMapGetPrefixMatchingKeys(hashMap_t hashMap, char* prefix, char** keys);
+/* upto 8 listeners, 0 on success */
+int            hashMapAddListener(hashMap_t hashMap, hashMapListener_t listener, void* context);
+int            hashMapRemoveListener(hashMap_t hashMap, hashMapListener_t listener, void* context);
+/* upto 8 lookup listeners, 0 on success */
+int            hashMapAddLookupListener(hashMap_t hashMap, hashMapLookupListener_t listener,
+		                                void* context);
+/* Visits the values in the next maxBuckets buckets starting at cursor
+ * (0 to start). Returns the cursor for the next call, 0 when every
+ * bucket has been visited. Values present for the whole scan are
+ * visited at least once, values moved by a split can be seen twice.
+ */
+u_int32_t      hashMapScan(hashMap_t hashMap, u_int32_t cursor, u_int32_t maxBuckets,
+		                   hashMapVisitor_t visitor, void* context);
 
 #endif //HASHMAP_HASHMAP_H_
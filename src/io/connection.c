@@ -7,6 +7,7 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <limits.h>
 
 typedef struct {
 	u_int32_t            isServer    : 1;
@@ -31,6 +32,10 @@ typedef struct {
 #define DEFAULT_BUFFER_SIZE 1024
 #define DEFAULT_BACKLOG     128
 
+#ifndef IOV_MAX
+#define IOV_MAX             1024
+#endif
+
 
 static void connectionEventHandler(const int fd, const short which, void *arg) {
 	connectionImpl_t* pC = CONNECTION(arg);
@@ -62,8 +67,8 @@ static void connectionEventHandler(const int fd, const short which, void *arg) {
     		}
     		return;
     	}
-    	//either accepted or connected socket
-    	if (which == EV_READ) {
+    	//either accepted or connected socket, read first when both are ready
+    	if (which & EV_READ) {
     		pC->CH->readAvailable(pC);
        	}else {
        		pC->CH->writeAvailable(pC);
@@ -83,6 +88,10 @@ connection_t  connectionServerCreate(u_int16_t port, char* ipAddress, connection
 		int flags = fcntl(pC->fd, F_GETFL, 0);
 	    IfTrue(fcntl(pC->fd, F_SETFL, flags | O_NONBLOCK) == 0,
 	    		ERR, "Error setting non blocking");
+	    //restart without waiting for the old connections in TIME_WAIT
+	    flags = 1;
+	    IfTrue(setsockopt(pC->fd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags)) == 0,
+	    		ERR, "Error setting reuse address");
 	}
 
 	memset((char*) &pC->address, 0, sizeof(pC->address));
@@ -233,6 +242,10 @@ static int connectionWriteHelper(connection_t conn, fallocator_t fallocator, dat
 
 	u_int32_t  bufferCount = dataStreamIteratorGetBufferCount(iter);
 	IfTrue(bufferCount > 0, WARN, "No data in the data buffer");
+	//sendmsg fails for more, the rest goes in the next call
+	if (bufferCount > IOV_MAX) {
+		bufferCount = IOV_MAX;
+	}
 	vector = calloc(bufferCount, sizeof(struct iovec));
 	IfTrue(vector, ERR, "Error allocating memory");
 	for (int i = 0; i < bufferCount; i++) {
@@ -345,6 +358,10 @@ int connectionConnect(connection_t connection) {
 	if (0 == connect(pC->fd, (struct sockaddr *) &(pC->address), sizeof(pC->address))) {
 		pC->isConnected = 1;
 		retval = 0;
+	}else if (errno == EISCONN) {
+		//called again after the non blocking connect completed
+		pC->isConnected = 1;
+		retval = 0;
 	}else {
 		IfTrue(errno == EINPROGRESS, DEBUG, "Connect Error %d [%s]", pC->fd, strerror(errno));
 		retval = 1;
@@ -423,6 +440,20 @@ void connectionWaitForWrite(connection_t conn, struct event_base *base) {
 	}
 }
 
+/* For pipelining clients, the other side might only read our requests
+ * after we read its responses.
+ */
+void connectionWaitForReadWrite(connection_t conn, struct event_base *base) {
+	connectionImpl_t* pC = CONNECTION(conn);
+	if (!(pC->isServer)) {
+		event_set(&pC->event, pC->fd, EV_READ | EV_WRITE, connectionEventHandler, (void *)pC);
+		event_base_set(base, &pC->event);
+		event_add(&pC->event, 0);
+	}else {
+		LOG(ERR, "wait for read write called on server socket %d", pC->fd);
+	}
+}
+
 void connectionWaitCancel(connection_t conn, struct event_base *base) {
 	connectionImpl_t* pC = CONNECTION(conn);
 	if (!(pC->isServer)) {
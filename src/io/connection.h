@@ -27,6 +27,7 @@ void*         connectionGetContext(connection_t connection);
 void*         connectionGetBuffer(connection_t conn, fallocator_t fallocator, u_int32_t size, u_int32_t* offset);
 void          connectionWaitForRead(connection_t conn, struct event_base *base);
 void          connectionWaitForWrite(connection_t conn, struct event_base *base);
+void          connectionWaitForReadWrite(connection_t conn, struct event_base *base);
 void          connectionWaitForConnect(connection_t conn, struct event_base *base);
 void          connectionWaitCancel(connection_t conn, struct event_base *base);
 
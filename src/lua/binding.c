@@ -1,4 +1,5 @@
 #include <dirent.h>
+#include <time.h>
 
 #include "binding.h"
 #include "marshal.h"
@@ -16,12 +17,15 @@
 
 #include "../cluster/consistent.h"
 #include "../cluster/clustermap.h"
+#include "../cluster/replication.h"
 
 
 
 #define LUA_CONFIG_FILE "config.lua"
 #define LUA_CORE_FILE   "core.lua"
 
+static clusterMap_t sharedClusterMap = 0;
+
 static void stackdump(lua_State* l)
 {
     int i;
@@ -65,6 +69,18 @@ static int luaSetGlobalLogLevel(lua_State* L) {
     return 0;
 }
 
+static u_int64_t currentTimeInMicros(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return  ((u_int64_t) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static int luaReloadScripts(lua_State* L) {
+	lua_pushinteger(L, reloadScripts());
+	return 1;
+}
+
 static int isCoreOrConfigFile(char* fileName) {
 	if ((strcmp(fileName, LUA_CONFIG_FILE)) == 0 || (strcmp(fileName, LUA_CORE_FILE) == 0)) {
 		return 1;
@@ -98,6 +114,52 @@ static char *path_cat (const char *str1, char *str2, int addSlash) {
 	return result;
 }
 
+/* Every script file other than core/config gets its own accounting
+ * entry, named after the file without the .lua extension. This is
+ * also the object type used in the virtual keys handled by it.
+ */
+static luaScriptStats_t* luaScriptStatsAdd(luaRunnableImpl_t* pRunnable, char* name, int length) {
+	luaScriptStats_t* newStats = 0;
+
+	if (length >= LUA_MAX_SCRIPT_NAME) {
+		length = LUA_MAX_SCRIPT_NAME - 1;
+	}
+	newStats = realloc(pRunnable->scriptStats, (pRunnable->scriptStatsCount + 1) * sizeof(luaScriptStats_t));
+	IfTrue(newStats, ERR, "Error allocating memory for script stats");
+	pRunnable->scriptStats = newStats;
+	newStats = &pRunnable->scriptStats[pRunnable->scriptStatsCount];
+	memset(newStats, 0, sizeof(luaScriptStats_t));
+	strncpy(newStats->name, name, length);
+	pRunnable->scriptStatsCount++;
+	goto OnSuccess;
+OnError:
+	newStats = 0;
+OnSuccess:
+	return newStats;
+}
+
+/* The first entry is always the core script. For virtual keys
+ * the object type is the part of the key before the first ':'
+ */
+static luaScriptStats_t* luaScriptStatsFind(luaRunnableImpl_t* pRunnable, command_t* pCommand) {
+	char* key   = pCommand->key;
+	char* colon = 0;
+
+	if (!key && (pCommand->multiGetKeysCount > 0)) {
+		key = pCommand->multiGetKeys[0];
+	}
+	if (pRunnable->enableVirtualKey && key && (colon = strchr(key, ':'))) {
+		int length = colon - key;
+		for (int i = 1; i < pRunnable->scriptStatsCount; i++) {
+			luaScriptStats_t* pStats = &pRunnable->scriptStats[i];
+			if ((strncmp(pStats->name, key, length) == 0) && (pStats->name[length] == 0)) {
+				return pStats;
+			}
+		}
+	}
+	return &pRunnable->scriptStats[0];
+}
+
 static int loadLuaFile(luaRunnableImpl_t* pRunnable, char* fileName) {
 	int err = 0;
 	err = luaL_loadfile(pRunnable->luaState, fileName);
@@ -120,7 +182,9 @@ static int loadDirectory (luaRunnableImpl_t* pRunnable, char* dir_path, int enab
     struct dirent *dp       = 0;
     DIR           *dir      = opendir(dir_path);
     char          *tmp      = 0;
+    int            result   = 0;
 
+    IfTrue(dir, ERR, "Error opening scripts directory %s", dir_path);
     //first load the config and core files
     tmp  = path_cat(dir_path, LUA_CORE_FILE, addSlash);
     IfTrue(tmp, ERR, "Error allocating memory");
@@ -134,8 +198,10 @@ static int loadDirectory (luaRunnableImpl_t* pRunnable, char* dir_path, int enab
 		while ((dp = readdir(dir)) != NULL) {
 			tmp = path_cat(dir_path, dp->d_name, addSlash);
 			IfTrue(tmp, ERR, "Error allocating memory");
-			if (isLuaFile(tmp) && (!isCoreOrConfigFile(tmp)) ) {
+			if (isLuaFile(dp->d_name) && (!isCoreOrConfigFile(dp->d_name)) ) {
 				IfTrue( 0 == loadLuaFile(pRunnable, tmp), ERR, "Error loading file %s", tmp);
+				IfTrue(luaScriptStatsAdd(pRunnable, dp->d_name, strlen(dp->d_name) - 4),
+						ERR, "Error adding stats for %s", tmp);
 				LOG(INFO, "Loaded file [%s]", tmp);
 			}
 			free(tmp);
@@ -148,50 +214,741 @@ OnError:
 		free(tmp);
 		tmp = 0;
 	}
+	result = -1;
 OnSuccess:
 	if (dir) {
 		closedir(dir);
 	}
-	return 0;
+	return result;
+}
+
+
+/* Keeps the runnable as the allocator userdata, the budget hook
+ * relies on it.
+ */
+static void* luaRunnableAlloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+	return luaAllocatorAlloc((LUA_RUNNABLE(ud))->allocator, ptr, osize, nsize);
+}
+
+
+/* The count hook is inherited by all the threads created from the
+ * main state. The allocator userdata gives us back the runnable.
+ * Outside of luaRunnableRun/luaRunnableResume (loading files, gc)
+ * there is no execution in progress and no budget is enforced.
+ */
+static void luaBudgetHook(lua_State* L, lua_Debug* ar) {
+	luaRunnableImpl_t* pRunnable  = 0;
+	luaExecution_t*    pExecution = 0;
+
+	lua_getallocf(L, (void**)&pRunnable);
+	pExecution = &pRunnable->execution;
+	if (!pExecution->pStats) {
+		return;
+	}
+	if (!pExecution->exceeded) {
+		command_t* pCommand = pExecution->pCommand;
+
+		pExecution->instructions += LUA_BUDGET_HOOK_INTERVAL;
+		if (pRunnable->maxInstructions &&
+				((pCommand->luaInstructions + pExecution->instructions) > pRunnable->maxInstructions)) {
+			pExecution->exceeded = 1;
+		}else if (pRunnable->maxMicros && ((pCommand->luaMicros + currentTimeInMicros() -
+				pExecution->startMicros) > pRunnable->maxMicros)) {
+			pExecution->exceeded = 1;
+		}
+		if (pExecution->exceeded) {
+			//from now on hook every instruction, so that a script catching
+			//the error with pcall gets it again as soon as pcall returns
+			lua_sethook(L, luaBudgetHook, LUA_MASKCOUNT, 1);
+		}
+	}
+	if (pExecution->exceeded) {
+		luaL_error(L, "script exceeded execution budget");
+	}
+}
+
+static void luaExecutionBegin(luaRunnableImpl_t* pRunnable, command_t* pCommand, int newCall) {
+	luaExecution_t* pExecution = &pRunnable->execution;
+
+	pExecution->pStats       = luaScriptStatsFind(pRunnable, pCommand);
+	pExecution->pCommand     = pCommand;
+	pExecution->key          = pCommand->key;
+	pExecution->keyLength    = pCommand->keySize;
+	if (!pExecution->key && (pCommand->multiGetKeysCount > 0)) {
+		pExecution->key       = pCommand->multiGetKeys[0];
+		pExecution->keyLength = strlen(pCommand->multiGetKeys[0]);
+	}
+	pExecution->instructions = 0;
+	pExecution->exceeded     = 0;
+	pExecution->startMicros  = currentTimeInMicros();
+	pExecution->allocFailures = luaAllocatorFailures(pRunnable->allocator);
+	if (newCall) {
+		pExecution->pStats->calls++;
+		pCommand->luaInstructions = 0;
+		pCommand->luaMicros       = 0;
+	}
+	luaAllocatorSetEnforced(pRunnable->allocator, 1);
+}
+
+/* Returns LUA_RUNNABLE_ABORTED if the budget was exceeded and
+ * LUA_RUNNABLE_NO_MEMORY if an allocation was refused. The script
+ * may have caught the memory error, so callers only treat it as
+ * fatal if the script failed.
+ *
+ * Lua 5.1 does not collect before failing an allocation, so when the
+ * state gets close to its limit we do a full collection here, while
+ * nothing is running and the limit is not enforced.
+ */
+static int luaExecutionEnd(luaRunnableImpl_t* pRunnable) {
+	luaExecution_t*     pExecution = &pRunnable->execution;
+	luaScriptStats_t*   pStats     = pExecution->pStats;
+	int                 status     = LUA_RUNNABLE_DONE;
+	u_int64_t           micros     = currentTimeInMicros() - pExecution->startMicros;
+	luaAllocatorStats_t memory;
+
+	luaAllocatorSetEnforced(pRunnable->allocator, 0);
+	pStats->instructions += pExecution->instructions;
+	pStats->micros       += micros;
+	pExecution->pCommand->luaInstructions += pExecution->instructions;
+	pExecution->pCommand->luaMicros       += micros;
+	accountingLuaTime(getGlobalAccounting(), pExecution->key, pExecution->keyLength, micros);
+	if (pExecution->exceeded) {
+		pStats->aborts++;
+		lua_sethook(pRunnable->luaState, luaBudgetHook, LUA_MASKCOUNT, LUA_BUDGET_HOOK_INTERVAL);
+		status = LUA_RUNNABLE_ABORTED;
+	}else if (luaAllocatorFailures(pRunnable->allocator) != pExecution->allocFailures) {
+		pStats->oom++;
+		status = LUA_RUNNABLE_NO_MEMORY;
+	}
+	luaAllocatorGetStats(pRunnable->allocator, &memory);
+	if (memory.limit && (memory.used > ((memory.limit / 4) * 3))) {
+		lua_gc(pRunnable->luaState, LUA_GCCOLLECT, 0);
+	}
+	pExecution->pStats   = 0;
+	pExecution->pCommand = 0;
+	pExecution->exceeded = 0;
+	return status;
+}
+
+/* getScriptStats() returns
+ *   { name => {calls = n, instructions = n, usec = n, aborts = n, oom = n}, ... }
+ */
+static int luaGetScriptStats(lua_State* L) {
+	luaRunnableImpl_t* pRunnable = lua_touserdata(L, lua_upvalueindex(1));
+
+	lua_createtable(L, 0, pRunnable->scriptStatsCount);
+	for (int i = 0; i < pRunnable->scriptStatsCount; i++) {
+		luaScriptStats_t* pStats = &pRunnable->scriptStats[i];
+		lua_pushstring(L, pStats->name);
+		lua_createtable(L, 0, 5);
+		lua_pushnumber(L, pStats->calls);
+		lua_setfield(L, -2, "calls");
+		lua_pushnumber(L, pStats->instructions);
+		lua_setfield(L, -2, "instructions");
+		lua_pushnumber(L, pStats->micros);
+		lua_setfield(L, -2, "usec");
+		lua_pushnumber(L, pStats->aborts);
+		lua_setfield(L, -2, "aborts");
+		lua_pushnumber(L, pStats->oom);
+		lua_setfield(L, -2, "oom");
+		lua_settable(L, -3);
+	}
+	return 1;
+}
+
+/* getLuaMemoryStats() returns
+ *   { used = n, peak = n, limit = n, failures = n, slab = n, large = n }
+ * all in bytes except failures.
+ */
+static int luaGetMemoryStats(lua_State* L) {
+	luaRunnableImpl_t*  pRunnable = lua_touserdata(L, lua_upvalueindex(1));
+	luaAllocatorStats_t memory;
+
+	luaAllocatorGetStats(pRunnable->allocator, &memory);
+	lua_createtable(L, 0, 6);
+	lua_pushnumber(L, memory.used);
+	lua_setfield(L, -2, "used");
+	lua_pushnumber(L, memory.peak);
+	lua_setfield(L, -2, "peak");
+	lua_pushnumber(L, memory.limit);
+	lua_setfield(L, -2, "limit");
+	lua_pushnumber(L, memory.failures);
+	lua_setfield(L, -2, "failures");
+	lua_pushnumber(L, memory.slabBytes);
+	lua_setfield(L, -2, "slab");
+	lua_pushnumber(L, memory.largeBytes);
+	lua_setfield(L, -2, "large");
+	return 1;
 }
 
+/* changeRing(servers) switches the proxy to the new ring and starts
+ * moving the keys, returns 0 on success, -1 if the servers are not valid
+ * or this server is not in proxy mode.
+ */
+static int luaChangeRing(lua_State* L) {
+	const char* servers = luaL_checkstring(L, 1);
+	proxy_t     proxy   = getGlobalProxy();
 
-static void* fallocatorBasedAlloc (void *ud, void *ptr, size_t osize, size_t nsize) {
-	fallocator_t fallocator = ud;
-	if (nsize == 0) {
-		if (ptr) {
-			fallocatorFree(fallocator, ptr);
+	if (!proxy || (0 != proxyChangeRing(proxy, (char*)servers))) {
+		lua_pushnumber(L, -1);
+	}else {
+		if (getGlobalHotPush()) {
+			hotPushSetPeers(getGlobalHotPush(), servers);
 		}
-		return NULL;
+		lua_pushnumber(L, 0);
+	}
+	return 1;
+}
+
+/* setNearCachePeers(servers) sets the servers the hot keys of this one
+ * are pushed to, for scripts which build their own rings. The proxy
+ * ring and the gossip members are used without it. Returns 0, -1 if
+ * hot keys are not pushed (needs -n and -x).
+ */
+static int luaSetNearCachePeers(lua_State* L) {
+	const char* servers = luaL_checkstring(L, 1);
+	hotPush_t   hotPush = getGlobalHotPush();
+
+	if (!hotPush || (0 != hotPushSetPeers(hotPush, servers))) {
+		lua_pushnumber(L, -1);
+	}else {
+		lua_pushnumber(L, 0);
+	}
+	return 1;
+}
+
+/* gossip(members) merges the member list sent by another server and
+ * returns the list of this one, nil if gossip is not enabled.
+ */
+static int luaGossip(lua_State* L) {
+	const char* members = luaL_checkstring(L, 1);
+	char*       digest  = membershipMerge(getGlobalMembership(), (char*)members);
+
+	if (!digest) {
+		lua_pushnil(L);
+	}else {
+		lua_pushstring(L, digest);
+		FREE(digest);
+	}
+	return 1;
+}
+
+/* getMembers() returns the alive members as a sorted comma separated
+ * list and its version, nil if gossip is not enabled or no list is
+ * settled yet. Scripts rebuild their rings when the version changes:
+ *   local servers, version = getMembers()
+ *   if (version ~= ringVersion) then ring = newConsistent(servers) end
+ */
+static int luaGetMembers(lua_State* L) {
+	membership_t      membership = getGlobalMembership();
+	const char*       members    = membershipGetMembers(membership);
+	membershipStats_t stats;
+
+	if (!members) {
+		lua_pushnil(L);
+		return 1;
+	}
+	membershipGetStats(membership, &stats);
+	lua_pushstring(L, members);
+	lua_pushnumber(L, stats.version);
+	return 2;
+}
+
+/* getMembershipStats() returns nil if gossip is not enabled or
+ *   { members = n, alive = n, version = n, settled = n, interval = n,
+ *     rounds = n, sent = n, failed = n, received = n }
+ * settled is the milli seconds from start till the last change of the
+ * members was reported.
+ */
+static int luaGetMembershipStats(lua_State* L) {
+	membership_t      membership = getGlobalMembership();
+	membershipStats_t stats;
+
+	if (!membership) {
+		lua_pushnil(L);
+		return 1;
+	}
+	membershipGetStats(membership, &stats);
+	lua_createtable(L, 0, 9);
+	lua_pushnumber(L, stats.members);
+	lua_setfield(L, -2, "members");
+	lua_pushnumber(L, stats.alive);
+	lua_setfield(L, -2, "alive");
+	lua_pushnumber(L, stats.version);
+	lua_setfield(L, -2, "version");
+	lua_pushnumber(L, stats.settledMillis);
+	lua_setfield(L, -2, "settled");
+	lua_pushnumber(L, stats.intervalMillis);
+	lua_setfield(L, -2, "interval");
+	lua_pushnumber(L, stats.rounds);
+	lua_setfield(L, -2, "rounds");
+	lua_pushnumber(L, stats.sent);
+	lua_setfield(L, -2, "sent");
+	lua_pushnumber(L, stats.failed);
+	lua_setfield(L, -2, "failed");
+	lua_pushnumber(L, stats.received);
+	lua_setfield(L, -2, "received");
+	return 1;
+}
+
+/* snapshot() starts writing the items to the snapshot file, 0 if
+ * started, -1 if one is running or it can't be done.
+ */
+static int luaSnapshot(lua_State* L) {
+	lua_pushinteger(L, snapshotStart(getGlobalSnapshot()));
+	return 1;
+}
+
+/* getSnapshotStats() returns
+ *   { inprogress = 0/1, snapshots = n, failed = n, items = n, bytes = n,
+ *     millis = n, time = n, loaded = n, loadmillis = n }
+ * items, bytes, millis and time are about the last completed snapshot,
+ * time in seconds since the epoch.
+ */
+static int luaGetSnapshotStats(lua_State* L) {
+	snapshotStats_t stats;
+
+	snapshotGetStats(getGlobalSnapshot(), &stats);
+	lua_createtable(L, 0, 9);
+	lua_pushnumber(L, stats.inProgress);
+	lua_setfield(L, -2, "inprogress");
+	lua_pushnumber(L, stats.snapshots);
+	lua_setfield(L, -2, "snapshots");
+	lua_pushnumber(L, stats.failed);
+	lua_setfield(L, -2, "failed");
+	lua_pushnumber(L, stats.lastItems);
+	lua_setfield(L, -2, "items");
+	lua_pushnumber(L, stats.lastBytes);
+	lua_setfield(L, -2, "bytes");
+	lua_pushnumber(L, stats.lastMillis);
+	lua_setfield(L, -2, "millis");
+	lua_pushnumber(L, stats.lastTime);
+	lua_setfield(L, -2, "time");
+	lua_pushnumber(L, stats.loadedItems);
+	lua_setfield(L, -2, "loaded");
+	lua_pushnumber(L, stats.loadMillis);
+	lua_setfield(L, -2, "loadmillis");
+	return 1;
+}
+
+static void slowlogLineVisitor(void* context, slowlogEntry_t* pEntry) {
+	lua_State* L = context;
+	char       line[SLOWLOG_LINE];
+
+	slowlogFormat(pEntry, line, sizeof(line));
+	lua_pushstring(L, line);
+	lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+}
+
+/* getSlowlog(count) returns the count newest slow requests, newest
+ * first, one string per request as formatted by slowlogFormat. nil if
+ * the slowlog is not enabled.
+ */
+static int luaGetSlowlog(lua_State* L) {
+	u_int32_t count = luaL_optinteger(L, 1, SLOWLOG_ENTRIES);
+
+	if (!getGlobalSlowlog()) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_createtable(L, 0, 0);
+	slowlogVisit(getGlobalSlowlog(), count, slowlogLineVisitor, L);
+	return 1;
+}
+
+static int luaResetSlowlog(lua_State* L) {
+	slowlogReset(getGlobalSlowlog());
+	return 0;
+}
+
+/* one STAT line worth, the name is name[:label], histograms give
+ * name[:label]:count, :avg, :p50, :p90, :p99 and :max */
+static void pushStat(lua_State* L, const char* name, const char* suffix, double value) {
+	int n = lua_objlen(L, -1);
+
+	lua_createtable(L, 0, 2);
+	if (suffix) {
+		lua_pushfstring(L, "%s:%s", name, suffix);
 	}else {
-		if (osize == 0) {
-			return fallocatorMalloc(fallocator, nsize);
+		lua_pushstring(L, name);
+	}
+	lua_setfield(L, -2, "name");
+	lua_pushnumber(L, value);
+	lua_setfield(L, -2, "value");
+	lua_rawseti(L, -2, n + 1);
+}
+
+/* the table being filled is on top of the stack */
+static void serverStatsVisitor(void* context, statsMetric_t* pMetric) {
+	lua_State*      L         = context;
+	hdrHistogram_t* histogram = pMetric->histogram;
+	char            name[128];
+
+	if (pMetric->labelName) {
+		snprintf(name, sizeof(name), "%s:%s", pMetric->name, pMetric->labelValue);
+	}else {
+		snprintf(name, sizeof(name), "%s", pMetric->name);
+	}
+	if (pMetric->type == STATS_HISTOGRAM) {
+		pushStat(L, name, "count", histogram->count);
+		pushStat(L, name, "avg", histogram->count ? (histogram->sum / histogram->count) : 0);
+		pushStat(L, name, "p50", hdrHistogramPercentile(histogram, 50));
+		pushStat(L, name, "p90", hdrHistogramPercentile(histogram, 90));
+		pushStat(L, name, "p99", hdrHistogramPercentile(histogram, 99));
+		pushStat(L, name, "max", histogram->max);
+	}else {
+		pushStat(L, name, 0, pMetric->value);
+	}
+}
+
+/* getServerStats([group]) returns the server stats in order as
+ *   { {name = "connections", value = n}, {name = "cmd:get", value = n}, ... }
+ * for one of the groups server, commands, hashmap, memory, fallocator,
+ * lua, cluster, membership, accounting, hotkeys, bigkeys and slowlog, or
+ * all of them. Empty for any other group.
+ */
+static int luaGetServerStats(lua_State* L) {
+	const char* group = luaL_optstring(L, 1, 0);
+
+	lua_newtable(L);
+	statsVisit(group, serverStatsVisitor, L);
+	return 1;
+}
+
+/* appendLog(key) logs the current value of key, or its delete if it is
+ * gone, when the append log is enabled. Returns 0, -1 on error.
+ */
+static int luaAppendLog(lua_State* L) {
+	size_t      length = 0;
+	const char* key    = luaL_checklstring(L, 1, &length);
+	lua_pushinteger(L, appendLogWrite(getGlobalAppendLog(), (char*)key, length));
+	return 1;
+}
+
+/* appendLogFlush() logs a flush_all, the logged keys are gone. Returns 0,
+ * -1 on error.
+ */
+static int luaAppendLogFlush(lua_State* L) {
+	lua_pushinteger(L, appendLogFlush(getGlobalAppendLog()));
+	return 1;
+}
+
+/* getAppendLogStats() returns nil if the append log is not enabled or
+ *   { records = n, bytes = n, writes = n, syncs = n, failed = n,
+ *     pending = n, syncmillis = n, keys = n, compacting = 0/1,
+ *     compactions = n, compactmillis = n, replayed = n, replaymillis = n }
+ */
+static int luaGetAppendLogStats(lua_State* L) {
+	appendLogStats_t stats;
+
+	if (!getGlobalAppendLog()) {
+		lua_pushnil(L);
+		return 1;
+	}
+	appendLogGetStats(getGlobalAppendLog(), &stats);
+	lua_createtable(L, 0, 13);
+	lua_pushnumber(L, stats.records);
+	lua_setfield(L, -2, "records");
+	lua_pushnumber(L, stats.bytes);
+	lua_setfield(L, -2, "bytes");
+	lua_pushnumber(L, stats.writes);
+	lua_setfield(L, -2, "writes");
+	lua_pushnumber(L, stats.syncs);
+	lua_setfield(L, -2, "syncs");
+	lua_pushnumber(L, stats.failed);
+	lua_setfield(L, -2, "failed");
+	lua_pushnumber(L, stats.pending);
+	lua_setfield(L, -2, "pending");
+	lua_pushnumber(L, stats.syncMillis);
+	lua_setfield(L, -2, "syncmillis");
+	lua_pushnumber(L, stats.keys);
+	lua_setfield(L, -2, "keys");
+	lua_pushnumber(L, stats.compacting);
+	lua_setfield(L, -2, "compacting");
+	lua_pushnumber(L, stats.compactions);
+	lua_setfield(L, -2, "compactions");
+	lua_pushnumber(L, stats.lastCompactMillis);
+	lua_setfield(L, -2, "compactmillis");
+	lua_pushnumber(L, stats.replayed);
+	lua_setfield(L, -2, "replayed");
+	lua_pushnumber(L, stats.replayMillis);
+	lua_setfield(L, -2, "replaymillis");
+	return 1;
+}
+
+/* getMigrationStats() returns nil if this server is not in proxy mode or
+ *   { active = 0/1, pending = n, migrations = n, scanned = n, sent = n,
+ *     moved = n, failed = n, dualreads = n }
+ */
+static int luaGetMigrationStats(lua_State* L) {
+	proxy_t          proxy = getGlobalProxy();
+	migrationStats_t stats;
+
+	if (!proxy) {
+		lua_pushnil(L);
+		return 1;
+	}
+	proxyGetMigrationStats(proxy, &stats);
+	lua_createtable(L, 0, 8);
+	lua_pushnumber(L, stats.active);
+	lua_setfield(L, -2, "active");
+	lua_pushnumber(L, stats.pending);
+	lua_setfield(L, -2, "pending");
+	lua_pushnumber(L, stats.migrations);
+	lua_setfield(L, -2, "migrations");
+	lua_pushnumber(L, stats.scanned);
+	lua_setfield(L, -2, "scanned");
+	lua_pushnumber(L, stats.sent);
+	lua_setfield(L, -2, "sent");
+	lua_pushnumber(L, stats.moved);
+	lua_setfield(L, -2, "moved");
+	lua_pushnumber(L, stats.failed);
+	lua_setfield(L, -2, "failed");
+	lua_pushnumber(L, stats.dualReads);
+	lua_setfield(L, -2, "dualreads");
+	return 1;
+}
+
+/* getReplicationStats() returns nil if this server has no follower or
+ *   { connected = 0/1, resyncing = 0/1, resyncs = n, sent = n, acked = n,
+ *     bytes = n, backlog = n, lag = n, maxlag = n }
+ * lag and maxlag are in micro seconds, backlog and bytes in bytes.
+ */
+static int luaGetReplicationStats(lua_State* L) {
+	replication_t      replication = getGlobalReplication();
+	replicationStats_t stats;
+
+	if (!replication) {
+		lua_pushnil(L);
+		return 1;
+	}
+	replicationGetStats(replication, &stats);
+	lua_createtable(L, 0, 9);
+	lua_pushnumber(L, stats.connected);
+	lua_setfield(L, -2, "connected");
+	lua_pushnumber(L, stats.resyncing);
+	lua_setfield(L, -2, "resyncing");
+	lua_pushnumber(L, stats.resyncs);
+	lua_setfield(L, -2, "resyncs");
+	lua_pushnumber(L, stats.commandsSent);
+	lua_setfield(L, -2, "sent");
+	lua_pushnumber(L, stats.commandsAcked);
+	lua_setfield(L, -2, "acked");
+	lua_pushnumber(L, stats.bytesSent);
+	lua_setfield(L, -2, "bytes");
+	lua_pushnumber(L, stats.backlogBytes);
+	lua_setfield(L, -2, "backlog");
+	lua_pushnumber(L, stats.lagMicros);
+	lua_setfield(L, -2, "lag");
+	lua_pushnumber(L, stats.maxLagMicros);
+	lua_setfield(L, -2, "maxlag");
+	return 1;
+}
+
+/* getNearCacheStats() returns nil if the near cache is not enabled or
+ *   { hits = n, misses = n, pushed = n, evictions = n, entries = n,
+ *     bytes = n, ttl = n }
+ * ttl is in milli seconds. If hot keys are pushed to the other servers
+ * it also has the ones of hotPushStats_t
+ *   { hot = n, peers = n, pushes = n, invalidations = n, failures = n,
+ *     peerhits = n }
+ */
+static int luaGetNearCacheStats(lua_State* L) {
+	luaRunnableImpl_t* pRunnable = lua_touserdata(L, lua_upvalueindex(1));
+	nearCacheStats_t   stats;
+	hotPushStats_t     pushStats;
+
+	if (0 != clusterMapGetNearCacheStats(pRunnable->clusterMap, &stats)) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_createtable(L, 0, 13);
+	lua_pushnumber(L, stats.hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushnumber(L, stats.misses);
+	lua_setfield(L, -2, "misses");
+	lua_pushnumber(L, stats.pushes);
+	lua_setfield(L, -2, "pushed");
+	lua_pushnumber(L, stats.evictions);
+	lua_setfield(L, -2, "evictions");
+	lua_pushnumber(L, stats.entries);
+	lua_setfield(L, -2, "entries");
+	lua_pushnumber(L, stats.bytes);
+	lua_setfield(L, -2, "bytes");
+	lua_pushnumber(L, stats.ttlMillis);
+	lua_setfield(L, -2, "ttl");
+	if (getGlobalHotPush()) {
+		hotPushGetStats(getGlobalHotPush(), &pushStats);
+		lua_pushnumber(L, pushStats.hotKeys);
+		lua_setfield(L, -2, "hot");
+		lua_pushnumber(L, pushStats.peers);
+		lua_setfield(L, -2, "peers");
+		lua_pushnumber(L, pushStats.pushes);
+		lua_setfield(L, -2, "pushes");
+		lua_pushnumber(L, pushStats.invalidations);
+		lua_setfield(L, -2, "invalidations");
+		lua_pushnumber(L, pushStats.failures);
+		lua_setfield(L, -2, "failures");
+		lua_pushnumber(L, pushStats.peerHits);
+		lua_setfield(L, -2, "peerhits");
+	}
+	return 1;
+}
+
+/* getHealthStats() returns nil if health checks are not enabled or
+ *   { probes = n, failures = n, fastfails = n, servers = n, down = n,
+ *     interval = n, timeout = n }
+ * summed over the clusterMaps of the scripts and of the proxy. interval
+ * and timeout are in milli seconds.
+ */
+static int luaGetHealthStats(lua_State* L) {
+	luaRunnableImpl_t*      pRunnable = lua_touserdata(L, lua_upvalueindex(1));
+	clusterMapHealthStats_t stats;
+	clusterMapHealthStats_t proxyStats;
+	int                     enabled   = 0;
+
+	enabled = (0 == clusterMapGetHealthStats(pRunnable->clusterMap, &stats));
+	if (0 == clusterMapGetHealthStats(proxyGetClusterMap(getGlobalProxy()), &proxyStats)) {
+		if (!enabled) {
+			stats = proxyStats;
 		}else {
-			void* newPtr = fallocatorMalloc(fallocator, nsize);
-			if (newPtr) {
-				int size = osize > nsize ? nsize : osize;
-				memcpy(newPtr, ptr, size);
-				if (ptr) {
-					fallocatorFree(fallocator, ptr);
-				}
-				return newPtr;
-			}
-			return NULL;
+			stats.probes        += proxyStats.probes;
+			stats.probeFailures += proxyStats.probeFailures;
+			stats.fastFails     += proxyStats.fastFails;
+			stats.servers       += proxyStats.servers;
+			stats.serversDown   += proxyStats.serversDown;
 		}
+		enabled = 1;
 	}
+	if (!enabled) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_createtable(L, 0, 7);
+	lua_pushnumber(L, stats.probes);
+	lua_setfield(L, -2, "probes");
+	lua_pushnumber(L, stats.probeFailures);
+	lua_setfield(L, -2, "failures");
+	lua_pushnumber(L, stats.fastFails);
+	lua_setfield(L, -2, "fastfails");
+	lua_pushnumber(L, stats.servers);
+	lua_setfield(L, -2, "servers");
+	lua_pushnumber(L, stats.serversDown);
+	lua_setfield(L, -2, "down");
+	lua_pushnumber(L, stats.intervalMillis);
+	lua_setfield(L, -2, "interval");
+	lua_pushnumber(L, stats.timeoutMillis);
+	lua_setfield(L, -2, "timeout");
+	return 1;
 }
 
+/* getClusterStats() returns
+ *   { suspended = n, inflight = n, maxinflight = n, deadline = n,
+ *     timeouts = n, rejected = n, resumed = n, avg = n, p50 = n, p90 = n,
+ *     p99 = n, max = n, buckets = { {le = n, count = n}, ... } }
+ * suspended are the scripts waiting for other servers, the requests are
+ * summed over the clusterMaps of the scripts and of the proxy. The wait
+ * times are in micro seconds, buckets only has the non empty ones.
+ */
+static int luaGetClusterStats(lua_State* L) {
+	luaRunnableImpl_t*        pRunnable = lua_touserdata(L, lua_upvalueindex(1));
+	clusterMapRequestStats_t  requests;
+	clusterMapRequestStats_t  proxyRequests;
+	luaClusterMapStats_t      stats;
+	int                       n         = 0;
+
+	clusterMapGetRequestStats(pRunnable->clusterMap, &requests);
+	clusterMapGetRequestStats(proxyGetClusterMap(getGlobalProxy()), &proxyRequests);
+	luaClusterMapGetStats(&stats);
+
+	lua_createtable(L, 0, 13);
+	lua_pushnumber(L, stats.suspended);
+	lua_setfield(L, -2, "suspended");
+	lua_pushnumber(L, requests.inFlight + proxyRequests.inFlight);
+	lua_setfield(L, -2, "inflight");
+	lua_pushnumber(L, requests.maxInFlight);
+	lua_setfield(L, -2, "maxinflight");
+	lua_pushnumber(L, requests.deadlineMillis);
+	lua_setfield(L, -2, "deadline");
+	lua_pushnumber(L, requests.timeouts + proxyRequests.timeouts);
+	lua_setfield(L, -2, "timeouts");
+	lua_pushnumber(L, requests.rejected + proxyRequests.rejected);
+	lua_setfield(L, -2, "rejected");
+	lua_pushnumber(L, stats.wait.count);
+	lua_setfield(L, -2, "resumed");
+	lua_pushnumber(L, stats.wait.count ? (stats.wait.sum / stats.wait.count) : 0);
+	lua_setfield(L, -2, "avg");
+	lua_pushnumber(L, hdrHistogramPercentile(&stats.wait, 50));
+	lua_setfield(L, -2, "p50");
+	lua_pushnumber(L, hdrHistogramPercentile(&stats.wait, 90));
+	lua_setfield(L, -2, "p90");
+	lua_pushnumber(L, hdrHistogramPercentile(&stats.wait, 99));
+	lua_setfield(L, -2, "p99");
+	lua_pushnumber(L, stats.wait.max);
+	lua_setfield(L, -2, "max");
+	lua_newtable(L);
+	for (int i = 0; i < HDR_BUCKETS; i++) {
+		if (stats.wait.buckets[i] > 0) {
+			lua_createtable(L, 0, 2);
+			lua_pushnumber(L, hdrHistogramBucketLimit(i));
+			lua_setfield(L, -2, "le");
+			lua_pushnumber(L, stats.wait.buckets[i]);
+			lua_setfield(L, -2, "count");
+			lua_rawseti(L, -2, ++n);
+		}
+	}
+	lua_setfield(L, -2, "buckets");
+	return 1;
+}
 
 luaRunnable_t luaRunnableCreate(char* directory, int enableVirtualKey) {
 	luaRunnableImpl_t* pRunnable = ALLOCATE_1(luaRunnableImpl_t);
 	pRunnable->fallocator = fallocatorCreate();
-	pRunnable->luaState = lua_newstate(fallocatorBasedAlloc, pRunnable->fallocator);
-	pRunnable->clusterMap = clusterMapCreate(clusterMapResultHandler);
+	pRunnable->allocator  = luaAllocatorCreate(0);
+	pRunnable->enableVirtualKey = enableVirtualKey;
+	luaScriptStatsAdd(pRunnable, LUA_CORE_SCRIPT_NAME, strlen(LUA_CORE_SCRIPT_NAME));
+	pRunnable->luaState = lua_newstate(luaRunnableAlloc, pRunnable);
+	if (!sharedClusterMap) {
+		sharedClusterMap = clusterMapCreate(clusterMapResultHandler);
+	}
+	pRunnable->clusterMap = sharedClusterMap;
 	luaL_openlibs(pRunnable->luaState);
+	lua_sethook(pRunnable->luaState, luaBudgetHook, LUA_MASKCOUNT, LUA_BUDGET_HOOK_INTERVAL);
 	lua_register(pRunnable->luaState, "getHashMap",       luaGetGlobalHashMap);
 	lua_register(pRunnable->luaState, "setLogLevel",      luaSetGlobalLogLevel);
 	lua_register(pRunnable->luaState, "newConsistent",    luaConsistentNew);
 	lua_register(pRunnable->luaState, "deleteConsistent", luaConsistentDelete);
+	lua_register(pRunnable->luaState, "reloadScripts",    luaReloadScripts);
+	lua_register(pRunnable->luaState, "getReplicationStats", luaGetReplicationStats);
+	lua_register(pRunnable->luaState, "getMigrationStats",   luaGetMigrationStats);
+	lua_register(pRunnable->luaState, "changeRing",          luaChangeRing);
+	lua_register(pRunnable->luaState, "gossip",              luaGossip);
+	lua_register(pRunnable->luaState, "getMembers",          luaGetMembers);
+	lua_register(pRunnable->luaState, "setNearCachePeers",   luaSetNearCachePeers);
+	lua_register(pRunnable->luaState, "getMembershipStats",  luaGetMembershipStats);
+	lua_register(pRunnable->luaState, "snapshot",            luaSnapshot);
+	lua_register(pRunnable->luaState, "getSnapshotStats",    luaGetSnapshotStats);
+	lua_register(pRunnable->luaState, "appendLog",           luaAppendLog);
+	lua_register(pRunnable->luaState, "appendLogFlush",      luaAppendLogFlush);
+	lua_register(pRunnable->luaState, "getServerStats",      luaGetServerStats);
+	lua_register(pRunnable->luaState, "getAppendLogStats",   luaGetAppendLogStats);
+	lua_register(pRunnable->luaState, "getSlowlog",          luaGetSlowlog);
+	lua_register(pRunnable->luaState, "resetSlowlog",        luaResetSlowlog);
+	lua_pushlightuserdata(pRunnable->luaState, pRunnable);
+	lua_pushcclosure(pRunnable->luaState, luaGetScriptStats, 1);
+	lua_setglobal(pRunnable->luaState, "getScriptStats");
+	lua_pushlightuserdata(pRunnable->luaState, pRunnable);
+	lua_pushcclosure(pRunnable->luaState, luaGetMemoryStats, 1);
+	lua_setglobal(pRunnable->luaState, "getLuaMemoryStats");
+	lua_pushlightuserdata(pRunnable->luaState, pRunnable);
+	lua_pushcclosure(pRunnable->luaState, luaGetNearCacheStats, 1);
+	lua_setglobal(pRunnable->luaState, "getNearCacheStats");
+	lua_pushlightuserdata(pRunnable->luaState, pRunnable);
+	lua_pushcclosure(pRunnable->luaState, luaGetHealthStats, 1);
+	lua_setglobal(pRunnable->luaState, "getHealthStats");
+	lua_pushlightuserdata(pRunnable->luaState, pRunnable);
+	lua_pushcclosure(pRunnable->luaState, luaGetClusterStats, 1);
+	lua_setglobal(pRunnable->luaState, "getClusterStats");
 
 	//open the marshling library
 	luaopen_marshal(pRunnable->luaState, pRunnable->fallocator);
@@ -212,7 +969,11 @@ void luaRunnableDelete(luaRunnable_t runnable) {
 	luaRunnableImpl_t* pRunnable = LUA_RUNNABLE(runnable);
 	if (pRunnable) {
 		lua_close(pRunnable->luaState);
+		luaAllocatorDelete(pRunnable->allocator);
 		fallocatorDelete(pRunnable->fallocator);
+		if (pRunnable->scriptStats) {
+			FREE(pRunnable->scriptStats);
+		}
 		FREE(pRunnable);
 	}
 }
@@ -224,6 +985,66 @@ void luaRunnableGC(luaRunnable_t runnable) {
 	lua_gc(pRunnable->luaState, LUA_GCCOLLECT, 0);
 }
 
+/* Called when a newer runnable has taken over. We can only delete it
+ * after the last suspended thread is done and nothing is executing
+ * on it (the reload could have been triggered by one of its scripts).
+ */
+static void luaRunnableDeleteIfDrained(luaRunnableImpl_t* pRunnable) {
+	if (pRunnable->retired && (pRunnable->running == 0) && (pRunnable->suspended == 0)) {
+		LOG(INFO, "Deleting retired lua runnable %p", pRunnable);
+		luaRunnableDelete(pRunnable);
+	}
+}
+
+void luaRunnableRetire(luaRunnable_t runnable) {
+	luaRunnableImpl_t* pRunnable = LUA_RUNNABLE(runnable);
+	if (pRunnable) {
+		LOG(INFO, "Retiring lua runnable %p with %d suspended requests", pRunnable, pRunnable->suspended);
+		pRunnable->retired = 1;
+		luaRunnableDeleteIfDrained(pRunnable);
+	}
+}
+
+void luaRunnableSetBudget(luaRunnable_t runnable, u_int64_t maxInstructions, u_int32_t maxMillis) {
+	luaRunnableImpl_t* pRunnable = LUA_RUNNABLE(runnable);
+	if (pRunnable) {
+		pRunnable->maxInstructions = maxInstructions;
+		pRunnable->maxMicros       = (u_int64_t)maxMillis * 1000;
+	}
+}
+
+
+void luaRunnableSetMemoryLimit(luaRunnable_t runnable, u_int64_t maxBytes) {
+	luaRunnableImpl_t* pRunnable = LUA_RUNNABLE(runnable);
+	if (pRunnable) {
+		luaAllocatorSetLimit(pRunnable->allocator, maxBytes);
+	}
+}
+
+int luaRunnableSetNearCache(luaRunnable_t runnable, u_int32_t ttlMillis) {
+	luaRunnableImpl_t* pRunnable = LUA_RUNNABLE(runnable);
+	if (pRunnable) {
+		return clusterMapSetNearCache(pRunnable->clusterMap, ttlMillis);
+	}
+	return -1;
+}
+
+int luaRunnableSetHealthCheck(luaRunnable_t runnable, u_int32_t intervalMillis,
+		u_int32_t timeoutMillis) {
+	luaRunnableImpl_t* pRunnable = LUA_RUNNABLE(runnable);
+	if (pRunnable) {
+		return clusterMapSetHealthCheck(pRunnable->clusterMap, intervalMillis, timeoutMillis);
+	}
+	return -1;
+}
+
+int luaRunnableSetLimits(luaRunnable_t runnable, u_int32_t deadlineMillis, u_int32_t maxInFlight) {
+	luaRunnableImpl_t* pRunnable = LUA_RUNNABLE(runnable);
+	if (pRunnable) {
+		return clusterMapSetLimits(pRunnable->clusterMap, deadlineMillis, maxInFlight);
+	}
+	return -1;
+}
 
 /**
  * In non cluster mode we either run with virtual keys enabled or not.
@@ -239,6 +1060,7 @@ static int luaRunnableRunNoCluster(luaRunnableImpl_t* pRunnable, connection_t co
 		 int enableVirtualKey) {
 
 	int result = 0;
+	int status = 0;
 
 	if (enableVirtualKey) {
 		lua_getglobal(pRunnable->luaState, "mainVirtualKey");
@@ -246,11 +1068,19 @@ static int luaRunnableRunNoCluster(luaRunnableImpl_t* pRunnable, connection_t co
 		lua_getglobal(pRunnable->luaState, "mainNormal");
 	}
 	luaCommandNew(pRunnable->luaState, connection, fallocator, pCommand, pRunnable);
+	luaExecutionBegin(pRunnable, pCommand, 1);
     result = lua_pcall(pRunnable->luaState, 1, 1, 0);
+    status = luaExecutionEnd(pRunnable);
 
- 	if (result != 0) {
+ 	if ((status == LUA_RUNNABLE_ABORTED) || ((status == LUA_RUNNABLE_NO_MEMORY) && (result != 0))) {
+		LOG(WARN, "lua_pcall aborted [%s]", lua_tostring(pRunnable->luaState,-1));
+		lua_pop(pRunnable->luaState, 1);
+		result = status;
+ 	}else if (result != 0) {
 		LOG(ERR, "lua_pcall failed  [%s]", lua_tostring(pRunnable->luaState,-1));
 		stackdump(pRunnable->luaState);
+		lua_pop(pRunnable->luaState, 1);
+		result = -1;
 	}else {
 		result = lua_tointeger(pRunnable->luaState, -1);
 		lua_remove(pRunnable->luaState, lua_gettop(pRunnable->luaState));
@@ -264,6 +1094,42 @@ static int luaRunnableRunNoCluster(luaRunnableImpl_t* pRunnable, connection_t co
 }
 
 
+/**
+ * Runs the request thread, which must be on the top of the main lua
+ * stack. Unless the thread yields again, it is removed from the main
+ * stack so that it can be garbage collected.
+ */
+static int luaRunnableContinue(luaRunnableImpl_t* pRunnable, lua_State* thread, int nargs) {
+	int result = 0;
+	int status = 0;
+
+	result = lua_resume(thread, nargs);
+	status = luaExecutionEnd(pRunnable);
+ 	if ((status == LUA_RUNNABLE_ABORTED) ||
+ 			((status == LUA_RUNNABLE_NO_MEMORY) && (result != 0) && (result != LUA_YIELD))) {
+ 		LOG(WARN, "lua_resume aborted [%s]", lua_tostring(thread,-1));
+ 		result = status;
+ 	}else if (result != 0) {
+ 		//this can only happen for getFromServer call
+ 		if (result == LUA_YIELD) {
+ 			pRunnable->suspended++;
+ 			return LUA_RUNNABLE_SUSPENDED;
+ 		}else {
+ 			LOG(ERR, "lua_resume failed  [%s]", lua_tostring(thread,-1));
+ 			result = -1;
+ 		}
+	}else {
+		result = lua_tointeger(thread, -1);
+		lua_remove(thread, lua_gettop(thread));
+		if (result != 0) {
+			LOG(WARN, "main lua function returned error %d", result);
+		}
+	}
+	lua_remove(pRunnable->luaState, lua_gettop(pRunnable->luaState));
+	return result;
+}
+
+
 /**
  * In cluster mode each request gets a new lua thread to handle the request.
  * This again has some 8% overhead and we don't want to incur it, in case
@@ -275,8 +1141,12 @@ int luaRunnableRun(luaRunnable_t runnable, connection_t connection, fallocator_t
 	luaRunnableImpl_t* pRunnable = LUA_RUNNABLE(runnable);
 	int                result    = 0;
 
+	pRunnable->running++;
 	if (!enableClusterMode) {
-		return luaRunnableRunNoCluster(pRunnable, connection, fallocator, pCommand, enableVirtualKey);
+		result = luaRunnableRunNoCluster(pRunnable, connection, fallocator, pCommand, enableVirtualKey);
+		pRunnable->running--;
+		luaRunnableDeleteIfDrained(pRunnable);
+		return result;
 	}
 
 	lua_State*  localLuaState = lua_newthread(pRunnable->luaState);
@@ -291,22 +1161,27 @@ int luaRunnableRun(luaRunnable_t runnable, connection_t connection, fallocator_t
 		stackdump(pRunnable->luaState);
 	}
 	luaCommandNew(localLuaState, connection, fallocator, pCommand, pRunnable);
-    result = lua_resume(localLuaState, 1);
- 	if (result != 0) {
- 		//this can only happen for getFromServer call
- 		if (result == LUA_YIELD) {
- 			return 1;
- 		}else {
- 			LOG(ERR, "lua_resume failed  [%s]", lua_tostring(localLuaState,-1));
- 			result = -1;
- 		}
-	}else {
-		result = lua_tointeger(localLuaState, -1);
-		lua_remove(localLuaState, lua_gettop(localLuaState));
-		if (result != 0) {
-			LOG(WARN, "main lua function returned error %d", result);
-		}
-	}
-	lua_remove(pRunnable->luaState, lua_gettop(pRunnable->luaState));
+	luaExecutionBegin(pRunnable, pCommand, 1);
+	result = luaRunnableContinue(pRunnable, localLuaState, 1);
+	pRunnable->running--;
+	luaRunnableDeleteIfDrained(pRunnable);
+	return result;
+}
+
+/**
+ * Called with the result of getFromServer/getInParallel pushed on the
+ * suspended thread. The runnable might be a retired one and could be
+ * deleted before this returns.
+ */
+int luaRunnableResume(luaRunnable_t runnable, lua_State* thread, command_t* pCommand, int nargs) {
+	luaRunnableImpl_t* pRunnable = LUA_RUNNABLE(runnable);
+	int                result    = 0;
+
+	pRunnable->running++;
+	pRunnable->suspended--;
+	luaExecutionBegin(pRunnable, pCommand, 0);
+	result = luaRunnableContinue(pRunnable, thread, nargs);
+	pRunnable->running--;
+	luaRunnableDeleteIfDrained(pRunnable);
 	return result;
 }
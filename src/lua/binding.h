@@ -11,6 +11,7 @@
 #include "../hashmap/hashmap.h"
 #include "../io/connection.h"
 #include "../cluster/clustermap.h"
+#include "luaalloc.h"
 
 
 /* The business of enableVirtualKey and enableClusterMode
@@ -45,12 +46,91 @@
  *- deleting lua threads.
  */
 
+/* Execution budgets
+ *
+ * Every request runs its script with an instruction and time
+ * budget. In cluster mode the budget covers all the runs of a
+ * script suspended in getFromServer/getInParallel, the time it
+ * waits for the other servers does not count. A count hook
+ * fires every LUA_BUDGET_HOOK_INTERVAL vm instructions and
+ * raises an error once the budget is used up. The request is
+ * then answered with SERVER_ERROR instead of stalling the
+ * event loop for every other connection.
+ *
+ * A budget of 0 means unlimited. Instructions and time used
+ * are accounted per script (the virtual key object type, or
+ * "core" for plain memcached commands) and reported by the
+ * "stats scripts" command.
+ */
+
+/* Memory
+ *
+ * Each lua state has its own luaAllocator with a limit given by -L,
+ * unlimited by default. A script which allocates beyond the limit
+ * gets a lua memory error and the client gets SERVER_ERROR, the
+ * process does not run out of memory. Failures are counted per
+ * script as "oom".
+ */
+
+#define LUA_BUDGET_HOOK_INTERVAL   1000
+#define LUA_CORE_SCRIPT_NAME       "core"
+#define LUA_MAX_SCRIPT_NAME        64
+
+/* return values of luaRunnableRun and luaRunnableResume */
+#define LUA_RUNNABLE_DONE          0
+#define LUA_RUNNABLE_SUSPENDED     1
+#define LUA_RUNNABLE_ABORTED       2
+#define LUA_RUNNABLE_NO_MEMORY     3
+
 typedef void* luaRunnable_t;
 
+typedef struct luaScriptStats_t {
+	char       name[LUA_MAX_SCRIPT_NAME];
+	u_int64_t  calls;
+	u_int64_t  instructions;
+	u_int64_t  micros;
+	u_int64_t  aborts;
+	u_int64_t  oom;
+} luaScriptStats_t;
+
+/* instructions and startMicros are for the current run, the command
+ * keeps the budget used by the earlier runs of the request.
+ */
+typedef struct {
+	luaScriptStats_t* pStats;
+	command_t*        pCommand;
+	char*             key;           //for accounting, 0 if the command has none
+	u_int32_t         keyLength;
+	u_int64_t         instructions;
+	u_int64_t         startMicros;
+	u_int64_t         allocFailures;
+	int               exceeded;
+} luaExecution_t;
+
+/* Hot reload
+ *
+ * A reload builds a complete new runnable from the scripts directory
+ * and only if that succeeds the server switches over to it. The old
+ * runnable is retired: new requests never see it, but threads which
+ * are suspended in getFromServer/getInParallel are resumed on it.
+ * It is deleted when the last of them finishes. The clusterMap is
+ * shared by all runnables, so pending requests survive a reload.
+ */
+
 typedef struct {
-	fallocator_t  fallocator;
-	lua_State*    luaState;
-	clusterMap_t  clusterMap;
+	fallocator_t      fallocator;
+	luaAllocator_t    allocator;
+	lua_State*        luaState;
+	clusterMap_t      clusterMap;
+	int               enableVirtualKey;
+	int               retired;
+	u_int32_t         running;
+	u_int32_t         suspended;
+	u_int64_t         maxInstructions;
+	u_int64_t         maxMicros;
+	luaExecution_t    execution;
+	luaScriptStats_t* scriptStats;
+	int               scriptStatsCount;
 }luaRunnableImpl_t;
 
 
@@ -61,8 +141,19 @@ typedef struct {
 luaRunnable_t luaRunnableCreate(char* directory, int enableVirtualKey);
 void          luaRunnableDelete(luaRunnable_t runnable);
 void          luaRunnableGC(luaRunnable_t runnable);
+void          luaRunnableRetire(luaRunnable_t runnable);
+void          luaRunnableSetBudget(luaRunnable_t runnable, u_int64_t maxInstructions,
+				u_int32_t maxMillis);
+void          luaRunnableSetMemoryLimit(luaRunnable_t runnable, u_int64_t maxBytes);
+int           luaRunnableSetNearCache(luaRunnable_t runnable, u_int32_t ttlMillis);
+int           luaRunnableSetHealthCheck(luaRunnable_t runnable, u_int32_t intervalMillis,
+				u_int32_t timeoutMillis);
+int           luaRunnableSetLimits(luaRunnable_t runnable, u_int32_t deadlineMillis,
+				u_int32_t maxInFlight);
 int           luaRunnableRun(luaRunnable_t runnable, connection_t connection,
 			    fallocator_t fallocator, command_t* pCommand, int enableVirtualKey,
 			    int enableClusterMode);
+int           luaRunnableResume(luaRunnable_t runnable, lua_State* thread,
+				command_t* pCommand, int nargs);
 
 #endif /* LUA_BINDING_H_ */
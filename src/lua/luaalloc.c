@@ -0,0 +1,215 @@
+#include "luaalloc.h"
+
+/*
+ * Size classes are 16 bytes apart upto 128 bytes and 32 bytes apart
+ * upto 512 bytes. Most of what lua allocates (strings, tables, closures,
+ * upvalues) is small and lands in the first few classes.
+ *
+ * Free blocks of a class are kept in a singly linked list threaded
+ * through the blocks themselves. Slabs are only returned to malloc
+ * when the allocator is deleted, which happens when the lua state is
+ * closed (reload or shutdown).
+ */
+
+#define SMALL_CLASS_LIMIT   128
+#define SMALL_CLASS_COUNT   (SMALL_CLASS_LIMIT / 16)
+#define CLASS_COUNT         (SMALL_CLASS_COUNT + ((LUA_ALLOC_MAX_POOLED - SMALL_CLASS_LIMIT) / 32))
+#define SLAB_HEADER_SIZE    16
+
+typedef struct freeBlock_t {
+	struct freeBlock_t* pNext;
+} freeBlock_t;
+
+typedef struct slab_t {
+	struct slab_t*      pNext;
+} slab_t;
+
+typedef struct luaAllocatorImpl_t {
+	freeBlock_t*        freeLists[CLASS_COUNT];
+	slab_t*             pSlabs;
+	char*               bump;
+	u_int32_t           bumpFree;
+	int                 enforced;
+	luaAllocatorStats_t stats;
+} luaAllocatorImpl_t;
+
+#define LUA_ALLOCATOR(x) ((luaAllocatorImpl_t*)(x))
+
+static inline int sizeToClass(size_t size) {
+	if (size <= SMALL_CLASS_LIMIT) {
+		return ((size + 15) >> 4) - 1;
+	}
+	return SMALL_CLASS_COUNT + ((size - (SMALL_CLASS_LIMIT + 1)) >> 5);
+}
+
+static inline u_int32_t classToSize(int sizeClass) {
+	if (sizeClass < SMALL_CLASS_COUNT) {
+		return (sizeClass + 1) << 4;
+	}
+	return SMALL_CLASS_LIMIT + ((sizeClass - SMALL_CLASS_COUNT + 1) << 5);
+}
+
+static void* poolAlloc(luaAllocatorImpl_t* pAllocator, int sizeClass) {
+	freeBlock_t* pBlock    = pAllocator->freeLists[sizeClass];
+	u_int32_t    blockSize = 0;
+
+	if (pBlock) {
+		pAllocator->freeLists[sizeClass] = pBlock->pNext;
+		return pBlock;
+	}
+	blockSize = classToSize(sizeClass);
+	if (pAllocator->bumpFree < blockSize) {
+		slab_t* pSlab = malloc(LUA_ALLOC_SLAB_SIZE);
+		if (!pSlab) {
+			return NULL;
+		}
+		pSlab->pNext          = pAllocator->pSlabs;
+		pAllocator->pSlabs    = pSlab;
+		pAllocator->bump      = ((char*)pSlab) + SLAB_HEADER_SIZE;
+		pAllocator->bumpFree  = LUA_ALLOC_SLAB_SIZE - SLAB_HEADER_SIZE;
+		pAllocator->stats.slabBytes += LUA_ALLOC_SLAB_SIZE;
+	}
+	pBlock = (freeBlock_t*)pAllocator->bump;
+	pAllocator->bump     += blockSize;
+	pAllocator->bumpFree -= blockSize;
+	return pBlock;
+}
+
+static inline void poolFree(luaAllocatorImpl_t* pAllocator, void* ptr, int sizeClass) {
+	freeBlock_t* pBlock = ptr;
+	pBlock->pNext = pAllocator->freeLists[sizeClass];
+	pAllocator->freeLists[sizeClass] = pBlock;
+}
+
+static void* blockAlloc(luaAllocatorImpl_t* pAllocator, size_t size) {
+	if (size > LUA_ALLOC_MAX_POOLED) {
+		void* ptr = malloc(size);
+		if (ptr) {
+			pAllocator->stats.largeBytes += size;
+		}
+		return ptr;
+	}
+	return poolAlloc(pAllocator, sizeToClass(size));
+}
+
+static void blockFree(luaAllocatorImpl_t* pAllocator, void* ptr, size_t size) {
+	if (size > LUA_ALLOC_MAX_POOLED) {
+		pAllocator->stats.largeBytes -= size;
+		free(ptr);
+	}else {
+		poolFree(pAllocator, ptr, sizeToClass(size));
+	}
+}
+
+static void* blockRealloc(luaAllocatorImpl_t* pAllocator, void* ptr, size_t osize, size_t nsize) {
+	void* newPtr = 0;
+
+	if ((osize > LUA_ALLOC_MAX_POOLED) && (nsize > LUA_ALLOC_MAX_POOLED)) {
+		newPtr = realloc(ptr, nsize);
+		if (newPtr) {
+			pAllocator->stats.largeBytes += nsize;
+			pAllocator->stats.largeBytes -= osize;
+		}
+		return newPtr;
+	}
+	if ((osize <= LUA_ALLOC_MAX_POOLED) && (nsize <= LUA_ALLOC_MAX_POOLED) &&
+			(sizeToClass(osize) == sizeToClass(nsize))) {
+		return ptr;
+	}
+	newPtr = blockAlloc(pAllocator, nsize);
+	if (newPtr) {
+		memcpy(newPtr, ptr, osize < nsize ? osize : nsize);
+		blockFree(pAllocator, ptr, osize);
+	}else if (nsize < osize) {
+		// lua does not expect shrinking to fail. Keep the bigger block,
+		// it ends up on the free list of the smaller class later.
+		if (osize > LUA_ALLOC_MAX_POOLED) {
+			pAllocator->stats.largeBytes -= osize;
+		}
+		newPtr = ptr;
+	}
+	return newPtr;
+}
+
+luaAllocator_t luaAllocatorCreate(u_int64_t limit) {
+	luaAllocatorImpl_t* pAllocator = ALLOCATE_1(luaAllocatorImpl_t);
+	if (pAllocator) {
+		pAllocator->stats.limit = limit;
+	}
+	return pAllocator;
+}
+
+void luaAllocatorDelete(luaAllocator_t allocator) {
+	luaAllocatorImpl_t* pAllocator = LUA_ALLOCATOR(allocator);
+	if (pAllocator) {
+		while (pAllocator->pSlabs) {
+			slab_t* pSlab = pAllocator->pSlabs;
+			pAllocator->pSlabs = pSlab->pNext;
+			free(pSlab);
+		}
+		FREE(pAllocator);
+	}
+}
+
+/* Has the lua_Alloc signature except for the first argument. When
+ * nsize is 0 the block is freed, when ptr is null a new block is
+ * allocated and otherwise the block is resized.
+ */
+void* luaAllocatorAlloc(luaAllocator_t allocator, void* ptr, size_t osize, size_t nsize) {
+	luaAllocatorImpl_t* pAllocator = LUA_ALLOCATOR(allocator);
+	void*               newPtr     = 0;
+
+	if (!ptr) {
+		osize = 0;
+	}
+	if (nsize == 0) {
+		if (ptr) {
+			blockFree(pAllocator, ptr, osize);
+			pAllocator->stats.used -= osize;
+		}
+		return NULL;
+	}
+	if ((nsize > osize) && pAllocator->enforced && pAllocator->stats.limit &&
+			((pAllocator->stats.used + (nsize - osize)) > pAllocator->stats.limit)) {
+		pAllocator->stats.failures++;
+		return NULL;
+	}
+	if (ptr) {
+		newPtr = blockRealloc(pAllocator, ptr, osize, nsize);
+	}else {
+		newPtr = blockAlloc(pAllocator, nsize);
+	}
+	if (newPtr) {
+		pAllocator->stats.used += nsize;
+		pAllocator->stats.used -= osize;
+		if (pAllocator->stats.used > pAllocator->stats.peak) {
+			pAllocator->stats.peak = pAllocator->stats.used;
+		}
+	}else {
+		pAllocator->stats.failures++;
+	}
+	return newPtr;
+}
+
+void luaAllocatorSetLimit(luaAllocator_t allocator, u_int64_t limit) {
+	LUA_ALLOCATOR(allocator)->stats.limit = limit;
+}
+
+/* The limit is only enforced while a script is executing. Lua treats
+ * a failed allocation outside of a protected call as fatal.
+ */
+void luaAllocatorSetEnforced(luaAllocator_t allocator, int enforced) {
+	LUA_ALLOCATOR(allocator)->enforced = enforced;
+}
+
+u_int64_t luaAllocatorUsed(luaAllocator_t allocator) {
+	return LUA_ALLOCATOR(allocator)->stats.used;
+}
+
+u_int64_t luaAllocatorFailures(luaAllocator_t allocator) {
+	return LUA_ALLOCATOR(allocator)->stats.failures;
+}
+
+void luaAllocatorGetStats(luaAllocator_t allocator, luaAllocatorStats_t* pStats) {
+	*pStats = LUA_ALLOCATOR(allocator)->stats;
+}
@@ -0,0 +1,43 @@
+#ifndef LUAALLOC_H_
+#define LUAALLOC_H_
+
+#include "../common/common.h"
+
+/* Memory allocator for a lua_State
+ *
+ * Small blocks (upto LUA_ALLOC_MAX_POOLED bytes) come from size class
+ * pools carved out of LUA_ALLOC_SLAB_SIZE slabs, bigger ones from
+ * malloc. Lua always tells us the old size of a block, so there is
+ * no per block header. A realloc within the same size class returns
+ * the same pointer and does not copy.
+ *
+ * Every byte handed to lua is accounted. When a limit is set and the
+ * allocator is enforcing, an allocation which would take the state
+ * over the limit fails and lua raises a "not enough memory" error in
+ * the script. Shrinking and freeing never fail.
+ */
+
+#define LUA_ALLOC_SLAB_SIZE    (16 * 1024)
+#define LUA_ALLOC_MAX_POOLED   512
+
+typedef void* luaAllocator_t;
+
+typedef struct luaAllocatorStats_t {
+	u_int64_t  used;
+	u_int64_t  peak;
+	u_int64_t  limit;
+	u_int64_t  failures;
+	u_int64_t  slabBytes;
+	u_int64_t  largeBytes;
+} luaAllocatorStats_t;
+
+luaAllocator_t luaAllocatorCreate(u_int64_t limit);
+void           luaAllocatorDelete(luaAllocator_t allocator);
+void*          luaAllocatorAlloc(luaAllocator_t allocator, void* ptr, size_t osize, size_t nsize);
+void           luaAllocatorSetLimit(luaAllocator_t allocator, u_int64_t limit);
+void           luaAllocatorSetEnforced(luaAllocator_t allocator, int enforced);
+u_int64_t      luaAllocatorUsed(luaAllocator_t allocator);
+u_int64_t      luaAllocatorFailures(luaAllocator_t allocator);
+void           luaAllocatorGetStats(luaAllocator_t allocator, luaAllocatorStats_t* pStats);
+
+#endif /* LUAALLOC_H_ */
@@ -42,6 +42,12 @@ static int luaCacheItemGetExpiryTime(lua_State* L) {
     return 1;
 }
 
+static int luaCacheItemGetTTL(lua_State* L) {
+	cacheItem_t* p = (cacheItem_t*) lua_touserdata(L, 1);
+    lua_pushnumber(L, cacheItemGetTTL(*p));
+    return 1;
+}
+
 static int luaCacheItemGetDataSize(lua_State* L) {
 	cacheItem_t* p = (cacheItem_t*) lua_touserdata(L, 1);
     lua_pushnumber(L, cacheItemGetDataLength(*p));
@@ -68,6 +74,7 @@ static const luaL_Reg cacheitem_methods[] = {
     {"getKey",        luaCacheItemGetKey},
     {"getKeySize",    luaCacheItemGetKeySize},
     {"getExpiryTime", luaCacheItemGetExpiryTime},
+    {"getTTL",        luaCacheItemGetTTL},
     {"getFlags",      luaCacheItemGetFlags},
     {"getDataSize",   luaCacheItemGetDataSize},
     {"getData",       luaCacheItemGetData},
@@ -1,3 +1,4 @@
+#include <time.h>
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
@@ -7,6 +8,23 @@
 #include "../cacheismo.h"
 #include "luacommand.h"
 
+static luaClusterMapStats_t stats;
+
+static u_int64_t currentTimeInMicros(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((u_int64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+/* called when the script yields waiting for other servers */
+static void scriptSuspended(luaContext_t* pContext) {
+	pContext->suspendedAt = currentTimeInMicros();
+	stats.suspended++;
+}
+
+void luaClusterMapGetStats(luaClusterMapStats_t* pStats) {
+	*pStats = stats;
+}
 
 /* for handling parallel gets we need to keep track of
  * what was asked by the script and have we got all
@@ -162,7 +180,7 @@ int luaCommandGetValueFromExternalServer(lua_State* L) {
 		context->multiContext = 0;
 	}
 
-	IfTrue(0 >  clusterMapGet(pRunnable->clusterMap, context, NULL, server, key),
+	IfTrue(0 == clusterMapGet(pRunnable->clusterMap, context, NULL, server, key),
 			WARN, "Error submitting request to clusterMap");
 
 	goto OnSuccess;
@@ -190,6 +208,7 @@ OnSuccess:
 		//we do a yield, nothing on the stack
 		//this for the script to stop execution
 		//and return result to driver.c
+		scriptSuspended(context);
 		return lua_yield (L, 0);
 	}
 }
@@ -321,6 +340,7 @@ OnSuccess:
 		//we do a yield, nothing on the stack
 		//this for the script to stop execution
 		//and return result to driver.c
+		scriptSuspended(context);
 		return lua_yield (L, 0);
 	}
 }
@@ -351,12 +371,26 @@ static void pushMultiResultOnStack(lua_State* L, multiContext_t* pMContext) {
 	}
 }
 
+/* The result is already pushed on the stack of thread. If the runnable
+ * was retired by a reload, it is gone after this along with the context.
+ */
+static void resumeSuspendedScript(luaContext_t* pContext, lua_State* thread) {
+	connection_t connection = pContext->connection;
+	int          result     = 0;
+
+	stats.suspended--;
+	hdrHistogramAdd(&stats.wait, currentTimeInMicros() - pContext->suspendedAt);
+	result = luaRunnableResume(pContext->runnable, thread, pContext->pCommand, 1);
+	if (result == LUA_RUNNABLE_SUSPENDED) {
+		return;
+	}
+	onLuaResponseAvailable(connection, result);
+}
 
 void clusterMapResultHandler(void* luaContext, void* keyContext, int status, dataStream_t data) {
-	luaContext_t*      pContext  = (luaContext_t*)luaContext;
-	luaRunnableImpl_t* pRunnable = LUA_RUNNABLE(pContext->runnable);
-	int                result    = 0;
-	int                multi    = 0;
+	luaContext_t*      pContext   = (luaContext_t*)luaContext;
+	luaRunnableImpl_t* pRunnable  = LUA_RUNNABLE(pContext->runnable);
+	int                multi      = 0;
 
 	if (keyContext && pContext->multiContext) {
 		multi = 1;
@@ -409,26 +443,247 @@ void clusterMapResultHandler(void* luaContext, void* keyContext, int status, dat
 		pContext->multiContext = 0;
 	}
 
-	//now we need to resume the script
-	result = lua_resume(localLuaState, 1);
+	resumeSuspendedScript(pContext, localLuaState);
+}
+
 
-	if (result != 0) {
-		if (result == LUA_YIELD) {
-			return;
-		}else {
-			LOG(ERR, "lua_resume failed  [%s]", lua_tostring(localLuaState,-1));
-			//stackdump(localLuaState);
+/* Writes to other servers
+ *
+ * setOnServer, deleteOnServer and incrOnServer send the command with
+ * clusterMapForward and yield like getFromServer. Writes to the same
+ * server made by the scripts in one event loop iteration are written
+ * together and pipelined on the pooled connections. When the server
+ * answers, the script is resumed with
+ *   true   - STORED, DELETED
+ *   false  - NOT_STORED, NOT_FOUND
+ *   number - new value after incr
+ *   nil    - error, server not reachable
+ */
+
+#define MAX_WRITE_KEY_SIZE   250
+#define MAX_WRITE_LINE_SIZE  96
+#define MAX_WRITE_DATA_COPY  (32 * 1024)
+
+static int appendCopy(dataStream_t request, fallocator_t fallocator, const char* data, size_t length) {
+	while (length > 0) {
+		u_int32_t size   = (length > MAX_WRITE_DATA_COPY) ? MAX_WRITE_DATA_COPY : length;
+		char*     buffer = dataStreamBufferAllocate(NULL, fallocator, size);
+		int       err    = 0;
+
+		if (!buffer) {
+			return -1;
+		}
+		memcpy(buffer, data, size);
+		err = dataStreamAppendData(request, buffer, 0, size);
+		dataStreamBufferFree(buffer);
+		if (err != 0) {
+			return -1;
 		}
+		data   += size;
+		length -= size;
+	}
+	return 0;
+}
+
+static void remoteWriteHandler(void* luaContext, int status, dataStream_t response) {
+	luaContext_t*      pContext  = (luaContext_t*)luaContext;
+	luaRunnableImpl_t* pRunnable = LUA_RUNNABLE(pContext->runnable);
+	char*              line      = 0;
+
+	lua_rawgeti(pRunnable->luaState, LUA_REGISTRYINDEX, pContext->threadRef);
+	luaL_unref(pRunnable->luaState, LUA_REGISTRYINDEX, pContext->threadRef);
+	pContext->threadRef = LUA_NOREF;
+
+	lua_State* localLuaState = lua_tothread(pRunnable->luaState, -1);
+	if ((status == 0) && response) {
+		line = dataStreamToString(response);
+	}
+	if (!line) {
+		lua_pushnil(localLuaState);
+	}else if ((0 == strncmp(line, "STORED", 6)) || (0 == strncmp(line, "DELETED", 7))) {
+		lua_pushboolean(localLuaState, 1);
+	}else if ((0 == strncmp(line, "NOT_STORED", 10)) || (0 == strncmp(line, "NOT_FOUND", 9))) {
+		lua_pushboolean(localLuaState, 0);
+	}else if ((line[0] >= '0') && (line[0] <= '9')) {
+		lua_pushnumber(localLuaState, (lua_Number)strtoull(line, 0, 10));
 	}else {
-		result = lua_tointeger(localLuaState, -1);
-		lua_remove(localLuaState, lua_gettop(localLuaState));
-		if (result != 0) {
-			LOG(WARN, "main lua function returned error %d", result);
+		LOG(INFO, "Error response for write %.*s", (int)strcspn(line, "\r\n"), line);
+		lua_pushnil(localLuaState);
+	}
+	if (line) {
+		FREE(line);
+	}
+	resumeSuspendedScript(pContext, localLuaState);
+}
+
+/* submits the request and yields. On error nil is returned to the
+ * script without suspending it. The nearCache copy of the key is
+ * dropped, the script should not read back the old value.
+ */
+static int submitWriteAndYield(lua_State* L, luaContext_t* context, const char* server,
+		const char* key, dataStream_t request) {
+	luaRunnableImpl_t* pRunnable = 0;
+	int                result    = 0;
+
+	IfTrue(context && request, ERR, "Null context from lua stack");
+	IfTrue(!context->multiContext, ERR, "MultiContext not Null in the lua context");
+	pRunnable = context->runnable;
+	clusterMapInvalidate(pRunnable->clusterMap, (char*)server, (char*)key);
+
+	//current running thread is always present at the top of the
+	//main lua stack
+	context->threadRef = luaL_ref(pRunnable->luaState, LUA_REGISTRYINDEX);
+	IfTrue(0 == clusterMapForward(pRunnable->clusterMap, context, remoteWriteHandler,
+			(char*)server, request, 0), WARN, "Error submitting request to clusterMap");
+	goto OnSuccess;
+OnError:
+	result = -1;
+	if (pRunnable) {
+		//restore thread on the main stack
+		lua_rawgeti(pRunnable->luaState, LUA_REGISTRYINDEX, context->threadRef);
+		luaL_unref(pRunnable->luaState, LUA_REGISTRYINDEX, context->threadRef);
+		context->threadRef = LUA_NOREF;
+	}
+OnSuccess:
+	//clusterMap keeps its own reference
+	if (request) {
+		dataStreamDelete(request);
+	}
+	if (result < 0) {
+		lua_pushnil(L);
+		return 1;
+	}
+	scriptSuspended(context);
+	return lua_yield(L, 0);
+}
+
+/* creates the request line, data is appended followed by \r\n */
+static dataStream_t createWriteRequest(fallocator_t fallocator, const char* line, int length,
+		const char* data, size_t dataLength) {
+	dataStream_t request = dataStreamCreate();
+
+	IfTrue(request, WARN, "Error allocating memory");
+	IfTrue(0 == appendCopy(request, fallocator, line, length), WARN, "Error copying request");
+	if (data) {
+		IfTrue(0 == appendCopy(request, fallocator, data, dataLength), WARN, "Error copying data");
+		IfTrue(0 == appendCopy(request, fallocator, "\r\n", 2), WARN, "Error copying request");
+	}
+	goto OnSuccess;
+OnError:
+	if (request) {
+		dataStreamDelete(request);
+		request = 0;
+	}
+OnSuccess:
+	return request;
+}
+
+static int isValidKey(const char* key, size_t length) {
+	if ((length == 0) || (length > MAX_WRITE_KEY_SIZE)) {
+		return 0;
+	}
+	for (size_t i = 0; i < length; i++) {
+		if ((key[i] <= ' ') || (key[i] == 0x7f)) {
+			return 0;
 		}
 	}
-	//pop the thread from stack so that it can be garbage collected
-	lua_remove(pRunnable->luaState, lua_gettop(pRunnable->luaState));
-	onLuaResponseAvailable(((luaContext_t*)luaContext)->connection, result);
-	return;
+	return 1;
+}
+
+/* command:setOnServer(server, key, value [, expiryTime [, flags]]) */
+int luaCommandSetValueOnExternalServer(lua_State* L) {
+	luaContext_t* context   = (luaContext_t*) lua_touserdata(L, 1);
+	size_t        keyLength = 0, dataLength = 0;
+	const char*   server    = luaL_checkstring(L, 2);
+	const char*   key       = luaL_checklstring(L, 3, &keyLength);
+	const char*   data      = luaL_checklstring(L, 4, &dataLength);
+	u_int32_t     expiry    = (u_int32_t)luaL_optinteger(L, 5, 0);
+	u_int32_t     flags     = (u_int32_t)luaL_optinteger(L, 6, 0);
+	char          line[MAX_WRITE_LINE_SIZE + MAX_WRITE_KEY_SIZE];
+	int           length    = 0;
+
+	if (!context || !isValidKey(key, keyLength)) {
+		lua_pushnil(L);
+		return 1;
+	}
+	length = snprintf(line, sizeof(line), "set %s %u %u %lu\r\n", key, flags, expiry,
+			(unsigned long)dataLength);
+	return submitWriteAndYield(L, context, server, key,
+			createWriteRequest(context->fallocator, line, length, data, dataLength));
+}
+
+/* command:deleteOnServer(server, key) */
+int luaCommandDeleteValueOnExternalServer(lua_State* L) {
+	luaContext_t* context   = (luaContext_t*) lua_touserdata(L, 1);
+	size_t        keyLength = 0;
+	const char*   server    = luaL_checkstring(L, 2);
+	const char*   key       = luaL_checklstring(L, 3, &keyLength);
+	char          line[MAX_WRITE_LINE_SIZE + MAX_WRITE_KEY_SIZE];
+	int           length    = 0;
+
+	if (!context || !isValidKey(key, keyLength)) {
+		lua_pushnil(L);
+		return 1;
+	}
+	length = snprintf(line, sizeof(line), "delete %s\r\n", key);
+	return submitWriteAndYield(L, context, server, key,
+			createWriteRequest(context->fallocator, line, length, 0, 0));
+}
+
+/* command:incrOnServer(server, key [, delta]), decr for negative delta */
+int luaCommandIncrValueOnExternalServer(lua_State* L) {
+	luaContext_t* context   = (luaContext_t*) lua_touserdata(L, 1);
+	size_t        keyLength = 0;
+	const char*   server    = luaL_checkstring(L, 2);
+	const char*   key       = luaL_checklstring(L, 3, &keyLength);
+	lua_Number    delta     = luaL_optnumber(L, 4, 1);
+	char          line[MAX_WRITE_LINE_SIZE + MAX_WRITE_KEY_SIZE];
+	int           length    = 0;
+
+	if (!context || !isValidKey(key, keyLength)) {
+		lua_pushnil(L);
+		return 1;
+	}
+	length = snprintf(line, sizeof(line), "%s %s %llu\r\n", (delta < 0) ? "decr" : "incr", key,
+			(unsigned long long)((delta < 0) ? -delta : delta));
+	return submitWriteAndYield(L, context, server, key,
+			createWriteRequest(context->fallocator, line, length, 0, 0));
+}
+
+/* command:pushToNearCache() keeps the value of a nearset in the near
+ * cache as got from the server which sent it. Returns the hits of the
+ * copy replaced, nil if the near cache is not enabled.
+ */
+int luaCommandPushToNearCache(lua_State* L) {
+	luaContext_t*      context   = (luaContext_t*) lua_touserdata(L, 1);
+	luaRunnableImpl_t* pRunnable = 0;
+	command_t*         pCommand  = 0;
+	int                hits      = -1;
+
+	if (context && context->pCommand->server && context->pCommand->key &&
+			context->pCommand->dataStream) {
+		pRunnable = context->runnable;
+		pCommand  = context->pCommand;
+		hits      = clusterMapPushToNearCache(pRunnable->clusterMap, pCommand->server,
+				pCommand->key, pCommand->dataStream);
+	}
+	if (hits < 0) {
+		lua_pushnil(L);
+	}else {
+		lua_pushnumber(L, hits);
+	}
+	return 1;
 }
 
+/* command:dropFromNearCache() drops the copy named by a neardelete */
+int luaCommandDropFromNearCache(lua_State* L) {
+	luaContext_t*      context   = (luaContext_t*) lua_touserdata(L, 1);
+	luaRunnableImpl_t* pRunnable = 0;
+
+	if (context && context->pCommand->server && context->pCommand->key) {
+		pRunnable = context->runnable;
+		clusterMapInvalidate(pRunnable->clusterMap, context->pCommand->server,
+				context->pCommand->key);
+	}
+	return 0;
+}
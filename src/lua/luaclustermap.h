@@ -3,6 +3,7 @@
 
 #include "../common/list.h"
 #include "../datastream/datastream.h"
+#include "../common/hdrhistogram.h"
 
 typedef struct keyValue_t {
 	struct keyValue_t* pNext;
@@ -29,6 +30,21 @@ typedef struct {
 
 int luaCommandGetValueFromExternalServer(lua_State* L);
 int luaCommandGetMultipleValuesFromExternalServers(lua_State* L);
+int luaCommandSetValueOnExternalServer(lua_State* L);
+int luaCommandDeleteValueOnExternalServer(lua_State* L);
+int luaCommandIncrValueOnExternalServer(lua_State* L);
+int luaCommandPushToNearCache(lua_State* L);
+int luaCommandDropFromNearCache(lua_State* L);
 void clusterMapResultHandler(void* luaContext, void* keyContext, int status, dataStream_t data) ;
 
+/* Scripts waiting for other servers, the time they waited is counted
+ * in micro seconds when they are resumed.
+ */
+typedef struct {
+	u_int32_t      suspended;
+	hdrHistogram_t wait;
+} luaClusterMapStats_t;
+
+void luaClusterMapGetStats(luaClusterMapStats_t* pStats);
+
 #endif /* LUACLUSTERMAP_H_ */
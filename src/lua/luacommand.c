@@ -3,6 +3,8 @@
 #include "luacommand.h"
 #include "../cacheismo.h"
 
+#define LUA_COMMAND_DATA_BUFFER  (32 * 1024)
+
 static const char* command2String(enum commands_enum_t command) {
 	switch (command) {
 	case COMMAND_GET:        return "get";
@@ -22,6 +24,16 @@ static const char* command2String(enum commands_enum_t command) {
 	case COMMAND_VERSION:    return "version";
 	case COMMAND_QUIT:       return "quit";
 	case COMMAND_VERBOSITY:  return "verbosity";
+	case COMMAND_RELOAD:     return "reload";
+	case COMMAND_LGET:       return "get";
+	case COMMAND_LADD:       return "add";
+	case COMMAND_LDELETE:    return "delete";
+	case COMMAND_RING:       return "ring";
+	case COMMAND_GOSSIP:     return "gossip";
+	case COMMAND_SNAPSHOT:   return "snapshot";
+	case COMMAND_SLOWLOG:    return "slowlog";
+	case COMMAND_NEARSET:    return "nearset";
+	case COMMAND_NEARDELETE: return "neardelete";
 	}
 	return 0;
 }
@@ -36,6 +48,7 @@ int luaCommandNew(lua_State* L, connection_t connection, fallocator_t fallocator
    context->runnable     = runnable;
    context->threadRef    = LUA_NOREF;
    context->multiContext = 0;
+   context->suspendedAt  = 0;
    lua_getglobal(L, "Command");
    lua_setmetatable(L, -2);
    return 1;
@@ -92,23 +105,31 @@ static int luaCommandSetData(lua_State* L) {
 	size_t l;
 	const char *s = luaL_checklstring(L, -1, &l);
 	if (s && l > 0) {
-		dataStream_t ds = dataStreamCreate();
-		if (ds) {
-			char*  buffer = (char*) dataStreamBufferAllocate(NULL, context->fallocator, l);
+		dataStream_t ds   = dataStreamCreate();
+		size_t       done = 0;
+		//vector length of a dataStream is 16 bits, copy in pieces
+		while (ds && (done < l)) {
+			size_t size   = ((l - done) > LUA_COMMAND_DATA_BUFFER) ? LUA_COMMAND_DATA_BUFFER : (l - done);
+			char*  buffer = (char*) dataStreamBufferAllocate(NULL, context->fallocator, size);
+			int    err    = -1;
 			if (buffer) {
-				memcpy(buffer, s, l);
-				if (0 == dataStreamAppendData(ds, buffer, 0, l)) {
-					if (context->pCommand->dataStream) {
-					  	dataStreamDelete(context->pCommand->dataStream);
-					}
-					context->pCommand->dataStream = ds;
-					context->pCommand->dataLength = l;
-					ds = 0;
-				}
+				memcpy(buffer, s + done, size);
+				err = dataStreamAppendData(ds, buffer, 0, size);
 				//decrease our refcount
 				dataStreamBufferFree(buffer);
-				buffer = 0;
 			}
+			if (err != 0) {
+				dataStreamDelete(ds);
+				ds = 0;
+			}
+			done += size;
+		}
+		if (ds) {
+			if (context->pCommand->dataStream) {
+			  	dataStreamDelete(context->pCommand->dataStream);
+			}
+			context->pCommand->dataStream = ds;
+			context->pCommand->dataLength = l;
 		}
 	}
 	return 0;
@@ -272,6 +293,11 @@ static const luaL_Reg command_methods[] = {
     {"getMultipleKeys",luaCommandGetMultipleKeys},
     {"getFromServer",  luaCommandGetValueFromExternalServer},
     {"getInParallel",  luaCommandGetMultipleValuesFromExternalServers},
+    {"setOnServer",    luaCommandSetValueOnExternalServer},
+    {"deleteOnServer", luaCommandDeleteValueOnExternalServer},
+    {"incrOnServer",   luaCommandIncrValueOnExternalServer},
+    {"pushToNearCache",   luaCommandPushToNearCache},
+    {"dropFromNearCache", luaCommandDropFromNearCache},
     {NULL, NULL}
 };
 
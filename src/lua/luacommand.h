@@ -17,6 +17,7 @@ typedef struct luaContext_t {
 	luaRunnable_t    runnable;
 	int              threadRef;
 	multiContext_t*  multiContext;
+	u_int64_t        suspendedAt;    //micros, waiting for another server
 } luaContext_t;
 
 int luaCommandNew(lua_State* L, connection_t connection, fallocator_t fallocator,
@@ -3,9 +3,15 @@
 int luaConsistentNew(lua_State* L) {
 	consistent_t consistent = 0;
 	size_t l;
-	const char *serverList = luaL_checklstring(L, -1, &l);
+	const char *serverList = luaL_checklstring(L, 1, &l);
+	const char *modeName   = luaL_optstring(L, 2, "ketama");
+	int         mode       = consistentModeFromName(modeName);
+
+	if (mode < 0) {
+		return luaL_argerror(L, 2, "mode must be ketama, jump or rendezvous");
+	}
 	if (serverList && l > 0) {
-		consistent =  consistentCreate((char*)serverList);
+		consistent =  consistentCreateWithMode((char*)serverList, mode);
 	}
 
 	if (consistent) {
@@ -73,11 +79,18 @@ static int luaConsistentSetServerAvailable(lua_State* L) {
 
 
 // r methods..
+static int luaConsistentGetMode(lua_State* L) {
+	consistent_t*   pC = (consistent_t*)lua_touserdata(L, 1);
+	lua_pushstring(L, consistentGetModeName(*pC));
+	return 1;
+}
+
 static const luaL_Reg consistent_methods[] = {
     {"findServerForKey",   luaConsistentFindServer},
     {"getServerCount",     luaConsistentGetServerCount},
     {"isServerAvailable",  luaConsistentIsServerAvailable},
     {"setServerAvailable", luaConsistentSetServerAvailable},
+    {"getMode",            luaConsistentGetMode},
     {NULL, NULL}
 };
 
@@ -2,6 +2,19 @@
 #include "../hashmap/hashmap.h"
 #include "../cacheitem/cacheitem.h"
 #include "luacacheitem.h"
+#include "luacommand.h"
+#include "../cacheismo.h"
+
+#define LUA_MULTI_BATCH_SIZE 64
+
+/* the hashMap calls are timed for the slowlog, the items created and
+ * written around them are not */
+#define SLOWLOG_TIMED(phaseName, call)                           \
+	{                                                            \
+		int phase = slowlogEnter(getGlobalSlowlog(), phaseName); \
+		call;                                                    \
+		slowlogLeave(getGlobalSlowlog(), phase);                 \
+	}
 
 static int luaHashMapGet(lua_State* L) {
 	hashMap_t* pHashMap = (hashMap_t*) lua_touserdata(L, 1);
@@ -9,7 +22,7 @@ static int luaHashMapGet(lua_State* L) {
 	cacheItem_t item = 0;
 	const char *s = luaL_checklstring(L, -1, &l);
 	if (s && l > 0) {
-		item = hashMapGetElement(*pHashMap, (char*)s, l);
+		SLOWLOG_TIMED(SLOWLOG_HASHMAP, item = hashMapGetElement(*pHashMap, (char*)s, l));
 		if (item) {
 			luaCacheItemNew(L, item);
 		}else {
@@ -26,7 +39,7 @@ static int luaHashMapDelete(lua_State* L) {
 	size_t l;
 	const char *s = luaL_checklstring(L, -1, &l);
 	if (s && l > 0) {
-		hashMapDeleteElement(*pHashMap, (char*)s, l);
+		SLOWLOG_TIMED(SLOWLOG_HASHMAP, hashMapDeleteElement(*pHashMap, (char*)s, l));
 	}
 	return 0;
 }
@@ -34,14 +47,123 @@ static int luaHashMapDelete(lua_State* L) {
 static int luaHashMapPut(lua_State* L) {
 	hashMap_t*   pHashMap = (hashMap_t*)lua_touserdata(L, 1);
 	cacheItem_t* pItem    = (cacheItem_t*)lua_touserdata(L, 2);
-	hashMapPutElement(*pHashMap,*pItem);
+	SLOWLOG_TIMED(SLOWLOG_HASHMAP, hashMapPutElement(*pHashMap,*pItem));
 	return 0;
 }
 
+/* Looks up the keys in one go and writes a VALUE block for every hit to the
+ * command's connection. No CacheItem userdata is created for the hits.
+ */
+static int writeElements(hashMap_t hashMap, luaContext_t* context, u_int32_t count,
+		char** keys, u_int32_t* keyLengths) {
+	void*     values[LUA_MULTI_BATCH_SIZE];
+	u_int32_t found = 0;
+
+	SLOWLOG_TIMED(SLOWLOG_HASHMAP,
+			found = hashMapGetElements(hashMap, count, keys, keyLengths, values));
+	if (found > 0) {
+		for (int i = 0; i < count; i++) {
+			if (values[i]) {
+				writeCacheItemToStream(context->connection, values[i]);
+				cacheItemDelete(getGlobalChunkpool(), values[i]);
+			}
+		}
+	}
+	return found;
+}
+
+/* hashMap:getMulti(command [, keys]) writes every key found, in order, as
+ * the get command would and returns the number of hits. Without the keys
+ * table the keys of the command itself are used.
+ */
+static int luaHashMapGetMulti(lua_State* L) {
+	hashMap_t*    pHashMap = (hashMap_t*)lua_touserdata(L, 1);
+	luaContext_t* context  = (luaContext_t*)lua_touserdata(L, 2);
+	char*         keys[LUA_MULTI_BATCH_SIZE];
+	u_int32_t     keyLengths[LUA_MULTI_BATCH_SIZE];
+	u_int32_t     count    = 0;
+	u_int32_t     found    = 0;
+	int           top      = lua_gettop(L);
+
+	luaL_argcheck(L, context != 0, 2, "command expected");
+
+	if (lua_istable(L, 3)) {
+		int total = lua_objlen(L, 3);
+		luaL_checkstack(L, LUA_MULTI_BATCH_SIZE, "too many keys");
+		for (int i = 1; i <= total; i++) {
+			size_t l = 0;
+			/* The keys stay on the stack until they are looked up, a number
+			 * converted by lua_tolstring has no other reference. Keys which
+			 * are neither strings nor numbers are skipped.
+			 */
+			lua_rawgeti(L, 3, i);
+			keys[count] = (char*)lua_tolstring(L, -1, &l);
+			if (!keys[count]) {
+				lua_pop(L, 1);
+				continue;
+			}
+			keyLengths[count] = l;
+			if (++count == LUA_MULTI_BATCH_SIZE) {
+				found += writeElements(*pHashMap, context, count, keys, keyLengths);
+				count  = 0;
+				lua_settop(L, top);
+			}
+		}
+	}else if (context->pCommand->multiGetKeysCount > 0) {
+		for (int i = 0; i < context->pCommand->multiGetKeysCount; i++) {
+			keys[count]       = context->pCommand->multiGetKeys[i];
+			keyLengths[count] = strlen(keys[count]);
+			if (++count == LUA_MULTI_BATCH_SIZE) {
+				found += writeElements(*pHashMap, context, count, keys, keyLengths);
+				count  = 0;
+			}
+		}
+	}else if (context->pCommand->key) {
+		keys[count]       = context->pCommand->key;
+		keyLengths[count] = context->pCommand->keySize;
+		count++;
+	}
+	if (count > 0) {
+		found += writeElements(*pHashMap, context, count, keys, keyLengths);
+	}
+	lua_settop(L, top);
+	lua_pushnumber(L, found);
+	return 1;
+}
+
+/* hashMap:putMulti(items) puts every CacheItem of the array, replacing
+ * existing entries with the same key. Like put, the hashMap takes over
+ * the items. Returns the number of items put.
+ */
+static int luaHashMapPutMulti(lua_State* L) {
+	hashMap_t* pHashMap = (hashMap_t*)lua_touserdata(L, 1);
+	int        total    = 0;
+	int        count    = 0;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	total = lua_objlen(L, 2);
+	for (int i = 1; i <= total; i++) {
+		cacheItem_t* pItem = 0;
+		lua_rawgeti(L, 2, i);
+		pItem = (cacheItem_t*)lua_touserdata(L, -1);
+		if (pItem && *pItem) {
+			int phase = slowlogEnter(getGlobalSlowlog(), SLOWLOG_HASHMAP);
+			hashMapDeleteElement(*pHashMap, cacheItemGetKey(*pItem), cacheItemGetKeyLength(*pItem));
+			if (0 == hashMapPutElement(*pHashMap, *pItem)) {
+				count++;
+			}
+			slowlogLeave(getGlobalSlowlog(), phase);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pushnumber(L, count);
+	return 1;
+}
+
 static int luaHashMapDeleteLRU(lua_State* L) {
 	hashMap_t*   pHashMap = (hashMap_t*)lua_touserdata(L, 1);
 	u_int64_t    freeBytes = lua_tointeger(L, 2);
-	hashMapDeleteLRU(*pHashMap, freeBytes);
+	SLOWLOG_TIMED(SLOWLOG_ALLOC, hashMapDeleteLRU(*pHashMap, freeBytes));
 	return 0;
 }
 
@@ -52,7 +174,8 @@ static int luaHashMapGetPrefixMatchingKeys(lua_State* L) {
 	if (s && l > 0) {
 		u_int32_t count = 0;
 		char*     keys  = 0;
-		count = hashMapGetPrefixMatchingKeys(*pHashMap, (char*)s, &keys);
+		SLOWLOG_TIMED(SLOWLOG_HASHMAP,
+				count = hashMapGetPrefixMatchingKeys(*pHashMap, (char*)s, &keys));
 		LOG(DEBUG, "Got %d keys matching prefix %s", count, s);
 		if (count > 0) {
 			lua_createtable(L, count, 0);
@@ -80,7 +203,9 @@ static int luaHashMapGetPrefixMatchingKeys(lua_State* L) {
 
 static const luaL_Reg hashmap_methods[] = {
     {"get",       luaHashMapGet},
+    {"getMulti",  luaHashMapGetMulti},
     {"put",       luaHashMapPut},
+    {"putMulti",  luaHashMapPutMulti},
     {"delete",    luaHashMapDelete},
     {"deleteLRU", luaHashMapDeleteLRU},
     {"getPrefixMatchingKeys", luaHashMapGetPrefixMatchingKeys},
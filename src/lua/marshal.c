@@ -6,6 +6,7 @@
 * Provides:
 * s = table.marshal(t)      - serializes a table to a byte stream
 * t = table.unmarshal(s)    - deserializes a byte stream to a table
+* v = table.getfield(s, k)  - reads a single field of a serialized table
 *
 * Limitations:
 * Coroutines are not serialized and nor are userdata, however support
@@ -40,6 +41,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <math.h>
 
 #include <lua.h>
 #include <lualib.h>
@@ -56,15 +58,39 @@
 
 #define MAR_MAGIC 0x8e
 
+/* Version 2 layout, used when the table holds only booleans, numbers,
+ * strings and plain (acyclic, unshared) tables:
+ *
+ *   magic | u32 string count | u32 entry count | u32 string bytes
+ *   u32 string offsets[string count]
+ *   {u32 key hash, u32 body offset}[entry count], sorted by hash
+ *   strings: varint length + bytes, repeated values and nested keys once
+ *   body: key, value pairs of the top level table
+ *
+ * Values are a tag byte followed by a zigzag varint for integral numbers,
+ * 8 bytes for other numbers, a varint string index for strings and a
+ * varint entry count plus key, value pairs for nested tables. The index
+ * lets table.getfield() find a top level field with a binary search and
+ * decode only that value. Everything else falls back to version 1.
+ */
+#define MAR2_MAGIC       0x8f
+#define MAR2_HEADER_SIZE 13
+
+#define MAR2_FALSE  0
+#define MAR2_TRUE   1
+#define MAR2_INT    2
+#define MAR2_DOUBLE 3
+#define MAR2_STRING 4
+#define MAR2_TABLE  5
+
 typedef struct mar_Buffer {
     size_t size;
     size_t seek;
     size_t head;
     char*  data;
+    fallocator_t fallocator;
 } mar_Buffer;
 
-static fallocator_t FALLOCATOR = 0;
-
 static int mar_pack(lua_State *L, mar_Buffer *buf, int *idx);
 static int mar_unpack(lua_State *L, const char* buf, size_t len, int *idx);
 
@@ -73,13 +99,15 @@ static void buf_init(lua_State *L, mar_Buffer *buf)
     buf->size = 128;
     buf->seek = 0;
     buf->head = 0;
-    if (!(buf->data = fallocatorMalloc(FALLOCATOR, (buf->size))))
+    /* each lua state has its own fallocator, kept as upvalue of the library */
+    buf->fallocator = lua_touserdata(L, lua_upvalueindex(1));
+    if (!(buf->data = fallocatorMalloc(buf->fallocator, (buf->size))))
     		luaL_error(L, "Out of memory!");
 }
 
 static void buf_done(lua_State* L, mar_Buffer *buf)
 {
-    fallocatorFree(FALLOCATOR, buf->data);
+    fallocatorFree(buf->fallocator, buf->data);
 }
 
 static int buf_write(lua_State* L, const char* str, size_t len, mar_Buffer *buf)
@@ -91,7 +119,7 @@ static int buf_write(lua_State* L, const char* str, size_t len, mar_Buffer *buf)
         while (new_size - cur_head <= len) {
             new_size = new_size << 1;
         }
-        if (!(buf->data = fallocatorRealloc(FALLOCATOR, buf->data, buf->size, new_size))) {
+        if (!(buf->data = fallocatorRealloc(buf->fallocator, buf->data, buf->size, new_size))) {
             luaL_error(L, "Out of memory!");
         }
         buf->size = new_size;
@@ -456,11 +484,551 @@ static int mar_unpack(lua_State *L, const char* buf, size_t len, int *idx)
     return 1;
 }
 
+typedef struct mar2_Entry {
+    uint32_t hash;
+    uint32_t offset;
+} mar2_Entry;
+
+/* open addressing map from lua object pointers to ids. lua strings are
+ * interned, so equal strings have the same pointer */
+typedef struct mar2_Slot {
+    const void *key;
+    uint32_t    value;
+} mar2_Slot;
+
+typedef struct mar2_Map {
+    mar2_Slot   *slots;
+    uint32_t     mask;
+    uint32_t     count;
+    fallocator_t fallocator;
+} mar2_Map;
+
+typedef struct mar2_Writer {
+    mar_Buffer offsets;
+    mar_Buffer index;
+    mar_Buffer strings;
+    mar_Buffer body;
+    mar2_Map   interned;
+    mar2_Map   seen;
+    uint32_t   stringCount;
+} mar2_Writer;
+
+typedef struct mar2_Reader {
+    const char* offsets;
+    const char* index;
+    const char* strings;
+    const char* body;
+    const char* end;
+    uint32_t    stringCount;
+    uint32_t    entryCount;
+    uint32_t    stringBytes;
+} mar2_Reader;
+
+static int mar2_pack_table(lua_State *L, mar2_Writer *w, mar_Buffer *buf, int val);
+static void mar2_unpack_entries(lua_State *L, mar2_Reader *r, const char **p, uint64_t count);
+
+static void mar2_map_init(lua_State *L, mar2_Map *map, uint32_t size)
+{
+    map->fallocator = lua_touserdata(L, lua_upvalueindex(1));
+    map->mask  = size - 1;
+    map->count = 0;
+    if (!(map->slots = fallocatorMalloc(map->fallocator, size * sizeof(mar2_Slot))))
+        luaL_error(L, "Out of memory!");
+    memset(map->slots, 0, size * sizeof(mar2_Slot));
+}
+
+static void mar2_map_done(mar2_Map *map)
+{
+    fallocatorFree(map->fallocator, map->slots);
+}
+
+/* slot holding key, or the empty slot where it goes */
+static mar2_Slot* mar2_map_slot(mar2_Map *map, const void *key)
+{
+    uint32_t i = (uint32_t)(((uint64_t)(uintptr_t)key * 0x9e3779b97f4a7c15ull) >> 32);
+    for (i &= map->mask; ; i = (i + 1) & map->mask) {
+        if (map->slots[i].key == key || map->slots[i].key == NULL) {
+            return &map->slots[i];
+        }
+    }
+}
+
+static void mar2_map_put(lua_State *L, mar2_Map *map, mar2_Slot *slot, const void *key, uint32_t value)
+{
+    slot->key   = key;
+    slot->value = value;
+    if (++map->count * 4 > map->mask * 3) {
+        mar2_Map bigger;
+        uint32_t i;
+        mar2_map_init(L, &bigger, (map->mask + 1) * 2);
+        for (i = 0; i <= map->mask; i++) {
+            if (map->slots[i].key) {
+                *mar2_map_slot(&bigger, map->slots[i].key) = map->slots[i];
+            }
+        }
+        bigger.count = map->count;
+        mar2_map_done(map);
+        *map = bigger;
+    }
+}
+
+static uint32_t mar2_hash(int type, const char* data, size_t len)
+{
+    uint32_t hash = 2166136261u ^ (uint32_t)type;
+    size_t   i;
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* hash of a top level key, -1 if the key type can't be indexed */
+static int mar2_keyhash(lua_State *L, int key, uint32_t *hash)
+{
+    switch (lua_type(L, key)) {
+    case LUA_TSTRING: {
+        size_t l;
+        const char *str_val = lua_tolstring(L, key, &l);
+        *hash = mar2_hash(LUA_TSTRING, str_val, l);
+        return 0;
+    }
+    case LUA_TNUMBER: {
+        lua_Number num_val = lua_tonumber(L, key);
+        if (num_val == 0) num_val = 0; /* -0 and 0 are the same key */
+        *hash = mar2_hash(LUA_TNUMBER, (const char*)&num_val, sizeof(num_val));
+        return 0;
+    }
+    case LUA_TBOOLEAN: {
+        char bool_val = (char)lua_toboolean(L, key);
+        *hash = mar2_hash(LUA_TBOOLEAN, &bool_val, MAR_CHR);
+        return 0;
+    }
+    }
+    return -1;
+}
+
+/* tag byte followed by a varint, in one write */
+static void mar2_write_varint(lua_State *L, int tag, uint64_t value, mar_Buffer *buf)
+{
+    char   bytes[11];
+    size_t n = 0;
+    if (tag >= 0) {
+        bytes[n++] = (char)tag;
+    }
+    while (value >= 0x80) {
+        bytes[n++] = (char)(value | 0x80);
+        value >>= 7;
+    }
+    bytes[n++] = (char)value;
+    buf_write(L, bytes, n, buf);
+}
+
+static uint32_t mar2_add_string(lua_State *L, mar2_Writer *w, const char *str_val, size_t l)
+{
+    uint32_t offset = (uint32_t)w->strings.head;
+    buf_write(L, (void*)&offset, MAR_I32, &w->offsets);
+    mar2_write_varint(L, -1, l, &w->strings);
+    buf_write(L, str_val, l, &w->strings);
+    return w->stringCount++;
+}
+
+static uint32_t mar2_intern(lua_State *L, mar2_Writer *w, int val)
+{
+    size_t      l;
+    const char *str_val = lua_tolstring(L, val, &l);
+    mar2_Slot  *slot = mar2_map_slot(&w->interned, str_val);
+    uint32_t    id;
+
+    if (slot->key) {
+        return slot->value;
+    }
+    id = mar2_add_string(L, w, str_val, l);
+    mar2_map_put(L, &w->interned, slot, str_val, id);
+    return id;
+}
+
+static int mar2_pack_value(lua_State *L, mar2_Writer *w, mar_Buffer *buf, int val)
+{
+    char tag;
+    switch (lua_type(L, val)) {
+    case LUA_TBOOLEAN:
+        tag = lua_toboolean(L, val) ? MAR2_TRUE : MAR2_FALSE;
+        buf_write(L, &tag, MAR_CHR, buf);
+        return 0;
+    case LUA_TNUMBER: {
+        lua_Number num_val = lua_tonumber(L, val);
+        if (num_val >= -9.2e18 && num_val <= 9.2e18 &&
+            (lua_Number)(int64_t)num_val == num_val &&
+            !(num_val == 0 && signbit(num_val))) {
+            int64_t int_val = (int64_t)num_val;
+            mar2_write_varint(L, MAR2_INT, ((uint64_t)int_val << 1) ^ (uint64_t)(int_val >> 63), buf);
+        }
+        else {
+            tag = MAR2_DOUBLE;
+            buf_write(L, &tag, MAR_CHR, buf);
+            buf_write(L, (void*)&num_val, MAR_I64, buf);
+        }
+        return 0;
+    }
+    case LUA_TSTRING: {
+        mar2_write_varint(L, MAR2_STRING, mar2_intern(L, w, val), buf);
+        return 0;
+    }
+    case LUA_TTABLE:
+        return mar2_pack_table(L, w, buf, val);
+    }
+    /* functions, userdata and threads need version 1 */
+    return -1;
+}
+
+static int mar2_pack_table(lua_State *L, mar2_Writer *w, mar_Buffer *buf, int val)
+{
+    uint64_t count = 0;
+
+    /* shared and cyclic tables need the references of version 1, and so
+     * does __persist */
+    const void *table = lua_topointer(L, val);
+    mar2_Slot  *slot  = mar2_map_slot(&w->seen, table);
+
+    if (slot->key) {
+        return -1;
+    }
+    if (luaL_getmetafield(L, val, "__persist")) {
+        lua_pop(L, 1);
+        return -1;
+    }
+    if (!lua_checkstack(L, 4)) {
+        return -1;
+    }
+    mar2_map_put(L, &w->seen, slot, table, 0);
+
+    lua_pushnil(L);
+    while (lua_next(L, val) != 0) {
+        count++;
+        lua_pop(L, 1);
+    }
+    mar2_write_varint(L, MAR2_TABLE, count, buf);
+
+    lua_pushnil(L);
+    while (lua_next(L, val) != 0) {
+        int top = lua_gettop(L);
+        if (mar2_pack_value(L, w, buf, top - 1) || mar2_pack_value(L, w, buf, top)) {
+            lua_pop(L, 2);
+            return -1;
+        }
+        lua_pop(L, 1);
+    }
+    return 0;
+}
+
+/* packs the table at index 1, with the top level entries in the index */
+static int mar2_pack(lua_State *L, mar2_Writer *w)
+{
+    mar2_Entry entry;
+
+    mar2_map_put(L, &w->seen, mar2_map_slot(&w->seen, lua_topointer(L, 1)), lua_topointer(L, 1), 0);
+
+    lua_pushnil(L);
+    while (lua_next(L, 1) != 0) {
+        int top = lua_gettop(L);
+        if (mar2_keyhash(L, top - 1, &entry.hash) != 0) {
+            lua_pop(L, 2);
+            return -1;
+        }
+        entry.offset = (uint32_t)w->body.head;
+        buf_write(L, (void*)&entry, sizeof(entry), &w->index);
+        if (lua_type(L, top - 1) == LUA_TSTRING) {
+            /* top level keys are unique, no need to look them up */
+            size_t      l;
+            const char *str_val = lua_tolstring(L, top - 1, &l);
+            mar2_write_varint(L, MAR2_STRING, mar2_add_string(L, w, str_val, l), &w->body);
+        }
+        else if (mar2_pack_value(L, w, &w->body, top - 1)) {
+            lua_pop(L, 2);
+            return -1;
+        }
+        if (mar2_pack_value(L, w, &w->body, top)) {
+            lua_pop(L, 2);
+            return -1;
+        }
+        lua_pop(L, 1);
+    }
+    return 0;
+}
+
+/* stable radix sort on the hash, entries with the same hash stay in body
+ * order */
+static void mar2_sort(lua_State *L, mar_Buffer *index)
+{
+    uint32_t    count = (uint32_t)(index->head / sizeof(mar2_Entry));
+    uint32_t    histogram[4][256];
+    mar2_Entry *from = (mar2_Entry*)index->data;
+    mar2_Entry *to, *temp;
+    uint32_t    i, pass;
+
+    if (count < 2) {
+        return;
+    }
+    if (!(temp = fallocatorMalloc(index->fallocator, count * sizeof(mar2_Entry))))
+        luaL_error(L, "Out of memory!");
+
+    memset(histogram, 0, sizeof(histogram));
+    for (i = 0; i < count; i++) {
+        for (pass = 0; pass < 4; pass++) {
+            histogram[pass][(from[i].hash >> (pass * 8)) & 0xff]++;
+        }
+    }
+
+    to = temp;
+    for (pass = 0; pass < 4; pass++) {
+        uint32_t  sum = 0;
+        uint32_t *bucket = histogram[pass];
+        for (i = 0; i < 256; i++) {
+            uint32_t n = bucket[i];
+            bucket[i] = sum;
+            sum += n;
+        }
+        for (i = 0; i < count; i++) {
+            to[bucket[(from[i].hash >> (pass * 8)) & 0xff]++] = from[i];
+        }
+        to   = from;
+        from = (from == temp) ? (mar2_Entry*)index->data : temp;
+    }
+    /* an even number of passes leaves the result in index */
+    fallocatorFree(index->fallocator, temp);
+}
+
+/* pushes the version 2 encoding of the table at index 1, returns -1 without
+ * pushing anything if the table needs version 1 */
+static int mar2_marshal(lua_State *L)
+{
+    mar2_Writer w;
+    mar_Buffer  result;
+    char        header[MAR2_HEADER_SIZE];
+    uint32_t    entryCount, stringBytes;
+    int         status;
+
+    lua_settop(L, 1);
+
+    buf_init(L, &w.offsets);
+    buf_init(L, &w.index);
+    buf_init(L, &w.strings);
+    buf_init(L, &w.body);
+    mar2_map_init(L, &w.interned, 64);
+    mar2_map_init(L, &w.seen, 16);
+    w.stringCount = 0;
+
+    status = mar2_pack(L, &w);
+    if (0 == status && (w.strings.head > UINT32_MAX || w.body.head > UINT32_MAX)) {
+        status = -1;
+    }
+    if (0 == status) {
+        entryCount  = (uint32_t)(w.index.head / sizeof(mar2_Entry));
+        stringBytes = (uint32_t)w.strings.head;
+        mar2_sort(L, &w.index);
+
+        header[0] = (char)MAR2_MAGIC;
+        memcpy(&header[1], &w.stringCount, MAR_I32);
+        memcpy(&header[5], &entryCount, MAR_I32);
+        memcpy(&header[9], &stringBytes, MAR_I32);
+
+        buf_init(L, &result);
+        buf_write(L, header, MAR2_HEADER_SIZE, &result);
+        buf_write(L, w.offsets.data, w.offsets.head, &result);
+        buf_write(L, w.index.data, w.index.head, &result);
+        buf_write(L, w.strings.data, w.strings.head, &result);
+        buf_write(L, w.body.data, w.body.head, &result);
+        lua_settop(L, 1);
+        lua_pushlstring(L, result.data, result.head);
+        buf_done(L, &result);
+    }
+
+    buf_done(L, &w.offsets);
+    buf_done(L, &w.index);
+    buf_done(L, &w.strings);
+    buf_done(L, &w.body);
+    mar2_map_done(&w.interned);
+    mar2_map_done(&w.seen);
+    return status;
+}
+
+static uint32_t mar2_read_u32(const char *p)
+{
+    uint32_t value;
+    memcpy(&value, p, MAR_I32);
+    return value;
+}
+
+static void mar2_open(lua_State *L, mar2_Reader *r, const char *buf, size_t len)
+{
+    uint64_t tables;
+    if (len < MAR2_HEADER_SIZE) luaL_error(L, "bad header");
+    r->stringCount = mar2_read_u32(&buf[1]);
+    r->entryCount  = mar2_read_u32(&buf[5]);
+    r->stringBytes = mar2_read_u32(&buf[9]);
+
+    tables = (uint64_t)r->stringCount * MAR_I32 +
+             (uint64_t)r->entryCount * sizeof(mar2_Entry) + r->stringBytes;
+    if (tables > len - MAR2_HEADER_SIZE) luaL_error(L, "bad header");
+
+    r->offsets = buf + MAR2_HEADER_SIZE;
+    r->index   = r->offsets + (size_t)r->stringCount * MAR_I32;
+    r->strings = r->index + (size_t)r->entryCount * sizeof(mar2_Entry);
+    r->body    = r->strings + r->stringBytes;
+    r->end     = buf + len;
+}
+
+static uint64_t mar2_read_varint(lua_State *L, const char **p, const char *end)
+{
+    uint64_t value = 0;
+    int      shift;
+    for (shift = 0; shift < 64 && *p < end; shift += 7) {
+        unsigned char byte = (unsigned char)*(*p)++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    luaL_error(L, "bad code");
+    return 0;
+}
+
+static void mar2_push_string(lua_State *L, mar2_Reader *r, uint64_t id)
+{
+    const char *p;
+    uint32_t    offset;
+    uint64_t    l;
+
+    if (id >= r->stringCount) luaL_error(L, "bad code");
+    offset = mar2_read_u32(r->offsets + id * MAR_I32);
+    if (offset >= r->stringBytes) luaL_error(L, "bad code");
+    p = r->strings + offset;
+    l = mar2_read_varint(L, &p, r->body);
+    if (l > (uint64_t)(r->body - p)) luaL_error(L, "bad code");
+    lua_pushlstring(L, p, (size_t)l);
+}
+
+static void mar2_unpack_value(lua_State *L, mar2_Reader *r, const char **p)
+{
+    char tag;
+    if (*p >= r->end) luaL_error(L, "bad code");
+    tag = *(*p)++;
+    switch (tag) {
+    case MAR2_FALSE:
+        lua_pushboolean(L, 0);
+        break;
+    case MAR2_TRUE:
+        lua_pushboolean(L, 1);
+        break;
+    case MAR2_INT: {
+        uint64_t zigzag = mar2_read_varint(L, p, r->end);
+        lua_pushnumber(L, (lua_Number)(int64_t)((zigzag >> 1) ^ (0 - (zigzag & 1))));
+        break;
+    }
+    case MAR2_DOUBLE: {
+        lua_Number num_val;
+        if (r->end - *p < MAR_I64) luaL_error(L, "bad code");
+        memcpy(&num_val, *p, MAR_I64);
+        (*p) += MAR_I64;
+        lua_pushnumber(L, num_val);
+        break;
+    }
+    case MAR2_STRING:
+        mar2_push_string(L, r, mar2_read_varint(L, p, r->end));
+        break;
+    case MAR2_TABLE: {
+        uint64_t count = mar2_read_varint(L, p, r->end);
+        /* every entry takes at least two bytes */
+        if (count > (uint64_t)(r->end - *p) / 2) luaL_error(L, "bad code");
+        if (!lua_checkstack(L, 3)) luaL_error(L, "table nested too deep");
+        lua_createtable(L, 0, (int)count);
+        mar2_unpack_entries(L, r, p, count);
+        break;
+    }
+    default:
+        luaL_error(L, "bad code");
+    }
+}
+
+static void mar2_unpack_entries(lua_State *L, mar2_Reader *r, const char **p, uint64_t count)
+{
+    while (count-- > 0) {
+        mar2_unpack_value(L, r, p);
+        mar2_unpack_value(L, r, p);
+        lua_rawset(L, -3);
+    }
+}
+
+static void mar2_unmarshal(lua_State *L, const char *buf, size_t len)
+{
+    mar2_Reader r;
+    const char *p;
+
+    mar2_open(L, &r, buf, len);
+    p = r.body;
+    if (r.entryCount > (uint64_t)(r.end - p) / 2) luaL_error(L, "bad code");
+    lua_createtable(L, 0, (int)r.entryCount);
+    mar2_unpack_entries(L, &r, &p, r.entryCount);
+}
+
+/* pushes the value of key without decoding the other entries */
+static void mar2_getfield(lua_State *L, const char *buf, size_t len, int key)
+{
+    mar2_Reader r;
+    mar2_Entry  entry;
+    uint32_t    hash, low, high;
+
+    mar2_open(L, &r, buf, len);
+    if (mar2_keyhash(L, key, &hash) != 0) {
+        lua_pushnil(L);
+        return;
+    }
+
+    low  = 0;
+    high = r.entryCount;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        memcpy(&entry, r.index + (size_t)mid * sizeof(entry), sizeof(entry));
+        if (entry.hash < hash) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+
+    for (; low < r.entryCount; low++) {
+        const char *p;
+        memcpy(&entry, r.index + (size_t)low * sizeof(entry), sizeof(entry));
+        if (entry.hash != hash) {
+            break;
+        }
+        if (entry.offset >= (uint64_t)(r.end - r.body)) luaL_error(L, "bad code");
+        p = r.body + entry.offset;
+        mar2_unpack_value(L, &r, &p);
+        if (lua_rawequal(L, -1, key)) {
+            lua_pop(L, 1);
+            mar2_unpack_value(L, &r, &p);
+            return;
+        }
+        lua_pop(L, 1);
+    }
+    lua_pushnil(L);
+}
+
 static int tbl_marshal(lua_State* L)
 {
     const unsigned char m = MAR_MAGIC;
     int idx=1;
     mar_Buffer buf;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    if (0 == mar2_marshal(L)) {
+        return 1;
+    }
+
+    lua_settop(L, 1);
     lua_newtable(L);
     lua_pushvalue(L, 1);
 
@@ -478,7 +1046,17 @@ static int tbl_unmarshal(lua_State* L)
     size_t l;
     const char *s = luaL_checklstring(L, -1, &l);
     int idx=1;
+
+    /* version 1 keeps its references at index 2, whether this was called
+     * as table.unmarshal(s) or table:unmarshal(s) */
+    lua_insert(L, 1);
+    lua_settop(L, 1);
+
     if (l < 1) luaL_error(L, "bad header");
+    if (*(unsigned char *)s == MAR2_MAGIC) {
+        mar2_unmarshal(L, s, l);
+        return 1;
+    }
     if (*(unsigned char *)s++ != MAR_MAGIC) luaL_error(L, "bad magic");
     l -= 1;
 
@@ -490,6 +1068,32 @@ static int tbl_unmarshal(lua_State* L)
     return 1;
 }
 
+static int tbl_getfield(lua_State* L)
+{
+    size_t l;
+    const char *s = luaL_checklstring(L, 1, &l);
+    int idx=1;
+
+    luaL_checkany(L, 2);
+    lua_settop(L, 2);
+
+    if (l < 1) luaL_error(L, "bad header");
+    if (*(unsigned char *)s == MAR2_MAGIC) {
+        mar2_getfield(L, s, l, 2);
+        return 1;
+    }
+    if (*(unsigned char *)s != MAR_MAGIC) luaL_error(L, "bad magic");
+
+    /* version 1 has no index, decode everything */
+    lua_newtable(L);
+    lua_insert(L, 2);
+    lua_newtable(L);
+    mar_unpack(L, s + 1, l - 1, &idx);
+    lua_pushvalue(L, 3);
+    lua_rawget(L, -2);
+    return 1;
+}
+
 static int tbl_clone(lua_State* L)
 {
     tbl_marshal(L);
@@ -501,13 +1105,14 @@ static const luaL_reg R[] =
 {
     {"marshal",     tbl_marshal},
     {"unmarshal",   tbl_unmarshal},
+    {"getfield",    tbl_getfield},
     {"clone",       tbl_clone},
     {NULL,	    NULL}
 };
 
 int luaopen_marshal(lua_State *L, fallocator_t fallocator)
 {
-	FALLOCATOR = fallocator;
-    luaL_openlib(L, LUA_TABLIBNAME, R, 0);
+    lua_pushlightuserdata(L, fallocator);
+    luaL_openlib(L, LUA_TABLIBNAME, R, 1);
     return 1;
 }
@@ -183,7 +183,8 @@ static int parseFirstLineRequest(fallocator_t fallocator, requestParserImpl_t* p
 
 	if (ntokens >= 2 && (((strcmp(tokens[0], "get") == 0) && (pParser->pCommand->command
 			= COMMAND_GET)) || ((strcmp(tokens[0], "bget") == 0)
-			&& (pParser->pCommand->command = COMMAND_BGET)))) {
+			&& (pParser->pCommand->command = COMMAND_BGET)) || ((strcmp(tokens[0], "lget") == 0)
+			&& (pParser->pCommand->command = COMMAND_LGET)))) {
 
 		if (ntokens > 2) {
 			//copy the keys ...
@@ -205,7 +206,8 @@ static int parseFirstLineRequest(fallocator_t fallocator, requestParserImpl_t* p
 			tokens[0], "replace") == 0 && (pParser->pCommand->command = COMMAND_REPLACE))
 			|| (strcmp(tokens[0], "prepend") == 0 && (pParser->pCommand->command
 					= COMMAND_PREPEND)) || (strcmp(tokens[0], "append") == 0
-			&& (pParser->pCommand->command = COMMAND_APPEND)))) {
+			&& (pParser->pCommand->command = COMMAND_APPEND)) || (strcmp(tokens[0], "ladd")
+			== 0 && (pParser->pCommand->command = COMMAND_LADD)))) {
 		pParser->pCommand->key = tokens[1];
 		pParser->pCommand->keySize = strlen(tokens[1]);
 		tokens[1] = 0;
@@ -257,7 +259,7 @@ static int parseFirstLineRequest(fallocator_t fallocator, requestParserImpl_t* p
 		tokens[1] = 0;
 		//TODO - only suport one key per get for now
 
-	} else if ((ntokens == 4 || ntokens == 5) && (strcmp(tokens[0], "decr")
+	} else if ((ntokens == 3 || ntokens == 4) && (strcmp(tokens[0], "decr")
 			== 0)) {
 		pParser->pCommand->command = COMMAND_DECR;
 		pParser->pCommand->key = tokens[1];
@@ -270,9 +272,9 @@ static int parseFirstLineRequest(fallocator_t fallocator, requestParserImpl_t* p
 				pParser->pCommand->noreply = 1;
 			}
 		}
-	} else if (ntokens >= 2 && ntokens <= 4 && (strcmp(tokens[0], "delete")
-			== 0)) {
-		pParser->pCommand->command = COMMAND_DELETE;
+	} else if (ntokens >= 2 && ntokens <= 4 && (((strcmp(tokens[0], "delete") == 0)
+			&& (pParser->pCommand->command = COMMAND_DELETE)) || ((strcmp(tokens[0],
+			"ldelete") == 0) && (pParser->pCommand->command = COMMAND_LDELETE)))) {
 		pParser->pCommand->key = tokens[1];
 		pParser->pCommand->keySize = strlen(tokens[1]);
 		tokens[1] = 0;
@@ -281,9 +283,14 @@ static int parseFirstLineRequest(fallocator_t fallocator, requestParserImpl_t* p
 				pParser->pCommand->noreply = 1;
 			}
 		}
-	} else if (ntokens >= 2 && (strcmp(tokens[0], "stats") == 0)) {
+	} else if (ntokens >= 1 && ntokens <= 2 && (strcmp(tokens[0], "stats") == 0)) {
 		pParser->pCommand->command = COMMAND_STATS;
-		//TODO - later
+		//the optional stats group is passed as key
+		if (ntokens == 2) {
+			pParser->pCommand->key = tokens[1];
+			pParser->pCommand->keySize = strlen(tokens[1]);
+			tokens[1] = 0;
+		}
 	} else if (ntokens >= 1 && ntokens <= 2 && (strcmp(tokens[0], "flush_all")
 			== 0)) {
 		pParser->pCommand->command = COMMAND_FLUSH_ALL;
@@ -294,6 +301,45 @@ static int parseFirstLineRequest(fallocator_t fallocator, requestParserImpl_t* p
 	} else if (ntokens == 1 && (strcmp(tokens[0], "quit") == 0)) {
 		pParser->pCommand->command = COMMAND_QUIT;
 		//TODO - later
+	} else if (ntokens == 1 && (strcmp(tokens[0], "reload") == 0)) {
+		pParser->pCommand->command = COMMAND_RELOAD;
+	} else if (ntokens == 1 && (strcmp(tokens[0], "snapshot") == 0)) {
+		pParser->pCommand->command = COMMAND_SNAPSHOT;
+	} else if (ntokens >= 1 && ntokens <= 2 && (strcmp(tokens[0], "slowlog") == 0)) {
+		pParser->pCommand->command = COMMAND_SLOWLOG;
+		//the optional count or reset is passed as key
+		if (ntokens == 2) {
+			pParser->pCommand->key = tokens[1];
+			pParser->pCommand->keySize = strlen(tokens[1]);
+			tokens[1] = 0;
+		}
+	} else if (ntokens == 2 && (strcmp(tokens[0], "ring") == 0)) {
+		pParser->pCommand->command = COMMAND_RING;
+		//the servers of the new ring are passed as key
+		pParser->pCommand->key = tokens[1];
+		pParser->pCommand->keySize = strlen(tokens[1]);
+		tokens[1] = 0;
+	} else if (ntokens == 2 && (strcmp(tokens[0], "gossip") == 0)) {
+		pParser->pCommand->command = COMMAND_GOSSIP;
+		//the member list is passed as key
+		pParser->pCommand->key = tokens[1];
+		pParser->pCommand->keySize = strlen(tokens[1]);
+		tokens[1] = 0;
+	} else if (ntokens == 4 && (strcmp(tokens[0], "nearset") == 0)) {
+		pParser->pCommand->command = COMMAND_NEARSET;
+		pParser->pCommand->server  = tokens[1];
+		tokens[1] = 0;
+		pParser->pCommand->key     = tokens[2];
+		pParser->pCommand->keySize = strlen(tokens[2]);
+		tokens[2] = 0;
+		IfTrue(safe_strtoul(tokens[3], &pParser->pCommand->dataLength), INFO, "Error parsing data length");
+	} else if (ntokens == 3 && (strcmp(tokens[0], "neardelete") == 0)) {
+		pParser->pCommand->command = COMMAND_NEARDELETE;
+		pParser->pCommand->server  = tokens[1];
+		tokens[1] = 0;
+		pParser->pCommand->key     = tokens[2];
+		pParser->pCommand->keySize = strlen(tokens[2]);
+		tokens[2] = 0;
 	} else if ((ntokens == 2 || ntokens == 3)
 			&& (strcmp(tokens[0], "verbosity") == 0)) {
 		pParser->pCommand->command = COMMAND_VERBOSITY;
@@ -312,11 +358,13 @@ OnSuccess:
 static int isDataExpected(requestParserImpl_t* pParser) {
 	switch (pParser->pCommand->command) {
 	case COMMAND_ADD:
+	case COMMAND_LADD:
 	case COMMAND_SET:
 	case COMMAND_REPLACE:
 	case COMMAND_PREPEND:
 	case COMMAND_APPEND:
 	case COMMAND_CAS:
+	case COMMAND_NEARSET:
 		 return 1;
 	default:
 		return 0;
@@ -533,3 +581,84 @@ int responseParserGetResponse(responseParser_t parser, dataStream_t dataStream,
 	return returnValue;
 }
 
+
+/* Moves the first length bytes of dataStream to the end of pResponse.
+ * The buffers are shared, not copied.
+ */
+static int moveData(responseParserImpl_t* pParser, dataStream_t dataStream,
+		u_int32_t length, dataStream_t pResponse) {
+	dataStream_t part        = 0;
+	int          returnValue = 0;
+
+	part = dataStreamSubStream(pParser->fallocator, dataStream, 0, length);
+	IfTrue(part, INFO, "Error creating data stream");
+	IfTrue(0 == dataStreamAppendDataStream(pResponse, part), INFO, "Error appending data");
+	dataStreamTruncateFromStart(dataStream, dataStreamGetSize(dataStream) - length);
+	goto OnSuccess;
+OnError:
+	returnValue = -1;
+OnSuccess:
+	if (part) {
+		dataStreamDelete(part);
+	}
+	return returnValue;
+}
+
+int responseParserForward(responseParser_t parser, dataStream_t dataStream,
+		int multiLine, dataStream_t pResponse) {
+	responseParserImpl_t* pParser = RESPONSE_PARSER(parser);
+	char** tokens = 0;
+	int    ntokens = 0, endOfLine = 0, returnValue = 0, isValue = 0;
+
+	IfTrue(pParser, ERR, "Null Parser Object");
+
+	while (1) {
+		if (pParser->state == parse_data) {
+			if (dataStreamGetSize(dataStream) < (pParser->valueLength + 2)) {
+				returnValue = 1;
+				goto OnSuccess;
+			}
+			IfTrue(0 == moveData(pParser, dataStream, pParser->valueLength + 2, pResponse),
+					INFO, "Error moving value");
+			pParser->state = parse_first;
+		}
+
+		endOfLine = dataStreamFindEndOfLine(dataStream);
+		if (endOfLine <= 0) {
+			returnValue = 1;
+			goto OnSuccess;
+		}
+		if (!multiLine) {
+			IfTrue(0 == moveData(pParser, dataStream, endOfLine + 2, pResponse),
+					INFO, "Error moving response");
+			goto OnSuccess;
+		}
+		tokens = tokenizeFirstLine(pParser->fallocator, dataStream, endOfLine, &ntokens);
+		IfTrue(tokens, DEBUG, "Error getting tokens");
+		if ((ntokens == 1) && (0 == strcmp(tokens[0], "END"))) {
+			dataStreamTruncateFromStart(dataStream, dataStreamGetSize(dataStream) - (endOfLine + 2));
+			goto OnSuccess;
+		}
+		isValue = (ntokens >= 4) && (0 == strcmp(tokens[0], "VALUE"));
+		if (isValue) {
+			IfTrue(safe_strtoul(tokens[3], &pParser->valueLength), INFO, "Error parsing value length");
+		}
+		cleanupTokens(pParser->fallocator, tokens, ntokens);
+		tokens = 0;
+		IfTrue(0 == moveData(pParser, dataStream, endOfLine + 2, pResponse),
+				INFO, "Error moving response line");
+		if (!isValue) {
+			//ERROR, SERVER_ERROR... instead of the values
+			goto OnSuccess;
+		}
+		pParser->state = parse_data;
+	}
+OnError:
+	returnValue = -1;
+OnSuccess:
+	if (pParser) {
+		cleanupTokens(pParser->fallocator, tokens, ntokens);
+		tokens = 0;
+	}
+	return returnValue;
+}
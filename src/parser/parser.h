@@ -23,5 +23,13 @@ int                responseParserParse(responseParser_t parser, dataStream_t dat
 int                responseParserGetResponse(responseParser_t parser,
 		              dataStream_t dataStream, char** pKey, dataStream_t* pValue,
 		              u_int32_t* pFlags);
+/* Moves one complete response from dataStream to pResponse without
+ * interpreting it. multiLine is for get/gets: VALUE blocks are moved
+ * and the terminating END line is dropped. Everything else is a single
+ * line. Returns -1 on error, 1 if more input is required, 0 when the
+ * response is complete.
+ */
+int                responseParserForward(responseParser_t parser, dataStream_t dataStream,
+		              int multiLine, dataStream_t pResponse);
 
 #endif /* PARSER_H_ */
@@ -0,0 +1,661 @@
+#include "appendlog.h"
+#include "../cacheitem/cacheitem.h"
+#include "../datastream/datastream.h"
+#include "../fallocator/fallocator.h"
+#include "../common/map.h"
+#include "../common/crc32.h"
+#include "../cacheismo.h"
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define APPENDLOG_MAGIC         0x464f4143     //CAOF
+#define APPENDLOG_VERSION       1
+#define APPENDLOG_PUT           1
+#define APPENDLOG_DELETE        2
+#define APPENDLOG_FLUSH         3
+#define APPENDLOG_SCAN_BUCKETS  1024
+#define APPENDLOG_BUFFER        (64 * 1024)
+#define APPENDLOG_DATA_BUFFER   (32 * 1024)
+#define APPENDLOG_MAX_DATA      (256 * 1024 * 1024)
+
+typedef struct {
+	u_int32_t magic;
+	u_int32_t version;
+} appendLogHeader_t;
+
+typedef struct {
+	u_int32_t crc;
+	u_int32_t op;
+	u_int32_t keyLength;
+	u_int32_t flags;
+	u_int32_t expiry;
+	u_int32_t dataLength;
+} appendLogRecord_t;
+
+typedef struct {
+	char*     data;
+	u_int32_t used;
+	u_int32_t size;
+} appendLogBuffer_t;
+
+typedef struct {
+	hashMap_t          hashMap;
+	chunkpool_t        chunkpool;
+	fallocator_t       fallocator;
+	char*              path;
+	char*              tmpPath;
+	char*              key;           //key being logged, 0 terminated
+	u_int32_t          maxKeyLength;
+	int                fd;
+	int                dirty;         //written, not synced
+	map_t              keys;          //every key with a put as its last record
+	appendLogBuffer_t  pending;
+	struct event*      flushEvent;
+	struct event*      syncTimer;
+	/* compaction */
+	int                tmpFd;
+	map_t              compactKeys;
+	appendLogBuffer_t  compactPending;
+	u_int32_t          compactCursor;
+	u_int64_t          compactBytes;
+	u_int64_t          compactStart;
+	u_int64_t          compactedBytes; //size after the last compaction
+	struct event*      compactEvent;
+	appendLogStats_t   stats;
+} appendLogImpl_t;
+
+#define APPENDLOG(x) ((appendLogImpl_t*)(x))
+
+static void compactCallback(evutil_socket_t fd, short events, void* arg);
+
+static u_int32_t clockSeconds(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (u_int32_t)ts.tv_sec;
+}
+
+static u_int64_t currentTimeInMillis(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((u_int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static int bufferReserve(appendLogBuffer_t* pBuffer, u_int32_t length) {
+	u_int32_t size = pBuffer->size ? pBuffer->size : APPENDLOG_BUFFER;
+	char*     data = 0;
+
+	if (pBuffer->used + length <= pBuffer->size) {
+		return 0;
+	}
+	while (size < pBuffer->used + length) {
+		size = size * 2;
+	}
+	data = realloc(pBuffer->data, size);
+	IfTrue(data, ERR, "Error allocating %u bytes", size);
+	pBuffer->data = data;
+	pBuffer->size = size;
+	return 0;
+OnError:
+	return -1;
+}
+
+static void bufferAppend(appendLogBuffer_t* pBuffer, const void* data, u_int32_t length) {
+	memcpy(pBuffer->data + pBuffer->used, data, length);
+	pBuffer->used += length;
+}
+
+/* writes all of it, the buffer is empty after, even on error */
+static int bufferWrite(appendLogBuffer_t* pBuffer, int fd) {
+	u_int32_t done = 0;
+	ssize_t   rc   = 0;
+
+	while (done < pBuffer->used) {
+		rc = write(fd, pBuffer->data + done, pBuffer->used - done);
+		if ((rc < 0) && (errno == EINTR)) {
+			continue;
+		}
+		IfTrue(rc > 0, ERR, "Error writing append log %s", strerror(errno));
+		done += rc;
+	}
+	pBuffer->used = 0;
+	return 0;
+OnError:
+	pBuffer->used = 0;
+	return -1;
+}
+
+/* item is 0 for a delete, key and item are 0 for a flush */
+static int recordAppend(appendLogImpl_t* pLog, appendLogBuffer_t* pBuffer, char* key,
+		u_int32_t keyLength, cacheItem_t item) {
+	appendLogRecord_t    record;
+	dataStream_t         data   = 0;
+	dataStreamIterator_t iter   = 0;
+	u_int32_t            start  = pBuffer->used;
+	u_int32_t            ttl    = 0;
+
+	memset(&record, 0, sizeof(record));
+	record.op        = item ? APPENDLOG_PUT : (key ? APPENDLOG_DELETE : APPENDLOG_FLUSH);
+	record.keyLength = keyLength;
+	if (item) {
+		data              = cacheItemGetDataStream(item);
+		ttl               = cacheItemGetTTL(item);
+		record.flags      = cacheItemGetFlags(item);
+		record.expiry     = ttl ? (clockSeconds(CLOCK_REALTIME) + ttl) : 0;
+		record.dataLength = dataStreamGetSize(data);
+	}
+	IfTrue(0 == bufferReserve(pBuffer, sizeof(record) + keyLength + record.dataLength), ERR,
+			"Error growing append log buffer");
+	bufferAppend(pBuffer, &record, sizeof(record));
+	bufferAppend(pBuffer, key, keyLength);
+	if (record.dataLength) {
+		iter = dataStreamIteratorCreate(pLog->fallocator, data, 0, record.dataLength);
+		IfTrue(iter, ERR, "Error iterating data");
+		for (int i = 0; i < dataStreamIteratorGetBufferCount(iter); i++) {
+			u_int32_t offset = 0;
+			u_int32_t length = 0;
+			char*     buffer = dataStreamIteratorGetBufferAtIndex(iter, i, &offset, &length);
+			bufferAppend(pBuffer, buffer + offset, length);
+		}
+		dataStreamIteratorDelete(pLog->fallocator, iter);
+	}
+	record.crc = crc32Update(0, pBuffer->data + start + sizeof(u_int32_t),
+			pBuffer->used - start - sizeof(u_int32_t));
+	memcpy(pBuffer->data + start, &record.crc, sizeof(u_int32_t));
+	return 0;
+OnError:
+	pBuffer->used = start;
+	return -1;
+}
+
+static void compactEnd(appendLogImpl_t* pLog) {
+	if (pLog->tmpFd >= 0) {
+		close(pLog->tmpFd);
+		pLog->tmpFd = -1;
+	}
+	if (pLog->compactKeys) {
+		mapDelete(pLog->compactKeys);
+		pLog->compactKeys = 0;
+	}
+	pLog->compactPending.used = 0;
+	pLog->stats.compacting    = 0;
+}
+
+static void compactAbort(appendLogImpl_t* pLog) {
+	compactEnd(pLog);
+	unlink(pLog->tmpPath);
+	pLog->stats.failed++;
+	/* not again before the log doubles once more */
+	pLog->compactedBytes = pLog->stats.bytes;
+	LOG(ERR, "Compaction of %s failed", pLog->path);
+}
+
+static void compactStart(appendLogImpl_t* pLog) {
+	appendLogHeader_t header = { APPENDLOG_MAGIC, APPENDLOG_VERSION };
+	struct timeval    now    = { 0, 0 };
+
+	pLog->tmpFd = open(pLog->tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	IfTrue(pLog->tmpFd >= 0, ERR, "Error creating %s", pLog->tmpPath);
+	pLog->compactKeys = mapCreate();
+	IfTrue(pLog->compactKeys, ERR, "Error allocating memory");
+	IfTrue(0 == bufferReserve(&pLog->compactPending, sizeof(header)), ERR, "Error allocating memory");
+	bufferAppend(&pLog->compactPending, &header, sizeof(header));
+	pLog->compactCursor    = 0;
+	pLog->compactBytes     = 0;
+	pLog->compactStart     = currentTimeInMillis();
+	pLog->stats.compacting = 1;
+	event_add(pLog->compactEvent, &now);
+	return;
+OnError:
+	compactAbort(pLog);
+}
+
+static void compactFinish(appendLogImpl_t* pLog) {
+	pLog->compactBytes += pLog->compactPending.used;
+	IfTrue(0 == bufferWrite(&pLog->compactPending, pLog->tmpFd), ERR, "Error writing %s", pLog->tmpPath);
+	IfTrue(0 == fdatasync(pLog->tmpFd), ERR, "Error syncing %s", pLog->tmpPath);
+	IfTrue(0 == rename(pLog->tmpPath, pLog->path), ERR, "Error renaming %s", pLog->tmpPath);
+
+	/* everything pending for the old log is in the new one as well */
+	pLog->pending.used = 0;
+	close(pLog->fd);
+	pLog->fd          = pLog->tmpFd;
+	pLog->tmpFd       = -1;
+	pLog->dirty       = 0;
+	mapDelete(pLog->keys);
+	pLog->keys        = pLog->compactKeys;
+	pLog->compactKeys = 0;
+	pLog->stats.bytes       = pLog->compactBytes;
+	pLog->stats.keys        = mapSize(pLog->keys);
+	pLog->stats.compactions++;
+	pLog->stats.lastCompactMillis = currentTimeInMillis() - pLog->compactStart;
+	pLog->compactedBytes    = pLog->compactBytes;
+	compactEnd(pLog);
+	LOG(INFO, "Compacted %s to %lu bytes in %lu ms", pLog->path, pLog->stats.bytes,
+			pLog->stats.lastCompactMillis);
+	return;
+OnError:
+	compactAbort(pLog);
+}
+
+/* copies the key, 0 if it can't be kept in a map */
+static char* keyCopy(appendLogImpl_t* pLog, char* key, u_int32_t keyLength) {
+	if ((keyLength == 0) || (keyLength > pLog->maxKeyLength) || memchr(key, 0, keyLength)) {
+		return 0;
+	}
+	memcpy(pLog->key, key, keyLength);
+	pLog->key[keyLength] = 0;
+	return pLog->key;
+}
+
+static void compactVisitor(void* context, void* value) {
+	appendLogImpl_t* pLog = context;
+	cacheItem_t      item = value;
+	char*            key  = keyCopy(pLog, cacheItemGetKey(item), cacheItemGetKeyLength(item));
+
+	/* keys already in compactKeys were logged since the compaction began */
+	if (!key || !mapGetElement(pLog->keys, key) || mapGetElement(pLog->compactKeys, key)) {
+		return;
+	}
+	if (cacheItemGetExpiry(item) <= clockSeconds(CLOCK_MONOTONIC)) {
+		return;
+	}
+	if (0 == recordAppend(pLog, &pLog->compactPending, key, cacheItemGetKeyLength(item), item)) {
+		mapPutElement(pLog->compactKeys, key, pLog);
+	}
+}
+
+static void compactCallback(evutil_socket_t fd, short events, void* arg) {
+	appendLogImpl_t* pLog = APPENDLOG(arg);
+	struct timeval   now  = { 0, 0 };
+
+	if (!pLog->stats.compacting) {
+		return;
+	}
+	pLog->compactCursor = hashMapScan(pLog->hashMap, pLog->compactCursor, APPENDLOG_SCAN_BUCKETS,
+			compactVisitor, pLog);
+	if (pLog->compactCursor == 0) {
+		compactFinish(pLog);
+		return;
+	}
+	pLog->compactBytes += pLog->compactPending.used;
+	if (0 != bufferWrite(&pLog->compactPending, pLog->tmpFd)) {
+		compactAbort(pLog);
+		return;
+	}
+	event_add(pLog->compactEvent, &now);
+}
+
+static void logSync(appendLogImpl_t* pLog) {
+	if (!pLog->dirty) {
+		return;
+	}
+	if (0 == fdatasync(pLog->fd)) {
+		pLog->stats.syncs++;
+	}else {
+		pLog->stats.failed++;
+		LOG(ERR, "Error syncing %s", pLog->path);
+	}
+	pLog->dirty = 0;
+}
+
+static void logFlush(appendLogImpl_t* pLog) {
+	if (pLog->pending.used) {
+		pLog->stats.bytes += pLog->pending.used;
+		pLog->stats.writes++;
+		pLog->dirty = 1;
+		if (0 != bufferWrite(&pLog->pending, pLog->fd)) {
+			pLog->stats.failed++;
+		}
+	}
+	if (pLog->stats.compacting && pLog->compactPending.used) {
+		pLog->compactBytes += pLog->compactPending.used;
+		if (0 != bufferWrite(&pLog->compactPending, pLog->tmpFd)) {
+			compactAbort(pLog);
+		}
+	}
+}
+
+static void flushCallback(evutil_socket_t fd, short events, void* arg) {
+	appendLogImpl_t* pLog = APPENDLOG(arg);
+
+	logFlush(pLog);
+	if (pLog->stats.syncMillis == 0) {
+		logSync(pLog);
+	}
+	if (!pLog->stats.compacting && (pLog->stats.bytes >= APPENDLOG_MIN_COMPACT) &&
+			(pLog->stats.bytes >= 2 * pLog->compactedBytes)) {
+		compactStart(pLog);
+	}
+}
+
+static void syncCallback(evutil_socket_t fd, short events, void* arg) {
+	logSync(APPENDLOG(arg));
+}
+
+appendLog_t appendLogCreate(hashMap_t hashMap, chunkpool_t chunkpool, char* path,
+		u_int32_t syncMillis) {
+	appendLogImpl_t*  pLog     = ALLOCATE_1(appendLogImpl_t);
+	appendLogHeader_t header   = { APPENDLOG_MAGIC, APPENDLOG_VERSION };
+	struct timeval    interval = { syncMillis / 1000, (syncMillis % 1000) * 1000 };
+	struct stat       fileStat;
+
+	IfTrue(pLog, ERR, "Error allocating memory");
+	pLog->fd    = -1;
+	pLog->tmpFd = -1;
+	pLog->hashMap          = hashMap;
+	pLog->chunkpool        = chunkpool;
+	pLog->stats.syncMillis = syncMillis;
+	pLog->maxKeyLength     = chunkpoolMaxMallocSize(chunkpool);
+	pLog->path       = strdup(path);
+	pLog->tmpPath    = ALLOCATE_N(strlen(path) + 5, char);
+	pLog->key        = ALLOCATE_N(pLog->maxKeyLength + 1, char);
+	pLog->fallocator = fallocatorCreate();
+	pLog->keys       = mapCreate();
+	IfTrue(pLog->path && pLog->tmpPath && pLog->key && pLog->fallocator && pLog->keys, ERR,
+			"Error allocating memory");
+	sprintf(pLog->tmpPath, "%s.tmp", path);
+
+	pLog->fd = open(path, O_RDWR | O_CREAT, 0644);
+	IfTrue(pLog->fd >= 0, ERR, "Error opening %s", path);
+	IfTrue(0 == fstat(pLog->fd, &fileStat), ERR, "Error reading %s", path);
+	if (fileStat.st_size == 0) {
+		IfTrue(sizeof(header) == write(pLog->fd, &header, sizeof(header)), ERR, "Error writing %s", path);
+		IfTrue(0 == fdatasync(pLog->fd), ERR, "Error syncing %s", path);
+		pLog->stats.bytes = sizeof(header);
+	}else {
+		IfTrue(sizeof(header) == read(pLog->fd, &header, sizeof(header)), ERR, "Error reading %s", path);
+		IfTrue((header.magic == APPENDLOG_MAGIC) && (header.version == APPENDLOG_VERSION), ERR,
+				"%s is not an append log", path);
+		pLog->stats.bytes = fileStat.st_size;
+	}
+	IfTrue(0 <= lseek(pLog->fd, 0, SEEK_END), ERR, "Error seeking %s", path);
+	pLog->compactedBytes = pLog->stats.bytes;
+
+	pLog->flushEvent   = evtimer_new(getGlobalEventBase(), flushCallback, pLog);
+	pLog->compactEvent = evtimer_new(getGlobalEventBase(), compactCallback, pLog);
+	IfTrue(pLog->flushEvent && pLog->compactEvent, ERR, "Error creating events");
+	if (syncMillis) {
+		pLog->syncTimer = event_new(getGlobalEventBase(), -1, EV_PERSIST, syncCallback, pLog);
+		IfTrue(pLog->syncTimer, ERR, "Error creating sync timer");
+		event_add(pLog->syncTimer, &interval);
+	}
+	return pLog;
+OnError:
+	appendLogDelete(pLog);
+	return 0;
+}
+
+static void replayFlushVisitor(void* context, char* key, void* value) {
+	appendLogImpl_t* pLog = context;
+	hashMapDeleteElement(pLog->hashMap, key, strlen(key));
+}
+
+/* reads length bytes of value into the stream, at most APPENDLOG_DATA_BUFFER
+ * per buffer because the vector length of a dataStream is 16 bits. 0 when
+ * read, 1 for a torn record, -1 if out of memory
+ */
+static int replayData(appendLogImpl_t* pLog, FILE* file, dataStream_t stream, u_int32_t length,
+		u_int32_t* pCrc) {
+	while (length > 0) {
+		u_int32_t size   = (length > APPENDLOG_DATA_BUFFER) ? APPENDLOG_DATA_BUFFER : length;
+		char*     buffer = dataStreamBufferAllocate(NULL, pLog->fallocator, size);
+		int       err    = 0;
+
+		if (!buffer) {
+			return -1;
+		}
+		if (1 == fread(buffer, size, 1, file)) {
+			*pCrc = crc32Update(*pCrc, buffer, size);
+			err   = (0 == dataStreamAppendData(stream, buffer, 0, size)) ? 0 : -1;
+		} else {
+			err   = 1;
+		}
+		dataStreamBufferFree(buffer);
+		if (err != 0) {
+			return err;
+		}
+		length -= size;
+	}
+	return 0;
+}
+
+/* 0 for a good record, 1 at the end of the log or a torn or bad
+ * record, -1 if it can't be applied */
+static int replayRecord(appendLogImpl_t* pLog, FILE* file, u_int32_t wallNow) {
+	appendLogRecord_t record;
+	command_t         command;
+	cacheItem_t       item        = 0;
+	u_int32_t         crc         = 0;
+	int               returnValue = 1;
+
+	memset(&command, 0, sizeof(command));
+	if (1 != fread(&record, sizeof(record), 1, file)) {
+		return 1;
+	}
+	IfTrue((record.op == APPENDLOG_PUT) || (record.op == APPENDLOG_DELETE) ||
+			(record.op == APPENDLOG_FLUSH), WARN, "Bad op %u", record.op);
+	IfTrue((record.op == APPENDLOG_FLUSH) ? ((record.keyLength == 0) && (record.dataLength == 0)) :
+			(record.keyLength && (record.keyLength <= pLog->maxKeyLength)), WARN,
+			"Bad key length %u", record.keyLength);
+	IfTrue(record.dataLength <= APPENDLOG_MAX_DATA, WARN, "Bad data length %u", record.dataLength);
+	IfTrue(!record.keyLength || (1 == fread(pLog->key, record.keyLength, 1, file)), WARN,
+			"Error reading key");
+	pLog->key[record.keyLength] = 0;
+	crc = crc32Update(0, ((char*)&record) + sizeof(u_int32_t), sizeof(record) - sizeof(u_int32_t));
+	crc = crc32Update(crc, pLog->key, record.keyLength);
+	command.dataStream = dataStreamCreate();
+	returnValue = command.dataStream ? 1 : -1;
+	IfTrue(command.dataStream, ERR, "Error allocating memory");
+	returnValue = replayData(pLog, file, command.dataStream, record.dataLength, &crc);
+	IfTrue(returnValue == 0, WARN, "Error reading data");
+	returnValue = 1;
+	IfTrue(crc == record.crc, WARN, "Bad crc");
+
+	returnValue = -1;
+	if (record.op == APPENDLOG_FLUSH) {
+		mapVisit(pLog->keys, replayFlushVisitor, pLog);
+		mapDelete(pLog->keys);
+		pLog->keys = mapCreate();
+		IfTrue(pLog->keys, ERR, "Error allocating memory");
+		dataStreamDelete(command.dataStream);
+		return 0;
+	}
+	hashMapDeleteElement(pLog->hashMap, pLog->key, record.keyLength);
+	mapDeleteElement(pLog->keys, pLog->key);
+	if ((record.op == APPENDLOG_PUT) && (!record.expiry || (record.expiry > wallNow))) {
+		command.command    = COMMAND_SET;
+		command.key        = pLog->key;
+		command.keySize    = record.keyLength;
+		command.flags      = record.flags;
+		command.dataLength = record.dataLength;
+		command.expiryTime = record.expiry ? (record.expiry - wallNow) : 0;
+		item = cacheItemCreate(pLog->chunkpool, &command);
+		if (item && (0 == hashMapPutElement(pLog->hashMap, item))) {
+			mapPutElement(pLog->keys, pLog->key, pLog);
+		}
+	}
+	dataStreamDelete(command.dataStream);
+	return 0;
+OnError:
+	if (command.dataStream) {
+		dataStreamDelete(command.dataStream);
+	}
+	return returnValue;
+}
+
+int appendLogReplay(appendLog_t appendLog) {
+	appendLogImpl_t* pLog    = APPENDLOG(appendLog);
+	FILE*            file    = 0;
+	long             good    = sizeof(appendLogHeader_t);
+	u_int32_t        wallNow = clockSeconds(CLOCK_REALTIME);
+	u_int64_t        start   = currentTimeInMillis();
+	int              rc      = 0;
+
+	IfTrue(pLog, ERR, "Append log not enabled");
+	file = fopen(pLog->path, "r");
+	IfTrue(file, ERR, "Error opening %s", pLog->path);
+	setvbuf(file, 0, _IOFBF, APPENDLOG_BUFFER);
+	IfTrue(0 == fseek(file, good, SEEK_SET), ERR, "Error seeking %s", pLog->path);
+	while (0 == (rc = replayRecord(pLog, file, wallNow))) {
+		good = ftell(file);
+		pLog->stats.replayed++;
+	}
+	IfTrue(rc > 0, ERR, "Error replaying %s", pLog->path);
+	if ((u_int64_t)good < pLog->stats.bytes) {
+		LOG(WARN, "Cutting %lu bytes of torn or bad records off %s",
+				(u_int64_t)(pLog->stats.bytes - good), pLog->path);
+		IfTrue(0 == ftruncate(pLog->fd, good), ERR, "Error truncating %s", pLog->path);
+		IfTrue(good == lseek(pLog->fd, good, SEEK_SET), ERR, "Error seeking %s", pLog->path);
+		pLog->stats.bytes = good;
+	}
+	fclose(file);
+	pLog->compactedBytes     = pLog->stats.bytes;
+	pLog->stats.keys         = mapSize(pLog->keys);
+	pLog->stats.replayMillis = currentTimeInMillis() - start;
+	LOG(INFO, "Replayed %lu records for %u keys from %s in %lu ms", pLog->stats.replayed,
+			pLog->stats.keys, pLog->path, pLog->stats.replayMillis);
+	return 0;
+OnError:
+	if (file) {
+		fclose(file);
+	}
+	return -1;
+}
+
+int appendLogWrite(appendLog_t appendLog, char* key, u_int32_t keyLength) {
+	appendLogImpl_t* pLog   = APPENDLOG(appendLog);
+	struct timeval   now    = { 0, 0 };
+	cacheItem_t      item   = 0;
+	char*            copy   = 0;
+	int              logged = 0;
+
+	if (!pLog) {
+		return 0;
+	}
+	copy = keyCopy(pLog, key, keyLength);
+	IfTrue(copy, WARN, "Key can't be logged");
+	item = hashMapGetElement(pLog->hashMap, key, keyLength);
+	if (item) {
+		IfTrue(0 == recordAppend(pLog, &pLog->pending, key, keyLength, item), ERR, "Error logging");
+		if (!mapGetElement(pLog->keys, copy)) {
+			mapPutElement(pLog->keys, copy, pLog);
+		}
+		if (pLog->stats.compacting && (0 == recordAppend(pLog, &pLog->compactPending, key, keyLength, item))
+				&& !mapGetElement(pLog->compactKeys, copy)) {
+			mapPutElement(pLog->compactKeys, copy, pLog);
+		}
+		cacheItemDelete(pLog->chunkpool, item);
+		item   = 0;
+		logged = 1;
+	}else if (mapGetElement(pLog->keys, copy)) {
+		/* a key never logged has nothing to undo */
+		IfTrue(0 == recordAppend(pLog, &pLog->pending, key, keyLength, 0), ERR, "Error logging");
+		mapDeleteElement(pLog->keys, copy);
+		if (pLog->stats.compacting) {
+			recordAppend(pLog, &pLog->compactPending, key, keyLength, 0);
+			mapDeleteElement(pLog->compactKeys, copy);
+		}
+		logged = 1;
+	}
+	if (logged) {
+		pLog->stats.records++;
+		pLog->stats.keys = mapSize(pLog->keys);
+		if (!event_pending(pLog->flushEvent, EV_TIMEOUT, NULL)) {
+			event_add(pLog->flushEvent, &now);
+		}
+	}
+	return 0;
+OnError:
+	if (item) {
+		cacheItemDelete(pLog->chunkpool, item);
+	}
+	return -1;
+}
+
+int appendLogFlush(appendLog_t appendLog) {
+	appendLogImpl_t* pLog = APPENDLOG(appendLog);
+	struct timeval   now  = { 0, 0 };
+	map_t            keys = 0;
+
+	/* no logged key, nothing to undo */
+	if (!pLog || (mapSize(pLog->keys) == 0)) {
+		return 0;
+	}
+	keys = mapCreate();
+	IfTrue(keys, ERR, "Error allocating memory");
+	IfTrue(0 == recordAppend(pLog, &pLog->pending, 0, 0, 0), ERR, "Error logging");
+	mapDelete(pLog->keys);
+	pLog->keys = keys;
+	keys       = 0;
+	if (pLog->stats.compacting) {
+		/* the rest of the walk finds no logged key */
+		recordAppend(pLog, &pLog->compactPending, 0, 0, 0);
+		mapDelete(pLog->compactKeys);
+		pLog->compactKeys = mapCreate();
+		if (!pLog->compactKeys) {
+			compactAbort(pLog);
+		}
+	}
+	pLog->stats.records++;
+	pLog->stats.keys = 0;
+	if (!event_pending(pLog->flushEvent, EV_TIMEOUT, NULL)) {
+		event_add(pLog->flushEvent, &now);
+	}
+	return 0;
+OnError:
+	if (keys) {
+		mapDelete(keys);
+	}
+	return -1;
+}
+
+void appendLogDelete(appendLog_t appendLog) {
+	appendLogImpl_t* pLog = APPENDLOG(appendLog);
+
+	if (pLog) {
+		if (pLog->fd >= 0) {
+			logFlush(pLog);
+			pLog->dirty = 1;
+			logSync(pLog);
+			close(pLog->fd);
+		}
+		if (pLog->stats.compacting) {
+			compactEnd(pLog);
+			unlink(pLog->tmpPath);
+		}
+		if (pLog->flushEvent) {
+			event_free(pLog->flushEvent);
+		}
+		if (pLog->compactEvent) {
+			event_free(pLog->compactEvent);
+		}
+		if (pLog->syncTimer) {
+			event_free(pLog->syncTimer);
+		}
+		if (pLog->keys) {
+			mapDelete(pLog->keys);
+		}
+		if (pLog->fallocator) {
+			fallocatorDelete(pLog->fallocator);
+		}
+		FREE(pLog->pending.data);
+		FREE(pLog->compactPending.data);
+		FREE(pLog->key);
+		FREE(pLog->path);
+		FREE(pLog->tmpPath);
+		FREE(pLog);
+	}
+}
+
+void appendLogGetStats(appendLog_t appendLog, appendLogStats_t* pStats) {
+	appendLogImpl_t* pLog = APPENDLOG(appendLog);
+	if (pLog) {
+		*pStats = pLog->stats;
+		pStats->pending = pLog->pending.used;
+	}else {
+		memset(pStats, 0, sizeof(appendLogStats_t));
+	}
+}
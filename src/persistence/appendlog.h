@@ -0,0 +1,72 @@
+#ifndef PERSISTENCE_APPENDLOG_H_
+#define PERSISTENCE_APPENDLOG_H_
+
+#include "../common/common.h"
+#include "../hashmap/hashmap.h"
+#include "../chunkpool/chunkpool.h"
+
+/* Append only log of the objects changed by the scripts
+ *
+ * appendLogWrite is called by executeNew and executeReadWrite after the
+ * object is put in (or left out of) the hashMap, and by delete after the
+ * key is gone. The resulting value is logged, not the operation, the
+ * objects read the clock. flush_all calls appendLogFlush. Records are
+ * collected in memory and written once per turn of the event loop,
+ * every record of the turn in one write. fdatasync runs every
+ * syncMillis, after every write if 0. Replies are not held back, a
+ * crash loses at most syncMillis of changes.
+ *
+ * The file, native byte order:
+ *   header  magic, version                                   2 x u32
+ *   record  crc, op, keyLength, flags, expiry, dataLength     6 x u32
+ *           key, data
+ * crc covers the record after the crc itself. op is put, delete or
+ * flush, a flush has no key. expiry is wall clock seconds, 0 if the
+ * object never expires.
+ *
+ * Once the log is twice as big as after the last compaction, and at
+ * least APPENDLOG_MIN_COMPACT bytes, the current value of every logged
+ * key still in the hashMap is written to path.tmp a few buckets per
+ * turn. Records logged meanwhile go to both files, so the last record
+ * of a key stays the right one. When the walk is over path.tmp is
+ * synced and renamed over path.
+ *
+ * appendLogReplay puts the logged objects back in the hashMap at start,
+ * the last record of a key wins, a flush deletes the keys logged before
+ * it. A torn or bad record at the end is
+ * cut off, the log goes on from the last good one.
+ */
+
+#define APPENDLOG_MIN_COMPACT  (4 * 1024 * 1024)
+
+typedef void* appendLog_t;
+
+typedef struct {
+	u_int64_t records;       //logged since start
+	u_int64_t bytes;         //size of the log
+	u_int64_t writes;
+	u_int64_t syncs;
+	u_int64_t failed;        //writes or syncs
+	u_int64_t pending;       //bytes not written yet
+	u_int32_t syncMillis;
+	u_int32_t keys;          //logged keys
+	u_int32_t compacting;
+	u_int64_t compactions;
+	u_int64_t lastCompactMillis;
+	u_int64_t replayed;      //records read at start
+	u_int64_t replayMillis;
+} appendLogStats_t;
+
+appendLog_t appendLogCreate(hashMap_t hashMap, chunkpool_t chunkpool, char* path,
+		                    u_int32_t syncMillis);
+/* 0 if replayed or there is no log, -1 if it can't be read */
+int         appendLogReplay(appendLog_t appendLog);
+/* logs the current value of key, a delete if it is not in the hashMap */
+int         appendLogWrite(appendLog_t appendLog, char* key, u_int32_t keyLength);
+/* logs a flush, after the hashMap was emptied */
+int         appendLogFlush(appendLog_t appendLog);
+/* writes and syncs what is pending, closes the log */
+void        appendLogDelete(appendLog_t appendLog);
+void        appendLogGetStats(appendLog_t appendLog, appendLogStats_t* pStats);
+
+#endif /* PERSISTENCE_APPENDLOG_H_ */
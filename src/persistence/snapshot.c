@@ -0,0 +1,406 @@
+#include "snapshot.h"
+#include "../cacheitem/cacheitem.h"
+#include "../datastream/datastream.h"
+#include "../fallocator/fallocator.h"
+#include "../common/crc32.h"
+#include "../cacheismo.h"
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define SNAPSHOT_MAGIC          0x504e5343     //CSNP
+#define SNAPSHOT_END_MAGIC      0x444e4543     //CEND
+#define SNAPSHOT_VERSION        1
+#define SNAPSHOT_SCAN_BUCKETS   4096
+#define SNAPSHOT_IO_BUFFER      (1024 * 1024)
+#define SNAPSHOT_DATA_BUFFER    (32 * 1024)
+
+typedef struct {
+	u_int32_t magic;
+	u_int32_t version;
+	u_int32_t created;
+} snapshotHeader_t;
+
+typedef struct {
+	u_int32_t keyLength;
+	u_int32_t flags;
+	u_int32_t expiry;
+	u_int32_t dataLength;
+} snapshotRecord_t;
+
+typedef struct {
+	u_int32_t magic;
+	u_int32_t count;
+	u_int32_t crc;
+} snapshotTrailer_t;
+
+typedef struct {
+	hashMap_t        hashMap;
+	chunkpool_t      chunkpool;
+	char*            path;
+	char*            tmpPath;
+	pid_t            pid;
+	u_int64_t        startMillis;
+	struct event*    childSignal;
+	snapshotStats_t  stats;
+} snapshotImpl_t;
+
+/* state of the child while it writes */
+typedef struct {
+	FILE*            file;
+	fallocator_t     fallocator;
+	u_int32_t        crc;
+	u_int32_t        count;
+	u_int32_t        monotonicNow;
+	u_int32_t        wallNow;
+	int              failed;
+} snapshotWriter_t;
+
+#define SNAPSHOT(x) ((snapshotImpl_t*)(x))
+
+static u_int32_t clockSeconds(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (u_int32_t)ts.tv_sec;
+}
+
+static u_int64_t currentTimeInMillis(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((u_int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static void writerWrite(snapshotWriter_t* pWriter, const void* data, size_t length) {
+	if (length && (1 != fwrite(data, length, 1, pWriter->file))) {
+		pWriter->failed = 1;
+	}
+	pWriter->crc = crc32Update(pWriter->crc, data, length);
+}
+
+static void snapshotVisitor(void* context, void* value) {
+	snapshotWriter_t*    pWriter = context;
+	cacheItem_t          item    = value;
+	dataStream_t         data    = cacheItemGetDataStream(item);
+	dataStreamIterator_t iter    = 0;
+	snapshotRecord_t     record;
+	u_int32_t            ttl     = 0;
+
+	if (pWriter->failed || (cacheItemGetExpiry(item) <= pWriter->monotonicNow)) {
+		return;
+	}
+	ttl               = cacheItemGetTTL(item);
+	record.keyLength  = cacheItemGetKeyLength(item);
+	record.flags      = cacheItemGetFlags(item);
+	record.expiry     = ttl ? (pWriter->wallNow + ttl) : 0;
+	record.dataLength = dataStreamGetSize(data);
+	writerWrite(pWriter, &record, sizeof(record));
+	writerWrite(pWriter, cacheItemGetKey(item), record.keyLength);
+	if (record.dataLength) {
+		iter = dataStreamIteratorCreate(pWriter->fallocator, data, 0, record.dataLength);
+		if (!iter) {
+			pWriter->failed = 1;
+			return;
+		}
+		for (int i = 0; i < dataStreamIteratorGetBufferCount(iter); i++) {
+			u_int32_t offset = 0;
+			u_int32_t length = 0;
+			char*     buffer = dataStreamIteratorGetBufferAtIndex(iter, i, &offset, &length);
+			writerWrite(pWriter, buffer + offset, length);
+		}
+		dataStreamIteratorDelete(pWriter->fallocator, iter);
+	}
+	pWriter->count++;
+}
+
+/* runs in the child */
+static int snapshotWrite(snapshotImpl_t* pSnap) {
+	snapshotWriter_t  writer;
+	snapshotHeader_t  header;
+	snapshotTrailer_t trailer;
+	u_int32_t         cursor = 0;
+
+	memset(&writer, 0, sizeof(writer));
+	writer.file = fopen(pSnap->tmpPath, "w");
+	IfTrue(writer.file, ERR, "Error creating %s", pSnap->tmpPath);
+	setvbuf(writer.file, 0, _IOFBF, SNAPSHOT_IO_BUFFER);
+	writer.fallocator   = fallocatorCreate();
+	IfTrue(writer.fallocator, ERR, "Error creating fallocator");
+	writer.monotonicNow = clockSeconds(CLOCK_MONOTONIC);
+	writer.wallNow      = clockSeconds(CLOCK_REALTIME);
+
+	header.magic   = SNAPSHOT_MAGIC;
+	header.version = SNAPSHOT_VERSION;
+	header.created = writer.wallNow;
+	IfTrue(1 == fwrite(&header, sizeof(header), 1, writer.file), ERR, "Error writing %s", pSnap->tmpPath);
+	do {
+		cursor = hashMapScan(pSnap->hashMap, cursor, SNAPSHOT_SCAN_BUCKETS, snapshotVisitor, &writer);
+	} while (cursor && !writer.failed);
+	IfTrue(!writer.failed, ERR, "Error writing %s", pSnap->tmpPath);
+
+	trailer.magic = SNAPSHOT_END_MAGIC;
+	trailer.count = writer.count;
+	trailer.crc   = writer.crc;
+	IfTrue(1 == fwrite(&trailer, sizeof(trailer), 1, writer.file), ERR, "Error writing %s", pSnap->tmpPath);
+	IfTrue(0 == fflush(writer.file), ERR, "Error writing %s", pSnap->tmpPath);
+	IfTrue(0 == fsync(fileno(writer.file)), ERR, "Error syncing %s", pSnap->tmpPath);
+	IfTrue(0 == fclose(writer.file), ERR, "Error closing %s", pSnap->tmpPath);
+	writer.file = 0;
+	IfTrue(0 == rename(pSnap->tmpPath, pSnap->path), ERR, "Error renaming %s", pSnap->tmpPath);
+	return 0;
+OnError:
+	if (writer.file) {
+		fclose(writer.file);
+	}
+	unlink(pSnap->tmpPath);
+	return -1;
+}
+
+static int readTrailer(FILE* file, snapshotTrailer_t* pTrailer) {
+	IfTrue(0 == fseek(file, -(long)sizeof(snapshotTrailer_t), SEEK_END), WARN, "Snapshot too short");
+	IfTrue(1 == fread(pTrailer, sizeof(snapshotTrailer_t), 1, file), WARN, "Error reading trailer");
+	IfTrue(pTrailer->magic == SNAPSHOT_END_MAGIC, WARN, "Bad trailer");
+	return 0;
+OnError:
+	return -1;
+}
+
+static void childSignalCallback(evutil_socket_t signal, short events, void *arg) {
+	snapshotImpl_t*   pSnap  = SNAPSHOT(arg);
+	snapshotTrailer_t trailer;
+	struct stat       fileStat;
+	FILE*             file   = 0;
+	int               status = 0;
+
+	if (!pSnap->pid || (pSnap->pid != waitpid(pSnap->pid, &status, WNOHANG))) {
+		return;
+	}
+	pSnap->pid              = 0;
+	pSnap->stats.inProgress = 0;
+	if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+		pSnap->stats.failed++;
+		LOG(ERR, "Snapshot to %s failed", pSnap->path);
+		return;
+	}
+	pSnap->stats.snapshots++;
+	pSnap->stats.lastMillis = currentTimeInMillis() - pSnap->startMillis;
+	pSnap->stats.lastTime   = clockSeconds(CLOCK_REALTIME);
+	file = fopen(pSnap->path, "r");
+	if (file) {
+		if (0 == readTrailer(file, &trailer)) {
+			pSnap->stats.lastItems = trailer.count;
+		}
+		if (0 == fstat(fileno(file), &fileStat)) {
+			pSnap->stats.lastBytes = fileStat.st_size;
+		}
+		fclose(file);
+	}
+	LOG(INFO, "Snapshot of %lu items to %s in %lu ms", pSnap->stats.lastItems, pSnap->path,
+			pSnap->stats.lastMillis);
+}
+
+snapshot_t snapshotCreate(hashMap_t hashMap, chunkpool_t chunkpool, char* path) {
+	snapshotImpl_t* pSnap = ALLOCATE_1(snapshotImpl_t);
+
+	IfTrue(pSnap, ERR, "Error allocating memory");
+	pSnap->hashMap   = hashMap;
+	pSnap->chunkpool = chunkpool;
+	pSnap->path      = strdup(path);
+	pSnap->tmpPath   = ALLOCATE_N(strlen(path) + 5, char);
+	IfTrue(pSnap->path && pSnap->tmpPath, ERR, "Error allocating memory");
+	sprintf(pSnap->tmpPath, "%s.tmp", path);
+	pSnap->childSignal = evsignal_new(getGlobalEventBase(), SIGCHLD, childSignalCallback, pSnap);
+	IfTrue(pSnap->childSignal, ERR, "Error creating signal event");
+	event_add(pSnap->childSignal, NULL);
+	return pSnap;
+OnError:
+	if (pSnap) {
+		FREE(pSnap->path);
+		FREE(pSnap->tmpPath);
+		FREE(pSnap);
+	}
+	return 0;
+}
+
+int snapshotStart(snapshot_t snapshot) {
+	snapshotImpl_t* pSnap = SNAPSHOT(snapshot);
+	pid_t           pid   = 0;
+
+	IfTrue(pSnap, INFO, "Snapshot not enabled");
+	IfTrue(!pSnap->pid, INFO, "Snapshot already in progress");
+	IfTrue(!chunkpoolIsMapped(pSnap->chunkpool), WARN, "No snapshot with a mapped chunkpool");
+
+	pSnap->startMillis = currentTimeInMillis();
+	pid = fork();
+	IfTrue(pid >= 0, ERR, "Error forking for snapshot");
+	if (pid == 0) {
+		/* no atexit handlers, no stdio of the parent */
+		_exit(snapshotWrite(pSnap) == 0 ? 0 : 1);
+	}
+	pSnap->pid              = pid;
+	pSnap->stats.inProgress = 1;
+	return 0;
+OnError:
+	return -1;
+}
+
+/* reads the records once to check the crc */
+static int snapshotVerify(FILE* file, u_int32_t* pCount) {
+	snapshotHeader_t  header;
+	snapshotTrailer_t trailer;
+	char*             buffer = 0;
+	long              left   = 0;
+	u_int32_t         crc    = 0;
+
+	IfTrue(0 == readTrailer(file, &trailer), WARN, "Bad snapshot");
+	left = ftell(file) - (long)sizeof(trailer) - (long)sizeof(header);
+	IfTrue(0 == fseek(file, 0, SEEK_SET), WARN, "Error seeking");
+	IfTrue(1 == fread(&header, sizeof(header), 1, file), WARN, "Error reading header");
+	IfTrue((header.magic == SNAPSHOT_MAGIC) && (header.version == SNAPSHOT_VERSION) && (left >= 0),
+			WARN, "Bad header");
+	buffer = ALLOCATE_N(SNAPSHOT_IO_BUFFER, char);
+	IfTrue(buffer, ERR, "Error allocating memory");
+	while (left > 0) {
+		size_t size = (left > SNAPSHOT_IO_BUFFER) ? SNAPSHOT_IO_BUFFER : left;
+		IfTrue(1 == fread(buffer, size, 1, file), WARN, "Error reading records");
+		crc   = crc32Update(crc, buffer, size);
+		left -= size;
+	}
+	IfTrue(crc == trailer.crc, WARN, "Bad crc");
+	FREE(buffer);
+	*pCount = trailer.count;
+	return 0;
+OnError:
+	if (buffer) {
+		FREE(buffer);
+	}
+	return -1;
+}
+
+/* reads length bytes of value into the stream, at most SNAPSHOT_DATA_BUFFER
+ * per buffer because the vector length of a dataStream is 16 bits
+ */
+static int snapshotReadData(FILE* file, fallocator_t fallocator, dataStream_t stream, u_int32_t length) {
+	while (length > 0) {
+		u_int32_t size   = (length > SNAPSHOT_DATA_BUFFER) ? SNAPSHOT_DATA_BUFFER : length;
+		char*     buffer = dataStreamBufferAllocate(NULL, fallocator, size);
+		int       err    = 0;
+
+		if (!buffer) {
+			return -1;
+		}
+		if (1 == fread(buffer, size, 1, file)) {
+			err = dataStreamAppendData(stream, buffer, 0, size);
+		} else {
+			err = -1;
+		}
+		dataStreamBufferFree(buffer);
+		if (err != 0) {
+			return -1;
+		}
+		length -= size;
+	}
+	return 0;
+}
+
+/* puts one record in the hashMap, -1 if it can't be read */
+static int snapshotLoadRecord(snapshotImpl_t* pSnap, FILE* file, fallocator_t fallocator,
+		char* key, u_int32_t wallNow, u_int32_t* pLoaded) {
+	snapshotRecord_t record;
+	command_t        command;
+	cacheItem_t      item    = 0;
+
+	memset(&command, 0, sizeof(command));
+	IfTrue(1 == fread(&record, sizeof(record), 1, file), WARN, "Error reading record");
+	IfTrue(record.keyLength && (record.keyLength < chunkpoolMaxMallocSize(pSnap->chunkpool)),
+			WARN, "Bad key length %u", record.keyLength);
+	IfTrue(1 == fread(key, record.keyLength, 1, file), WARN, "Error reading key");
+	key[record.keyLength] = 0;
+
+	command.command    = COMMAND_SET;
+	command.key        = key;
+	command.keySize    = record.keyLength;
+	command.flags      = record.flags;
+	command.dataLength = record.dataLength;
+	command.dataStream = dataStreamCreate();
+	IfTrue(command.dataStream, ERR, "Error allocating memory");
+	IfTrue(0 == snapshotReadData(file, fallocator, command.dataStream, record.dataLength),
+			WARN, "Error reading data");
+	if (!record.expiry || (record.expiry > wallNow)) {
+		command.expiryTime = record.expiry ? (record.expiry - wallNow) : 0;
+		item = cacheItemCreate(pSnap->chunkpool, &command);
+		if (item) {
+			hashMapDeleteElement(pSnap->hashMap, key, record.keyLength);
+			if (0 == hashMapPutElement(pSnap->hashMap, item)) {
+				(*pLoaded)++;
+			}
+		}
+	}
+	dataStreamDelete(command.dataStream);
+	return 0;
+OnError:
+	if (command.dataStream) {
+		dataStreamDelete(command.dataStream);
+	}
+	return -1;
+}
+
+int snapshotLoad(snapshot_t snapshot) {
+	snapshotImpl_t* pSnap      = SNAPSHOT(snapshot);
+	FILE*           file       = fopen(pSnap->path, "r");
+	fallocator_t    fallocator = 0;
+	char*           key        = 0;
+	u_int32_t       count      = 0;
+	u_int32_t       loaded     = 0;
+	u_int32_t       wallNow    = clockSeconds(CLOCK_REALTIME);
+	u_int64_t       start      = currentTimeInMillis();
+
+	if (!file && (errno == ENOENT)) {
+		LOG(INFO, "No snapshot in %s", pSnap->path);
+		return 0;
+	}
+	IfTrue(file, ERR, "Error opening %s", pSnap->path);
+	setvbuf(file, 0, _IOFBF, SNAPSHOT_IO_BUFFER);
+	IfTrue(0 == snapshotVerify(file, &count), ERR, "%s is not a good snapshot", pSnap->path);
+	IfTrue(0 == hashMapReserve(pSnap->hashMap, hashMapSize(pSnap->hashMap) + count), ERR,
+			"Error sizing hashMap for %u items", count);
+
+	fallocator = fallocatorCreate();
+	key        = ALLOCATE_N(chunkpoolMaxMallocSize(pSnap->chunkpool), char);
+	IfTrue(fallocator && key, ERR, "Error allocating memory");
+	IfTrue(0 == fseek(file, sizeof(snapshotHeader_t), SEEK_SET), ERR, "Error seeking");
+	for (u_int32_t i = 0; i < count; i++) {
+		IfTrue(0 == snapshotLoadRecord(pSnap, file, fallocator, key, wallNow, &loaded), ERR,
+				"Error loading record %u of %s", i, pSnap->path);
+	}
+	pSnap->stats.loadedItems = loaded;
+	pSnap->stats.loadMillis  = currentTimeInMillis() - start;
+	LOG(INFO, "Loaded %u items of %u from %s in %lu ms", loaded, count, pSnap->path,
+			pSnap->stats.loadMillis);
+	FREE(key);
+	fallocatorDelete(fallocator);
+	fclose(file);
+	return 0;
+OnError:
+	if (key) {
+		FREE(key);
+	}
+	if (fallocator) {
+		fallocatorDelete(fallocator);
+	}
+	if (file) {
+		fclose(file);
+	}
+	return -1;
+}
+
+void snapshotGetStats(snapshot_t snapshot, snapshotStats_t* pStats) {
+	snapshotImpl_t* pSnap = SNAPSHOT(snapshot);
+	if (pSnap) {
+		*pStats = pSnap->stats;
+	}else {
+		memset(pStats, 0, sizeof(snapshotStats_t));
+	}
+}
@@ -0,0 +1,50 @@
+#ifndef PERSISTENCE_SNAPSHOT_H_
+#define PERSISTENCE_SNAPSHOT_H_
+
+#include "../common/common.h"
+#include "../hashmap/hashmap.h"
+#include "../chunkpool/chunkpool.h"
+
+/* Point in time snapshot of the hashMap
+ *
+ * snapshotStart forks, the child walks its copy of the hashMap and
+ * writes every live item to path.tmp, which is renamed to path once
+ * complete and synced. The event loop of the parent only pays for the
+ * fork. The child is reaped on SIGCHLD.
+ *
+ * The file, native byte order:
+ *   header  magic, version, wall clock time        3 x u32
+ *   record  keyLength, flags, expiry, dataLength   4 x u32
+ *           key, data
+ *   trailer magic, record count, crc32 of the records
+ * expiry is wall clock seconds, 0 if the item never expires.
+ *
+ * snapshotLoad checks the crc first, then sizes the hashMap for the
+ * record count and puts the items, skipping the expired ones.
+ *
+ * Not available with a mapped chunkpool (-M), the parent keeps changing
+ * the shared chunks under the child.
+ */
+
+typedef void* snapshot_t;
+
+typedef struct {
+	u_int32_t inProgress;
+	u_int64_t snapshots;     //completed
+	u_int64_t failed;
+	u_int64_t lastItems;
+	u_int64_t lastBytes;
+	u_int64_t lastMillis;    //fork to rename
+	u_int64_t lastTime;      //wall clock seconds of the last completed one
+	u_int64_t loadedItems;
+	u_int64_t loadMillis;
+} snapshotStats_t;
+
+snapshot_t snapshotCreate(hashMap_t hashMap, chunkpool_t chunkpool, char* path);
+/* 0 if the child is started, -1 if one is running or it can't fork */
+int        snapshotStart(snapshot_t snapshot);
+/* 0 if loaded or there is no file, -1 if the file is bad */
+int        snapshotLoad(snapshot_t snapshot);
+void       snapshotGetStats(snapshot_t snapshot, snapshotStats_t* pStats);
+
+#endif /* PERSISTENCE_SNAPSHOT_H_ */
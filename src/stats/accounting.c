@@ -0,0 +1,154 @@
+#include "accounting.h"
+#include "../cacheitem/cacheitem.h"
+
+#define ACCOUNTING_SLOTS   (2 * ACCOUNTING_MAX_PREFIXES)
+#define ACCOUNTING_OTHER   0
+
+typedef struct {
+	char        prefix[ACCOUNTING_MAX_PREFIX_LENGTH + 1];
+	u_int32_t   length;
+	u_int64_t   items;
+	u_int64_t   bytes;
+	u_int64_t   ops;
+	u_int64_t   lastOps;
+	u_int64_t   opsPerSecond;
+	u_int64_t   gets;
+	u_int64_t   hits;
+	u_int64_t   luaMicros;
+} account_t;
+
+/* slots is an open addressing table of account index + 1, 0 if free */
+typedef struct {
+	char        isSeparator[256];
+	u_int16_t   slots[ACCOUNTING_SLOTS];
+	u_int32_t   count;
+	account_t   accounts[ACCOUNTING_MAX_PREFIXES + 1];
+} accountingImpl_t;
+
+#define ACCOUNTING(x) ((accountingImpl_t*)(x))
+
+static account_t* accountFind(accountingImpl_t* pAcc, char* key, u_int32_t keyLength) {
+	u_int32_t length = 0;
+	u_int32_t hash   = 2166136261u;
+	u_int32_t slot   = 0;
+
+	if (keyLength > ACCOUNTING_MAX_PREFIX_LENGTH + 1) {
+		keyLength = ACCOUNTING_MAX_PREFIX_LENGTH + 1;
+	}
+	while ((length < keyLength) && !pAcc->isSeparator[(unsigned char)key[length]]) {
+		hash = (hash ^ (unsigned char)key[length]) * 16777619u;
+		length++;
+	}
+	if ((length == keyLength) || (length == 0)) {
+		return &pAcc->accounts[ACCOUNTING_OTHER];
+	}
+	for (slot = hash % ACCOUNTING_SLOTS; pAcc->slots[slot]; slot = (slot + 1) % ACCOUNTING_SLOTS) {
+		account_t* pAccount = &pAcc->accounts[pAcc->slots[slot] - 1];
+		if ((pAccount->length == length) && (0 == memcmp(pAccount->prefix, key, length))) {
+			return pAccount;
+		}
+	}
+	//first time seen, the table is never more than half full
+	if (pAcc->count == ACCOUNTING_MAX_PREFIXES) {
+		return &pAcc->accounts[ACCOUNTING_OTHER];
+	}
+	pAcc->count++;
+	memcpy(pAcc->accounts[pAcc->count].prefix, key, length);
+	pAcc->accounts[pAcc->count].length = length;
+	pAcc->slots[slot] = pAcc->count + 1;
+	return &pAcc->accounts[pAcc->count];
+}
+
+static void accountingListener(void* context, int event, void* value) {
+	accountingImpl_t* pAcc     = ACCOUNTING(context);
+	account_t*        pAccount = accountFind(pAcc, cacheItemGetKey(value), cacheItemGetKeyLength(value));
+
+	if (event == HASHMAP_EVENT_PUT) {
+		pAccount->items++;
+		pAccount->bytes += cacheItemGetTotalSize(value);
+	}else {
+		pAccount->items--;
+		pAccount->bytes -= cacheItemGetTotalSize(value);
+	}
+}
+
+static void accountingLookupListener(void* context, char* key, u_int32_t keyLength, void* value) {
+	account_t* pAccount = accountFind(ACCOUNTING(context), key, keyLength);
+
+	pAccount->gets++;
+	if (value) {
+		pAccount->hits++;
+	}
+}
+
+accounting_t accountingCreate(hashMap_t hashMap, char* separators) {
+	accountingImpl_t* pAcc = ALLOCATE_1(accountingImpl_t);
+
+	IfTrue(pAcc, ERR, "Error allocating memory");
+	IfTrue(separators && *separators, ERR, "No separator for the key prefixes");
+	for (char* c = separators; *c; c++) {
+		pAcc->isSeparator[(unsigned char)*c] = 1;
+	}
+	strcpy(pAcc->accounts[ACCOUNTING_OTHER].prefix, "other");
+	IfTrue(0 == hashMapAddListener(hashMap, accountingListener, pAcc), ERR,
+			"Error adding hashMap listener");
+	IfTrue(0 == hashMapAddLookupListener(hashMap, accountingLookupListener, pAcc), ERR,
+			"Error adding hashMap lookup listener");
+	goto OnSuccess;
+OnError:
+	if (pAcc) {
+		hashMapRemoveListener(hashMap, accountingListener, pAcc);
+		FREE(pAcc);
+		pAcc = 0;
+	}
+OnSuccess:
+	return pAcc;
+}
+
+void accountingCommand(accounting_t accounting, char* key, u_int32_t keyLength) {
+	if (accounting && key) {
+		accountFind(ACCOUNTING(accounting), key, keyLength)->ops++;
+	}
+}
+
+void accountingLuaTime(accounting_t accounting, char* key, u_int32_t keyLength, u_int64_t micros) {
+	if (accounting) {
+		account_t* pAccount = &(ACCOUNTING(accounting))->accounts[ACCOUNTING_OTHER];
+		if (key) {
+			pAccount = accountFind(ACCOUNTING(accounting), key, keyLength);
+		}
+		pAccount->luaMicros += micros;
+	}
+}
+
+void accountingTick(accounting_t accounting) {
+	accountingImpl_t* pAcc = ACCOUNTING(accounting);
+
+	if (pAcc) {
+		for (u_int32_t i = 0; i <= pAcc->count; i++) {
+			pAcc->accounts[i].opsPerSecond = pAcc->accounts[i].ops - pAcc->accounts[i].lastOps;
+			pAcc->accounts[i].lastOps      = pAcc->accounts[i].ops;
+		}
+	}
+}
+
+void accountingVisit(accounting_t accounting, accountingVisitor_t visitor, void* context) {
+	accountingImpl_t* pAcc = ACCOUNTING(accounting);
+	accountStats_t    stats;
+
+	if (pAcc) {
+		for (u_int32_t i = 0; i <= pAcc->count; i++) {
+			account_t* pAccount = &pAcc->accounts[i];
+
+			stats.prefix       = pAccount->prefix;
+			stats.items        = pAccount->items;
+			stats.bytes        = pAccount->bytes;
+			stats.ops          = pAccount->ops;
+			stats.opsPerSecond = pAccount->opsPerSecond;
+			stats.gets         = pAccount->gets;
+			stats.hits         = pAccount->hits;
+			stats.luaMicros    = pAccount->luaMicros;
+			visitor(context, &stats);
+		}
+	}
+}
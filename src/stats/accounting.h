@@ -0,0 +1,53 @@
+#ifndef STATS_ACCOUNTING_H_
+#define STATS_ACCOUNTING_H_
+
+#include "../common/common.h"
+#include "../hashmap/hashmap.h"
+
+/* Usage accounting per key prefix
+ *
+ * The prefix of a key is the part before the first of the separator
+ * characters given to accountingCreate. With ":$" plain keys like
+ * user:42 count as user, virtual keys like set:put:tags and the objects
+ * stored for them, set$tags, both count as their object type set.
+ *
+ * The prefixes are interned in a fixed table when first seen. Keys
+ * without a separator in the first ACCOUNTING_MAX_PREFIX_LENGTH bytes
+ * and prefixes past the first ACCOUNTING_MAX_PREFIXES count as other.
+ * Every update is a lookup in that table, no allocation.
+ *
+ * Items and bytes (cacheItemGetTotalSize) follow the puts and deletes
+ * of the hashMap, gets and hits its lookups, including the ones made
+ * by scripts. ops are the keys of the commands answered, luaMicros the
+ * time the scripts ran for them.
+ */
+
+#define ACCOUNTING_MAX_PREFIXES       256
+#define ACCOUNTING_MAX_PREFIX_LENGTH  32
+
+typedef void* accounting_t;
+
+typedef struct {
+	const char* prefix;
+	u_int64_t   items;
+	u_int64_t   bytes;
+	u_int64_t   ops;
+	u_int64_t   opsPerSecond;  //in the last second
+	u_int64_t   gets;
+	u_int64_t   hits;
+	u_int64_t   luaMicros;
+} accountStats_t;
+
+typedef void (*accountingVisitor_t)(void* context, accountStats_t* pStats);
+
+accounting_t accountingCreate(hashMap_t hashMap, char* separators);
+/* the accounting arguments may be 0, then nothing is counted */
+void         accountingCommand(accounting_t accounting, char* key, u_int32_t keyLength);
+void         accountingLuaTime(accounting_t accounting, char* key, u_int32_t keyLength,
+		                       u_int64_t micros);
+/* once a second, for opsPerSecond */
+void         accountingTick(accounting_t accounting);
+/* the prefixes in the order they were first seen, other first */
+void         accountingVisit(accounting_t accounting, accountingVisitor_t visitor, void* context);
+
+#endif /* STATS_ACCOUNTING_H_ */
@@ -0,0 +1,419 @@
+#include "admin.h"
+#include "stats.h"
+#include "../io/connection.h"
+#include "../datastream/datastream.h"
+#include "../fallocator/fallocator.h"
+#include "../cacheismo.h"
+#include <stdarg.h>
+
+#define ADMIN_MAX_REQUEST   (8 * 1024)
+#define ADMIN_PREFIX        "cacheismo_"
+
+#define ADMIN_OK        "HTTP/1.1 200 OK\r\n" \
+                        "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n" \
+                        "Connection: close\r\n\r\n"
+#define ADMIN_TEXT      "HTTP/1.1 200 OK\r\n" \
+                        "Content-Type: text/plain; charset=utf-8\r\n" \
+                        "Connection: close\r\n\r\n"
+#define ADMIN_NOT_FOUND "HTTP/1.1 404 Not Found\r\n" \
+                        "Content-Type: text/plain\r\n" \
+                        "Connection: close\r\n\r\n" \
+                        "Not Found\n"
+#define ADMIN_BAD       "HTTP/1.1 405 Method Not Allowed\r\n" \
+                        "Content-Type: text/plain\r\n" \
+                        "Connection: close\r\n\r\n" \
+                        "Method Not Allowed\n"
+
+/* The same le boundaries on every scrape and every server, so that
+ * rate() and histogram_quantile() can be taken across both. The
+ * histograms count micro seconds.
+ */
+static const u_int64_t adminBucketLimits[] = {
+	1, 2, 5, 10, 25, 50, 100, 250, 500,
+	1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+	1000000, 2500000, 5000000, 10000000
+};
+
+#define ADMIN_BUCKETS   (sizeof(adminBucketLimits) / sizeof(adminBucketLimits[0]))
+
+typedef struct {
+	connectionHandler_t handler;
+	connection_t        server;
+} adminImpl_t;
+
+#define ADMIN(x) ((adminImpl_t*)(x))
+
+/* nextGroup is -1 till the request is read, then the stats group to
+ * render next. statsGroupCount() is the # EOF line, anything past it
+ * means the answer is complete once written.
+ */
+typedef struct {
+	connection_t   connection;
+	fallocator_t   fallocator;
+	dataStream_t   readStream;
+	dataStream_t   writeStream;
+	int            nextGroup;
+	const char*    lastName;     //of the metric family being rendered
+	char*          text;
+	u_int32_t      textUsed;
+	u_int32_t      textSize;
+	int            failed;
+} adminConnection_t;
+
+static void adminConnectionDelete(adminConnection_t* pConn) {
+	if (pConn) {
+		if (pConn->connection) {
+			connectionClose(pConn->connection);
+		}
+		if (pConn->readStream) {
+			dataStreamDelete(pConn->readStream);
+		}
+		if (pConn->writeStream) {
+			dataStreamDelete(pConn->writeStream);
+		}
+		if (pConn->fallocator) {
+			fallocatorDelete(pConn->fallocator);
+		}
+		if (pConn->text) {
+			FREE(pConn->text);
+		}
+		FREE(pConn);
+	}
+}
+
+static adminConnection_t* adminConnectionCreate(connection_t connection) {
+	adminConnection_t* pConn = ALLOCATE_1(adminConnection_t);
+
+	IfTrue(pConn, ERR, "Error allocating memory");
+	pConn->connection  = connection;
+	pConn->nextGroup   = -1;
+	pConn->readStream  = dataStreamCreate();
+	IfTrue(pConn->readStream, WARN, "Error creating read stream");
+	pConn->writeStream = dataStreamCreate();
+	IfTrue(pConn->writeStream, WARN, "Error creating write stream");
+	pConn->fallocator  = fallocatorCreate();
+	IfTrue(pConn->fallocator, WARN, "Error creating fallocator");
+	goto OnSuccess;
+OnError:
+	if (pConn) {
+		pConn->connection = 0;
+		adminConnectionDelete(pConn);
+		pConn = 0;
+	}
+OnSuccess:
+	return pConn;
+}
+
+static void adminPrintf(adminConnection_t* pConn, const char* format, ...) {
+	va_list   args;
+	int       length = 0;
+
+	if (pConn->failed) {
+		return;
+	}
+	while (1) {
+		u_int32_t available = pConn->textSize - pConn->textUsed;
+
+		va_start(args, format);
+		length = vsnprintf(pConn->text + pConn->textUsed, available, format, args);
+		va_end(args);
+		IfTrue(length >= 0, WARN, "Error formatting metric");
+		if ((u_int32_t)length < available) {
+			pConn->textUsed += length;
+			break;
+		}
+		{
+			u_int32_t size = pConn->textSize ? (2 * pConn->textSize) : 4096;
+			char*     text = 0;
+
+			while (size <= pConn->textUsed + length) {
+				size = 2 * size;
+			}
+			text = realloc(pConn->text, size);
+			IfTrue(text, WARN, "Error allocating memory");
+			pConn->text     = text;
+			pConn->textSize = size;
+		}
+	}
+	return;
+OnError:
+	pConn->failed = 1;
+}
+
+/* moves the text rendered so far to the writeStream */
+static int adminFlushText(adminConnection_t* pConn) {
+	void* buffer = 0;
+	int   err    = -1;
+
+	IfTrue(!pConn->failed, WARN, "Error rendering metrics");
+	if (pConn->textUsed == 0) {
+		return 0;
+	}
+	buffer = dataStreamBufferAllocate(NULL, pConn->fallocator, pConn->textUsed);
+	IfTrue(buffer, WARN, "Error allocating memory");
+	memcpy(buffer, pConn->text, pConn->textUsed);
+	IfTrue(0 == dataStreamAppendData(pConn->writeStream, buffer, 0, pConn->textUsed),
+			WARN, "Error appending metrics");
+	pConn->textUsed = 0;
+	err = 0;
+OnError:
+	if (buffer) {
+		dataStreamBufferFree(buffer);
+	}
+	return err;
+}
+
+/* label values are keys too, \ and " are escaped */
+static void adminPrintLabelValue(adminConnection_t* pConn, const char* value) {
+	const char* start = value;
+
+	for (; *value; value++) {
+		if ((*value == '\\') || (*value == '"')) {
+			adminPrintf(pConn, "%.*s\\%c", (int)(value - start), start, *value);
+			start = value + 1;
+		}
+	}
+	adminPrintf(pConn, "%s", start);
+}
+
+static void adminPrintLabels(adminConnection_t* pConn, statsMetric_t* pMetric, const char* le) {
+	if (pMetric->labelName) {
+		adminPrintf(pConn, "{%s=\"", pMetric->labelName);
+		adminPrintLabelValue(pConn, pMetric->labelValue);
+		if (le) {
+			adminPrintf(pConn, "\",le=\"%s\"}", le);
+		}else {
+			adminPrintf(pConn, "\"}");
+		}
+	}else if (le) {
+		adminPrintf(pConn, "{le=\"%s\"}", le);
+	}
+}
+
+static void adminPrintHistogram(adminConnection_t* pConn, statsMetric_t* pMetric) {
+	hdrHistogram_t* histogram  = pMetric->histogram;
+	u_int64_t       cumulative = 0;
+	int             bucket     = 0;
+	char            le[32];
+
+	//an hdrHistogram bucket is counted under the first le not below its limit
+	for (int i = 0; i < ADMIN_BUCKETS; i++) {
+		while ((bucket < HDR_BUCKETS) && (hdrHistogramBucketLimit(bucket) <= adminBucketLimits[i])) {
+			cumulative += histogram->buckets[bucket];
+			bucket++;
+		}
+		snprintf(le, sizeof(le), "%llu", (unsigned long long)adminBucketLimits[i]);
+		adminPrintf(pConn, ADMIN_PREFIX"%s_bucket", pMetric->name);
+		adminPrintLabels(pConn, pMetric, le);
+		adminPrintf(pConn, " %llu\n", (unsigned long long)cumulative);
+	}
+	adminPrintf(pConn, ADMIN_PREFIX"%s_bucket", pMetric->name);
+	adminPrintLabels(pConn, pMetric, "+Inf");
+	adminPrintf(pConn, " %llu\n", (unsigned long long)histogram->count);
+	adminPrintf(pConn, ADMIN_PREFIX"%s_count", pMetric->name);
+	adminPrintLabels(pConn, pMetric, 0);
+	adminPrintf(pConn, " %llu\n", (unsigned long long)histogram->count);
+	adminPrintf(pConn, ADMIN_PREFIX"%s_sum", pMetric->name);
+	adminPrintLabels(pConn, pMetric, 0);
+	adminPrintf(pConn, " %llu\n", (unsigned long long)histogram->sum);
+}
+
+static void adminMetricVisitor(void* context, statsMetric_t* pMetric) {
+	adminConnection_t* pConn = context;
+
+	//metrics with a label come one after the other, one family
+	if (!pConn->lastName || strcmp(pConn->lastName, pMetric->name)) {
+		const char* type = (pMetric->type == STATS_COUNTER) ? "counter" :
+				((pMetric->type == STATS_HISTOGRAM) ? "histogram" : "gauge");
+		adminPrintf(pConn, "# TYPE "ADMIN_PREFIX"%s %s\n", pMetric->name, type);
+		adminPrintf(pConn, "# HELP "ADMIN_PREFIX"%s %s\n", pMetric->name, pMetric->help);
+		pConn->lastName = pMetric->name;
+	}
+	if (pMetric->type == STATS_HISTOGRAM) {
+		adminPrintHistogram(pConn, pMetric);
+		return;
+	}
+	adminPrintf(pConn, ADMIN_PREFIX"%s%s", pMetric->name,
+			(pMetric->type == STATS_COUNTER) ? "_total" : "");
+	adminPrintLabels(pConn, pMetric, 0);
+	adminPrintf(pConn, " %.15g\n", pMetric->value);
+}
+
+static int adminWriteStream(adminConnection_t* pConn) {
+	u_int32_t size    = dataStreamGetSize(pConn->writeStream);
+	u_int32_t written = 0;
+	int       err     = 0;
+
+	if (size > 0) {
+		err = connectionWrite(pConn->connection, pConn->fallocator, pConn->writeStream, size, &written);
+		if ((err >= 0) && (written > 0)) {
+			dataStreamTruncateFromStart(pConn->writeStream, size - written);
+		}
+	}
+	return err;
+}
+
+/* Writes what is rendered and renders the next group once it is all
+ * gone. Returns to the event loop after every group.
+ */
+static void adminRespond(adminConnection_t* pConn) {
+	int groups = statsGroupCount();
+	int err    = 0;
+
+	while (1) {
+		err = adminWriteStream(pConn);
+		IfTrue(err >= 0, INFO, "Error writing metrics");
+		if (err > 0) {
+			connectionWaitForWrite(pConn->connection, getGlobalEventBase());
+			return;
+		}
+		if (pConn->nextGroup > groups) {
+			break;
+		}
+		if (pConn->nextGroup == groups) {
+			adminPrintf(pConn, "# EOF\n");
+			pConn->nextGroup++;
+			IfTrue(0 == adminFlushText(pConn), WARN, "Error rendering metrics");
+			continue;
+		}
+		pConn->lastName = 0;
+		statsVisit(statsGroupName(pConn->nextGroup), adminMetricVisitor, pConn);
+		pConn->nextGroup++;
+		IfTrue(0 == adminFlushText(pConn), WARN, "Error rendering metrics");
+		err = adminWriteStream(pConn);
+		IfTrue(err >= 0, INFO, "Error writing metrics");
+		//the next group in the next iteration of the event loop
+		connectionWaitForWrite(pConn->connection, getGlobalEventBase());
+		return;
+	}
+OnError:
+	adminConnectionDelete(pConn);
+}
+
+static int adminAppendString(adminConnection_t* pConn, const char* value) {
+	adminPrintf(pConn, "%s", value);
+	return adminFlushText(pConn);
+}
+
+static void adminSlowlogVisitor(void* context, slowlogEntry_t* pEntry) {
+	char line[SLOWLOG_LINE];
+
+	slowlogFormat(pEntry, line, sizeof(line));
+	adminPrintf(context, "%s\n", line);
+}
+
+/* the slowlog is small, it is rendered in one go */
+static int adminAppendSlowlog(adminConnection_t* pConn) {
+	if (!getGlobalSlowlog()) {
+		return adminAppendString(pConn, ADMIN_NOT_FOUND);
+	}
+	adminPrintf(pConn, "%s", ADMIN_TEXT);
+	slowlogVisit(getGlobalSlowlog(), SLOWLOG_ENTRIES, adminSlowlogVisitor, pConn);
+	return adminFlushText(pConn);
+}
+
+static int adminIsPath(const char* request, const char* path) {
+	int length = strlen(path);
+	return (0 == strncmp(request + 4, path, length)) &&
+			((request[4 + length] == ' ') || (request[4 + length] == '?'));
+}
+
+/* 1 while the request is incomplete */
+static int adminParseRequest(adminConnection_t* pConn) {
+	char* request = dataStreamToString(pConn->readStream);
+	int   err     = 0;
+
+	IfTrue(request, WARN, "Error allocating memory");
+	if (!strstr(request, "\r\n\r\n") && !strstr(request, "\n\n")) {
+		err = 1;
+		goto OnSuccess;
+	}
+	pConn->nextGroup = 0;
+	if (0 != strncmp(request, "GET ", 4)) {
+		pConn->nextGroup = statsGroupCount() + 1;
+		err = adminAppendString(pConn, ADMIN_BAD);
+	}else if (adminIsPath(request, "/metrics")) {
+		err = adminAppendString(pConn, ADMIN_OK);
+	}else if (adminIsPath(request, "/slowlog")) {
+		pConn->nextGroup = statsGroupCount() + 1;
+		err = adminAppendSlowlog(pConn);
+	}else {
+		pConn->nextGroup = statsGroupCount() + 1;
+		err = adminAppendString(pConn, ADMIN_NOT_FOUND);
+	}
+	goto OnSuccess;
+OnError:
+	err = -1;
+OnSuccess:
+	if (request) {
+		FREE(request);
+	}
+	return err;
+}
+
+static void adminReadAvailable(connection_t connection) {
+	adminConnection_t* pConn     = connectionGetContext(connection);
+	u_int32_t          bytesRead = 0;
+	int                err       = 0;
+
+	err = connectionRead(connection, pConn->fallocator, pConn->readStream, ADMIN_MAX_REQUEST, &bytesRead);
+	IfTrue(err >= 0, INFO, "Admin connection closed");
+	IfTrue(dataStreamGetSize(pConn->readStream) < ADMIN_MAX_REQUEST, INFO, "Admin request too long");
+	err = adminParseRequest(pConn);
+	IfTrue(err >= 0, INFO, "Error reading admin request");
+	if (err > 0) {
+		connectionWaitForRead(connection, getGlobalEventBase());
+		return;
+	}
+	adminRespond(pConn);
+	return;
+OnError:
+	adminConnectionDelete(pConn);
+}
+
+static void adminWriteAvailable(connection_t connection) {
+	adminRespond(connectionGetContext(connection));
+}
+
+static void adminNewConnection(connection_t connection) {
+	adminConnection_t* pConn = adminConnectionCreate(connection);
+
+	if (pConn) {
+		connectionSetContext(connection, pConn);
+		connectionWaitForRead(connection, getGlobalEventBase());
+	}else {
+		connectionClose(connection);
+	}
+}
+
+admin_t adminCreate(char* ipAddress, u_int16_t port) {
+	adminImpl_t* pAdmin = ALLOCATE_1(adminImpl_t);
+
+	IfTrue(pAdmin, ERR, "Error allocating memory");
+	pAdmin->handler.newConnection   = adminNewConnection;
+	pAdmin->handler.readAvailable   = adminReadAvailable;
+	pAdmin->handler.writeAvailable  = adminWriteAvailable;
+	pAdmin->handler.connectComplete = 0;
+	pAdmin->server = connectionServerCreate(port, ipAddress, &pAdmin->handler);
+	IfTrue(pAdmin->server, ERR, "Error opening admin port %s:%d", ipAddress, port);
+	connectionWaitForRead(pAdmin->server, getGlobalEventBase());
+	goto OnSuccess;
+OnError:
+	if (pAdmin) {
+		adminDelete(pAdmin);
+		pAdmin = 0;
+	}
+OnSuccess:
+	return pAdmin;
+}
+
+void adminDelete(admin_t admin) {
+	adminImpl_t* pAdmin = ADMIN(admin);
+
+	if (pAdmin) {
+		if (pAdmin->server) {
+			connectionClose(pAdmin->server);
+		}
+		FREE(pAdmin);
+	}
+}
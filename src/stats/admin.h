@@ -0,0 +1,31 @@
+#ifndef STATS_ADMIN_H_
+#define STATS_ADMIN_H_
+
+#include "../common/common.h"
+
+/* Admin port serving the server stats over http
+ *
+ *   GET /metrics
+ * answers with every stats group in the OpenMetrics text format, names
+ * prefixed with cacheismo_, counters with the _total suffix and the
+ * histograms with cumulative buckets at a fixed set of le boundaries,
+ * from 1us to 10s, and +Inf.
+ *
+ *   GET /slowlog
+ * answers with the slow requests in plain text, newest first, one line
+ * per request as formatted by slowlogFormat, 404 without a slowlog.
+ *
+ * Any other path gets a 404. The connection is closed after the answer.
+ *
+ * The admin port runs on the event loop of the server. The answer is
+ * rendered one stats group at a time, each written before the next one
+ * is rendered in a later iteration of the loop, so a scrape never holds
+ * up the memcached connections for more than a group.
+ */
+
+typedef void* admin_t;
+
+admin_t    adminCreate(char* ipAddress, u_int16_t port);
+void       adminDelete(admin_t admin);
+
+#endif /* STATS_ADMIN_H_ */
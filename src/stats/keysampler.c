@@ -0,0 +1,203 @@
+#include "keysampler.h"
+#include "../cacheitem/cacheitem.h"
+
+typedef struct {
+	char       key[KEYSAMPLER_MAX_KEY + 1];
+	u_int32_t  keyLength;
+	u_int64_t  value;          //sampled count or bytes
+} sampledKey_t;
+
+/* hot and big are being filled, lastHot and lastBig are reported */
+typedef struct {
+	hashMap_t     hashMap;
+	u_int32_t     lookups;
+	u_int32_t     windowAge;
+	u_int32_t     hotCount;
+	sampledKey_t  hot[KEYSAMPLER_HOT_KEYS];
+	u_int32_t     lastHotCount;
+	sampledKey_t  lastHot[KEYSAMPLER_HOT_KEYS];
+	u_int32_t     cursor;
+	u_int32_t     bigCount;
+	sampledKey_t  big[KEYSAMPLER_BIG_KEYS];
+	u_int32_t     lastBigCount;
+	sampledKey_t  lastBig[KEYSAMPLER_BIG_KEYS];
+} keySamplerImpl_t;
+
+#define KEY_SAMPLER(x) ((keySamplerImpl_t*)(x))
+
+static void sampledKeySet(sampledKey_t* pKey, char* key, u_int32_t keyLength, u_int64_t value) {
+	memcpy(pKey->key, key, keyLength);
+	pKey->key[keyLength] = 0;
+	pKey->keyLength      = keyLength;
+	pKey->value          = value;
+}
+
+static int sampledKeyFind(sampledKey_t* keys, u_int32_t count, char* key, u_int32_t keyLength) {
+	for (u_int32_t i = 0; i < count; i++) {
+		if ((keys[i].keyLength == keyLength) && (0 == memcmp(keys[i].key, key, keyLength))) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int sampledKeyCompare(const void* a, const void* b) {
+	const sampledKey_t* pA = a;
+	const sampledKey_t* pB = b;
+
+	if (pA->value == pB->value) {
+		return 0;
+	}
+	return (pA->value > pB->value) ? -1 : 1;
+}
+
+static void keySamplerCount(keySamplerImpl_t* pSampler, char* key, u_int32_t keyLength) {
+	u_int32_t minIndex = 0;
+
+	if ((++pSampler->lookups & (KEYSAMPLER_SAMPLE_RATE - 1)) ||
+			(keyLength == 0) || (keyLength > KEYSAMPLER_MAX_KEY)) {
+		return;
+	}
+	for (u_int32_t i = 0; i < pSampler->hotCount; i++) {
+		sampledKey_t* pKey = &pSampler->hot[i];
+		if ((pKey->keyLength == keyLength) && (0 == memcmp(pKey->key, key, keyLength))) {
+			pKey->value++;
+			return;
+		}
+		if (pKey->value < pSampler->hot[minIndex].value) {
+			minIndex = i;
+		}
+	}
+	if (pSampler->hotCount < KEYSAMPLER_HOT_KEYS) {
+		sampledKeySet(&pSampler->hot[pSampler->hotCount++], key, keyLength, 1);
+	}else {
+		sampledKeySet(&pSampler->hot[minIndex], key, keyLength, pSampler->hot[minIndex].value + 1);
+	}
+}
+
+static void keySamplerLookupListener(void* context, char* key, u_int32_t keyLength, void* value) {
+	keySamplerCount(KEY_SAMPLER(context), key, keyLength);
+}
+
+static void keySamplerListener(void* context, int event, void* value) {
+	if (event == HASHMAP_EVENT_PUT) {
+		keySamplerCount(KEY_SAMPLER(context), cacheItemGetKey(value), cacheItemGetKeyLength(value));
+	}
+}
+
+/* a key moved by a split is seen again, it keeps one entry */
+static void keySamplerScanVisitor(void* context, void* value) {
+	keySamplerImpl_t* pSampler  = KEY_SAMPLER(context);
+	u_int32_t         size      = cacheItemGetTotalSize(value);
+	u_int32_t         keyLength = cacheItemGetKeyLength(value);
+	u_int32_t         minIndex  = 0;
+	int               index     = 0;
+
+	if (keyLength > KEYSAMPLER_MAX_KEY) {
+		return;
+	}
+	index = sampledKeyFind(pSampler->big, pSampler->bigCount, cacheItemGetKey(value), keyLength);
+	if (index >= 0) {
+		pSampler->big[index].value = size;
+		return;
+	}
+	if (pSampler->bigCount < KEYSAMPLER_BIG_KEYS) {
+		sampledKeySet(&pSampler->big[pSampler->bigCount++], cacheItemGetKey(value), keyLength, size);
+		return;
+	}
+	for (u_int32_t i = 1; i < KEYSAMPLER_BIG_KEYS; i++) {
+		if (pSampler->big[i].value < pSampler->big[minIndex].value) {
+			minIndex = i;
+		}
+	}
+	if (size > pSampler->big[minIndex].value) {
+		sampledKeySet(&pSampler->big[minIndex], cacheItemGetKey(value), keyLength, size);
+	}
+}
+
+keySampler_t keySamplerCreate(hashMap_t hashMap) {
+	keySamplerImpl_t* pSampler = ALLOCATE_1(keySamplerImpl_t);
+
+	IfTrue(pSampler, ERR, "Error allocating memory");
+	pSampler->hashMap = hashMap;
+	IfTrue(0 == hashMapAddListener(hashMap, keySamplerListener, pSampler), ERR,
+			"Error adding hashMap listener");
+	IfTrue(0 == hashMapAddLookupListener(hashMap, keySamplerLookupListener, pSampler), ERR,
+			"Error adding hashMap lookup listener");
+	goto OnSuccess;
+OnError:
+	if (pSampler) {
+		hashMapRemoveListener(hashMap, keySamplerListener, pSampler);
+		FREE(pSampler);
+		pSampler = 0;
+	}
+OnSuccess:
+	return pSampler;
+}
+
+void keySamplerTick(keySampler_t sampler) {
+	keySamplerImpl_t* pSampler = KEY_SAMPLER(sampler);
+	hashMapStats_t    stats;
+	u_int32_t         buckets  = 0;
+
+	if (!pSampler) {
+		return;
+	}
+	if (++pSampler->windowAge >= KEYSAMPLER_WINDOW) {
+		memcpy(pSampler->lastHot, pSampler->hot, pSampler->hotCount * sizeof(sampledKey_t));
+		pSampler->lastHotCount = pSampler->hotCount;
+		qsort(pSampler->lastHot, pSampler->lastHotCount, sizeof(sampledKey_t), sampledKeyCompare);
+		pSampler->hotCount  = 0;
+		pSampler->windowAge = 0;
+	}
+	hashMapGetStats(pSampler->hashMap, &stats);
+	buckets = stats.activeBuckets / KEYSAMPLER_SCAN_SECONDS;
+	if (buckets < KEYSAMPLER_MIN_SCAN_BUCKETS) {
+		buckets = KEYSAMPLER_MIN_SCAN_BUCKETS;
+	}else if (buckets > KEYSAMPLER_MAX_SCAN_BUCKETS) {
+		buckets = KEYSAMPLER_MAX_SCAN_BUCKETS;
+	}
+	pSampler->cursor = hashMapScan(pSampler->hashMap, pSampler->cursor, buckets,
+			keySamplerScanVisitor, pSampler);
+	if (pSampler->cursor == 0) {
+		memcpy(pSampler->lastBig, pSampler->big, pSampler->bigCount * sizeof(sampledKey_t));
+		pSampler->lastBigCount = pSampler->bigCount;
+		qsort(pSampler->lastBig, pSampler->lastBigCount, sizeof(sampledKey_t), sampledKeyCompare);
+		pSampler->bigCount = 0;
+	}
+}
+
+void keySamplerVisitHot(keySampler_t sampler, keySamplerVisitor_t visitor, void* context) {
+	keySamplerImpl_t* pSampler = KEY_SAMPLER(sampler);
+
+	if (pSampler) {
+		for (u_int32_t i = 0; i < pSampler->lastHotCount; i++) {
+			visitor(context, pSampler->lastHot[i].key,
+					(pSampler->lastHot[i].value * KEYSAMPLER_SAMPLE_RATE) / KEYSAMPLER_WINDOW);
+		}
+	}
+}
+
+/* the running scan has the latest sizes, the last one adds the keys
+ * it has not reached yet */
+void keySamplerVisitBig(keySampler_t sampler, keySamplerVisitor_t visitor, void* context) {
+	keySamplerImpl_t* pSampler = KEY_SAMPLER(sampler);
+	sampledKey_t      merged[2 * KEYSAMPLER_BIG_KEYS];
+	u_int32_t         count    = 0;
+
+	if (!pSampler) {
+		return;
+	}
+	memcpy(merged, pSampler->big, pSampler->bigCount * sizeof(sampledKey_t));
+	count = pSampler->bigCount;
+	for (u_int32_t i = 0; i < pSampler->lastBigCount; i++) {
+		sampledKey_t* pKey = &pSampler->lastBig[i];
+		if (sampledKeyFind(pSampler->big, pSampler->bigCount, pKey->key, pKey->keyLength) < 0) {
+			merged[count++] = *pKey;
+		}
+	}
+	qsort(merged, count, sizeof(sampledKey_t), sampledKeyCompare);
+	for (u_int32_t i = 0; (i < count) && (i < KEYSAMPLER_BIG_KEYS); i++) {
+		visitor(context, merged[i].key, merged[i].value);
+	}
+}
@@ -0,0 +1,50 @@
+#ifndef STATS_KEYSAMPLER_H_
+#define STATS_KEYSAMPLER_H_
+
+#include "../common/common.h"
+#include "../hashmap/hashmap.h"
+
+/* Hot keys and big keys
+ *
+ * One in KEYSAMPLER_SAMPLE_RATE lookups and puts of the hashMap is
+ * counted in a space saving sketch of KEYSAMPLER_HOT_KEYS keys: a key
+ * not in the sketch replaces the one with the lowest count and starts
+ * from that count, so a key is never under counted and the error of a
+ * count is at most the count it started from. The sketch starts over
+ * every KEYSAMPLER_WINDOW seconds, the hot keys reported are the ones
+ * of the last complete window, with their estimated requests per
+ * second.
+ *
+ * The big keys come from a scan of the hashMap which keeps the
+ * KEYSAMPLER_BIG_KEYS largest items by cacheItemGetTotalSize. Every
+ * tick scans a 1/KEYSAMPLER_SCAN_SECONDS of the buckets, at least
+ * KEYSAMPLER_MIN_SCAN_BUCKETS and at most KEYSAMPLER_MAX_SCAN_BUCKETS.
+ * The ones reported are the largest of the last complete scan and of
+ * the one running, a key seen by both or seen twice because of a split
+ * during the scan is reported once, with its latest size.
+ *
+ * Keys longer than KEYSAMPLER_MAX_KEY are not counted.
+ */
+
+#define KEYSAMPLER_SAMPLE_RATE        16          //power of two
+#define KEYSAMPLER_HOT_KEYS           64
+#define KEYSAMPLER_BIG_KEYS           16
+#define KEYSAMPLER_WINDOW             10          //seconds
+#define KEYSAMPLER_SCAN_SECONDS       60
+#define KEYSAMPLER_MIN_SCAN_BUCKETS   4096
+#define KEYSAMPLER_MAX_SCAN_BUCKETS   (64 * 1024)
+#define KEYSAMPLER_MAX_KEY            250
+
+typedef void* keySampler_t;
+
+/* value is requests per second for the hot keys, bytes for the big ones */
+typedef void (*keySamplerVisitor_t)(void* context, const char* key, u_int64_t value);
+
+keySampler_t keySamplerCreate(hashMap_t hashMap);
+/* once a second, ends the windows and advances the scan */
+void         keySamplerTick(keySampler_t sampler);
+/* hottest and biggest first */
+void         keySamplerVisitHot(keySampler_t sampler, keySamplerVisitor_t visitor, void* context);
+void         keySamplerVisitBig(keySampler_t sampler, keySamplerVisitor_t visitor, void* context);
+
+#endif /* STATS_KEYSAMPLER_H_ */
@@ -0,0 +1,265 @@
+#include "slowlog.h"
+#include <time.h>
+
+#define SLOWLOG_CALIBRATE_NANOS  1000000
+
+/* first is the id of the oldest entry still shown, ids before it were
+ * reset. Entry id is at entries[id % SLOWLOG_ENTRIES].
+ */
+typedef struct {
+	u_int32_t          thresholdMicros;
+	u_int64_t          thresholdTicks;
+	double             ticksPerMicro;
+	u_int64_t          calibrationTicks;
+	u_int64_t          calibrationNanos;
+	slowlogRequest_t*  pCurrent;
+	int                phase;
+	u_int64_t          phaseStart;
+	u_int64_t          logged;
+	u_int64_t          first;
+	slowlogEntry_t     entries[SLOWLOG_ENTRIES];
+} slowlogImpl_t;
+
+#define SLOWLOG(x) ((slowlogImpl_t*)(x))
+
+static const char* phaseNames[SLOWLOG_PHASES] = {
+	[SLOWLOG_OTHER]   = "other",
+	[SLOWLOG_PARSE]   = "parse",
+	[SLOWLOG_LUA]     = "lua",
+	[SLOWLOG_HASHMAP] = "hashmap",
+	[SLOWLOG_ALLOC]   = "alloc",
+	[SLOWLOG_WRITE]   = "write",
+};
+
+static u_int64_t monotonicNanos(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((u_int64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+u_int64_t slowlogClock(void) {
+	u_int32_t low, high;
+	__asm__ __volatile__ ("rdtsc" : "=a" (low), "=d" (high));
+	return ((u_int64_t)high << 32) | low;
+}
+
+/* ticks per micro second since the start, better with every tick */
+static void slowlogCalibrate(slowlogImpl_t* pLog) {
+	u_int64_t nanos = monotonicNanos() - pLog->calibrationNanos;
+	u_int64_t ticks = slowlogClock() - pLog->calibrationTicks;
+
+	if (nanos > 0) {
+		pLog->ticksPerMicro  = (1000.0 * ticks) / nanos;
+		pLog->thresholdTicks = pLog->thresholdMicros * pLog->ticksPerMicro;
+	}
+}
+
+#else
+
+u_int64_t slowlogClock(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ((u_int64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static void slowlogCalibrate(slowlogImpl_t* pLog) {
+	pLog->ticksPerMicro  = 1000.0;
+	pLog->thresholdTicks = (u_int64_t)pLog->thresholdMicros * 1000;
+}
+
+#endif
+
+static u_int64_t ticksToMicros(slowlogImpl_t* pLog, u_int64_t ticks) {
+	return ticks / pLog->ticksPerMicro;
+}
+
+/* charges the time since the last change to the current phase */
+static u_int64_t slowlogCharge(slowlogImpl_t* pLog) {
+	u_int64_t now = slowlogClock();
+
+	pLog->pCurrent->ticks[pLog->phase] += now - pLog->phaseStart;
+	pLog->phaseStart = now;
+	return now;
+}
+
+slowlog_t slowlogCreate(u_int32_t thresholdMicros) {
+	slowlogImpl_t* pLog = ALLOCATE_1(slowlogImpl_t);
+
+	IfTrue(pLog, ERR, "Error allocating memory");
+	pLog->thresholdMicros  = thresholdMicros;
+	pLog->calibrationTicks = slowlogClock();
+	pLog->calibrationNanos = monotonicNanos();
+	//a first guess, slowlogTick makes it better
+	while ((monotonicNanos() - pLog->calibrationNanos) < SLOWLOG_CALIBRATE_NANOS) {
+	}
+	slowlogCalibrate(pLog);
+OnError:
+	return pLog;
+}
+
+void slowlogDelete(slowlog_t slowlog) {
+	if (slowlog) {
+		FREE(slowlog);
+	}
+}
+
+void slowlogTick(slowlog_t slowlog) {
+	if (slowlog) {
+		slowlogCalibrate(SLOWLOG(slowlog));
+	}
+}
+
+void slowlogBegin(slowlog_t slowlog, slowlogRequest_t* pRequest, u_int64_t start) {
+	slowlogImpl_t* pLog = SLOWLOG(slowlog);
+	u_int64_t      now  = 0;
+
+	if (!pLog) {
+		return;
+	}
+	now = slowlogClock();
+	memset(pRequest->ticks, 0, sizeof(pRequest->ticks));
+	pRequest->start                = start;
+	pRequest->ticks[SLOWLOG_PARSE] = now - start;
+	pRequest->command              = 0;
+	pRequest->key[0]               = 0;
+	pLog->pCurrent   = pRequest;
+	pLog->phase      = SLOWLOG_OTHER;
+	pLog->phaseStart = now;
+}
+
+void slowlogSuspend(slowlog_t slowlog, slowlogRequest_t* pRequest) {
+	slowlogImpl_t* pLog = SLOWLOG(slowlog);
+
+	if (pLog && (pLog->pCurrent == pRequest)) {
+		slowlogCharge(pLog);
+		pLog->pCurrent = 0;
+	}
+}
+
+void slowlogResume(slowlog_t slowlog, slowlogRequest_t* pRequest) {
+	slowlogImpl_t* pLog = SLOWLOG(slowlog);
+
+	if (pLog && pRequest->start) {
+		pLog->pCurrent   = pRequest;
+		pLog->phase      = SLOWLOG_OTHER;
+		pLog->phaseStart = slowlogClock();
+	}
+}
+
+void slowlogSetCommand(slowlog_t slowlog, slowlogRequest_t* pRequest, const char* command,
+		char* key, u_int32_t keyLength) {
+	if (slowlog && pRequest->start) {
+		if (keyLength > SLOWLOG_MAX_KEY) {
+			keyLength = SLOWLOG_MAX_KEY;
+		}
+		pRequest->command = command;
+		if (key) {
+			memcpy(pRequest->key, key, keyLength);
+			pRequest->key[keyLength] = 0;
+		}
+	}
+}
+
+void slowlogEnd(slowlog_t slowlog, slowlogRequest_t* pRequest) {
+	slowlogImpl_t*  pLog   = SLOWLOG(slowlog);
+	slowlogEntry_t* pEntry = 0;
+	u_int64_t       now    = 0;
+	u_int64_t       total  = 0;
+	u_int64_t       phases = 0;
+
+	if (!pLog || !pRequest->start) {
+		return;
+	}
+	if (pLog->pCurrent == pRequest) {
+		now = slowlogCharge(pLog);
+		pLog->pCurrent = 0;
+	}else {
+		now = slowlogClock();
+	}
+	total = now - pRequest->start;
+	pRequest->start = 0;
+	if (total < pLog->thresholdTicks) {
+		return;
+	}
+
+	pEntry = &pLog->entries[pLog->logged % SLOWLOG_ENTRIES];
+	pEntry->id          = pLog->logged++;
+	pEntry->time        = time(0);
+	pEntry->command     = pRequest->command;
+	pEntry->totalMicros = ticksToMicros(pLog, total);
+	memcpy(pEntry->key, pRequest->key, sizeof(pEntry->key));
+	for (int i = SLOWLOG_PARSE; i < SLOWLOG_PHASES; i++) {
+		pEntry->micros[i] = ticksToMicros(pLog, pRequest->ticks[i]);
+		phases += pRequest->ticks[i];
+	}
+	//other includes the time the request was suspended
+	pEntry->micros[SLOWLOG_OTHER] = (total > phases) ? ticksToMicros(pLog, total - phases) : 0;
+}
+
+int slowlogEnter(slowlog_t slowlog, int phase) {
+	slowlogImpl_t* pLog     = SLOWLOG(slowlog);
+	int            previous = SLOWLOG_OTHER;
+
+	if (pLog && pLog->pCurrent) {
+		slowlogCharge(pLog);
+		previous    = pLog->phase;
+		pLog->phase = phase;
+	}
+	return previous;
+}
+
+void slowlogLeave(slowlog_t slowlog, int previous) {
+	slowlogImpl_t* pLog = SLOWLOG(slowlog);
+
+	if (pLog && pLog->pCurrent) {
+		slowlogCharge(pLog);
+		pLog->phase = previous;
+	}
+}
+
+u_int32_t slowlogThreshold(slowlog_t slowlog) {
+	return slowlog ? SLOWLOG(slowlog)->thresholdMicros : 0;
+}
+
+u_int64_t slowlogLogged(slowlog_t slowlog) {
+	return slowlog ? SLOWLOG(slowlog)->logged : 0;
+}
+
+void slowlogVisit(slowlog_t slowlog, u_int32_t count, slowlogVisitor_t visitor, void* context) {
+	slowlogImpl_t* pLog  = SLOWLOG(slowlog);
+	u_int64_t      first = 0;
+
+	if (!pLog) {
+		return;
+	}
+	first = pLog->first;
+	if (pLog->logged - first > SLOWLOG_ENTRIES) {
+		first = pLog->logged - SLOWLOG_ENTRIES;
+	}
+	for (u_int64_t id = pLog->logged; (id > first) && (count > 0); id--, count--) {
+		visitor(context, &pLog->entries[(id - 1) % SLOWLOG_ENTRIES]);
+	}
+}
+
+void slowlogReset(slowlog_t slowlog) {
+	if (slowlog) {
+		SLOWLOG(slowlog)->first = SLOWLOG(slowlog)->logged;
+	}
+}
+
+int slowlogFormat(slowlogEntry_t* pEntry, char* buffer, int size) {
+	int length = snprintf(buffer, size, "%llu %llu %s %s total=%llu",
+			(unsigned long long)pEntry->id, (unsigned long long)pEntry->time,
+			pEntry->command ? pEntry->command : "-", pEntry->key[0] ? pEntry->key : "-",
+			(unsigned long long)pEntry->totalMicros);
+
+	for (int i = SLOWLOG_PARSE; (i <= SLOWLOG_PHASES) && (length < size); i++) {
+		//other goes last
+		int phase = (i == SLOWLOG_PHASES) ? SLOWLOG_OTHER : i;
+		length += snprintf(buffer + length, size - length, " %s=%llu", phaseNames[phase],
+				(unsigned long long)pEntry->micros[phase]);
+	}
+	return (length < size) ? length : size - 1;
+}
@@ -0,0 +1,100 @@
+#ifndef STATS_SLOWLOG_H_
+#define STATS_SLOWLOG_H_
+
+#include "../common/common.h"
+
+/* Slow requests
+ *
+ * Every request is timed from its parse to the first write of its
+ * answer. The ones taking at least the threshold are kept in a ring of
+ * the last SLOWLOG_ENTRIES, with the time spent in each phase:
+ *
+ *   parse    requestParserParse for the complete command
+ *   lua      the scripts, without the phases below they call
+ *   hashmap  lookups, puts and deletes made by the scripts
+ *   alloc    creating items, including the evictions to make room
+ *   write    writing the answer to the socket
+ *   other    the rest, waiting for other servers in cluster mode and
+ *            the scripts resumed after that included
+ *
+ * The phases don't overlap, slowlogEnter charges the time so far to the
+ * phase being left. The timer work between requests, expiry and
+ * chunkpoolGC, is timed the same way and logged as command timer.
+ *
+ * The clock is the time stamp counter where there is one, calibrated
+ * against CLOCK_MONOTONIC once a tick, else CLOCK_MONOTONIC_COARSE.
+ * Taking the time costs tens of cycles either way. With no slowlog, the
+ * slowlog_t is 0 and every call returns at once.
+ */
+
+#define SLOWLOG_ENTRIES  128
+#define SLOWLOG_MAX_KEY  64        //longer keys are cut
+#define SLOWLOG_LINE     256       //enough for a formatted entry
+
+enum slowlogPhase_t {
+	SLOWLOG_OTHER = 0,
+	SLOWLOG_PARSE,
+	SLOWLOG_LUA,
+	SLOWLOG_HASHMAP,
+	SLOWLOG_ALLOC,
+	SLOWLOG_WRITE,
+	SLOWLOG_PHASES
+};
+
+typedef void* slowlog_t;
+
+/* One per connection, the request being timed. start is 0 when there
+ * is none.
+ */
+typedef struct {
+	u_int64_t    start;
+	u_int64_t    ticks[SLOWLOG_PHASES];
+	const char*  command;
+	char         key[SLOWLOG_MAX_KEY + 1];
+} slowlogRequest_t;
+
+typedef struct {
+	u_int64_t    id;
+	u_int64_t    time;                   //wall clock seconds
+	const char*  command;
+	char         key[SLOWLOG_MAX_KEY + 1];
+	u_int64_t    totalMicros;
+	u_int64_t    micros[SLOWLOG_PHASES];
+} slowlogEntry_t;
+
+typedef void (*slowlogVisitor_t)(void* context, slowlogEntry_t* pEntry);
+
+slowlog_t   slowlogCreate(u_int32_t thresholdMicros);
+void        slowlogDelete(slowlog_t slowlog);
+u_int64_t   slowlogClock(void);
+/* once a second, recalibrates the clock */
+void        slowlogTick(slowlog_t slowlog);
+
+/* pRequest is timed from start, a slowlogClock() taken before the
+ * parse, and becomes the current request. Suspend stops charging time
+ * to it while it waits, Resume makes it current again, End logs it if
+ * it was slow. Suspend and End of a request that is not current or
+ * already ended do nothing.
+ */
+void        slowlogBegin(slowlog_t slowlog, slowlogRequest_t* pRequest, u_int64_t start);
+void        slowlogSuspend(slowlog_t slowlog, slowlogRequest_t* pRequest);
+void        slowlogResume(slowlog_t slowlog, slowlogRequest_t* pRequest);
+void        slowlogSetCommand(slowlog_t slowlog, slowlogRequest_t* pRequest, const char* command,
+		                      char* key, u_int32_t keyLength);
+void        slowlogEnd(slowlog_t slowlog, slowlogRequest_t* pRequest);
+
+/* enter returns the phase to give back to leave */
+int         slowlogEnter(slowlog_t slowlog, int phase);
+void        slowlogLeave(slowlog_t slowlog, int previous);
+
+u_int32_t   slowlogThreshold(slowlog_t slowlog);
+/* entries logged since the start, including those no longer in the ring */
+u_int64_t   slowlogLogged(slowlog_t slowlog);
+/* the count newest entries, newest first */
+void        slowlogVisit(slowlog_t slowlog, u_int32_t count, slowlogVisitor_t visitor, void* context);
+void        slowlogReset(slowlog_t slowlog);
+/* "id time command key total=us parse=us lua=us hashmap=us alloc=us
+ * write=us other=us", - for no key. Returns the length. */
+int         slowlogFormat(slowlogEntry_t* pEntry, char* buffer, int size);
+
+#endif /* STATS_SLOWLOG_H_ */
@@ -0,0 +1,364 @@
+#include "stats.h"
+#include "../hashmap/hashmap.h"
+#include "../chunkpool/chunkpool.h"
+#include "../fallocator/fallocator.h"
+#include "../cacheismo.h"
+#include <time.h>
+
+serverStats_t serverStats;
+
+static const char* commandNames[STATS_MAX_COMMAND] = {
+	[COMMAND_GET]       = "get",
+	[COMMAND_BGET]      = "bget",
+	[COMMAND_ADD]       = "add",
+	[COMMAND_SET]       = "set",
+	[COMMAND_REPLACE]   = "replace",
+	[COMMAND_PREPEND]   = "prepend",
+	[COMMAND_APPEND]    = "append",
+	[COMMAND_CAS]       = "cas",
+	[COMMAND_INCR]      = "incr",
+	[COMMAND_DECR]      = "decr",
+	[COMMAND_GETS]      = "gets",
+	[COMMAND_DELETE]    = "delete",
+	[COMMAND_STATS]     = "stats",
+	[COMMAND_FLUSH_ALL] = "flush_all",
+	[COMMAND_VERSION]   = "version",
+	[COMMAND_QUIT]      = "quit",
+	[COMMAND_VERBOSITY] = "verbosity",
+	[COMMAND_RELOAD]    = "reload",
+	[COMMAND_LGET]      = "lget",
+	[COMMAND_LADD]      = "ladd",
+	[COMMAND_LDELETE]   = "ldelete",
+	[COMMAND_RING]      = "ring",
+	[COMMAND_GOSSIP]    = "gossip",
+	[COMMAND_SNAPSHOT]  = "snapshot",
+	[COMMAND_SLOWLOG]   = "slowlog",
+	[COMMAND_NEARSET]   = "nearset",
+	[COMMAND_NEARDELETE] = "neardelete",
+};
+
+typedef struct {
+	statsVisitor_t visitor;
+	void*          context;
+	int            count;
+	char           label[16];
+	int            pass;
+} statsWalk_t;
+
+typedef void (*statsGroupVisitor_t)(statsWalk_t* pWalk);
+
+static void emitLabeled(statsWalk_t* pWalk, const char* name, const char* help, int type,
+		const char* labelName, const char* labelValue, double value, hdrHistogram_t* histogram) {
+	statsMetric_t metric;
+
+	metric.name       = name;
+	metric.help       = help;
+	metric.type       = type;
+	metric.labelName  = labelName;
+	metric.labelValue = labelValue;
+	metric.value      = value;
+	metric.histogram  = histogram;
+	pWalk->visitor(pWalk->context, &metric);
+	pWalk->count++;
+}
+
+static void emit(statsWalk_t* pWalk, const char* name, const char* help, int type, double value) {
+	emitLabeled(pWalk, name, help, type, 0, 0, value, 0);
+}
+
+static void visitServer(statsWalk_t* pWalk) {
+	emit(pWalk, "uptime_seconds", "Seconds since start", STATS_GAUGE,
+			(double)(time(0) - serverStats.startTime));
+	emit(pWalk, "connections", "Client connections accepted", STATS_COUNTER,
+			serverStats.connections);
+	emit(pWalk, "current_connections", "Client connections open", STATS_GAUGE,
+			serverStats.currentConnections);
+	emit(pWalk, "bytes_read", "Bytes read from clients", STATS_COUNTER, serverStats.bytesRead);
+	emit(pWalk, "bytes_written", "Bytes written to clients", STATS_COUNTER,
+			serverStats.bytesWritten);
+}
+
+static void visitCommands(statsWalk_t* pWalk) {
+	for (int i = 0; i < STATS_MAX_COMMAND; i++) {
+		if (commandNames[i] && serverStats.commands[i]) {
+			emitLabeled(pWalk, "cmd", "Commands processed", STATS_COUNTER, "command",
+					commandNames[i], serverStats.commands[i], 0);
+		}
+	}
+	for (int i = 0; i < STATS_MAX_COMMAND; i++) {
+		if (commandNames[i] && serverStats.commands[i]) {
+			emitLabeled(pWalk, "cmd_latency_us", "Micro seconds from parsed to answered",
+					STATS_HISTOGRAM, "command", commandNames[i], 0, &serverStats.latency[i]);
+		}
+	}
+}
+
+static void visitHashMap(statsWalk_t* pWalk) {
+	hashMapStats_t stats;
+
+	hashMapGetStats(getGlobalHashMap(), &stats);
+	emit(pWalk, "hashmap_items", "Items in the hashMap", STATS_GAUGE, stats.count);
+	emit(pWalk, "hashmap_buckets", "Buckets allocated", STATS_GAUGE, stats.buckets);
+	emit(pWalk, "hashmap_active_buckets", "Buckets in use", STATS_GAUGE, stats.activeBuckets);
+	emit(pWalk, "hashmap_load_factor_percent", "Items per bucket in use, in percent", STATS_GAUGE,
+			stats.activeBuckets ? ((100.0 * stats.count) / stats.activeBuckets) : 0);
+	emit(pWalk, "hashmap_split_at", "Next bucket to split in this round", STATS_GAUGE, stats.splitAt);
+	emit(pWalk, "hashmap_split_round", "Buckets to split in this round", STATS_GAUGE, stats.maxSplit);
+	emit(pWalk, "hashmap_hits", "Lookups that found a live item", STATS_COUNTER, stats.hits);
+	emit(pWalk, "hashmap_misses", "Lookups that found nothing", STATS_COUNTER, stats.misses);
+	emit(pWalk, "hashmap_expired", "Items removed once expired", STATS_COUNTER, stats.expired);
+	emit(pWalk, "hashmap_evicted", "Items evicted for memory", STATS_COUNTER, stats.evicted);
+}
+
+/* the slabs and the servers are walked once per metric, so the values
+ * of a metric come one after the other */
+static void slabVisitor(void* context, u_int32_t slabSize, u_int32_t freeCount) {
+	statsWalk_t* pWalk = context;
+
+	snprintf(pWalk->label, sizeof(pWalk->label), "%u", slabSize);
+	if (pWalk->pass == 0) {
+		emitLabeled(pWalk, "slab_free_chunks", "Free chunks of the slab size", STATS_GAUGE, "slab",
+				pWalk->label, freeCount, 0);
+	}else {
+		emitLabeled(pWalk, "slab_free_bytes", "Free bytes in chunks of the slab size", STATS_GAUGE,
+				"slab", pWalk->label, (double)freeCount * slabSize, 0);
+	}
+}
+
+static void visitMemory(statsWalk_t* pWalk) {
+	chunkpoolStats_t stats;
+
+	chunkpoolGetStats(getGlobalChunkpool(), &stats);
+	emit(pWalk, "memory_bytes", "Item memory", STATS_GAUGE, stats.totalBytes);
+	emit(pWalk, "memory_used_bytes", "Item memory in use", STATS_GAUGE,
+			stats.totalBytes - stats.freeBytes);
+	emit(pWalk, "memory_free_bytes", "Item memory free", STATS_GAUGE, stats.freeBytes);
+	emit(pWalk, "memory_free_chunks", "Free chunks of any size", STATS_GAUGE, stats.freeChunks);
+	/* free memory not in whole pages can't hold the larger items */
+	emit(pWalk, "memory_fragmentation_percent", "Free memory in chunks smaller than a page",
+			STATS_GAUGE, stats.freeBytes ?
+					((100.0 * (stats.freeBytes - stats.freePageBytes)) / stats.freeBytes) : 0);
+	for (pWalk->pass = 0; pWalk->pass < 2; pWalk->pass++) {
+		chunkpoolVisitSlabs(getGlobalChunkpool(), slabVisitor, pWalk);
+	}
+}
+
+static void visitFallocator(statsWalk_t* pWalk) {
+	fallocatorStats_t stats;
+
+	fallocatorGetStats(&stats);
+	emit(pWalk, "io_buffer_bytes", "Size of the cached io buffers", STATS_GAUGE, stats.bufferSize);
+	emit(pWalk, "io_buffers_free", "Io buffers in the cache", STATS_GAUGE, stats.freeBuffers);
+	emit(pWalk, "io_buffers_max", "Io buffers the cache keeps at most", STATS_GAUGE,
+			stats.maxFreeBuffers);
+	emit(pWalk, "io_buffer_hits", "Io buffers taken from the cache", STATS_COUNTER, stats.hits);
+	emit(pWalk, "io_buffer_misses", "Io buffers malloced for an empty cache", STATS_COUNTER,
+			stats.misses);
+}
+
+static void visitLua(statsWalk_t* pWalk) {
+	luaAllocatorStats_t stats;
+
+	memset(&stats, 0, sizeof(stats));
+	if (getGlobalLuaAllocator()) {
+		luaAllocatorGetStats(getGlobalLuaAllocator(), &stats);
+	}
+	emit(pWalk, "lua_memory_used", "Bytes used by the scripts", STATS_GAUGE, stats.used);
+	emit(pWalk, "lua_memory_peak", "Most bytes ever used by the scripts", STATS_GAUGE, stats.peak);
+	emit(pWalk, "lua_memory_limit", "Bytes the scripts may use, 0 for no limit", STATS_GAUGE,
+			stats.limit);
+	emit(pWalk, "lua_memory_failures", "Allocations failed over the limit", STATS_COUNTER,
+			stats.failures);
+	emit(pWalk, "lua_memory_slab_bytes", "Bytes in slabs for small blocks", STATS_GAUGE,
+			stats.slabBytes);
+	emit(pWalk, "lua_memory_large_bytes", "Bytes in blocks too large for the slabs", STATS_GAUGE,
+			stats.largeBytes);
+}
+
+static void serverVisitor(void* context, const char* server, int available,
+		u_int32_t connections, u_int32_t queued) {
+	statsWalk_t* pWalk = context;
+
+	switch (pWalk->pass) {
+	case 0:
+		emitLabeled(pWalk, "cluster_server_up", "1 if the server is available", STATS_GAUGE,
+				"server", server, available ? 1 : 0, 0);
+		break;
+	case 1:
+		emitLabeled(pWalk, "cluster_server_connections", "Connections open to the server",
+				STATS_GAUGE, "server", server, connections, 0);
+		break;
+	default:
+		emitLabeled(pWalk, "cluster_server_queued", "Requests waiting for a connection",
+				STATS_GAUGE, "server", server, queued, 0);
+		break;
+	}
+}
+
+static void visitCluster(statsWalk_t* pWalk) {
+	for (pWalk->pass = 0; pWalk->pass < 3; pWalk->pass++) {
+		clusterMapVisitServers(getGlobalClusterMap(), serverVisitor, pWalk);
+	}
+}
+
+static void visitMembership(statsWalk_t* pWalk) {
+	membershipStats_t stats;
+
+	if (!getGlobalMembership()) {
+		return;
+	}
+	membershipGetStats(getGlobalMembership(), &stats);
+	emit(pWalk, "members_known", "Members known by gossip, alive or dead", STATS_GAUGE,
+			stats.members);
+	emit(pWalk, "members_alive", "Members alive, this server included", STATS_GAUGE, stats.alive);
+	emit(pWalk, "members_version", "Changes of the alive members", STATS_COUNTER, stats.version);
+	emit(pWalk, "members_settled_ms", "Milli seconds from start to the last change", STATS_GAUGE,
+			stats.settledMillis);
+	emit(pWalk, "gossip_interval_ms", "Milli seconds between gossip rounds", STATS_GAUGE,
+			stats.intervalMillis);
+	emit(pWalk, "gossip_rounds", "Gossip rounds", STATS_COUNTER, stats.rounds);
+	emit(pWalk, "gossip_sent", "Member lists sent", STATS_COUNTER, stats.sent);
+	emit(pWalk, "gossip_failed", "Member lists not answered", STATS_COUNTER, stats.failed);
+	emit(pWalk, "gossip_received", "Member lists merged from requests", STATS_COUNTER,
+			stats.received);
+}
+
+static void accountVisitor(void* context, accountStats_t* pStats) {
+	statsWalk_t* pWalk  = context;
+	const char*  prefix = pStats->prefix;
+
+	switch (pWalk->pass) {
+	case 0:
+		emitLabeled(pWalk, "account_items", "Items with the key prefix", STATS_GAUGE,
+				"prefix", prefix, pStats->items, 0);
+		break;
+	case 1:
+		emitLabeled(pWalk, "account_bytes", "Bytes of the items with the key prefix", STATS_GAUGE,
+				"prefix", prefix, pStats->bytes, 0);
+		break;
+	case 2:
+		emitLabeled(pWalk, "account_ops", "Keys of the commands answered", STATS_COUNTER,
+				"prefix", prefix, pStats->ops, 0);
+		break;
+	case 3:
+		emitLabeled(pWalk, "account_ops_per_sec", "Keys of the commands in the last second",
+				STATS_GAUGE, "prefix", prefix, pStats->opsPerSecond, 0);
+		break;
+	case 4:
+		emitLabeled(pWalk, "account_gets", "Lookups in the hashMap", STATS_COUNTER,
+				"prefix", prefix, pStats->gets, 0);
+		break;
+	case 5:
+		emitLabeled(pWalk, "account_hits", "Lookups which found a live item", STATS_COUNTER,
+				"prefix", prefix, pStats->hits, 0);
+		break;
+	case 6:
+		emitLabeled(pWalk, "account_hit_ratio_percent", "Lookups which found a live item, in percent",
+				STATS_GAUGE, "prefix", prefix,
+				pStats->gets ? ((100.0 * pStats->hits) / pStats->gets) : 0, 0);
+		break;
+	default:
+		emitLabeled(pWalk, "account_lua_us", "Micro seconds the scripts ran", STATS_COUNTER,
+				"prefix", prefix, pStats->luaMicros, 0);
+		break;
+	}
+}
+
+static void visitAccounting(statsWalk_t* pWalk) {
+	for (pWalk->pass = 0; pWalk->pass < 8; pWalk->pass++) {
+		accountingVisit(getGlobalAccounting(), accountVisitor, pWalk);
+	}
+}
+
+static void hotKeyVisitor(void* context, const char* key, u_int64_t value) {
+	emitLabeled(context, "hotkey_requests_per_sec", "Estimated lookups and puts of the key",
+			STATS_GAUGE, "key", key, value, 0);
+}
+
+static void visitHotKeys(statsWalk_t* pWalk) {
+	keySamplerVisitHot(getGlobalKeySampler(), hotKeyVisitor, pWalk);
+}
+
+static void bigKeyVisitor(void* context, const char* key, u_int64_t value) {
+	emitLabeled(context, "bigkey_bytes", "Bytes of the item", STATS_GAUGE, "key", key, value, 0);
+}
+
+static void visitBigKeys(statsWalk_t* pWalk) {
+	keySamplerVisitBig(getGlobalKeySampler(), bigKeyVisitor, pWalk);
+}
+
+static void visitSlowlog(statsWalk_t* pWalk) {
+	if (!getGlobalSlowlog()) {
+		return;
+	}
+	emit(pWalk, "slowlog_threshold_us", "Micro seconds from which a request is logged",
+			STATS_GAUGE, slowlogThreshold(getGlobalSlowlog()));
+	emit(pWalk, "slowlog_logged", "Slow requests logged", STATS_COUNTER,
+			slowlogLogged(getGlobalSlowlog()));
+}
+
+static const struct {
+	const char*         name;
+	statsGroupVisitor_t visit;
+} statsGroups[] = {
+	{ "server",     visitServer     },
+	{ "commands",   visitCommands   },
+	{ "hashmap",    visitHashMap    },
+	{ "memory",     visitMemory     },
+	{ "fallocator", visitFallocator },
+	{ "lua",        visitLua        },
+	{ "cluster",    visitCluster    },
+	{ "membership", visitMembership },
+	{ "accounting", visitAccounting },
+	{ "hotkeys",    visitHotKeys    },
+	{ "bigkeys",    visitBigKeys    },
+	{ "slowlog",    visitSlowlog    },
+};
+
+#define STATS_GROUPS ((int)(sizeof(statsGroups)/sizeof(statsGroups[0])))
+
+void statsInit(void) {
+	memset(&serverStats, 0, sizeof(serverStats));
+	serverStats.startTime = time(0);
+}
+
+u_int64_t statsNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((u_int64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+void statsCommandDone(enum commands_enum_t command, u_int64_t startMicros) {
+	if ((u_int32_t)command < STATS_MAX_COMMAND) {
+		serverStats.commands[command]++;
+		hdrHistogramAdd(&serverStats.latency[command], statsNow() - startMicros);
+	}
+}
+
+const char* statsCommandName(enum commands_enum_t command) {
+	return ((u_int32_t)command < STATS_MAX_COMMAND) ? commandNames[command] : 0;
+}
+
+int statsGroupCount(void) {
+	return STATS_GROUPS;
+}
+
+const char* statsGroupName(int group) {
+	return ((group >= 0) && (group < STATS_GROUPS)) ? statsGroups[group].name : 0;
+}
+
+int statsVisit(const char* group, statsVisitor_t visitor, void* context) {
+	statsWalk_t walk;
+	int         found = 0;
+
+	memset(&walk, 0, sizeof(walk));
+	walk.visitor = visitor;
+	walk.context = context;
+	for (int i = 0; i < STATS_GROUPS; i++) {
+		if (!group || (0 == strcmp(group, statsGroups[i].name))) {
+			statsGroups[i].visit(&walk);
+			found = 1;
+		}
+	}
+	return found ? walk.count : -1;
+}
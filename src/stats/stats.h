@@ -0,0 +1,69 @@
+#ifndef STATS_STATS_H_
+#define STATS_STATS_H_
+
+#include "../common/common.h"
+#include "../common/commands.h"
+#include "../common/hdrhistogram.h"
+
+/* Server statistics
+ *
+ * The counters of the request path live in serverStats and are bumped
+ * in place, the server has a single thread so there is nothing to
+ * share or lock. Everything else is read from the modules (hashMap,
+ * chunkpool, fallocator, lua, clusterMap, membership, accounting, the
+ * key sampler, the slowlog) when the stats are rendered.
+ *
+ * statsVisit walks the metrics of a group in a fixed order and hands
+ * each one to the visitor, so the stats command and other renderers
+ * share the walk and only differ in the output. Metrics with a label
+ * come once per value of the label, a command, a slab size, a server,
+ * a key prefix or a key. The values of a metric are never mixed with other
+ * metrics.
+ */
+
+#define STATS_MAX_COMMAND  32
+
+enum statsType_t {
+	STATS_COUNTER = 1,
+	STATS_GAUGE,
+	STATS_HISTOGRAM
+};
+
+typedef struct {
+	const char*     name;
+	const char*     help;
+	int             type;
+	const char*     labelName;    //0 if the metric has no label
+	const char*     labelValue;
+	double          value;        //not for histograms
+	hdrHistogram_t* histogram;    //only for histograms
+} statsMetric_t;
+
+typedef void (*statsVisitor_t)(void* context, statsMetric_t* pMetric);
+
+typedef struct {
+	u_int64_t       startTime;    //wall clock seconds
+	u_int64_t       connections;  //accepted
+	u_int64_t       currentConnections;
+	u_int64_t       bytesRead;
+	u_int64_t       bytesWritten;
+	u_int64_t       commands[STATS_MAX_COMMAND];
+	hdrHistogram_t  latency[STATS_MAX_COMMAND];  //micro seconds, parsed to answered
+} serverStats_t;
+
+extern serverStats_t serverStats;
+
+void        statsInit(void);
+/* micro seconds on the monotonic clock, for statsCommandDone */
+u_int64_t   statsNow(void);
+void        statsCommandDone(enum commands_enum_t command, u_int64_t startMicros);
+/* 0 for an unknown command */
+const char* statsCommandName(enum commands_enum_t command);
+/* number of groups and their names, for renderers going one group at a time */
+int         statsGroupCount(void);
+const char* statsGroupName(int group);
+/* group 0 visits every group, returns the number of metrics visited,
+ * -1 for an unknown group */
+int         statsVisit(const char* group, statsVisitor_t visitor, void* context);
+
+#endif /* STATS_STATS_H_ */
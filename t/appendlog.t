@@ -0,0 +1,42 @@
+#!/usr/bin/perl
+# Scripted objects written to the append log come back when the server
+# restarts with the same -A file.
+
+use strict;
+use warnings;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use Digest::MD5 qw(md5_hex);
+use File::Temp qw(tempdir);
+use Test::More tests => 5;
+use CacheismoTest;
+
+my $dir     = tempdir(CLEANUP => 1);
+my $file    = "$dir/cacheismo.aof";
+my $entries = 1000;
+# values that don't compress, so the object is well over 64KB
+sub value { my $i = shift; return join('', map { md5_hex("$i-$_") } 1 .. 6); }
+
+my $server = new_server('-e', '-A', $file, '-S', '0');
+my $sock   = $server->sock;
+mem_get($sock, 'map:new:small');
+mem_get($sock, 'map:put:small:k:hello');
+mem_get($sock, 'map:new:big');
+my $stored = 0;
+for my $i (1 .. $entries) {
+    $stored++ if (mem_get($sock, "map:put:big:k$i:" . value($i)) // '') eq 'SUCCESS';
+}
+is($stored, $entries, 'entries stored');
+my $length = length(mem_get($sock, 'map$big') // '');
+cmp_ok($length, '>', 65536, 'object is over 64KB');
+$server->stop();
+
+$server = start_server($server->port, '-e', '-A', $file, '-S', '0');
+$sock   = $server->sock;
+is(mem_get($sock, 'map:get:small:k'), 'k : hello', 'small object survives restart');
+is(length(mem_get($sock, 'map$big') // ''), $length, 'object over 64KB survives restart');
+my $good = 0;
+for my $i (1 .. $entries) {
+    $good++ if (mem_get($sock, "map:get:big:k$i") // '') eq "k$i : " . value($i);
+}
+is($good, $entries, 'entries of object over 64KB survive restart');
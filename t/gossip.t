@@ -0,0 +1,38 @@
+#!/usr/bin/perl
+# Starts GOSSIP_NODES (default 3) servers on 127.0.0.1 seeded with the
+# first one and reports how long the members took to settle on each.
+# GOSSIP_INTERVAL_MS is passed as -G (default 1000).
+
+use strict;
+use warnings;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use Test::More tests => 2;
+use Time::HiRes qw(sleep);
+use CacheismoTest;
+
+my $nodes    = $ENV{GOSSIP_NODES} || 3;
+my $interval = $ENV{GOSSIP_INTERVAL_MS} || 1000;
+my @ports    = map { free_port() } 1 .. $nodes;
+my $seed     = "127.0.0.1:$ports[0]";
+my @servers  = map { start_server($_, '-x', "127.0.0.1:$_", '-g', $seed, '-G', $interval) } @ports;
+my @socks    = map { $_->sock } @servers;
+
+ok(wait_for(10 + $nodes * $interval / 100, sub {
+    return !grep { (mem_stats($_, 'membership')->{members_alive} // 0) != $nodes } @socks;
+}), "all $nodes members alive on every server");
+
+# settled is when the alive members last changed, after MEMBERSHIP_SETTLE_ROUNDS
+# without news. Done once every server has all of them and nothing changed
+# for 5 more rounds.
+my @settled;
+ok(wait_for(10 + $nodes * $interval / 50, sub {
+    my @stats = map { mem_stats($_, 'membership') } @socks;
+    return 0 if grep { ($_->{members_alive} != $nodes) || !$_->{members_version} } @stats;
+    my $before = join(',', map { $_->{members_settled_ms} } @stats);
+    sleep(5 * $interval / 1000);
+    @settled = map { mem_stats($_, 'membership')->{members_settled_ms} } @socks;
+    return join(',', @settled) eq $before;
+}), 'members settled');
+my @sorted = sort { $a <=> $b } @settled;
+diag("nodes=$nodes gossip_interval_ms=$interval members_settled_ms min=$sorted[0] max=$sorted[-1]");
@@ -0,0 +1,143 @@
+package CacheismoTest;
+
+# Starts cacheismo servers on 127.0.0.1 for the tests in t/. The binary
+# is src/cacheismo of the build directory, or $ENV{CACHEISMO}. Server
+# output goes to /dev/null unless CACHEISMO_VERBOSE is set.
+
+use strict;
+use warnings;
+use Exporter 'import';
+use IO::Socket::INET;
+use POSIX ":sys_wait_h";
+use Time::HiRes qw(sleep time);
+
+our @EXPORT = qw(free_port new_server start_server mem_get mem_set mem_stats wait_for);
+
+my $srcdir   = $ENV{srcdir}   || '.';
+my $builddir = $ENV{builddir} || '.';
+my $binary   = $ENV{CACHEISMO} || "$builddir/src/cacheismo";
+
+sub free_port {
+    my $sock = IO::Socket::INET->new(LocalAddr => '127.0.0.1', LocalPort => 0,
+                                     Proto => 'tcp', Listen => 1, ReuseAddr => 1)
+        or die "No free port: $!";
+    my $port = $sock->sockport;
+    close($sock);
+    return $port;
+}
+
+# new_server(@args) runs the server on a free port with the extra args
+sub new_server {
+    return start_server(free_port(), @_);
+}
+
+sub start_server {
+    my ($port, @args) = @_;
+    my $pid = fork();
+    die "Can't fork: $!" unless defined $pid;
+    if ($pid == 0) {
+        unless ($ENV{CACHEISMO_VERBOSE}) {
+            open(STDOUT, '>', '/dev/null');
+            open(STDERR, '>', '/dev/null');
+        }
+        exec($binary, '-p', $port, '-l', '127.0.0.1', '-d', "$srcdir/scripts", @args);
+        exit(1);
+    }
+    my $server = bless { pid => $pid, port => $port }, 'CacheismoTest::Server';
+    my $until  = time() + 10;
+    while (time() < $until) {
+        my $sock = IO::Socket::INET->new(PeerAddr => "127.0.0.1:$port", Proto => 'tcp');
+        if ($sock) {
+            close($sock);
+            return $server;
+        }
+        die "$binary exited at start" if waitpid($pid, WNOHANG) == $pid;
+        sleep(0.05);
+    }
+    $server->stop();
+    die "$binary did not start on port $port";
+}
+
+# returns the value of a get, undef for a miss
+sub mem_get {
+    my ($sock, $key) = @_;
+    print $sock "get $key\r\n";
+    my $line = <$sock>;
+    return undef if !defined($line) || $line =~ /^END/;
+    my ($length) = $line =~ /^VALUE \S+ \d+ (\d+)/ or return undef;
+    my $data = '';
+    while (length($data) < $length + 2) {
+        my $n = read($sock, $data, $length + 2 - length($data), length($data));
+        last unless $n;
+    }
+    return substr($data, 0, $length) if length($data) < $length + 2;
+    <$sock>;   # END
+    return substr($data, 0, $length);
+}
+
+sub mem_set {
+    my ($sock, $key, $value, $expiry) = @_;
+    $expiry ||= 0;
+    print $sock "set $key 0 $expiry " . length($value) . "\r\n$value\r\n";
+    my $line = <$sock>;
+    return defined($line) && $line =~ /^STORED/;
+}
+
+# returns a hash of "stats <group>"
+sub mem_stats {
+    my ($sock, $group) = @_;
+    my %stats;
+    print $sock ($group ? "stats $group\r\n" : "stats\r\n");
+    while (my $line = <$sock>) {
+        last if $line =~ /^(END|ERROR|SERVER_ERROR)/;
+        $stats{$1} = $2 if $line =~ /^STAT (\S+) (.*?)\r?\n$/;
+    }
+    return \%stats;
+}
+
+# calls check every 10ms till it returns true, returns its value or undef
+sub wait_for {
+    my ($timeout, $check) = @_;
+    my $until = time() + $timeout;
+    while (time() < $until) {
+        my $result = $check->();
+        return $result if $result;
+        sleep(0.01);
+    }
+    return undef;
+}
+
+package CacheismoTest::Server;
+
+use POSIX ":sys_wait_h";
+use Socket qw(SOL_SOCKET SO_RCVTIMEO);
+use Time::HiRes qw(sleep);
+
+sub port { $_[0]->{port} }
+
+sub sock {
+    my $self = shift;
+    my $sock = IO::Socket::INET->new(PeerAddr => "127.0.0.1:$self->{port}", Proto => 'tcp')
+        or die "Can't connect to port $self->{port}: $!";
+    # a short reply fails the read instead of hanging the test
+    setsockopt($sock, SOL_SOCKET, SO_RCVTIMEO, pack('l!l!', 5, 0));
+    return $sock;
+}
+
+sub stop {
+    my $self = shift;
+    return unless $self->{pid};
+    kill('TERM', $self->{pid});
+    for (1 .. 200) {
+        last if waitpid($self->{pid}, WNOHANG) == $self->{pid};
+        sleep(0.02);
+        kill('KILL', $self->{pid}) if $_ == 100;
+    }
+    $self->{pid} = 0;
+}
+
+sub DESTROY {
+    $_[0]->stop();
+}
+
+1;
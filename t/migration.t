@@ -0,0 +1,44 @@
+#!/usr/bin/perl
+# A ring change moves the plain keys to their new owner and leaves the
+# objects of virtual keys on the server whose scripts use them.
+
+use strict;
+use warnings;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use Test::More tests => 5;
+use CacheismoTest;
+
+my $count = 50;
+my $pa    = free_port();
+my $pb    = free_port();
+my $a     = "127.0.0.1:$pa";
+my $b     = "127.0.0.1:$pb";
+
+my $serverA = start_server($pa, '-e', '-P', $a, '-x', $a);
+my $serverB = start_server($pb, '-e', '-P', $a, '-x', $b);
+my $sockA   = $serverA->sock;
+my $sockB   = $serverB->sock;
+
+for my $i (1 .. $count) {
+    mem_set($sockA, "key$i", "value$i");
+    mem_get($sockA, "map:new:m$i");
+    mem_get($sockA, "map:put:m$i:k:v$i");
+}
+for my $sock ($sockA, $sockB) {
+    print $sock "ring $a,$b\r\n";
+    <$sock>;
+}
+ok(wait_for(10, sub {
+    my $stats = mem_stats($sockA, 'migration');
+    return $stats->{migration_started} && !$stats->{migration_active};
+}), 'migration done');
+
+my $moved = mem_stats($sockA, 'migration')->{migration_moved};
+ok($moved > 0, "plain keys moved ($moved)");
+my $found = grep { (mem_get($sockA, "key$_") // '') eq "value$_" } 1 .. $count;
+is($found, $count, 'plain keys found after the ring change');
+my $objects = grep { (mem_get($sockA, "map:get:m$_:k") // '') eq "k : v$_" } 1 .. $count;
+is($objects, $count, 'virtual key objects stay on the server using them');
+my $lost = grep { defined(mem_get($sockB, "map\$m$_")) } 1 .. $count;
+is($lost, 0, 'virtual key objects are not moved');
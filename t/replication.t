@@ -0,0 +1,62 @@
+#!/usr/bin/perl
+# A leader started with -f replicates its writes to a follower on
+# 127.0.0.1 and measures the lag, also after the follower restarts.
+
+use strict;
+use warnings;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use Test::More tests => 7;
+use Time::HiRes qw(sleep);
+use CacheismoTest;
+
+my $count    = 2000;
+my $fport    = free_port();
+my $follower = start_server($fport);
+my $leader   = new_server('-f', "127.0.0.1:$fport");
+my $sock     = $leader->sock;
+
+sub synced {
+    my $stats = mem_stats($sock, 'replication');
+    return $stats->{repl_connected} && !$stats->{repl_resyncing};
+}
+
+# lag values seen over a second of writes, a new one per ping answered
+sub lags {
+    my ($prefix) = @_;
+    my %seen;
+    for my $i (1 .. 100) {
+        mem_set($sock, "$prefix$i", "value$i");
+        $seen{mem_stats($sock, 'replication')->{repl_lag_usec}} = 1;
+        sleep(0.01);
+    }
+    return sort { $a <=> $b } keys %seen;
+}
+
+ok(wait_for(10, \&synced), 'leader connected to follower');
+for my $i (1 .. $count) {
+    mem_set($sock, "key$i", "value$i");
+}
+my $fsock = $follower->sock;
+ok(wait_for(10, sub { (mem_get($fsock, "key$count") // '') eq "value$count" }),
+        'writes reach the follower');
+my @lags = lags('lag');
+ok(@lags > 1, 'lag is measured');
+diag("lag usec min $lags[0] median $lags[$#lags / 2] max $lags[-1]");
+
+# writes the stopped follower never answers are lost with the connection
+kill('STOP', $follower->{pid});
+for my $i (1 .. 100) {
+    mem_set($sock, "lost$i", "value$i");
+}
+sleep(0.2);
+kill('KILL', $follower->{pid});
+$follower->stop();
+ok(wait_for(5, sub { !mem_stats($sock, 'replication')->{repl_connected} }), 'leader sees follower gone');
+
+$follower = start_server($fport);
+$fsock    = $follower->sock;
+ok(wait_for(10, \&synced), 'leader reconnected and resynced');
+is(mem_get($fsock, "key$count"), "value$count", 'resync sends the items again');
+@lags = lags('again');
+ok(@lags > 1, 'lag is measured after the reconnect');
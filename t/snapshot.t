@@ -0,0 +1,34 @@
+#!/usr/bin/perl
+# Items written by "snapshot" come back when the server restarts with -r.
+
+use strict;
+use warnings;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use File::Temp qw(tempdir);
+use Test::More tests => 7;
+use CacheismoTest;
+
+my $dir  = tempdir(CLEANUP => 1);
+my $file = "$dir/cacheismo.snapshot";
+my $big  = join('', map { chr(ord('a') + $_ % 26) } 0 .. 299999);
+
+my $server = new_server('-r', $file);
+my $sock   = $server->sock;
+ok(mem_set($sock, 'small', 'hello'), 'stored small value');
+ok(mem_set($sock, 'big', $big), 'stored value over 64KB');
+print $sock "snapshot\r\n";
+<$sock>;
+ok(wait_for(10, sub {
+    my $stats = mem_stats($sock, 'snapshot');
+    return !$stats->{snapshot_in_progress} && $stats->{snapshot_completed};
+}), 'snapshot completed');
+$server->stop();
+
+$server = start_server($server->port, '-r', $file);
+$sock   = $server->sock;
+is(mem_stats($sock, 'snapshot')->{snapshot_loaded_items}, 2, 'loaded both items');
+is(mem_get($sock, 'small'), 'hello', 'small value survives restart');
+my $value = mem_get($sock, 'big');
+is(length($value // ''), length($big), 'length of value over 64KB survives restart');
+ok(defined($value) && $value eq $big, 'value over 64KB survives restart');